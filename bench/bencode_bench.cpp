@@ -0,0 +1,113 @@
+#include "torrent_file.h"
+#include "bencode.h"
+#include "byte_tools.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+/*
+ * Скорость загрузки большого .torrent файла: синтетический торрент с хешами частей общим размером `--size-mb`
+ * и `--files` файлами. Меряется LoadTorrentFile целиком (чтение файла, разбор, info_hash) и отдельно Bencode::Decode.
+ * Usage: bencode-bench [--dir <directory>] [--size-mb <N>] [--files <N>] [--iterations <N>]
+ */
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string BencodeString(std::string_view value) {
+    return std::to_string(value.size()) + ":" + std::string(value);
+}
+
+std::string MakeTorrent(size_t piecesBytes, size_t filesCount) {
+    constexpr size_t PIECE_LENGTH = 1 << 18;
+    const size_t piecesCount = piecesBytes / 20;
+    const size_t totalLength = piecesCount * PIECE_LENGTH;
+
+    std::string pieces(piecesCount * 20, '\0');
+    std::mt19937_64 random(42);
+    for (char& c : pieces) {
+        c = static_cast<char>(random());
+    }
+
+    std::string files = "l";
+    for (size_t i = 0, left = totalLength; i < filesCount; ++i) {
+        size_t length = i + 1 == filesCount ? left : totalLength / filesCount;
+        left -= length;
+        files += "d6:lengthi" + std::to_string(length) + "e4:pathl" + BencodeString("dir" + std::to_string(i % 16)) +
+                 BencodeString("file" + std::to_string(i) + ".bin") + "ee";
+    }
+    files += "e";
+
+    std::string torrent = "d";
+    torrent += "8:announce" + BencodeString("http://127.0.0.1:6969/announce");
+    torrent += "13:announce-listll" + BencodeString("http://127.0.0.1:6969/announce") + "el" +
+               BencodeString("http://127.0.0.2:6969/announce") + "ee";
+    torrent += "7:comment" + BencodeString("synthetic torrent for bencode-bench");
+    torrent += "4:infod5:files" + files + "4:name" + BencodeString("bencode-bench") + "12:piece lengthi" +
+               std::to_string(PIECE_LENGTH) + "e6:pieces" + BencodeString(pieces) + "e";
+    torrent += "e";
+    return torrent;
+}
+
+template <typename F>
+double MeasureBestSeconds(size_t iterations, F&& function) {
+    double best = 1e100;
+    for (size_t i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        function();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    fs::path directory = fs::temp_directory_path();
+    size_t sizeMb = 50;
+    size_t filesCount = 1000;
+    size_t iterations = 5;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--dir") {
+            directory = argv[i + 1];
+        } else if (arg == "--size-mb") {
+            sizeMb = std::stoul(argv[i + 1]);
+        } else if (arg == "--files") {
+            filesCount = std::max(1UL, std::stoul(argv[i + 1]));
+        } else if (arg == "--iterations") {
+            iterations = std::max(1UL, std::stoul(argv[i + 1]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--dir <directory>] [--size-mb <N>] [--files <N>] [--iterations <N>]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    const std::string torrent = MakeTorrent(sizeMb << 20, filesCount);
+    const fs::path fileName = directory / ("bencode-bench-" + RandomString(8) + ".torrent");
+    std::ofstream(fileName, std::ios::binary).write(torrent.data(), static_cast<std::streamsize>(torrent.size()));
+
+    size_t piecesCount = 0;
+    double loadSeconds = MeasureBestSeconds(iterations, [&]() {
+        piecesCount = LoadTorrentFile(fileName.string()).pieceHashes.size();
+    });
+    double decodeSeconds = MeasureBestSeconds(iterations, [&]() {
+        Bencode::Decode(torrent);
+    });
+    fs::remove(fileName);
+
+    const double megabytes = static_cast<double>(torrent.size()) / (1 << 20);
+    std::cout << "torrent " << std::fixed << std::setprecision(1) << megabytes << " MiB, " << piecesCount << " pieces, "
+              << filesCount << " files, best of " << iterations << std::endl;
+    std::cout << std::left << std::setw(18) << "LoadTorrentFile" << std::setw(10) << loadSeconds * 1000 << "ms "
+              << megabytes / loadSeconds << " MiB/s" << std::endl;
+    std::cout << std::left << std::setw(18) << "Bencode::Decode" << std::setw(10) << decodeSeconds * 1000 << "ms "
+              << megabytes / decodeSeconds << " MiB/s" << std::endl;
+    return 0;
+}
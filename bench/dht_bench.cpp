@@ -0,0 +1,151 @@
+#include "dht.h"
+#include "byte_tools.h"
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*
+ * Кластер узлов DHT на loopback: `--nodes` узлов знакомятся через первый, один объявляет `--torrents` торрентов,
+ * другой ищет их все одновременно. Печатает время объявления и поиска, число запросов и потоков процесса:
+ * одновременные поиски не добавляют потоков.
+ * Usage: dht-bench [--nodes <N>] [--torrents <N>]
+ */
+
+namespace {
+
+size_t ThreadsCount() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("Threads:")) {
+            return std::stoul(line.substr(8));
+        }
+    }
+    return 0;
+}
+
+// Ждет `count` вызовов Done
+class Latch {
+public:
+    explicit Latch(size_t count) : count_(count) {}
+
+    void Done() {
+        std::lock_guard lock(mutex_);
+        if (--count_ == 0) {
+            done_.notify_all();
+        }
+    }
+
+    bool Wait(std::chrono::seconds timeout) {
+        std::unique_lock lock(mutex_);
+        return done_.wait_for(lock, timeout, [this] { return count_ == 0; });
+    }
+private:
+    std::mutex mutex_;
+    std::condition_variable done_;
+    size_t count_;
+};
+
+double Since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    size_t nodesCount = 32;
+    size_t torrents = 16;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--nodes" && i + 1 < argc) {
+            nodesCount = std::max(3UL, std::stoul(argv[++i]));
+        } else if (arg == "--torrents" && i + 1 < argc) {
+            torrents = std::max(1UL, std::stoul(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--nodes <N>] [--torrents <N>]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<DhtNode>> nodes;
+    nodes.push_back(std::make_unique<DhtNode>(DhtNode::Options{}));
+    const std::string seed = "127.0.0.1:" + std::to_string(nodes[0]->Port());
+    for (size_t i = 1; i < nodesCount; ++i) {
+        nodes.push_back(std::make_unique<DhtNode>(DhtNode::Options{0, {seed}, ""}));
+    }
+    // первый узел узнает об остальных из их запросов; ждем, пока таблицы наполнятся
+    while (Since(start) < 5000) {
+        size_t filled = 0;
+        for (const auto& node : nodes) {
+            filled += node->NodesCount() >= std::min<size_t>(RoutingTable::K, nodesCount - 1);
+        }
+        if (filled == nodes.size()) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    size_t known = 0;
+    for (const auto& node : nodes) {
+        known += node->NodesCount();
+    }
+    std::cout << nodesCount << " nodes bootstrapped in " << Since(start) << " ms, " << known / nodesCount
+              << " known nodes per node" << std::endl;
+
+    std::vector<std::string> infoHashes;
+    for (size_t i = 0; i < torrents; ++i) {
+        infoHashes.push_back(CalculateSHA1("dht-bench " + std::to_string(i)));
+    }
+
+    DhtNode& announcer = *nodes[1];
+    size_t queriesBefore = announcer.QueriesSent();
+    start = std::chrono::steady_clock::now();
+    Latch announced(torrents);
+    for (const std::string& infoHash : infoHashes) {
+        announcer.GetPeers(infoHash, 6881, {}, [&announced] { announced.Done(); });
+    }
+    if (!announced.Wait(std::chrono::seconds(30))) {
+        std::cerr << "announce did not finish" << std::endl;
+        return 1;
+    }
+    std::cout << "announced " << torrents << " torrents in " << Since(start) << " ms with "
+              << announcer.QueriesSent() - queriesBefore << " queries" << std::endl;
+
+    DhtNode& searcher = *nodes.back();
+    queriesBefore = searcher.QueriesSent();
+    const size_t threadsBefore = ThreadsCount();
+    start = std::chrono::steady_clock::now();
+    std::mutex foundMutex;
+    size_t found = 0;
+    double firstPeerMs = -1;
+    Latch searched(torrents);
+    for (const std::string& infoHash : infoHashes) {
+        searcher.GetPeers(infoHash, 0, [&](const std::vector<Peer>& peers) {
+            std::lock_guard lock(foundMutex);
+            for (const Peer& peer : peers) {
+                if (peer.port == 6881) {
+                    ++found;
+                    if (firstPeerMs < 0) {
+                        firstPeerMs = Since(start);
+                    }
+                }
+            }
+        }, [&searched] { searched.Done(); });
+    }
+    const size_t threadsDuring = ThreadsCount();
+    if (!searched.Wait(std::chrono::seconds(30))) {
+        std::cerr << "lookups did not finish" << std::endl;
+        return 1;
+    }
+    std::cout << torrents << " concurrent lookups in " << Since(start) << " ms (first peer after " << firstPeerMs
+              << " ms) with " << searcher.QueriesSent() - queriesBefore << " queries, found the announced peer for "
+              << found << "/" << torrents << " torrents; threads " << threadsBefore << " -> " << threadsDuring
+              << std::endl;
+    return found == torrents ? 0 : 1;
+}
@@ -0,0 +1,485 @@
+#include "torrent_file.h"
+#include "bencode.h"
+#include "byte_tools.h"
+#include "message.h"
+#include "piece.h"
+#include "piece_storage.h"
+#include "peer_connect.h"
+#include "disk_writer.h"
+#include "memory_budget.h"
+#include "buffer_pool.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+/*
+ * Микробенчмарки горячих путей: разбор .torrent, сообщения протокола, BytesToInt/IntToBytes, сборка части
+ * из блоков, SHA1, bitfield пира и взятие/завершение частей в PieceStorage из нескольких потоков.
+ *
+ * Каждый бенчмарк калибруется так, чтобы один замер шел не меньше `--min-time-ms`, и повторяется `--repetitions`
+ * раз; в отчет идет медиана времени на операцию и разброс замеров. Результат печатается в JSON по одному бенчмарку
+ * на строку, так что файлы двух коммитов можно сравнить обычным diff или через `--baseline <old.json>`,
+ * который печатает в stderr изменение каждого бенчмарка в процентах.
+ *
+ * Usage: micro-bench [--filter <substring>] [--min-time-ms <N>] [--repetitions <N>] [--dir <directory>]
+ *                    [--out <file.json>] [--baseline <file.json>]
+ */
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr size_t BLOCK_SIZE = 1 << 14;
+constexpr size_t PIECE_LENGTH = 1 << 18;
+
+// Не дать компилятору выбросить вычисление, результат которого не используется
+template <typename T>
+void Consume(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Бенчмарк: `run(iterations)` выполняет `iterations` операций и возвращает, сколько секунд они заняли
+ * (подготовку данных функция в это время не включает)
+ */
+struct Benchmark {
+    std::string name;
+    size_t bytesPerOp;  // 0 -- пропускная способность в байтах не считается
+    std::function<double(size_t)> run;
+};
+
+struct Result {
+    std::string name;
+    size_t iterations;
+    double nsPerOp;  // медиана по повторам
+    double spread;  // (max - min) / медиана по повторам
+    double mibPerSecond;
+};
+
+Result Measure(const Benchmark& benchmark, double minSeconds, size_t repetitions) {
+    size_t iterations = 1;
+    while (true) {
+        const double seconds = benchmark.run(iterations);
+        if (seconds >= minSeconds) {
+            break;
+        }
+        // с запасом 20%, чтобы следующий замер наверняка уложился; не больше чем в 10 раз за шаг
+        const double scale = seconds > 0 ? minSeconds * 1.2 / seconds : 10.0;
+        iterations = std::max(iterations + 1, static_cast<size_t>(iterations * std::min(scale, 10.0)));
+    }
+    std::vector<double> nsPerOp;
+    for (size_t i = 0; i < repetitions; ++i) {
+        nsPerOp.push_back(benchmark.run(iterations) * 1e9 / iterations);
+    }
+    std::sort(nsPerOp.begin(), nsPerOp.end());
+    Result result{benchmark.name, iterations, nsPerOp[nsPerOp.size() / 2], 0, 0};
+    result.spread = (nsPerOp.back() - nsPerOp.front()) / result.nsPerOp;
+    if (benchmark.bytesPerOp > 0) {
+        result.mibPerSecond = benchmark.bytesPerOp / result.nsPerOp * 1e9 / (1 << 20);
+    }
+    return result;
+}
+
+// Выполнить `body(thread, count)` в `threads` потоках, разделив между ними `iterations` операций
+double RunInThreads(size_t threads, size_t iterations, const std::function<void(size_t, size_t)>& body) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < threads; ++i) {
+        const size_t count = iterations / threads + (i < iterations % threads ? 1 : 0);
+        workers.emplace_back(body, i, count);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return SecondsSince(start);
+}
+
+std::string RandomBytes(size_t length, uint64_t seed) {
+    std::string bytes(length, '\0');
+    std::mt19937_64 random(seed);
+    for (char& c : bytes) {
+        c = static_cast<char>(random());
+    }
+    return bytes;
+}
+
+// Многофайловый торрент с `piecesCount` хешами частей и `filesCount` файлами
+std::string MakeTorrent(size_t piecesCount, size_t filesCount) {
+    const size_t totalLength = piecesCount * PIECE_LENGTH;
+    Bencode::Encoder encoder;
+    encoder.BeginDict();
+    encoder.Key("announce");
+    encoder.String("http://127.0.0.1:6969/announce");
+    encoder.Key("info");
+    encoder.BeginDict();
+    encoder.Key("files");
+    encoder.BeginList();
+    for (size_t i = 0, left = totalLength; i < filesCount; ++i) {
+        const size_t length = i + 1 == filesCount ? left : totalLength / filesCount;
+        left -= length;
+        encoder.BeginDict();
+        encoder.Key("length");
+        encoder.Integer(static_cast<int64_t>(length));
+        encoder.Key("path");
+        encoder.BeginList();
+        encoder.String("dir" + std::to_string(i % 16));
+        encoder.String("file" + std::to_string(i) + ".bin");
+        encoder.End();
+        encoder.End();
+    }
+    encoder.End();
+    encoder.Key("name");
+    encoder.String("micro-bench");
+    encoder.Key("piece length");
+    encoder.Integer(static_cast<int64_t>(PIECE_LENGTH));
+    encoder.Key("pieces");
+    encoder.String(RandomBytes(piecesCount * 20, 42));
+    encoder.End();
+    encoder.End();
+    return encoder.Release();
+}
+
+// Торрент из `piecesCount` нулевых частей по `pieceLength` байт: хеш у всех частей один
+TorrentFile MakeZeroTorrent(size_t piecesCount, size_t pieceLength) {
+    TorrentFile tf;
+    tf.name = "micro-bench";
+    tf.pieceLength = pieceLength;
+    tf.length = piecesCount * pieceLength;
+    tf.files.emplace_back(tf.length, tf.name);
+    PieceHash hash;
+    CalculateSHA1(std::string(pieceLength, '\0'), hash.data());
+    tf.pieceHashes.assign(piecesCount, hash);
+    return tf;
+}
+
+// Строки "Сохранена часть ..." из PieceStorage на время бенчмарка уходят в никуда
+class SilenceStdout {
+public:
+    SilenceStdout() : previous_(std::cout.rdbuf(&null_)) {}
+    ~SilenceStdout() {
+        std::cout.rdbuf(previous_);
+    }
+private:
+    struct NullBuffer : std::streambuf {
+        int overflow(int c) override {
+            return c;
+        }
+    } null_;
+    std::streambuf* previous_;
+};
+
+std::vector<Benchmark> MakeBenchmarks(const fs::path& directory) {
+    std::vector<Benchmark> benchmarks;
+
+    // LoadTorrentFile: чтение файла, разбор и info_hash торрента на 64 ГиБ
+    {
+        auto torrent = std::make_shared<std::string>(MakeTorrent(1 << 18, 1000));
+        auto path = std::make_shared<fs::path>(directory / ("micro-bench-" + RandomString(8) + ".torrent"));
+        benchmarks.push_back({"LoadTorrentFile/262144_pieces/1000_files", torrent->size(),
+                              [torrent, path](size_t iterations) {
+            std::ofstream(*path, std::ios::binary).write(torrent->data(), static_cast<std::streamsize>(torrent->size()));
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; ++i) {
+                Consume(LoadTorrentFile(path->string()).pieceHashes.size());
+            }
+            const double seconds = SecondsSince(start);
+            fs::remove(*path);
+            return seconds;
+        }});
+    }
+
+    // Сообщения протокола: request (13 байт) и piece с блоком 16 КиБ
+    const std::string requestPayload = IntToBytes(7) + IntToBytes(static_cast<int>(BLOCK_SIZE)) +
+                                       IntToBytes(static_cast<int>(BLOCK_SIZE));
+    const std::string piecePayload = IntToBytes(7) + IntToBytes(0) + RandomBytes(BLOCK_SIZE, 1);
+    for (const auto& [name, id, payload] : {std::tuple{"request", MessageId::Request, requestPayload},
+                                            std::tuple{"piece_16KiB", MessageId::Piece, piecePayload}}) {
+        const std::string wire = static_cast<char>(id) + payload;
+        benchmarks.push_back({std::string("Message::Parse/") + name, wire.size(), [wire](size_t iterations) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; ++i) {
+                Consume(Message::Parse(wire).payload.size());
+            }
+            return SecondsSince(start);
+        }});
+        const Message message = Message::Init(id, payload);
+        benchmarks.push_back({std::string("Message::ToString/") + name, wire.size() + 4, [message](size_t iterations) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; ++i) {
+                Consume(message.ToString().size());
+            }
+            return SecondsSince(start);
+        }});
+    }
+
+    benchmarks.push_back({"BytesToInt", 4, [](size_t iterations) {
+        const std::string bytes = IntToBytes(0x12345678);
+        size_t sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            Consume(bytes);
+            sum += BytesToInt(bytes);
+        }
+        Consume(sum);
+        return SecondsSince(start);
+    }});
+    benchmarks.push_back({"IntToBytes", 4, [](size_t iterations) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            Consume(IntToBytes(static_cast<int>(i)).size());
+        }
+        return SecondsSince(start);
+    }});
+
+    // Сборка части 256 КиБ из блоков: одна операция -- один SaveBlock 16 КиБ
+    benchmarks.push_back({"Piece::SaveBlock/16KiB", BLOCK_SIZE, [](size_t iterations) {
+        BufferPool pool;
+        Piece piece(0, PIECE_LENGTH, PieceHash{});
+        piece.AttachBuffer(pool.Acquire(PIECE_LENGTH));
+        const std::string block = RandomBytes(BLOCK_SIZE, 2);
+        const size_t blocksCount = PIECE_LENGTH / BLOCK_SIZE;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            piece.SaveBlock(i % blocksCount, block);
+        }
+        return SecondsSince(start);
+    }});
+    benchmarks.push_back({"Piece::GetData", 0, [](size_t iterations) {
+        BufferPool pool;
+        Piece piece(0, PIECE_LENGTH, PieceHash{});
+        piece.AttachBuffer(pool.Acquire(PIECE_LENGTH));
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            Consume(piece.GetData().data());
+        }
+        return SecondsSince(start);
+    }});
+
+    for (size_t length : {BLOCK_SIZE, PIECE_LENGTH}) {
+        benchmarks.push_back({"CalculateSHA1/" + std::to_string(length >> 10) + "KiB", length, [length](size_t iterations) {
+            const std::string data = RandomBytes(length, 3);
+            PieceHash digest;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < iterations; ++i) {
+                CalculateSHA1(data, digest.data());
+                Consume(digest);
+            }
+            return SecondsSince(start);
+        }});
+    }
+
+    // bitfield пира на 2^20 частей: проверка и отметка случайных частей
+    constexpr size_t AVAILABILITY_PIECES = 1 << 20;
+    benchmarks.push_back({"PeerPiecesAvailability::IsPieceAvailable", 0, [](size_t iterations) {
+        const PeerPiecesAvailability availability(RandomBytes(AVAILABILITY_PIECES / 8, 4));
+        std::mt19937_64 random(5);
+        size_t available = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            available += availability.IsPieceAvailable(random() % AVAILABILITY_PIECES);
+        }
+        Consume(available);
+        return SecondsSince(start);
+    }});
+    benchmarks.push_back({"PeerPiecesAvailability::SetPieceAvailability", 0, [](size_t iterations) {
+        PeerPiecesAvailability availability(std::string(AVAILABILITY_PIECES / 8, '\0'));
+        std::mt19937_64 random(6);
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            availability.SetPieceAvailability(random() % AVAILABILITY_PIECES);
+        }
+        Consume(availability.Size());
+        return SecondsSince(start);
+    }});
+
+    for (size_t threads : {1, 2, 4, 8}) {
+        const std::string suffix = "/threads:" + std::to_string(threads);
+        /*
+         * Взять часть из очереди и вернуть ее обратно, как при ошибке соединения: mutex_ хранилища,
+         * бюджет памяти и пул буферов без хеширования и записи
+         */
+        benchmarks.push_back({"PieceStorage/claim_return" + suffix, 0, [directory, threads](size_t iterations) {
+            const TorrentFile tf = MakeZeroTorrent(1024, BLOCK_SIZE);
+            const std::string dataPath = (directory / ("micro-bench-" + RandomString(8))).string();
+            double seconds;
+            {
+                DiskWriter writer;
+                MemoryBudget budget;
+                PieceStorage storage(tf, directory, dataPath, writer, budget);
+                seconds = RunInThreads(threads, iterations, [&storage](size_t, size_t count) {
+                    for (size_t done = 0; done < count;) {
+                        PiecePtr piece = storage.GetNextPieceToDownload();
+                        if (!piece) {
+                            continue;
+                        }
+                        storage.DecrementPieceInProgressCounter();
+                        storage.BackPieceToQueue(piece->GetIndex());
+                        ++done;
+                    }
+                });
+            }
+            fs::remove(dataPath);
+            return seconds;
+        }});
+    }
+    for (size_t threads : {1, 2, 4, 8}) {
+        const std::string suffix = "/threads:" + std::to_string(threads);
+        /*
+         * Скачать нулевые части по 16 КиБ: взять, заполнить блок, PieceProcessed (проверка хеша в этом же потоке)
+         * и дождаться записи всех частей DiskWriter'ом. Одна операция -- одна часть
+         */
+        benchmarks.push_back({"PieceStorage/claim_complete_16KiB" + suffix, BLOCK_SIZE,
+                              [directory, threads](size_t iterations) {
+            const TorrentFile tf = MakeZeroTorrent(iterations, BLOCK_SIZE);
+            const std::string dataPath = (directory / ("micro-bench-" + RandomString(8))).string();
+            const std::string block(BLOCK_SIZE, '\0');
+            double seconds;
+            {
+                SilenceStdout silence;
+                DiskWriter writer;
+                MemoryBudget budget;
+                PieceStorage storage(tf, directory, dataPath, writer, budget);
+                auto start = std::chrono::steady_clock::now();
+                RunInThreads(threads, iterations, [&storage, &block](size_t, size_t) {
+                    while (true) {
+                        PiecePtr piece;
+                        try {
+                            piece = storage.GetNextPieceToDownload();
+                        } catch (const std::runtime_error&) {
+                            break;  // очередь пуста
+                        }
+                        if (!piece) {
+                            std::this_thread::yield();
+                            continue;
+                        }
+                        while (Block* missing = piece->FirstMissingBlock()) {
+                            piece->SaveBlock(missing->offset / BLOCK_SIZE, block);
+                        }
+                        storage.PieceProcessed(piece);
+                    }
+                });
+                storage.CloseOutputFile();
+                seconds = SecondsSince(start);
+            }
+            fs::remove(dataPath);
+            return seconds;
+        }});
+    }
+    return benchmarks;
+}
+
+std::string ToJson(const Result& result) {
+    std::ostringstream json;
+    json << std::fixed << std::setprecision(2) << "{\"name\": \"" << result.name << "\", \"iterations\": "
+         << result.iterations << ", \"ns_per_op\": " << result.nsPerOp << ", \"spread\": " << result.spread;
+    if (result.mibPerSecond > 0) {
+        json << ", \"mib_per_s\": " << result.mibPerSecond;
+    }
+    json << "}";
+    return json.str();
+}
+
+// Медианы ns_per_op из JSON, который раньше напечатал этот же бенчмарк (по одному бенчмарку на строку)
+std::map<std::string, double> LoadBaseline(const std::string& fileName) {
+    std::map<std::string, double> baseline;
+    std::ifstream input(fileName);
+    if (!input) {
+        throw std::runtime_error("Cannot open baseline " + fileName);
+    }
+    const std::string namePrefix = "{\"name\": \"";
+    const std::string nsPrefix = "\"ns_per_op\": ";
+    std::string line;
+    while (std::getline(input, line)) {
+        const size_t name = line.find(namePrefix);
+        const size_t ns = line.find(nsPrefix);
+        if (name == std::string::npos || ns == std::string::npos) {
+            continue;
+        }
+        const size_t nameBegin = name + namePrefix.size();
+        baseline[line.substr(nameBegin, line.find('"', nameBegin) - nameBegin)] =
+            std::stod(line.substr(ns + nsPrefix.size()));
+    }
+    return baseline;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    std::string filter;
+    double minSeconds = 0.1;
+    size_t repetitions = 5;
+    fs::path directory = fs::temp_directory_path();
+    std::string outFileName;
+    std::string baselineFileName;
+    bool usage = argc % 2 == 0;
+    for (int i = 1; i + 1 < argc && !usage; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--filter") {
+            filter = argv[i + 1];
+        } else if (arg == "--min-time-ms") {
+            minSeconds = std::stod(argv[i + 1]) / 1000;
+        } else if (arg == "--repetitions") {
+            repetitions = std::max(1UL, std::stoul(argv[i + 1]));
+        } else if (arg == "--dir") {
+            directory = argv[i + 1];
+        } else if (arg == "--out") {
+            outFileName = argv[i + 1];
+        } else if (arg == "--baseline") {
+            baselineFileName = argv[i + 1];
+        } else {
+            usage = true;
+        }
+    }
+    if (usage) {
+        std::cerr << "Usage: " << argv[0] << " [--filter <substring>] [--min-time-ms <N>] [--repetitions <N>]"
+                  << " [--dir <directory>] [--out <file.json>] [--baseline <file.json>]" << std::endl;
+        return 1;
+    }
+    fs::create_directories(directory);
+    const std::map<std::string, double> baseline =
+        baselineFileName.empty() ? std::map<std::string, double>{} : LoadBaseline(baselineFileName);
+
+    std::vector<std::string> lines;
+    for (const Benchmark& benchmark : MakeBenchmarks(directory)) {
+        if (benchmark.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        const Result result = Measure(benchmark, minSeconds, repetitions);
+        lines.push_back(ToJson(result));
+        std::cerr << std::left << std::setw(52) << result.name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(14) << result.nsPerOp << " ns/op";
+        if (auto old = baseline.find(result.name); old != baseline.end()) {
+            std::cerr << std::showpos << std::setw(10) << (result.nsPerOp / old->second - 1) * 100 << "%"
+                      << std::noshowpos;
+        }
+        std::cerr << std::endl;
+    }
+
+    std::ofstream outFile;
+    if (!outFileName.empty()) {
+        outFile.open(outFileName);
+    }
+    std::ostream& out = outFileName.empty() ? std::cout : outFile;
+    out << "{\n  \"context\": {\"hardware_concurrency\": " << std::thread::hardware_concurrency()
+        << ", \"min_time_ms\": " << minSeconds * 1000 << ", \"repetitions\": " << repetitions << "},\n"
+        << "  \"benchmarks\": [\n";
+    for (size_t i = 0; i < lines.size(); ++i) {
+        out << "    " << lines[i] << (i + 1 < lines.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}" << std::endl;
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "torrent_file.h"
+#include "piece_storage.h"
+#include "disk_writer.h"
+#include "memory_budget.h"
+#include "bencode.h"
+#include "byte_tools.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+/*
+ * Время запуска и память для торрента с большим числом частей: загрузка .torrent (LoadTorrentFile)
+ * и создание PieceStorage, прирост RSS после каждого шага.
+ * Usage: startup-bench [--dir <directory>] [--pieces <N>] [--piece-kb <K>]
+ */
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string MakeTorrent(size_t piecesCount, size_t pieceLength) {
+    std::string pieces(piecesCount * 20, '\0');
+    std::mt19937_64 random(42);
+    for (char& c : pieces) {
+        c = static_cast<char>(random());
+    }
+    Bencode::Encoder encoder;
+    encoder.BeginDict();
+    encoder.Key("announce");
+    encoder.String("http://127.0.0.1:6969/announce");
+    encoder.Key("info");
+    encoder.BeginDict();
+    encoder.Key("length");
+    encoder.Integer(static_cast<int64_t>(piecesCount * pieceLength));
+    encoder.Key("name");
+    encoder.String("startup-bench");
+    encoder.Key("piece length");
+    encoder.Integer(static_cast<int64_t>(pieceLength));
+    encoder.Key("pieces");
+    encoder.String(pieces);
+    encoder.End();
+    encoder.End();
+    return encoder.Release();
+}
+
+// Resident set size процесса в КиБ
+size_t ResidentKb() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.starts_with("VmRSS:")) {
+            return std::stoul(line.substr(6));
+        }
+    }
+    return 0;
+}
+
+double MillisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    fs::path directory = fs::temp_directory_path();
+    size_t piecesCount = 1000000;
+    size_t pieceKb = 16;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--dir") {
+            directory = argv[i + 1];
+        } else if (arg == "--pieces") {
+            piecesCount = std::stoul(argv[i + 1]);
+        } else if (arg == "--piece-kb") {
+            pieceKb = std::stoul(argv[i + 1]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--dir <directory>] [--pieces <N>] [--piece-kb <K>]" << std::endl;
+            return 1;
+        }
+    }
+    fs::create_directories(directory);
+    const fs::path torrentPath = directory / ("startup-bench-" + RandomString(8) + ".torrent");
+    const std::string dataPath = (directory / ("startup-bench-" + RandomString(8))).string();
+    {
+        const std::string torrent = MakeTorrent(piecesCount, pieceKb << 10);
+        std::ofstream(torrentPath, std::ios::binary).write(torrent.data(), static_cast<std::streamsize>(torrent.size()));
+    }
+
+    const size_t baseKb = ResidentKb();
+    auto start = std::chrono::steady_clock::now();
+    TorrentFile tf = LoadTorrentFile(torrentPath.string());
+    const double loadMs = MillisecondsSince(start);
+    const size_t loadedKb = ResidentKb();
+
+    double storageMs;
+    size_t storageKb;
+    {
+        DiskWriter writer;
+        MemoryBudget budget;
+        start = std::chrono::steady_clock::now();
+        // файл данных создается разреженным, место на диске не занимает
+        PieceStorage storage(tf, directory, dataPath, writer, budget);
+        storageMs = MillisecondsSince(start);
+        storageKb = ResidentKb();
+    }
+    fs::remove(torrentPath);
+    fs::remove(dataPath);
+
+    std::cout << piecesCount << " pieces of " << pieceKb << " KiB" << std::endl;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << std::left << std::setw(16) << "step" << std::setw(12) << "ms" << "RSS growth, MiB" << std::endl;
+    std::cout << std::left << std::setw(16) << "LoadTorrentFile" << std::setw(12) << loadMs
+              << (static_cast<double>(loadedKb) - baseKb) / 1024 << std::endl;
+    std::cout << std::left << std::setw(16) << "PieceStorage" << std::setw(12) << storageMs
+              << (static_cast<double>(storageKb) - loadedKb) / 1024 << std::endl;
+    return 0;
+}
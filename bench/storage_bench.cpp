@@ -0,0 +1,157 @@
+#include "piece_storage.h"
+#include "disk_writer.h"
+#include "byte_tools.h"
+#include <iostream>
+#include <cstring>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+/*
+ * Сравнение режимов выделения места под временный файл: скорость записи частей в случайном порядке
+ * и итоговая фрагментация файла (количество экстентов по FIEMAP).
+ * Usage: storage-bench [--dir <directory>] [--size-mb <N>] [--piece-kb <K>]
+ */
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr size_t PIECE_BLOCK_SIZE = 1 << 14; // BLOCK_SIZE занят макросом из linux/fs.h
+
+std::string GeneratePieceData(size_t index, size_t length) {
+    std::mt19937_64 random(index);
+    std::string data(length, '\0');
+    for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+        uint64_t value = random();
+        std::memcpy(data.data() + i, &value, std::min(sizeof(value), length - i));
+    }
+    return data;
+}
+
+TorrentFile MakeTorrentFile(size_t totalLength, size_t pieceLength) {
+    TorrentFile tf;
+    tf.name = "storage-bench";
+    tf.pieceLength = pieceLength;
+    tf.length = totalLength;
+    tf.files.push_back(File(totalLength, tf.name));
+    for (size_t offset = 0, index = 0; offset < totalLength; offset += pieceLength, ++index) {
+        CalculateSHA1(GeneratePieceData(index, std::min(pieceLength, totalLength - offset)),
+                      tf.pieceHashes.emplace_back().data());
+    }
+    return tf;
+}
+
+// Количество экстентов файла, -1 если ФС не поддерживает FIEMAP
+long CountExtents(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    fiemap request{};
+    request.fm_start = 0;
+    request.fm_length = FIEMAP_MAX_OFFSET;
+    request.fm_flags = FIEMAP_FLAG_SYNC;
+    request.fm_extent_count = 0; // только посчитать экстенты
+    long result = ioctl(fd, FS_IOC_FIEMAP, &request) < 0 ? -1 : static_cast<long>(request.fm_mapped_extents);
+    close(fd);
+    return result;
+}
+
+struct BenchResult {
+    double seconds;
+    long extents;
+};
+
+BenchResult RunMode(const TorrentFile& tf, const fs::path& directory, const StorageOptions& options) {
+    const std::string fileName = (directory / ("storage-bench-" + RandomString(8))).string();
+    std::vector<size_t> order(tf.pieceHashes.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937(42));
+
+    // PieceStorage пишет в std::cout строку на каждую сохраненную часть, в выводе бенчмарка она не нужна
+    std::ostream nullStream(nullptr);
+    std::streambuf* coutBuffer = std::cout.rdbuf(nullStream.rdbuf());
+
+    double seconds;
+    {
+        DiskWriter writer(64, FsyncPolicy::OnClose);
+        MemoryBudget budget;
+        PieceStorage storage(tf, directory, fileName, writer, budget, options);
+        std::vector<PiecePtr> pieces;
+        while (!storage.QueueIsEmpty()) {
+            pieces.push_back(storage.GetNextPieceToDownload());
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t index : order) {
+            PiecePtr piece = std::move(pieces[index]);
+            std::string data = GeneratePieceData(index, piece->GetLength());
+            while (Block* block = piece->FirstMissingBlock()) {
+                piece->SaveBlock(block->offset / PIECE_BLOCK_SIZE, std::string_view(data).substr(block->offset, block->length));
+            }
+            storage.PieceProcessed(piece);
+        }
+        storage.CloseOutputFile(); // ждет записи всех частей и fdatasync
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (storage.PiecesSavedToDiscCount() != tf.pieceHashes.size()) {
+            std::cerr << "Not all pieces were saved!" << std::endl;
+        }
+    }
+    std::cout.rdbuf(coutBuffer);
+    long extents = CountExtents(fileName);
+    fs::remove(fileName);
+    return {seconds, extents};
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    fs::path directory = fs::temp_directory_path();
+    size_t sizeMb = 256;
+    size_t pieceKb = 256;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--dir") {
+            directory = argv[i + 1];
+        } else if (arg == "--size-mb") {
+            sizeMb = std::stoul(argv[i + 1]);
+        } else if (arg == "--piece-kb") {
+            pieceKb = std::stoul(argv[i + 1]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--dir <directory>] [--size-mb <N>] [--piece-kb <K>]" << std::endl;
+            return 1;
+        }
+    }
+    fs::create_directories(directory);
+
+    // последняя часть короче остальных, как в настоящих торрентах
+    const size_t totalLength = (sizeMb << 20) - 12345;
+    const TorrentFile tf = MakeTorrentFile(totalLength, pieceKb << 10);
+
+    const std::vector<std::pair<std::string, StorageOptions>> modes = {
+        {"sparse", {StorageMode::Write, AllocationMode::Sparse}},
+        {"fallocate", {StorageMode::Write, AllocationMode::Fallocate}},
+        {"direct", {StorageMode::Write, AllocationMode::Direct}},
+        {"mmap+sparse", {StorageMode::Mmap, AllocationMode::Sparse}},
+        {"mmap+fallocate", {StorageMode::Mmap, AllocationMode::Fallocate}},
+    };
+
+    std::cout << "file " << (totalLength >> 20) << " MiB, " << tf.pieceHashes.size() << " pieces of " << pieceKb
+              << " KiB, random order, directory " << directory << std::endl;
+    std::cout << std::left << std::setw(16) << "mode" << std::setw(12) << "MiB/s" << "extents" << std::endl;
+    for (const auto& [name, options] : modes) {
+        BenchResult result = RunMode(tf, directory, options);
+        std::cout << std::left << std::setw(16) << name << std::setw(12) << std::fixed << std::setprecision(1)
+                  << (totalLength / result.seconds / (1 << 20))
+                  << (result.extents < 0 ? std::string("n/a") : std::to_string(result.extents)) << std::endl;
+    }
+    return 0;
+}
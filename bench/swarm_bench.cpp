@@ -0,0 +1,686 @@
+#include "torrent_creator.h"
+#include "bencode.h"
+#include "byte_tools.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <atomic>
+#include <csignal>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+/*
+ * Воспроизводимый замер скачивания без сети: рой на loopback.
+ *
+ * Генерирует файл `--size-mb` МиБ и торрент для него, поднимает в этом процессе `--seeders` раздающих пиров
+ * (peer wire protocol: рукопожатие, bitfield, unchoke на interested, ответы на request) и HTTP-трекер,
+ * который отдает их адреса, и запускает клиент отдельным процессом. Аргументы после `--` передаются клиенту.
+ * Печатает скорость скачивания, время до первой сохраненной части, процессорное время клиента на ГиБ и пиковый
+ * RSS клиента (по rusage дочернего процесса: раздающие пиры и трекер в замер не входят) и проверяет, что скачанный
+ * файл совпадает с исходным. Код возврата ненулевой, если клиент завершился с ошибкой, не завершился за `--timeout`
+ * секунд или данные не совпали. В конце печатает, сколько announce с событиями started, completed и stopped получил
+ * трекер и какие downloaded и left клиент прислал последними.
+ * `--stalled-leechers <N>` подключает к клиенту пиров, которые просят у него блоки, но ничего не читают:
+ * проверка того, что раздача, упершаяся в полный буфер сокета, не мешает клиенту завершиться. Клиент открывает им
+ * слоты только на тике choker, поэтому вместе с ними стоит передать клиенту `-- --seed-time <N>`.
+ *
+ * Usage: swarm-bench [--size-mb <N>] [--piece-kb <K>] [--seeders <N>] [--stalled-leechers <N>] [--runs <N>]
+ *                    [--timeout <seconds>] [--client <path>] [-- <client args>...]
+ */
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr size_t HANDSHAKE_LENGTH = 68;
+constexpr int POLL_TIMEOUT_MS = 100;
+
+void PutInt(std::string& data, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        data += static_cast<char>((value >> shift) & 0xFF);
+    }
+}
+
+int Listen(int& port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = 0;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock < 0 || bind(sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(sock, 64) < 0) {
+        throw std::runtime_error(std::string("Failed to listen on loopback: ") + std::strerror(errno));
+    }
+    socklen_t length = sizeof(address);
+    getsockname(sock, reinterpret_cast<sockaddr*>(&address), &length);
+    port = ntohs(address.sin_port);
+    return sock;
+}
+
+bool ReceiveAll(int sock, char* buffer, size_t length, const std::atomic<bool>& stopped) {
+    while (length > 0) {
+        pollfd readable = {sock, POLLIN, 0};
+        if (stopped || poll(&readable, 1, POLL_TIMEOUT_MS) < 0) {
+            return false;
+        }
+        if (readable.revents == 0) {
+            continue;
+        }
+        ssize_t received = recv(sock, buffer, length, 0);
+        if (received <= 0) {
+            return false;
+        }
+        buffer += received;
+        length -= received;
+    }
+    return true;
+}
+
+bool SendAll(int sock, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t sent = send(sock, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data.remove_prefix(sent);
+    }
+    return true;
+}
+
+/*
+ * Принимает соединения на своем порту; каждое соединение -- поток, который раздает все части файла `dataFd`
+ */
+class StubSeeder {
+public:
+    StubSeeder(const TorrentFile& tf, int dataFd) : tf_(tf), dataFd_(dataFd), stopped_(false), uploaded_(0) {
+        sock_ = Listen(port_);
+        peerId_ = "-SB0001-" + RandomString(12);
+        acceptThread_ = std::thread(&StubSeeder::AcceptLoop, this);
+    }
+
+    ~StubSeeder() {
+        stopped_ = true;
+        acceptThread_.join();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+        close(sock_);
+    }
+
+    int Port() const {
+        return port_;
+    }
+
+    uint64_t Uploaded() const {
+        return uploaded_;
+    }
+private:
+    void AcceptLoop() {
+        while (!stopped_) {
+            pollfd readable = {sock_, POLLIN, 0};
+            if (poll(&readable, 1, POLL_TIMEOUT_MS) <= 0) {
+                continue;
+            }
+            int client = accept4(sock_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                threads_.emplace_back(&StubSeeder::Serve, this, client);
+            }
+        }
+    }
+
+    void Serve(int client) {
+        ServeConnection(client);
+        close(client);
+    }
+
+    void ServeConnection(int client) {
+        char handshake[HANDSHAKE_LENGTH];
+        if (!ReceiveAll(client, handshake, sizeof(handshake), stopped_) ||
+            std::string_view(handshake + 28, 20) != tf_.infoHash) {
+            return;
+        }
+        std::string reply;
+        reply += static_cast<char>(19);
+        reply += "BitTorrent protocol";
+        reply.append(8, '\0');
+        reply += tf_.infoHash;
+        reply += peerId_;
+        // bitfield: у нас все части, лишние биты последнего байта нулевые
+        const size_t pieces = tf_.pieceHashes.size();
+        std::string bitfield((pieces + 7) / 8, '\xFF');
+        if (pieces % 8 != 0) {
+            bitfield.back() = static_cast<char>(0xFF << (8 - pieces % 8));
+        }
+        PutInt(reply, 1 + bitfield.size());
+        reply += static_cast<char>(5);
+        reply += bitfield;
+        if (!SendAll(client, reply)) {
+            return;
+        }
+
+        std::string message;
+        std::string piece;
+        while (!stopped_) {
+            char lengthBytes[4];
+            if (!ReceiveAll(client, lengthBytes, 4, stopped_)) {
+                return;
+            }
+            const size_t length = BytesToInt(std::string_view(lengthBytes, 4));
+            if (length == 0) {
+                continue;
+            }
+            if (length > (1 << 20)) {
+                return;
+            }
+            message.resize(length);
+            if (!ReceiveAll(client, message.data(), length, stopped_)) {
+                return;
+            }
+            const uint8_t id = message[0];
+            if (id == 2) {
+                // interested: раздача открыта всем сразу
+                std::string unchoke;
+                PutInt(unchoke, 1);
+                unchoke += static_cast<char>(1);
+                if (!SendAll(client, unchoke)) {
+                    return;
+                }
+            } else if (id == 6 && length == 13) {
+                const size_t index = BytesToInt(std::string_view(message).substr(1, 4));
+                const size_t begin = BytesToInt(std::string_view(message).substr(5, 4));
+                const size_t blockLength = BytesToInt(std::string_view(message).substr(9, 4));
+                const uint64_t offset = static_cast<uint64_t>(index) * tf_.pieceLength + begin;
+                if (index >= pieces || blockLength > (1 << 17) || offset + blockLength > tf_.length) {
+                    return;
+                }
+                piece.clear();
+                PutInt(piece, 9 + blockLength);
+                piece += static_cast<char>(7);
+                piece.append(message, 1, 8);
+                const size_t header = piece.size();
+                piece.resize(header + blockLength);
+                if (pread(dataFd_, piece.data() + header, blockLength, offset) != static_cast<ssize_t>(blockLength) ||
+                    !SendAll(client, piece)) {
+                    return;
+                }
+                uploaded_ += blockLength;
+            }
+        }
+    }
+
+    const TorrentFile& tf_;
+    const int dataFd_;
+    int sock_;
+    int port_;
+    std::string peerId_;
+    std::atomic<bool> stopped_;
+    std::atomic<uint64_t> uploaded_;
+    std::vector<std::thread> threads_;  // только из потока AcceptLoop, до join в деструкторе
+    std::thread acceptThread_;
+};
+
+/*
+ * Подключается к клиенту на `port` как входящий пир, заявляет интерес и раз за разом просит все блоки всех частей,
+ * но ничего не читает из сокета (и держит маленький буфер приема). Раздача такому пиру быстро упирается в полный
+ * буфер сокета клиента. Переподключается, пока клиент не начал слушать порт или пока не разорвал соединение
+ */
+class StalledLeecher {
+public:
+    StalledLeecher(const TorrentFile& tf, int port) : tf_(tf), port_(port), stopped_(false) {
+        peerId_ = "-SB0001-" + RandomString(12);
+        thread_ = std::thread(&StalledLeecher::Loop, this);
+    }
+
+    ~StalledLeecher() {
+        stopped_ = true;
+        thread_.join();
+    }
+private:
+    void Loop() {
+        while (!stopped_) {
+            int sock = Connect();
+            if (sock >= 0) {
+                Flood(sock);
+                close(sock);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT_MS));
+        }
+    }
+
+    int Connect() const {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int receiveBuffer = 4096;
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port_);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    void Flood(int sock) const {
+        std::string hello;
+        hello += static_cast<char>(19);
+        hello += "BitTorrent protocol";
+        hello.append(8, '\0');
+        hello += tf_.infoHash;
+        hello += peerId_;
+        PutInt(hello, 1);
+        hello += static_cast<char>(2);  // interested
+        if (!SendAll(sock, hello)) {
+            return;
+        }
+        // запросы шлются без ожидания: когда клиент перестает их читать, остаток круга отбрасывается
+        std::string requests;
+        for (size_t index = 0; index < tf_.pieceHashes.size(); ++index) {
+            const size_t pieceLength = std::min<size_t>(tf_.pieceLength, tf_.length - index * tf_.pieceLength);
+            for (size_t begin = 0; begin < pieceLength; begin += 1 << 14) {
+                PutInt(requests, 13);
+                requests += static_cast<char>(6);
+                PutInt(requests, index);
+                PutInt(requests, begin);
+                PutInt(requests, std::min<size_t>(1 << 14, pieceLength - begin));
+            }
+        }
+        while (!stopped_) {
+            std::string_view left = requests;
+            while (!left.empty() && !stopped_) {
+                ssize_t sent = send(sock, left.data(), left.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+                if (sent <= 0) {
+                    return;  // клиент закрыл соединение
+                }
+                left.remove_prefix(sent);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(2 * POLL_TIMEOUT_MS));
+        }
+    }
+
+    const TorrentFile& tf_;
+    const int port_;
+    std::string peerId_;
+    std::atomic<bool> stopped_;
+    std::thread thread_;
+};
+
+/*
+ * HTTP-трекер, который на любой GET отвечает компактным списком пиров `ports` на 127.0.0.1.
+ * Считает события announce и запоминает последние присланные клиентом downloaded и left
+ */
+class StubHttpTracker {
+public:
+    struct Report {
+        size_t started = 0;
+        size_t completed = 0;
+        size_t stopped = 0;
+        uint64_t downloaded = 0;
+        uint64_t left = 0;
+    };
+
+    explicit StubHttpTracker(const std::vector<int>& ports) : stopped_(false), announces_(0) {
+        Bencode::Encoder encoder;
+        encoder.BeginDict();
+        encoder.Key("interval");
+        encoder.Integer(1800);
+        encoder.Key("peers");
+        std::string peers;
+        for (int port : ports) {
+            PutInt(peers, INADDR_LOOPBACK);
+            peers += static_cast<char>(port >> 8);
+            peers += static_cast<char>(port & 0xFF);
+        }
+        encoder.String(peers);
+        encoder.End();
+        const std::string body = encoder.Release();
+        response_ = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " + std::to_string(body.size()) +
+                    "\r\n\r\n" + body;
+        sock_ = Listen(port_);
+        thread_ = std::thread(&StubHttpTracker::Serve, this);
+    }
+
+    ~StubHttpTracker() {
+        stopped_ = true;
+        thread_.join();
+        close(sock_);
+    }
+
+    std::string AnnounceUrl() const {
+        return "http://127.0.0.1:" + std::to_string(port_) + "/announce";
+    }
+
+    size_t Announces() const {
+        return announces_;
+    }
+
+    Report GetReport() const {
+        std::lock_guard lock(mutex_);
+        return report_;
+    }
+private:
+    // значение параметра `key` из строки запроса GET, пустое, если его нет
+    static std::string QueryValue(std::string_view request, std::string_view key) {
+        const std::string_view target = request.substr(0, request.find(' ', 4));
+        for (size_t begin = target.find('?'); begin != std::string_view::npos; begin = target.find('&', begin)) {
+            ++begin;
+            if (target.substr(begin).starts_with(key) && target.substr(begin + key.size()).starts_with('=')) {
+                const size_t value = begin + key.size() + 1;
+                return std::string(target.substr(value, target.find('&', value) - value));
+            }
+        }
+        return "";
+    }
+
+    void Record(std::string_view request) {
+        std::lock_guard lock(mutex_);
+        const std::string event = QueryValue(request, "event");
+        report_.started += event == "started";
+        report_.completed += event == "completed";
+        report_.stopped += event == "stopped";
+        const std::string downloaded = QueryValue(request, "downloaded");
+        const std::string left = QueryValue(request, "left");
+        report_.downloaded = downloaded.empty() ? 0 : std::stoull(downloaded);
+        report_.left = left.empty() ? 0 : std::stoull(left);
+    }
+
+    // запросов немного, поэтому по одному и с закрытием соединения после ответа
+    void Serve() {
+        while (!stopped_) {
+            pollfd readable = {sock_, POLLIN, 0};
+            if (poll(&readable, 1, POLL_TIMEOUT_MS) <= 0) {
+                continue;
+            }
+            int client = accept4(sock_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+            std::string request;
+            char chunk[4096];
+            while (request.find("\r\n\r\n") == std::string::npos) {
+                pollfd clientReadable = {client, POLLIN, 0};
+                if (poll(&clientReadable, 1, 1000) <= 0) {
+                    break;
+                }
+                ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+                if (received <= 0) {
+                    break;
+                }
+                request.append(chunk, received);
+            }
+            if (request.starts_with("GET ")) {
+                ++announces_;
+                Record(request);
+                SendAll(client, response_);
+            }
+            close(client);
+        }
+    }
+
+    std::string response_;
+    int sock_;
+    int port_;
+    std::atomic<bool> stopped_;
+    std::atomic<size_t> announces_;
+    mutable std::mutex mutex_;
+    Report report_;  // guarded by mutex_
+    std::thread thread_;
+};
+
+void GenerateFile(const fs::path& path, size_t length) {
+    std::mt19937_64 random(42);
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    std::string chunk(1 << 20, '\0');
+    for (size_t written = 0; written < length; written += chunk.size()) {
+        for (size_t i = 0; i < chunk.size(); i += sizeof(uint64_t)) {
+            uint64_t value = random();
+            std::memcpy(chunk.data() + i, &value, sizeof(value));
+        }
+        output.write(chunk.data(), static_cast<std::streamsize>(std::min(chunk.size(), length - written)));
+    }
+}
+
+bool SameFiles(const fs::path& lhs, const fs::path& rhs) {
+    std::ifstream left(lhs, std::ios::binary);
+    std::ifstream right(rhs, std::ios::binary);
+    if (!left || !right || fs::file_size(lhs) != fs::file_size(rhs)) {
+        return false;
+    }
+    std::string leftChunk(1 << 20, '\0');
+    std::string rightChunk(1 << 20, '\0');
+    while (left && right) {
+        left.read(leftChunk.data(), static_cast<std::streamsize>(leftChunk.size()));
+        right.read(rightChunk.data(), static_cast<std::streamsize>(rightChunk.size()));
+        if (left.gcount() != right.gcount() ||
+            std::memcmp(leftChunk.data(), rightChunk.data(), static_cast<size_t>(left.gcount())) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Свободный порт для входящих соединений клиента: ядро выдает его для bind(0), после закрытия он остается свободным
+int FreePort() {
+    int port;
+    close(Listen(port));
+    return port;
+}
+
+struct RunResult {
+    int status = -1;
+    double seconds = 0;
+    double firstPieceSeconds = -1;
+    double cpuSeconds = 0;
+    long peakRssKb = 0;
+    bool timedOut = false;  // клиент не завершился за отведенное время и был убит
+};
+
+/*
+ * Запустить клиент и дождаться его завершения, но не дольше `timeout`. Вывод клиента читается построчно: по первой
+ * строке о сохраненной части засекается время до первой части, остальное отбрасывается (и пишется в `logPath`)
+ */
+RunResult RunClient(const std::vector<std::string>& args, const fs::path& logPath, std::chrono::seconds timeout) {
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) < 0) {
+        throw std::runtime_error(std::string("pipe: ") + std::strerror(errno));
+    }
+    // после fork в многопоточном процессе до exec нельзя выделять память: argv готовится заранее
+    std::vector<char*> argv;
+    for (const std::string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    RunResult result;
+    const auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error(std::string("fork: ") + std::strerror(errno));
+    }
+    if (pid == 0) {
+        dup2(pipeFds[1], STDOUT_FILENO);
+        dup2(pipeFds[1], STDERR_FILENO);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    close(pipeFds[1]);
+
+    std::ofstream log(logPath);
+    std::string pending;
+    char chunk[65536];
+    ssize_t received;
+    const auto deadline = start + timeout;
+    while (true) {
+        using std::chrono::milliseconds;
+        const auto left = std::chrono::duration_cast<milliseconds>(deadline - std::chrono::steady_clock::now());
+        pollfd readable = {pipeFds[0], POLLIN, 0};
+        const int ready = left.count() > 0 ? poll(&readable, 1, static_cast<int>(left.count())) : 0;
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready == 0) {
+            kill(pid, SIGKILL);
+            result.timedOut = true;
+            break;
+        }
+        if ((received = read(pipeFds[0], chunk, sizeof(chunk))) <= 0) {
+            break;
+        }
+        log.write(chunk, received);
+        if (result.firstPieceSeconds < 0) {
+            pending.append(chunk, received);
+            // PieceStorage пишет строку на каждую записанную на диск часть
+            if (pending.find("Сохранена часть") != std::string::npos) {
+                result.firstPieceSeconds =
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                pending.clear();
+            } else if (pending.size() > 4096) {
+                pending.erase(0, pending.size() - 64);
+            }
+        }
+    }
+    close(pipeFds[0]);
+
+    int status = 0;
+    rusage usage{};
+    wait4(pid, &status, 0, &usage);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    result.cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec +
+                        usage.ru_stime.tv_usec / 1e6;
+    result.peakRssKb = usage.ru_maxrss;
+    return result;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    size_t sizeMb = 256;
+    size_t pieceKb = 256;
+    size_t seedersCount = 4;
+    size_t stalledLeechers = 0;
+    size_t runs = 1;
+    std::chrono::seconds timeout(300);
+    std::string client = (fs::canonical("/proc/self/exe").parent_path() / "torrent-client").string();
+    std::vector<std::string> clientArgs;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--size-mb" && i + 1 < argc) {
+            sizeMb = std::max(1UL, std::stoul(argv[++i]));
+        } else if (arg == "--piece-kb" && i + 1 < argc) {
+            pieceKb = std::stoul(argv[++i]);
+        } else if (arg == "--seeders" && i + 1 < argc) {
+            seedersCount = std::max(1UL, std::stoul(argv[++i]));
+        } else if (arg == "--stalled-leechers" && i + 1 < argc) {
+            stalledLeechers = std::stoul(argv[++i]);
+        } else if (arg == "--runs" && i + 1 < argc) {
+            runs = std::max(1UL, std::stoul(argv[++i]));
+        } else if (arg == "--timeout" && i + 1 < argc) {
+            timeout = std::chrono::seconds(std::max(1UL, std::stoul(argv[++i])));
+        } else if (arg == "--client" && i + 1 < argc) {
+            client = argv[++i];
+        } else if (arg == "--") {
+            clientArgs.assign(argv + i + 1, argv + argc);
+            break;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--size-mb <N>] [--piece-kb <K>] [--seeders <N>]"
+                      << " [--stalled-leechers <N>] [--runs <N>] [--timeout <seconds>] [--client <path>]"
+                      << " [-- <client args>...]" << std::endl;
+            return 1;
+        }
+    }
+
+    const fs::path directory = fs::temp_directory_path() / ("swarm-bench-" + RandomString(8));
+    fs::create_directories(directory);
+    const fs::path source = directory / "swarm-bench.bin";
+    GenerateFile(source, sizeMb << 20);
+    const int dataFd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+
+    // адрес трекера входит в .torrent, поэтому сначала поднимаются пиры, потом трекер, потом создается торрент.
+    // Пиры читают `tf` только при входящих соединениях, а они начнутся с запуском клиента
+    TorrentFile tf;
+    std::vector<std::unique_ptr<StubSeeder>> seeders;
+    std::vector<int> ports;
+    for (size_t i = 0; i < seedersCount; ++i) {
+        seeders.push_back(std::make_unique<StubSeeder>(tf, dataFd));
+        ports.push_back(seeders.back()->Port());
+    }
+    StubHttpTracker tracker(ports);
+    CreateOptions createOptions;
+    createOptions.announces.push_back(tracker.AnnounceUrl());
+    createOptions.pieceLength = pieceKb << 10;
+    tf = CreateTorrentFile(source, createOptions);
+    const fs::path torrentPath = directory / "swarm-bench.torrent";
+    SaveTorrentFile(tf, torrentPath.string());
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << sizeMb << " MiB, " << tf.pieceHashes.size() << " pieces of " << pieceKb << " KiB, " << seedersCount
+              << " seeders";
+    if (stalledLeechers != 0) {
+        std::cout << " and " << stalledLeechers << " stalled leechers";
+    }
+    std::cout << " on 127.0.0.1" << std::endl;
+    int exitCode = 0;
+    for (size_t run = 0; run < runs; ++run) {
+        const fs::path output = directory / ("out-" + std::to_string(run));
+        const int clientPort = FreePort();
+        std::vector<std::string> args = {client, "-d", output.string(), "--no-dht", "--port",
+                                         std::to_string(clientPort)};
+        args.insert(args.end(), clientArgs.begin(), clientArgs.end());
+        args.push_back(torrentPath.string());
+        const fs::path logPath = directory / ("client-" + std::to_string(run) + ".log");
+        std::vector<std::unique_ptr<StalledLeecher>> leechers;
+        for (size_t i = 0; i < stalledLeechers; ++i) {
+            leechers.push_back(std::make_unique<StalledLeecher>(tf, clientPort));
+        }
+        const RunResult result = RunClient(args, logPath, timeout);
+        leechers.clear();
+        const bool same = SameFiles(source, output / tf.name / tf.files.front().path);
+        const double gib = static_cast<double>(tf.length) / (1 << 30);
+        std::cout << "run " << run << ": " << result.seconds << " s, "
+                  << static_cast<double>(tf.length) / (1 << 20) / result.seconds << " MiB/s, first piece "
+                  << result.firstPieceSeconds * 1000 << " ms, CPU " << result.cpuSeconds << " s ("
+                  << result.cpuSeconds / gib << " s/GiB), peak RSS " << result.peakRssKb / 1024 << " MiB, "
+                  << (same ? "data OK" : "DATA MISMATCH") << (result.timedOut ? ", TIMED OUT" : "") << std::endl;
+        if (result.status != 0 || !same) {
+            std::cerr << "client exited with status " << result.status << ", log: " << logPath << std::endl;
+            exitCode = 1;
+            continue;
+        }
+        fs::remove_all(output);
+        fs::remove(logPath);
+    }
+    uint64_t uploaded = 0;
+    for (const auto& seeder : seeders) {
+        uploaded += seeder->Uploaded();
+    }
+    const StubHttpTracker::Report report = tracker.GetReport();
+    std::cout << "seeders uploaded " << (uploaded >> 20) << " MiB, tracker answered " << tracker.Announces()
+              << " announces (" << report.started << " started, " << report.completed << " completed, "
+              << report.stopped << " stopped), last reported downloaded " << (report.downloaded >> 20)
+              << " MiB, left " << report.left << std::endl;
+    seeders.clear();
+    close(dataFd);
+    if (exitCode == 0) {
+        fs::remove_all(directory);
+    }
+    return exitCode;
+}
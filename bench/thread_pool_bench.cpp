@@ -0,0 +1,174 @@
+#include "StaticThreadPool.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Пропускная способность StaticThreadPool на коротких задачах в зависимости от числа потоков, в сравнении
+ * с пулом на одной очереди под одним mutex и std::function (как был устроен StaticThreadPool раньше).
+ *
+ * external -- `--tasks` задач ставит один поток извне пула;
+ * nested -- задачи ставятся из задач: каждая порождает две следующих, пока не наберется `--tasks`
+ * (так пул используется, когда задачи сами дробят работу).
+ *
+ * Usage: thread-pool-bench [--tasks <N>] [--work <N>] [--max-threads <N>]
+ */
+
+namespace {
+
+// Пул с одной общей очередью под одним mutex и poison pill для остановки
+class MutexQueuePool {
+public:
+    using Task = std::function<void()>;
+
+    explicit MutexQueuePool(size_t workers) {
+        for (size_t i = 0; i < workers; ++i) {
+            workers_.emplace_back([this]() {
+                while (true) {
+                    Task task;
+                    {
+                        std::unique_lock lock(mutex_);
+                        notEmpty_.wait(lock, [this]() {
+                            return !tasks_.empty();
+                        });
+                        task = std::move(tasks_.front());
+                        tasks_.pop_front();
+                    }
+                    if (!task) {
+                        break;
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    void Submit(Task task) {
+        std::lock_guard lock(mutex_);
+        tasks_.push_back(std::move(task));
+        notEmpty_.notify_one();
+    }
+
+    // в отличие от StaticThreadPool, задачи, поставленные задачами после poison pill, не выполнятся:
+    // бенчмарк дожидается их сам, прежде чем вызвать Join
+    void Join() {
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            Submit({});
+        }
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+private:
+    std::deque<Task> tasks_;  // guarded by mutex_
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::vector<std::thread> workers_;
+};
+
+// Немного вычислений, чтобы задача не была совсем пустой
+uint64_t Work(uint64_t seed, size_t iterations) {
+    for (size_t i = 0; i < iterations; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+    }
+    return seed;
+}
+
+struct Counters {
+    std::atomic<size_t> done = 0;
+    std::atomic<uint64_t> checksum = 0;
+    std::mutex mutex;
+    std::condition_variable allDone;
+};
+
+void Finish(Counters& counters, size_t total, uint64_t value) {
+    counters.checksum.fetch_add(value, std::memory_order_relaxed);
+    if (counters.done.fetch_add(1) + 1 == total) {
+        std::lock_guard lock(counters.mutex);
+        counters.allDone.notify_all();
+    }
+}
+
+// Задача с номером `index` в двоичном дереве из `total` задач ставит своих потомков 2i+1 и 2i+2
+template <typename Pool>
+void SpawnTree(Pool& pool, Counters& counters, size_t index, size_t total, size_t work) {
+    for (size_t child = 2 * index + 1; child <= 2 * index + 2 && child < total; ++child) {
+        pool.Submit([&pool, &counters, child, total, work]() {
+            SpawnTree(pool, counters, child, total, work);
+        });
+    }
+    Finish(counters, total, Work(index + 1, work));
+}
+
+template <typename Pool>
+double Measure(size_t threads, size_t tasks, size_t work, bool nested) {
+    Pool pool(threads);
+    Counters counters;
+    auto start = std::chrono::steady_clock::now();
+    if (nested) {
+        pool.Submit([&pool, &counters, tasks, work]() {
+            SpawnTree(pool, counters, 0, tasks, work);
+        });
+    } else {
+        for (size_t i = 0; i < tasks; ++i) {
+            pool.Submit([&counters, i, tasks, work]() {
+                Finish(counters, tasks, Work(i + 1, work));
+            });
+        }
+    }
+    {
+        std::unique_lock lock(counters.mutex);
+        counters.allDone.wait(lock, [&counters, tasks]() {
+            return counters.done.load() == tasks;
+        });
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    pool.Join();
+    return tasks / seconds;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    size_t tasks = 1000000;
+    size_t work = 50;
+    size_t maxThreads = std::max(1U, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--tasks" && i + 1 < argc) {
+            tasks = std::max(1UL, std::stoul(argv[++i]));
+        } else if (arg == "--work" && i + 1 < argc) {
+            work = std::stoul(argv[++i]);
+        } else if (arg == "--max-threads" && i + 1 < argc) {
+            maxThreads = std::max(1UL, std::stoul(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--tasks <N>] [--work <N>] [--max-threads <N>]" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << tasks << " tasks of " << work << " xorshift rounds, Mtasks/s (work stealing / single mutex queue)"
+              << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    for (size_t threads = 1;; threads = std::min(threads * 2, maxThreads)) {
+        std::cout << std::setw(3) << threads << " threads:"
+                  << "  external " << Measure<StaticThreadPool>(threads, tasks, work, false) / 1e6
+                  << " / " << Measure<MutexQueuePool>(threads, tasks, work, false) / 1e6
+                  << "  nested " << Measure<StaticThreadPool>(threads, tasks, work, true) / 1e6
+                  << " / " << Measure<MutexQueuePool>(threads, tasks, work, true) / 1e6 << std::endl;
+        if (threads == maxThreads) {
+            break;
+        }
+    }
+    return 0;
+}
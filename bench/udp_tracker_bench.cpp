@@ -0,0 +1,307 @@
+#include "udp_tracker.h"
+#include "byte_tools.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+/*
+ * Локальный UDP-трекер (BEP 15) и замер UdpTrackerClient на нем.
+ *
+ * Без --serve: поднимает трекер на свободном порту и делает `--rounds` опросов, в каждом `--torrents` торрентов
+ * одновременно объявляются одному трекеру. Печатает время опроса и число пакетов: connect нужен один на опрос
+ * (connection_id кешируется), announce всех торрентов уходят пачкой. `--drop-every N` теряет каждый N-й пакет
+ * на стороне трекера, чтобы проверить повторы запросов.
+ * `--short-connect-every N` обрезает первый и затем каждый N-й ответ на connect до 8 байт, `--foreign-replies`
+ * перед каждым ответом на connect присылает с другого порта ответ с чужим connection_id: клиент должен отбросить
+ * и те и другие и дождаться настоящего ответа. Опрос, не закончившийся за 10 секунд, прерывается. Код возврата
+ * ненулевой, если хоть один announce завершился ошибкой.
+ *
+ * С --serve <port>: работает как трекер для ручных проверок клиента (udp://127.0.0.1:<port>/announce).
+ * Отвечает пирами, объявившимися для того же info_hash, и пирами из --peer.
+ *
+ * Usage: udp-tracker-bench [--torrents <N>] [--rounds <N>] [--drop-every <N>] [--short-connect-every <N>]
+ *                          [--foreign-replies]
+ *        udp-tracker-bench --serve <port> [--peer <ip:port>]... [--drop-every <N>]
+ */
+
+namespace {
+
+constexpr uint64_t PROTOCOL_ID = 0x41727101980;
+// опрос, не закончившийся за это время, прерывается через UdpTrackerClient::Stop
+constexpr std::chrono::seconds ROUND_TIMEOUT(10);
+
+void PutInt(std::string& packet, uint64_t value, size_t length) {
+    for (size_t i = 0; i < length; ++i) {
+        packet += static_cast<char>((value >> (8 * (length - 1 - i))) & 0xFF);
+    }
+}
+
+int BindLoopback(int port) {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sock < 0 || bind(sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        throw std::runtime_error(std::string("Failed to bind UDP tracker: ") + std::strerror(errno));
+    }
+    return sock;
+}
+
+/*
+ * Испорченные ответы трекера, которые клиент должен отбросить
+ */
+struct Faults {
+    size_t dropEvery = 0;  // терять каждый N-й входящий пакет
+    size_t shortConnectEvery = 0;  // обрезать первый и затем каждый N-й ответ на connect до action и transaction_id
+    bool foreignReplies = false;  // перед ответом на connect слать с другого порта ответ с чужим connection_id
+};
+
+class StubTracker {
+public:
+    StubTracker(int port, Faults faults, std::vector<Peer> peers) :
+        faults_(faults), staticPeers_(std::move(peers)), stopped_(false), received_(0), connects_(0),
+        announces_(0) {
+        sock_ = BindLoopback(port);
+        foreignSock_ = BindLoopback(0);
+        sockaddr_in address{};
+        socklen_t length = sizeof(address);
+        getsockname(sock_, reinterpret_cast<sockaddr*>(&address), &length);
+        port_ = ntohs(address.sin_port);
+        thread_ = std::thread(&StubTracker::Serve, this);
+    }
+
+    ~StubTracker() {
+        stopped_ = true;
+        thread_.join();
+        close(sock_);
+        close(foreignSock_);
+    }
+
+    int Port() const {
+        return port_;
+    }
+
+    size_t Connects() const {
+        return connects_;
+    }
+
+    size_t Announces() const {
+        return announces_;
+    }
+private:
+    void Serve() {
+        std::string buffer(2048, '\0');
+        while (!stopped_) {
+            pollfd readable = {sock_, POLLIN, 0};
+            if (poll(&readable, 1, 100) <= 0) {
+                continue;
+            }
+            sockaddr_storage from{};
+            socklen_t fromLength = sizeof(from);
+            ssize_t received = recvfrom(sock_, buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&from),
+                                        &fromLength);
+            if (received < 16 || (faults_.dropEvery != 0 && ++received_ % faults_.dropEvery == 0)) {
+                continue;
+            }
+            std::string_view request(buffer.data(), received);
+            const uint64_t connectionId = BytesToInt(request.substr(0, 8));
+            const uint32_t action = BytesToInt(request.substr(8, 4));
+            const std::string_view transaction = request.substr(12, 4);
+            std::string response;
+            if (action == 0 && connectionId == PROTOCOL_ID) {
+                ++connects_;
+                if (faults_.foreignReplies) {
+                    std::string foreign;
+                    PutInt(foreign, 0, 4);
+                    foreign += transaction;
+                    PutInt(foreign, (static_cast<uint64_t>(random_()) << 32) | random_(), 8);
+                    sendto(foreignSock_, foreign.data(), foreign.size(), 0, reinterpret_cast<sockaddr*>(&from),
+                           fromLength);
+                }
+                PutInt(response, 0, 4);
+                response += transaction;
+                if (faults_.shortConnectEvery == 0 || (connects_ - 1) % faults_.shortConnectEvery != 0) {
+                    const uint64_t issued = (static_cast<uint64_t>(random_()) << 32) | random_();
+                    connectionIds_.insert(issued);
+                    PutInt(response, issued, 8);
+                }
+            } else if (action == 1 && received >= 98) {
+                ++announces_;
+                if (!connectionIds_.contains(connectionId)) {
+                    PutInt(response, 3, 4);
+                    response += transaction;
+                    response += "Connection ID mismatch";
+                } else {
+                    Peer peer = Peer::FromSockaddr(reinterpret_cast<sockaddr*>(&from));
+                    peer.port = BytesToInt(request.substr(96, 2));
+                    std::set<Peer, PeerLess>& swarm = swarms_[std::string(request.substr(16, 20))];
+                    PutInt(response, 1, 4);
+                    response += transaction;
+                    PutInt(response, 30, 4);  // interval
+                    PutInt(response, 0, 4);
+                    PutInt(response, swarm.size(), 4);
+                    for (const Peer& known : staticPeers_) {
+                        AppendPeer(response, known);
+                    }
+                    for (const Peer& known : swarm) {
+                        if (!(known == peer)) {
+                            AppendPeer(response, known);
+                        }
+                    }
+                    swarm.insert(peer);
+                }
+            } else {
+                continue;
+            }
+            sendto(sock_, response.data(), response.size(), 0, reinterpret_cast<sockaddr*>(&from), fromLength);
+        }
+    }
+
+    static void AppendPeer(std::string& response, const Peer& peer) {
+        if (peer.family == AF_INET) {
+            response.append(reinterpret_cast<const char*>(peer.address.data()), 4);
+            PutInt(response, peer.port, 2);
+        }
+    }
+
+    struct PeerLess {
+        bool operator()(const Peer& a, const Peer& b) const {
+            return std::tie(a.address, a.port) < std::tie(b.address, b.port);
+        }
+    };
+
+    const Faults faults_;
+    const std::vector<Peer> staticPeers_;
+    int sock_;
+    int foreignSock_;
+    int port_;
+    std::atomic<bool> stopped_;
+    size_t received_;
+    std::atomic<size_t> connects_;
+    std::atomic<size_t> announces_;
+    std::mt19937 random_{42};
+    std::set<uint64_t> connectionIds_;
+    std::map<std::string, std::set<Peer, PeerLess>> swarms_;
+    std::thread thread_;
+};
+
+}
+
+int main(int argc, char* argv[]) {
+    size_t torrents = 100;
+    size_t rounds = 3;
+    Faults faults;
+    int servePort = -1;
+    std::vector<Peer> peers;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--torrents" && i + 1 < argc) {
+            torrents = std::stoul(argv[++i]);
+        } else if (arg == "--rounds" && i + 1 < argc) {
+            rounds = std::stoul(argv[++i]);
+        } else if (arg == "--drop-every" && i + 1 < argc) {
+            faults.dropEvery = std::stoul(argv[++i]);
+        } else if (arg == "--short-connect-every" && i + 1 < argc) {
+            faults.shortConnectEvery = std::stoul(argv[++i]);
+        } else if (arg == "--foreign-replies") {
+            faults.foreignReplies = true;
+        } else if (arg == "--serve" && i + 1 < argc) {
+            servePort = std::stoi(argv[++i]);
+        } else if (arg == "--peer" && i + 1 < argc) {
+            std::string address = argv[++i];
+            size_t colon = address.rfind(':');
+            Peer peer;
+            if (colon == std::string::npos ||
+                !Peer::FromString(address.substr(0, colon), std::stoi(address.substr(colon + 1)), peer)) {
+                std::cerr << "Invalid peer address: " << address << std::endl;
+                return 1;
+            }
+            peers.push_back(peer);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--torrents <N>] [--rounds <N>] [--drop-every <N>]"
+                      << " [--short-connect-every <N>] [--foreign-replies]" << std::endl;
+            std::cerr << "       " << argv[0] << " --serve <port> [--peer <ip:port>]... [--drop-every <N>]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (servePort >= 0) {
+        StubTracker tracker(servePort, faults, peers);
+        std::cout << "UDP tracker on udp://127.0.0.1:" << tracker.Port() << "/announce" << std::endl;
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+
+    StubTracker tracker(0, faults, {});
+    const std::string url = "udp://127.0.0.1:" + std::to_string(tracker.Port()) + "/announce";
+    // короткий таймаут повтора, чтобы потерянные пакеты не растягивали замер на десятки секунд
+    UdpTrackerClient client(std::chrono::milliseconds(200), 4);
+
+    std::cout << std::fixed << std::setprecision(2);
+    size_t totalFailed = 0;
+    for (size_t round = 0; round < rounds && totalFailed == 0; ++round) {
+        const size_t connectsBefore = client.ConnectsSent();
+        const size_t announcesBefore = client.AnnouncesSent();
+        std::atomic<size_t> failed = 0;
+        std::atomic<size_t> peersReceived = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < torrents; ++i) {
+            threads.emplace_back([&, i]() {
+                UdpTrackerClient::AnnounceRequest request;
+                request.infoHash = std::string(20, static_cast<char>(i % 4));
+                request.peerId = RandomString(20);
+                request.left = 1 << 20;
+                request.port = static_cast<uint16_t>(10000 + i);
+                try {
+                    TrackerResponse response = client.Announce(url, request);
+                    // ответ с ошибкой, например на чужой connection_id, -- тоже неудача
+                    failed += !response.failureReason.empty();
+                    peersReceived += response.peers.size();
+                } catch (const std::exception&) {
+                    ++failed;
+                }
+            });
+        }
+        std::atomic<bool> finished = false;
+        std::thread watchdog([&]() {
+            const auto deadline = start + ROUND_TIMEOUT;
+            while (!finished && std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            if (!finished) {
+                std::cout << "round " << round << " did not finish in " << ROUND_TIMEOUT.count() << " s" << std::endl;
+                client.Stop();
+            }
+        });
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        finished = true;
+        watchdog.join();
+        totalFailed += failed;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "round " << round << ": " << torrents << " announces in " << ms << " ms, sent "
+                  << client.ConnectsSent() - connectsBefore << " connect and "
+                  << client.AnnouncesSent() - announcesBefore << " announce packets, " << failed << " failed, "
+                  << peersReceived << " peers received" << std::endl;
+    }
+    std::cout << "tracker handled " << tracker.Connects() << " connects and " << tracker.Announces() << " announces"
+              << std::endl;
+    return totalFailed == 0 ? 0 : 1;
+}
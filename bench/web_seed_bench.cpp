@@ -0,0 +1,320 @@
+#include "web_seed.h"
+#include "torrent_creator.h"
+#include "disk_writer.h"
+#include "byte_tools.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+/*
+ * Локальный HTTP-сервер с поддержкой Range и keep-alive и замер скачивания через WebSeed.
+ *
+ * Без --serve: создает в temp-директории торрент из нескольких файлов неровной длины (в том числе пустых),
+ * поднимает сервер на свободном порту и скачивает все части `--connections` соединениями WebSeed.
+ * Печатает скорость, число HTTP-запросов и TCP-соединений на стороне сервера (соединения переиспользуются,
+ * поэтому их столько же, сколько WebSeed) и проверяет, что все части прошли проверку хеша.
+ *
+ * С --serve <dir>: раздает файлы директории для ручных проверок клиента
+ * (торрент из <dir>/<name> создается с --web-seed http://127.0.0.1:<port>/).
+ *
+ * Usage: web-seed-bench [--size-mb <N>] [--piece-kb <K>] [--connections <N>]
+ *        web-seed-bench --serve <dir> [--port <port>]
+ */
+
+namespace fs = std::filesystem;
+
+namespace {
+
+class StubHttpServer {
+public:
+    StubHttpServer(fs::path root, int port) : root_(std::move(root)), stopped_(false), requests_(0), connections_(0) {
+        sock_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (sock_ < 0 || bind(sock_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 ||
+            listen(sock_, 64) < 0) {
+            throw std::runtime_error(std::string("Failed to start HTTP server: ") + std::strerror(errno));
+        }
+        socklen_t length = sizeof(address);
+        getsockname(sock_, reinterpret_cast<sockaddr*>(&address), &length);
+        port_ = ntohs(address.sin_port);
+        acceptThread_ = std::thread(&StubHttpServer::AcceptLoop, this);
+    }
+
+    ~StubHttpServer() {
+        stopped_ = true;
+        acceptThread_.join();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+        close(sock_);
+    }
+
+    int Port() const {
+        return port_;
+    }
+
+    size_t Requests() const {
+        return requests_;
+    }
+
+    size_t Connections() const {
+        return connections_;
+    }
+private:
+    void AcceptLoop() {
+        while (!stopped_) {
+            pollfd readable = {sock_, POLLIN, 0};
+            if (poll(&readable, 1, 100) <= 0) {
+                continue;
+            }
+            int client = accept4(sock_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) {
+                continue;
+            }
+            ++connections_;
+            threads_.emplace_back(&StubHttpServer::Serve, this, client);
+        }
+    }
+
+    // Обслуживать запросы соединения, пока клиент его не закроет
+    void Serve(int client) {
+        std::string buffer;
+        char chunk[4096];
+        while (!stopped_) {
+            size_t headersEnd;
+            while ((headersEnd = buffer.find("\r\n\r\n")) == std::string::npos) {
+                pollfd readable = {client, POLLIN, 0};
+                if (stopped_ || poll(&readable, 1, 100) < 0) {
+                    close(client);
+                    return;
+                }
+                if (readable.revents == 0) {
+                    continue;
+                }
+                ssize_t received = recv(client, chunk, sizeof(chunk), 0);
+                if (received <= 0) {
+                    close(client);
+                    return;
+                }
+                buffer.append(chunk, received);
+            }
+            const std::string request = buffer.substr(0, headersEnd);
+            buffer.erase(0, headersEnd + 4);
+            ++requests_;
+            if (!Respond(client, request)) {
+                break;
+            }
+        }
+        close(client);
+    }
+
+    // Ответить на запрос GET. false -- соединение надо закрыть
+    bool Respond(int client, const std::string& request) {
+        const size_t pathBegin = request.find(' ') + 1;
+        const size_t pathEnd = request.find(' ', pathBegin);
+        if (!request.starts_with("GET ") || pathEnd == std::string::npos) {
+            SendAll(client, "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            return false;
+        }
+        const std::string path = UrlDecode(request.substr(pathBegin + 1, pathEnd - pathBegin - 1));
+        const int fd = path.find("..") == std::string::npos ? open((root_ / path).c_str(), O_RDONLY | O_CLOEXEC) : -1;
+        struct stat info{};
+        if (fd < 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return SendAll(client, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+        }
+        const size_t size = info.st_size;
+        size_t from = 0;
+        size_t to = size;
+        std::string status = "200 OK";
+        std::string headers;
+        const size_t range = request.find("\r\nRange: bytes=");
+        if (range != std::string::npos) {
+            const size_t begin = range + 15;
+            const size_t dash = request.find('-', begin);
+            from = std::stoull(request.substr(begin, dash - begin));
+            to = std::min<size_t>(size, std::stoull(request.substr(dash + 1)) + 1);
+            if (from >= to) {
+                close(fd);
+                return SendAll(client, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n\r\n");
+            }
+            status = "206 Partial Content";
+            headers = "Content-Range: bytes " + std::to_string(from) + "-" + std::to_string(to - 1) + "/" +
+                      std::to_string(size) + "\r\n";
+        }
+        std::string response = "HTTP/1.1 " + status + "\r\n" + headers + "Content-Length: " +
+                               std::to_string(to - from) + "\r\n\r\n";
+        const size_t headerLength = response.size();
+        response.resize(headerLength + to - from);
+        const bool read = pread(fd, response.data() + headerLength, to - from, from) == static_cast<ssize_t>(to - from);
+        close(fd);
+        return read && SendAll(client, response);
+    }
+
+    static bool SendAll(int client, std::string_view data) {
+        while (!data.empty()) {
+            ssize_t sent = send(client, data.data(), data.size(), MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return false;
+            }
+            data.remove_prefix(sent);
+        }
+        return true;
+    }
+
+    static std::string UrlDecode(std::string_view encoded) {
+        std::string result;
+        for (size_t i = 0; i < encoded.size(); ++i) {
+            if (encoded[i] == '%' && i + 2 < encoded.size()) {
+                result += static_cast<char>(std::stoi(std::string(encoded.substr(i + 1, 2)), nullptr, 16));
+                i += 2;
+            } else {
+                result += encoded[i];
+            }
+        }
+        return result;
+    }
+
+    const fs::path root_;
+    int sock_;
+    int port_;
+    std::atomic<bool> stopped_;
+    std::atomic<size_t> requests_;
+    std::atomic<size_t> connections_;
+    std::vector<std::thread> threads_;  // только из потока AcceptLoop, до join в деструкторе
+    std::thread acceptThread_;
+};
+
+// Файлы неровной длины, чтобы части пересекали границы файлов, плюс пустой файл и имя, которое надо экранировать
+void GenerateFiles(const fs::path& directory, size_t totalLength) {
+    std::mt19937_64 random(42);
+    const std::vector<std::string> names = {"a.bin", "empty", "sub dir/b.bin", "sub dir/c%d.bin", "z.bin"};
+    const std::vector<size_t> lengths = {totalLength / 3 + 12345, 0, 1, totalLength / 4 - 777, 0};
+    size_t written = 0;
+    for (size_t i = 0; i < names.size(); ++i) {
+        const size_t length = i + 1 == names.size() ? totalLength - written : lengths[i];
+        fs::create_directories((directory / names[i]).parent_path());
+        std::ofstream output(directory / names[i], std::ios::binary | std::ios::trunc);
+        std::string data(length, '\0');
+        for (char& c : data) {
+            c = static_cast<char>(random());
+        }
+        output.write(data.data(), static_cast<std::streamsize>(data.size()));
+        written += length;
+    }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+    size_t sizeMb = 64;
+    size_t pieceKb = 256;
+    size_t connections = 4;
+    std::string serveDirectory;
+    int port = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--size-mb" && i + 1 < argc) {
+            sizeMb = std::max(1UL, std::stoul(argv[++i]));
+        } else if (arg == "--piece-kb" && i + 1 < argc) {
+            pieceKb = std::stoul(argv[++i]);
+        } else if (arg == "--connections" && i + 1 < argc) {
+            connections = std::max(1UL, std::stoul(argv[++i]));
+        } else if (arg == "--serve" && i + 1 < argc) {
+            serveDirectory = argv[++i];
+        } else if (arg == "--port" && i + 1 < argc) {
+            port = std::stoi(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--size-mb <N>] [--piece-kb <K>] [--connections <N>]" << std::endl;
+            std::cerr << "       " << argv[0] << " --serve <dir> [--port <port>]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (!serveDirectory.empty()) {
+        StubHttpServer server(serveDirectory, port);
+        std::cout << "Serving " << serveDirectory << " on http://127.0.0.1:" << server.Port() << "/" << std::endl;
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    }
+
+    const fs::path directory = fs::temp_directory_path() / ("web-seed-bench-" + RandomString(8));
+    const fs::path source = directory / "data";
+    GenerateFiles(source, sizeMb << 20);
+    StubHttpServer server(directory, 0);
+
+    CreateOptions createOptions;
+    createOptions.pieceLength = pieceKb << 10;
+    createOptions.webSeeds.push_back("http://127.0.0.1:" + std::to_string(server.Port()) + "/");
+    const TorrentFile tf = CreateTorrentFile(source, createOptions);
+
+    // PieceStorage пишет в std::cout строку на каждую сохраненную часть, в выводе бенчмарка она не нужна
+    std::ostream nullStream(nullptr);
+    std::streambuf* coutBuffer = std::cout.rdbuf(nullStream.rdbuf());
+    double seconds;
+    size_t saved;
+    size_t requests = 0;
+    uint64_t downloaded = 0;
+    {
+        DiskWriter writer(64, FsyncPolicy::None);
+        MemoryBudget budget;
+        PieceStorage storage(tf, directory, (directory / "download").string(), writer, budget);
+        std::vector<std::unique_ptr<WebSeed>> seeds;
+        for (size_t i = 0; i < connections; ++i) {
+            seeds.push_back(std::make_unique<WebSeed>(tf.url_list.front(), tf, storage));
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (auto& seed : seeds) {
+            threads.emplace_back(&WebSeed::Run, seed.get());
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        storage.CloseOutputFile();
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        saved = storage.PiecesSavedToDiscCount();
+        for (auto& seed : seeds) {
+            requests += seed->RequestsSent();
+            downloaded += seed->DownloadedBytes();
+        }
+    }
+    std::cout.rdbuf(coutBuffer);
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << tf.files.size() << " files, " << tf.pieceHashes.size() << " pieces of " << pieceKb << " KiB, "
+              << connections << " connections" << std::endl;
+    std::cout << "downloaded " << (downloaded >> 20) << " MiB in " << seconds << " s ("
+              << static_cast<double>(downloaded) / (1 << 20) / seconds << " MiB/s), " << requests
+              << " HTTP requests, server accepted " << server.Connections() << " connections" << std::endl;
+    fs::remove_all(directory);
+    if (saved != tf.pieceHashes.size()) {
+        std::cerr << "Only " << saved << " of " << tf.pieceHashes.size() << " pieces passed the hash check!" << std::endl;
+        return 1;
+    }
+    std::cout << "all pieces passed the hash check" << std::endl;
+    return 0;
+}
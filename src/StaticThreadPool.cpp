@@ -1,35 +1,25 @@
 #include "StaticThreadPool.h"
+#include <cassert>
 
-// UnboundedBlockingMPMCQueue Implementation
-template <typename T>
-void UnboundedBlockingMPMCQueue<T>::Put(T value) {
-    std::lock_guard<std::mutex> guard(mutex_);
-    buffer_.push_back(std::move(value));
-    not_empty_.notify_one();
-}
+namespace {
 
-template <typename T>
-T UnboundedBlockingMPMCQueue<T>::Take() {
-    std::unique_lock<std::mutex> lock(mutex_);
-    while (buffer_.empty()){ // 
-        // 1) Release mutex, 2) Wait 3) Reacquire mutex
-        // Spurious wakeup
-        not_empty_.wait(lock);
-    }
-    return TakeLocked();
-}
+// пул и номер потока, в котором выполняется текущая задача: из него задачи ставятся в свою очередь
+thread_local const StaticThreadPool* currentPool = nullptr;
+thread_local size_t currentWorker = 0;
 
-template <typename T>
-T UnboundedBlockingMPMCQueue<T>::TakeLocked() {
-    assert(!buffer_.empty());
-    T front = std::move(buffer_.front());
-    buffer_.pop_front();
-    return front;
 }
 
-// StaticThreadPool Implementation
-StaticThreadPool::StaticThreadPool(size_t workers) {
-    StartWorkerThreads(workers);
+StaticThreadPool::StaticThreadPool(size_t workers) :
+    nextWorker_(0), pending_(0), sleeping_(0), stopped_(false) {
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    // потоки запускаются, когда все очереди уже созданы: воровать можно из любой
+    for (size_t i = 0; i < workers; ++i) {
+        workers_[i]->thread = std::thread([this, i]() {
+            WorkerRoutine(i);
+        });
+    }
 }
 
 StaticThreadPool::~StaticThreadPool() {
@@ -37,36 +27,83 @@ StaticThreadPool::~StaticThreadPool() {
 }
 
 void StaticThreadPool::Submit(Task task) {
-    tasks_.Put(std::move(task));
+    const size_t index = currentPool == this ? currentWorker
+                                             : nextWorker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+    // счетчик растет раньше, чем задача появляется в очереди: поток, увидевший его, не уснет, пока не найдет ее
+    pending_.fetch_add(1);
+    {
+        std::lock_guard lock(workers_[index]->mutex);
+        workers_[index]->tasks.push_back(std::move(task));
+    }
+    if (sleeping_.load() > 0) {
+        std::lock_guard lock(sleepMutex_);
+        hasWork_.notify_one();
+    }
 }
 
 void StaticThreadPool::Join() {
-    for (auto& worker : workers_) {
-        tasks_.Put({});  // Poison pill
+    stopped_ = true;
+    {
+        std::lock_guard lock(sleepMutex_);
+        hasWork_.notify_all();
     }
     for (auto& worker : workers_) {
-        worker.join();
+        worker->thread.join();
     }
     workers_.clear();
 }
 
-void StaticThreadPool::StartWorkerThreads(size_t count) {
-    for (size_t i = 0; i < count; ++i) {
-        workers_.emplace_back([this]() {
-            WorkerRoutine();
-        });
-    }
+size_t StaticThreadPool::WorkersCount() const {
+    return workers_.size();
+}
+
+size_t StaticThreadPool::QueuedCount() const {
+    return pending_.load();
 }
 
-void StaticThreadPool::WorkerRoutine() {
+void StaticThreadPool::WorkerRoutine(size_t index) {
+    currentPool = this;
+    currentWorker = index;
+    Task task;
     while (true) {
-        auto task = tasks_.Take();
-        if (!task) {
+        if (TryTake(index, task)) {
+            pending_.fetch_sub(1);
+            task();
+            // захваченное задачей освобождается сразу, а не при взятии следующей
+            task = Task();
+            continue;
+        }
+        std::unique_lock lock(sleepMutex_);
+        ++sleeping_;
+        hasWork_.wait(lock, [this]() {
+            return pending_.load() != 0 || stopped_.load();
+        });
+        --sleeping_;
+        if (pending_.load() == 0 && stopped_.load()) {
             break;
         }
-        task();
     }
+    currentPool = nullptr;
 }
 
-// Explicit instantiation of UnboundedBlockingMPMCQueue template for Task type
-template class UnboundedBlockingMPMCQueue<std::function<void()>>;
+bool StaticThreadPool::TryTake(size_t index, Task& task) {
+    {
+        Worker& own = *workers_[index];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.front());
+            own.tasks.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers_.size(); ++i) {
+        Worker& victim = *workers_[(index + i) % workers_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.back());
+            victim.tasks.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
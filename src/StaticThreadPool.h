@@ -1,54 +1,72 @@
 #pragma once
 
-#include <iostream>
+#include "task.h"
 #include <atomic>
-#include <functional>
-#include <thread>
-#include <chrono>
-#include <vector>
-#include <deque>
-#include <mutex>
-#include <assert.h>
 #include <condition_variable>
+#include <deque>
 #include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
-// Unbounded Blocking Multi-Producer/Multi-Consumer (MPMC) Queue
-
-// 1) shared state
-// 2) mutex
-// 3) predicate(state)
-
-template <typename T>
-class UnboundedBlockingMPMCQueue{
-public:
-    // Thread role: producer
-    void Put(T value);
-    
-    // Thread role: consumer
-    T Take();
-private:
-    T TakeLocked();
-
-    std::deque<T> buffer_; // Guarded by mutex_
-    std::mutex mutex_;
-    std::condition_variable not_empty_;
-};
-
+/*
+ * Пул из фиксированного числа потоков для коротких задач (проверка хешей частей, хеширование при создании торрента).
+ * У каждого потока своя очередь: задача, поставленная из потока пула, попадает в его же очередь, поставленная
+ * извне -- в очереди потоков по кругу. Поток берет задачи из начала своей очереди, а когда она пуста, забирает
+ * задачи с конца чужих (work stealing), так что потоки не делят один mutex на всех. Потоки без работы спят
+ * на condition variable, и будят их, только если кто-то действительно спит
+ */
 class StaticThreadPool{
-    using Task = std::function<void()>;
 public:
-    StaticThreadPool(size_t workers);
+    explicit StaticThreadPool(size_t workers);
     ~StaticThreadPool();
- 
+
     void Submit(Task task);
 
+    /*
+     * Поставить задачу `f` и получить future с ее результатом. Исключение из `f` выбрасывается из future::get
+     */
+    template <typename F>
+    std::future<std::invoke_result_t<std::decay_t<F>>> Async(F&& f) {
+        std::packaged_task<std::invoke_result_t<std::decay_t<F>>()> task(std::forward<F>(f));
+        auto result = task.get_future();
+        Submit(std::move(task));
+        return result;
+    }
+
+    /*
+     * Дождаться выполнения всех поставленных задач (в том числе поставленных самими задачами) и остановить потоки.
+     * Новые задачи извне после Join ставить нельзя
+     */
     void Join();
 
+    size_t WorkersCount() const;
+
+    /*
+     * Сколько задач стоит в очередях и еще не взято потоками
+     */
+    size_t QueuedCount() const;
 private:
-    void StartWorkerThreads(size_t count);
-    
-    void WorkerRoutine();
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;  // guarded by mutex
+        std::thread thread;
+    };
+
+    void WorkerRoutine(size_t index);
 
-    std::vector<std::thread> workers_;
-    UnboundedBlockingMPMCQueue<Task> tasks_;
-};
\ No newline at end of file
+    /*
+     * Взять задачу из начала своей очереди, а если она пуста -- с конца очереди другого потока
+     */
+    bool TryTake(size_t index, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<size_t> nextWorker_;  // в чью очередь пойдет следующая задача извне
+    std::atomic<size_t> pending_;  // задач в очередях, еще не взятых потоками
+    std::atomic<size_t> sleeping_;  // потоков, ждущих на hasWork_
+    std::atomic<bool> stopped_;
+    std::mutex sleepMutex_;
+    std::condition_variable hasWork_;
+};
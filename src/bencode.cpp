@@ -1,117 +1,214 @@
 #include "bencode.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace Bencode {
-    Peer parsePeer(std::string data){
-        Peer ret;
-        for (size_t i = 0; i <= 3; i++){
-            ret.ip += std::to_string(reinterpret_cast<unsigned char&>(data[i]));
-            if (i != 3) {
-                ret.ip += ".";
+    namespace {
+        // глубже в настоящих .torrent и ответах трекеров не бывает, а рекурсия на вредных данных не должна переполнить стек
+        constexpr size_t MAX_DEPTH = 64;
+
+        class Decoder {
+        public:
+            explicit Decoder(std::string_view data) : data_(data), pos_(0) {}
+
+            Node ParseNode(size_t depth) {
+                if (depth > MAX_DEPTH) {
+                    Fail("nesting is too deep");
+                }
+                if (pos_ >= data_.size()) {
+                    Fail("unexpected end of data");
+                }
+                const size_t begin = pos_;
+                Node node;
+                char c = data_[pos_];
+                if (c == 'i') {
+                    ++pos_;
+                    node.type = Node::Type::Integer;
+                    node.integer = ParseInteger('e');
+                } else if (c == 'l') {
+                    ++pos_;
+                    node.type = Node::Type::List;
+                    while (Peek() != 'e') {
+                        node.list.push_back(ParseNode(depth + 1));
+                    }
+                    ++pos_;
+                } else if (c == 'd') {
+                    ++pos_;
+                    node.type = Node::Type::Dict;
+                    while (Peek() != 'e') {
+                        std::string_view key = ParseString();
+                        node.dict.emplace_back(key, ParseNode(depth + 1));
+                    }
+                    ++pos_;
+                } else if (c >= '0' && c <= '9') {
+                    node.type = Node::Type::String;
+                    node.string = ParseString();
+                } else {
+                    Fail("unexpected character");
+                }
+                node.raw = data_.substr(begin, pos_ - begin);
+                return node;
             }
-        }
-        ret.port = (reinterpret_cast<unsigned char&>(data[4]) << 8) + reinterpret_cast<unsigned char&>(data[5]);
-        return ret;
-    }
-    std::string getCompactIp(const std::string& ip, bool isReversed){
-        std::string compactIp = "";
-        size_t idx = 0;
-        for (int i = 0; i < 4; i++){
-            compactIp += char(getNumWithIncrementIdx(ip, idx));
-        }
-        if (isReversed){
-            reverse(compactIp.begin(), compactIp.end());
-        }
-        return compactIp;
-    }
 
+            bool AtEnd() const {
+                return pos_ == data_.size();
+            }
 
+            [[noreturn]] void Fail(const std::string& reason) const {
+                throw std::invalid_argument("Invalid bencode at offset " + std::to_string(pos_) + ": " + reason);
+            }
+        private:
+            char Peek() const {
+                if (pos_ >= data_.size()) {
+                    Fail("unexpected end of data");
+                }
+                return data_[pos_];
+            }
 
+            int64_t ParseInteger(char terminator) {
+                bool negative = false;
+                if (Peek() == '-') {
+                    negative = true;
+                    ++pos_;
+                }
+                // BEP 3: у числа одна запись -- без ведущих нулей и без "-0"
+                if (Peek() == '0' && pos_ + 1 < data_.size() && data_[pos_ + 1] >= '0' && data_[pos_ + 1] <= '9') {
+                    Fail("leading zero in integer");
+                }
+                uint64_t value = 0;
+                size_t digits = 0;
+                while (Peek() >= '0' && data_[pos_] <= '9') {
+                    uint64_t next = value * 10 + static_cast<uint64_t>(data_[pos_] - '0');
+                    if (next / 10 != value || next > static_cast<uint64_t>(INT64_MAX)) {
+                        Fail("integer is too large");
+                    }
+                    value = next;
+                    ++pos_;
+                    ++digits;
+                }
+                if (digits == 0 || Peek() != terminator) {
+                    Fail("malformed integer");
+                }
+                if (negative && value == 0) {
+                    Fail("negative zero");
+                }
+                ++pos_;
+                return negative ? -static_cast<int64_t>(value) : static_cast<int64_t>(value);
+            }
 
+            std::string_view ParseString() {
+                if (Peek() < '0' || Peek() > '9') {
+                    Fail("string expected");
+                }
+                auto length = static_cast<size_t>(ParseInteger(':'));
+                if (length > data_.size() - pos_) {
+                    Fail("string is longer than data");
+                }
+                std::string_view result = data_.substr(pos_, length);
+                pos_ += length;
+                return result;
+            }
 
-    size_t getNumWithDecrementIdx(const std::string& data, size_t& idx){
-        size_t num = 0;
-        while (idx < data.size() && data[idx] >= '0' && data[idx] <= '9'){
-            num *= 10;
-            num += (data[idx] - '0');
-            idx++;
-        }
-        idx--;
-        return num;
+            std::string_view data_;
+            size_t pos_;
+        };
     }
 
-    size_t getNumWithIncrementIdx(const std::string& data, size_t& idx){
-        size_t num = 0;
-        while (idx < data.size() && data[idx] >= '0' && data[idx] <= '9'){
-            num *= 10;
-            num += (data[idx] - '0');
-            idx++;
+    const Node* Node::Find(std::string_view key) const {
+        for (const auto& [name, value] : dict) {
+            if (name == key) {
+                return &value;
+            }
         }
-        idx++;
-        return num;
+        return nullptr;
     }
 
-    std::string getFileData(const std::string& filename){
-        std::ifstream file(filename, std::ios::binary);
-        if (!file.is_open()){
-            throw std::runtime_error("Failed to open file");
+    Node Decode(std::string_view data) {
+        Decoder decoder(data);
+        Node root = decoder.ParseNode(0);
+        if (!decoder.AtEnd()) {
+            decoder.Fail("trailing data");
         }
-        std::ostringstream buffer;
-        buffer << file.rdbuf();
-        std::string data = buffer.str();
-        return data;
+        return root;
     }
 
-    std::string getWord(const std::string& data, size_t& idx){
-        std::string back = "";
-        while (data[idx] >= 'a' && data[idx] <= 'z') {
-            back += data[idx];
-            idx++;
-        }
-        idx--;
-        return back;
+    void Encoder::Integer(int64_t value) {
+        data_ += 'i';
+        data_ += std::to_string(value);
+        data_ += 'e';
     }
 
-    std::pair<std::string, std::string> getPairOfLenAndWord(const std::string& data, size_t& idx){
-        std::pair<std::string, std::string> back = {"", ""};
-        size_t len = 0;
-        while (data[idx] >= '0' && data[idx] <= '9'){
-            len *= 10;
-            len += static_cast<size_t>(data[idx] - '0');
-            idx++;
-        }
-        back.first = std::to_string(len);
-        for (size_t i = 0; i < len; i++){
-            back.second += data[idx + 1];
-            idx++;
-        }
-        return back;
+    void Encoder::String(std::string_view value) {
+        data_ += std::to_string(value.size());
+        data_ += ':';
+        data_ += value;
     }
 
+    void Encoder::Key(std::string_view key) {
+        String(key);
+    }
 
-    std::unordered_map<std::string, flagForTorrentFile> makeFlag(){
-        std::unordered_map<std::string, flagForTorrentFile> back;
-        back["announce"] = flagForTorrentFile::ANNOUNCE;
-        back["announce-list"] = flagForTorrentFile::ANNOUNCE_LIST;
-        back["comment"] = flagForTorrentFile::COMMENT;
-        back["created by"] = flagForTorrentFile::CREATED_BY;
-        back["creation date"] = flagForTorrentFile::CREATION_DATE;
-        back["info"] = flagForTorrentFile::INFO;
-        back["files"] = flagForTorrentFile::FILES;
-        back["md5sum"] = flagForTorrentFile::MD5SUM;
-        back["length"] = flagForTorrentFile::LENGTH;
-        back["path"] = flagForTorrentFile::PATH;
-        back["name"] = flagForTorrentFile::NAME;
-        back["piece length"] = flagForTorrentFile::PIECE_LENGTH;
-        back["pieces"] = flagForTorrentFile::PIECES;
-        back["url-list"] = flagForTorrentFile::URL_LIST;
-        
-        return back;
+    void Encoder::Raw(std::string_view encoded) {
+        data_ += encoded;
     }
 
+    void Encoder::BeginList() {
+        data_ += 'l';
+        ++openContainers_;
+    }
 
+    void Encoder::BeginDict() {
+        data_ += 'd';
+        ++openContainers_;
+    }
 
+    void Encoder::End() {
+        if (openContainers_ == 0) {
+            throw std::logic_error("Bencode encoder: End without an open list or dictionary");
+        }
+        data_ += 'e';
+        --openContainers_;
+    }
 
+    const std::string& Encoder::Data() const {
+        return data_;
+    }
 
+    std::string Encoder::Release() {
+        if (openContainers_ != 0) {
+            throw std::logic_error("Bencode encoder: unclosed list or dictionary");
+        }
+        return std::move(data_);
+    }
+
+    std::string getFileData(const std::string& filename){
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0){
+            throw std::runtime_error("Failed to open file");
+        }
+        struct stat st{};
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            throw std::runtime_error("Failed to stat file");
+        }
+        std::string data(static_cast<size_t>(st.st_size), '\0');
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t result = read(fd, data.data() + done, data.size() - done);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                close(fd);
+                throw std::runtime_error("Failed to read file");
+            }
+            done += result;
+        }
+        close(fd);
+        return data;
+    }
 
     std::string parseIp(std::vector<int> v) {
         std::string ans = "";
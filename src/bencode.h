@@ -20,43 +20,83 @@
 #include <assert.h>
 #include <iostream>
 #include <curl/curl.h>
+#include <cstdint>
+#include <string_view>
 
 #define debug(x, y) std::cerr << x << ":\t" << y << "\n";
 
 
 namespace Bencode {
 
-    enum flagForTorrentFile : int8_t {
-        NOTHING = -1,
-        OTHER,
-
-        ANNOUNCE,
-        ANNOUNCE_LIST,
-        COMMENT,
-        CREATED_BY,
-        CREATION_DATE,
-        INFO,
-        FILES,
-        LENGTH,
-        MD5SUM,
-        PATH,
-        NAME,
-        PIECE_LENGTH,
-        PIECES,
-        URL_LIST
-    };
 /*
  * В это пространство имен рекомендуется вынести функции для работы с данными в формате bencode.
  * Этот формат используется в .torrent файлах и в протоколе общения с трекером
 */
-    Peer parsePeer(std::string data);
-    std::string getCompactIp(const std::string& ip, bool isReversed = false);
-
-    size_t getNumWithIncrementIdx(const std::string& data, size_t& idx);
-    size_t getNumWithDecrementIdx(const std::string& data, size_t& idx);
-    std::string getWord(const std::string& data, size_t& idx);
-    std::pair<std::string, std::string> getPairOfLenAndWord(const std::string& data, size_t& idx);
-    std::unordered_map<std::string, flagForTorrentFile> makeFlag();
+
+    /*
+     * Узел разобранных данных в формате bencode.
+     * Строки не копируются: `string` и `raw` указывают в исходный буфер, который должен жить дольше узла
+     * https://wiki.theory.org/BitTorrentSpecification#Bencoding
+     */
+    struct Node {
+        enum class Type {
+            Integer,
+            String,
+            List,
+            Dict,
+        };
+
+        Type type = Type::String;
+        int64_t integer = 0;
+        std::string_view string;
+        std::vector<Node> list;
+        std::vector<std::pair<std::string_view, Node>> dict;  // в порядке следования в данных
+        std::string_view raw;  // весь узел в исходном буфере, например для хеша словаря info
+
+        /*
+         * Значение по ключу `key` или nullptr, если узел не словарь или ключа нет
+         */
+        const Node* Find(std::string_view key) const;
+
+        bool IsInteger() const { return type == Type::Integer; }
+        bool IsString() const { return type == Type::String; }
+        bool IsList() const { return type == Type::List; }
+        bool IsDict() const { return type == Type::Dict; }
+    };
+
+    /*
+     * Разобрать `data` целиком. Рекурсивный спуск по исходному буферу без копирования строк.
+     * При ошибке в данных выбрасывает std::invalid_argument
+     */
+    Node Decode(std::string_view data);
+
+    /*
+     * Последовательная запись данных в формате bencode в строку.
+     * Ключи словаря пишутся через Key перед значением; порядок ключей (по возрастанию байт, как требует
+     * спецификация) соблюдает вызывающий код
+     */
+    class Encoder {
+    public:
+        void Integer(int64_t value);
+        void String(std::string_view value);
+        void Key(std::string_view key);
+
+        void Raw(std::string_view encoded);  // уже закодированное значение, например словарь целиком
+
+        void BeginList();
+        void BeginDict();
+        void End();  // закрывает последний открытый список или словарь
+
+        const std::string& Data() const;
+        std::string Release();
+    private:
+        std::string data_;
+        size_t openContainers_ = 0;
+    };
+
+    /*
+     * Прочитать файл целиком одним вызовом read
+     */
     std::string getFileData(const std::string& filename);
 
     std::string parseIp(std::vector<int> v);
@@ -0,0 +1,132 @@
+#include "buffer_pool.h"
+#include <sys/mman.h>
+#include <stdexcept>
+#include <cassert>
+#include <utility>
+#include <new>
+#include <algorithm>
+
+/*
+-------------------------------------------------------------
+-------------------------PieceBuffer-------------------------
+-------------------------------------------------------------
+*/
+
+PieceBuffer::PieceBuffer(BufferPool* pool, char* data, size_t sizeClass) :
+    pool_(pool), data_(data), sizeClass_(sizeClass) {}
+
+PieceBuffer::~PieceBuffer() {
+    Release();
+}
+
+PieceBuffer::PieceBuffer(PieceBuffer&& other) noexcept :
+    pool_(std::exchange(other.pool_, nullptr)), data_(std::exchange(other.data_, nullptr)),
+    sizeClass_(std::exchange(other.sizeClass_, 0)) {}
+
+PieceBuffer& PieceBuffer::operator=(PieceBuffer&& other) noexcept {
+    if (this != &other) {
+        Release();
+        pool_ = std::exchange(other.pool_, nullptr);
+        data_ = std::exchange(other.data_, nullptr);
+        sizeClass_ = std::exchange(other.sizeClass_, 0);
+    }
+    return *this;
+}
+
+char* PieceBuffer::Data() const {
+    return data_;
+}
+
+size_t PieceBuffer::Capacity() const {
+    return data_ == nullptr ? 0 : size_t(1) << sizeClass_;
+}
+
+void PieceBuffer::Release() {
+    if (pool_ != nullptr && data_ != nullptr) {
+        pool_->Put(data_, sizeClass_);
+    }
+    pool_ = nullptr;
+    data_ = nullptr;
+    sizeClass_ = 0;
+}
+
+PieceBuffer::operator bool() const {
+    return data_ != nullptr;
+}
+
+/*
+-------------------------------------------------------------
+-------------------------BufferPool--------------------------
+-------------------------------------------------------------
+*/
+
+BufferPool::BufferPool(bool hugePages) : hugePages_(hugePages) {}
+
+BufferPool::~BufferPool() {
+    assert(bytesInUse_ == 0);
+    for (auto& [data, bytes] : slabs_) {
+        munmap(data, bytes);
+    }
+}
+
+PieceBuffer BufferPool::Acquire(size_t length) {
+    size_t shift = MIN_CLASS_SHIFT;
+    while ((size_t(1) << shift) < length) {
+        ++shift;
+    }
+    if (shift > MAX_CLASS_SHIFT) {
+        throw std::length_error("Piece is too large for buffer pool");
+    }
+    const size_t classSize = size_t(1) << shift;
+
+    std::unique_lock lock(mutex_);
+    auto& freeList = freeLists_[shift - MIN_CLASS_SHIFT];
+    if (freeList.empty()) {
+        // маленькие классы нарезаем из одного слэба, большие занимают несколько слэбов целиком
+        size_t slabBytes = std::max(classSize, SLAB_SIZE);
+        char* slab = AllocateSlab(slabBytes);
+        for (size_t offset = 0; offset < slabBytes; offset += classSize) {
+            freeList.push_back(slab + offset);
+        }
+    }
+    char* data = freeList.back();
+    freeList.pop_back();
+    bytesInUse_ += classSize;
+    return PieceBuffer(this, data, shift);
+}
+
+void BufferPool::Put(char* data, size_t sizeClass) {
+    std::unique_lock lock(mutex_);
+    freeLists_[sizeClass - MIN_CLASS_SHIFT].push_back(data);
+    bytesInUse_ -= size_t(1) << sizeClass;
+}
+
+char* BufferPool::AllocateSlab(size_t bytes) {
+    void* addr = MAP_FAILED;
+    if (hugePages_) {
+        addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (addr == MAP_FAILED) {
+        addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        if (hugePages_) {
+            // зарезервированных huge pages нет -- просим прозрачные
+            madvise(addr, bytes, MADV_HUGEPAGE);
+        }
+    }
+    slabs_.emplace_back(static_cast<char*>(addr), bytes);
+    bytesReserved_ += bytes;
+    return static_cast<char*>(addr);
+}
+
+size_t BufferPool::BytesInUse() const {
+    std::unique_lock lock(mutex_);
+    return bytesInUse_;
+}
+
+size_t BufferPool::BytesReserved() const {
+    std::unique_lock lock(mutex_);
+    return bytesReserved_;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <mutex>
+#include <cstddef>
+
+class BufferPool;
+
+/*
+ * Буфер из BufferPool. Владеет памятью эксклюзивно и возвращает ее в пул при уничтожении или вызове Release
+ */
+class PieceBuffer {
+public:
+    PieceBuffer() = default;
+    ~PieceBuffer();
+
+    PieceBuffer(PieceBuffer&& other) noexcept;
+    PieceBuffer& operator=(PieceBuffer&& other) noexcept;
+    PieceBuffer(const PieceBuffer&) = delete;
+    PieceBuffer& operator=(const PieceBuffer&) = delete;
+
+    char* Data() const;
+
+    /*
+     * Настоящий размер буфера (размер класса, не меньше запрошенного)
+     */
+    size_t Capacity() const;
+
+    /*
+     * Вернуть память в пул
+     */
+    void Release();
+
+    explicit operator bool() const;
+
+private:
+    friend class BufferPool;
+    PieceBuffer(BufferPool* pool, char* data, size_t sizeClass);
+
+    BufferPool* pool_ = nullptr;
+    char* data_ = nullptr;
+    size_t sizeClass_ = 0;
+};
+
+/*
+ * Пул буферов для данных частей файла.
+ * Размеры округляются вверх до степени двойки (классы от 16 КиБ), для каждого класса хранится список свободных
+ * буферов. Память берется у ОС слэбами по mmap и не возвращается до уничтожения пула, поэтому освобожденный после
+ * записи буфер сразу переиспользуется следующей частью без malloc/free. Все буферы выровнены по границе страницы,
+ * что подходит для записи через O_DIRECT.
+ */
+class BufferPool {
+public:
+    /*
+     * hugePages -- брать слэбы из huge pages (MAP_HUGETLB, если не получилось -- madvise(MADV_HUGEPAGE))
+     */
+    explicit BufferPool(bool hugePages = false);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /*
+     * Выдать буфер размером не меньше `length` байт
+     */
+    PieceBuffer Acquire(size_t length);
+
+    /*
+     * Сколько байт сейчас выдано в буферах
+     */
+    size_t BytesInUse() const;
+
+    /*
+     * Сколько байт всего получено у ОС
+     */
+    size_t BytesReserved() const;
+
+private:
+    friend class PieceBuffer;
+
+    static constexpr size_t MIN_CLASS_SHIFT = 14; // 16 КиБ, размер блока
+    static constexpr size_t MAX_CLASS_SHIFT = 30; // 1 ГиБ
+    static constexpr size_t SLAB_SIZE = 2 << 20;  // размер huge page на x86-64
+
+    void Put(char* data, size_t sizeClass);
+
+    /*
+     * Получить у ОС `bytes` байт (кратно SLAB_SIZE)
+     */
+    char* AllocateSlab(size_t bytes);
+
+    const bool hugePages_;
+    mutable std::mutex mutex_;
+    std::array<std::vector<char*>, MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1> freeLists_; // Guarded by mutex_
+    std::vector<std::pair<char*, size_t>> slabs_; // Guarded by mutex_
+    size_t bytesInUse_ = 0; // Guarded by mutex_
+    size_t bytesReserved_ = 0; // Guarded by mutex_
+};
@@ -31,9 +31,9 @@ template std::string IntToBytes<int>(int, bool);
 template std::string IntToBytes<unsigned int>(unsigned int, bool);
 
 
-std::string CalculateSHA1(const std::string& msg) {
+std::string CalculateSHA1(std::string_view msg) {
     unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1((unsigned char*)(msg.c_str()), msg.size(), hash);
+    SHA1((unsigned char*)(msg.data()), msg.size(), hash);
     std::string SHA1_string = "";
     for (int i = 0; i < SHA_DIGEST_LENGTH; i++) {
         SHA1_string += hash[i];
@@ -41,14 +41,19 @@ std::string CalculateSHA1(const std::string& msg) {
     return SHA1_string;
 }
 
+void CalculateSHA1(std::string_view msg, uint8_t* digest) {
+    SHA1(reinterpret_cast<const unsigned char*>(msg.data()), msg.size(), digest);
+}
+
 
 
 std::string HexEncode(const std::string& input) {
-    std::string back = "";
+    static constexpr char DIGITS[] = "0123456789abcdef";
+    std::string back;
+    back.reserve(input.size() * 2);
     for (const char& c : input){
-        if (c >= '0' && c <= '9' || c >= 'A' && c <= 'F' || c >= 'a' && c <= 'f'){
-            back += c;
-        }
+        back += DIGITS[static_cast<unsigned char>(c) >> 4];
+        back += DIGITS[static_cast<unsigned char>(c) & 0xF];
     }
     return back;
 }
@@ -15,7 +15,12 @@ std::string IntToBytes(T n, bool isReversed = false);
  * Расчет SHA1 хеш-суммы. Здесь в результате подразумевается не человеко-читаемая строка, а массив из 20 байтов
  * в том виде, в котором его генерирует библиотека OpenSSL
  */
-std::string CalculateSHA1(const std::string& msg);
+std::string CalculateSHA1(std::string_view msg);
+
+/*
+ * То же, но 20 байт хеш-суммы записываются в `digest` без выделения памяти
+ */
+void CalculateSHA1(std::string_view msg, uint8_t* digest);
 
 /*
  * Представить массив байтов в виде строки, содержащей только символы, соответствующие цифрам в шестнадцатеричном исчислении.
@@ -0,0 +1,164 @@
+#include "choker.h"
+#include <algorithm>
+
+namespace {
+// сколько адресов без живых соединений учитывать по отдельности: за долгую раздачу через трекеры, DHT и PEX
+// проходят тысячи адресов, и метрики по каждому росли бы без ограничений
+constexpr size_t MAX_FINISHED_PEERS = 64;
+}
+
+Choker::Choker(size_t slots, std::chrono::seconds interval, std::chrono::seconds optimisticInterval) :
+    slots_(slots), interval_(interval), optimisticInterval_(optimisticInterval), optimistic_(nullptr),
+    optimisticCursor_(0), started_(false) {}
+
+void Choker::AddPeer(const std::shared_ptr<PeerConnect>& peer) {
+    std::lock_guard lock(mutex_);
+    PeerState state;
+    state.peer = peer;
+    state.lastDownloaded = peer->DownloadedBytes();
+    state.lastUploaded = peer->UploadedBytes();
+    peers_.push_back(std::move(state));
+}
+
+void Choker::Tick(bool seeding, std::chrono::steady_clock::time_point now) {
+    {
+        std::lock_guard lock(mutex_);
+        if (started_ && now - lastRecalculation_ < interval_ && !HasIdleSlotLocked()) {
+            return;
+        }
+    }
+    Recalculate(seeding, now);
+}
+
+void Choker::Recalculate(bool seeding, std::chrono::steady_clock::time_point now) {
+    std::lock_guard lock(mutex_);
+    const double seconds = started_ ? std::chrono::duration<double>(now - lastRecalculation_).count() : 0;
+    lastRecalculation_ = now;
+
+    // выбрасываем завершившиеся соединения и обновляем скорости
+    std::erase_if(peers_, [this](const PeerState& state) {
+        bool terminated = state.peer->IsTerminated();
+        if (terminated && state.peer.get() == optimistic_) {
+            optimistic_ = nullptr;
+        }
+        if (terminated) {
+            // для метрик байты соединения остаются в итогах его адреса
+            PeerTraffic& traffic = finishedTraffic_[state.peer->GetPeer()];
+            traffic.downloaded += state.peer->DownloadedBytes();
+            traffic.uploaded += state.peer->UploadedBytes();
+        }
+        return terminated;
+    });
+    while (finishedTraffic_.size() > MAX_FINISHED_PEERS) {
+        // вытесняем адрес с наименьшим трафиком, его байты остаются в общих итогах
+        auto smallest = std::min_element(finishedTraffic_.begin(), finishedTraffic_.end(),
+                                         [](const auto& lhs, const auto& rhs) {
+            return lhs.second.downloaded + lhs.second.uploaded < rhs.second.downloaded + rhs.second.uploaded;
+        });
+        otherTraffic_.downloaded += smallest->second.downloaded;
+        otherTraffic_.uploaded += smallest->second.uploaded;
+        finishedTraffic_.erase(smallest);
+    }
+    for (auto& state : peers_) {
+        uint64_t downloaded = state.peer->DownloadedBytes();
+        uint64_t uploaded = state.peer->UploadedBytes();
+        uint64_t delta = seeding ? uploaded - state.lastUploaded : downloaded - state.lastDownloaded;
+        state.rate = seconds > 0 ? static_cast<double>(delta) / seconds : 0;
+        state.lastDownloaded = downloaded;
+        state.lastUploaded = uploaded;
+        state.unchoked = false;
+    }
+    if (optimisticCursor_ >= peers_.size()) {
+        optimisticCursor_ = 0;
+    }
+
+    // кандидаты -- заинтересованные пиры; `slots_` самых быстрых из них получают слоты
+    std::vector<PeerState*> interested;
+    interested.reserve(peers_.size());
+    for (auto& state : peers_) {
+        if (state.peer->IsPeerInterested()) {
+            interested.push_back(&state);
+        }
+    }
+    const size_t regular = std::min(slots_, interested.size());
+    std::nth_element(interested.begin(), interested.begin() + regular, interested.end(),
+                     [](const PeerState* lhs, const PeerState* rhs) {
+        return lhs->rate > rhs->rate;
+    });
+    for (size_t i = 0; i < regular; ++i) {
+        interested[i]->unchoked = true;
+    }
+
+    // optimistic unchoke: оставляем прежнего пира, пока не истек его срок, иначе ищем следующего по кругу
+    PeerState* optimistic = nullptr;
+    for (auto& state : peers_) {
+        if (state.peer.get() == optimistic_ && state.peer->IsPeerInterested() && !state.unchoked) {
+            optimistic = &state;
+        }
+    }
+    if (!optimistic || !started_ || now - lastOptimisticRotation_ >= optimisticInterval_) {
+        PeerState* previous = optimistic;
+        optimistic = nullptr;
+        for (size_t i = 0; i < peers_.size(); ++i) {
+            PeerState& state = peers_[(optimisticCursor_ + i) % peers_.size()];
+            if (state.peer->IsPeerInterested() && !state.unchoked && state.peer.get() != optimistic_) {
+                optimistic = &state;
+                optimisticCursor_ = (optimisticCursor_ + i + 1) % peers_.size();
+                break;
+            }
+        }
+        if (!optimistic) {
+            // других кандидатов нет
+            optimistic = previous;
+        }
+        lastOptimisticRotation_ = now;
+    }
+    optimistic_ = optimistic ? optimistic->peer.get() : nullptr;
+    if (optimistic) {
+        optimistic->unchoked = true;
+    }
+    started_ = true;
+
+    for (auto& state : peers_) {
+        state.peer->SetChoking(!state.unchoked);
+    }
+}
+
+bool Choker::HasIdleSlotLocked() const {
+    size_t unchoked = 0;
+    bool waiting = false;
+    for (const auto& state : peers_) {
+        unchoked += state.unchoked;
+        waiting = waiting || (!state.unchoked && state.peer->IsPeerInterested());
+    }
+    return waiting && unchoked < slots_ + 1;
+}
+
+size_t Choker::UnchokedCount() const {
+    std::lock_guard lock(mutex_);
+    return std::count_if(peers_.begin(), peers_.end(), [](const PeerState& state) {
+        return state.unchoked;
+    });
+}
+
+std::unordered_map<Peer, Choker::PeerTraffic> Choker::Traffic(PeerTraffic& other) const {
+    std::lock_guard lock(mutex_);
+    other = otherTraffic_;
+    std::unordered_map<Peer, PeerTraffic> traffic = finishedTraffic_;
+    for (const auto& state : peers_) {
+        PeerTraffic& total = traffic[state.peer->GetPeer()];
+        total.downloaded += state.peer->DownloadedBytes();
+        total.uploaded += state.peer->UploadedBytes();
+    }
+    return traffic;
+}
+
+std::vector<std::shared_ptr<PeerConnect>> Choker::Peers() const {
+    std::lock_guard lock(mutex_);
+    std::vector<std::shared_ptr<PeerConnect>> peers;
+    peers.reserve(peers_.size());
+    for (const auto& state : peers_) {
+        peers.push_back(state.peer);
+    }
+    return peers;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "peer_connect.h"
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Распределение слотов раздачи между пирами (tit-for-tat).
+ * Раз в `interval` пересчитывается скорость, с которой каждый заинтересованный пир отдает нам данные
+ * (а после окончания скачивания -- с которой он у нас качает), и раздача открывается `slots` самым быстрым.
+ * Еще один слот (optimistic unchoke) раз в `optimisticInterval` по кругу переходит к следующему заинтересованному
+ * пиру, чтобы новые пиры могли показать свою скорость.
+ * Пересчет работает за O(количество пиров) и не трогает PieceStorage: счетчики берутся из PeerConnect
+ * https://wiki.theory.org/BitTorrentSpecification#Choking_and_Optimistic_Unchoking
+ */
+class Choker {
+public:
+    Choker(size_t slots = 4, std::chrono::seconds interval = std::chrono::seconds(10),
+           std::chrono::seconds optimisticInterval = std::chrono::seconds(30));
+
+    /*
+     * Учитывать соединение при распределении слотов. Изначально пир зачокан.
+     * Завершившиеся соединения (PeerConnect::IsTerminated) выбрасываются при следующем пересчете
+     */
+    void AddPeer(const std::shared_ptr<PeerConnect>& peer);
+
+    /*
+     * Вызывается периодически из потока, координирующего соединения. Пересчитывает слоты,
+     * если с прошлого пересчета прошло не меньше `interval` или если есть свободный слот и пир, который его ждет.
+     * `seeding` -- скачивание закончено, пиров ранжируем по скорости раздачи им
+     */
+    void Tick(bool seeding, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    /*
+     * Пересчитать слоты прямо сейчас
+     */
+    void Recalculate(bool seeding, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+    /*
+     * Сколько пиров сейчас раскрыто (включая optimistic unchoke)
+     */
+    size_t UnchokedCount() const;
+
+    struct PeerTraffic {
+        uint64_t downloaded = 0;
+        uint64_t uploaded = 0;
+    };
+
+    /*
+     * Сколько байт получено от каждого адреса и отдано ему по всем соединениям, в том числе уже выброшенным.
+     * Из адресов без живых соединений отдельно помнятся только MAX_FINISHED_PEERS с наибольшим трафиком,
+     * байты остальных складываются в `other`
+     */
+    std::unordered_map<Peer, PeerTraffic> Traffic(PeerTraffic& other) const;
+
+    /*
+     * Соединения, которые учитываются сейчас (завершившиеся остаются до следующего пересчета)
+     */
+    std::vector<std::shared_ptr<PeerConnect>> Peers() const;
+private:
+    /*
+     * Есть незанятый слот и заинтересованный пир, которому раздача закрыта
+     */
+    bool HasIdleSlotLocked() const;
+
+    struct PeerState {
+        std::shared_ptr<PeerConnect> peer;
+        uint64_t lastDownloaded = 0;  // значения счетчиков пира на момент прошлого пересчета
+        uint64_t lastUploaded = 0;
+        double rate = 0;  // байт в секунду за последний интервал
+        bool unchoked = false;
+    };
+
+    const size_t slots_;
+    const std::chrono::seconds interval_, optimisticInterval_;
+    mutable std::mutex mutex_;
+    std::vector<PeerState> peers_;  // guarded by mutex_
+    std::unordered_map<Peer, PeerTraffic> finishedTraffic_;  // итоги выброшенных соединений; guarded by mutex_
+    PeerTraffic otherTraffic_;  // итоги адресов, вытесненных из finishedTraffic_; guarded by mutex_
+    std::chrono::steady_clock::time_point lastRecalculation_, lastOptimisticRotation_;
+    PeerConnect* optimistic_;  // пир в слоте optimistic unchoke
+    size_t optimisticCursor_;  // с какой позиции в peers_ искать следующего кандидата на optimistic unchoke
+    bool started_;
+};
@@ -0,0 +1,121 @@
+#include "connection_pool.h"
+#include <algorithm>
+#include <exception>
+
+ConnectionPool::ConnectionPool(size_t maxConnections) :
+    cursor_(0), idle_(0), queuedActive_(0), queuedLimit_(maxConnections), stopped_(false) {
+    for (size_t i = 0; i < maxConnections; ++i) {
+        workers_.emplace_back([this]() {
+            WorkerRoutine();
+        });
+    }
+}
+
+ConnectionPool::~ConnectionPool() {
+    Join();
+}
+
+void ConnectionPool::Submit(size_t owner, Task task) {
+    std::lock_guard lock(mutex_);
+    queues_[owner].push_back(std::move(task));
+    hasWork_.notify_one();
+}
+
+bool ConnectionPool::TryRun(size_t owner, Task task) {
+    std::lock_guard lock(mutex_);
+    // потоки, которые уже разбудили под задачи из immediate_, свободными не считаются
+    if (stopped_ || idle_ <= immediate_.size()) {
+        return false;
+    }
+    immediate_.emplace_back(owner, std::move(task));
+    hasWork_.notify_one();
+    return true;
+}
+
+void ConnectionPool::ReserveForImmediate(size_t count) {
+    std::lock_guard lock(mutex_);
+    queuedLimit_ = workers_.size() - std::min(count, workers_.size());
+}
+
+void ConnectionPool::Cancel(size_t owner) {
+    std::lock_guard lock(mutex_);
+    queues_.erase(owner);
+}
+
+size_t ConnectionPool::ActiveCount(size_t owner) const {
+    std::lock_guard lock(mutex_);
+    auto it = active_.find(owner);
+    return it == active_.end() ? 0 : it->second;
+}
+
+size_t ConnectionPool::PendingCount(size_t owner) const {
+    std::lock_guard lock(mutex_);
+    auto it = queues_.find(owner);
+    return it == queues_.end() ? 0 : it->second.size();
+}
+
+void ConnectionPool::Join() {
+    {
+        std::lock_guard lock(mutex_);
+        stopped_ = true;
+        hasWork_.notify_all();
+    }
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+    workers_.clear();
+}
+
+bool ConnectionPool::CanTakeQueuedLocked() const {
+    return !queues_.empty() && queuedActive_ < queuedLimit_;
+}
+
+std::pair<size_t, ConnectionPool::Task> ConnectionPool::TakeLocked() {
+    if (!immediate_.empty()) {
+        auto task = std::move(immediate_.front());
+        immediate_.pop_front();
+        return task;
+    }
+    auto it = queues_.upper_bound(cursor_);
+    if (it == queues_.end()) {
+        it = queues_.begin();
+    }
+    cursor_ = it->first;
+    std::pair<size_t, Task> task(it->first, std::move(it->second.front()));
+    it->second.pop_front();
+    if (it->second.empty()) {
+        queues_.erase(it);
+    }
+    return task;
+}
+
+void ConnectionPool::WorkerRoutine() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        ++idle_;
+        hasWork_.wait(lock, [this]() {
+            return stopped_ || !immediate_.empty() || CanTakeQueuedLocked();
+        });
+        --idle_;
+        if (immediate_.empty() && !CanTakeQueuedLocked()) {
+            // остановлен, и задач не осталось или оставшиеся из очередей доделают потоки, которые их сейчас выполняют
+            break;
+        }
+        const bool queued = immediate_.empty();
+        auto [owner, task] = TakeLocked();
+        ++active_[owner];
+        queuedActive_ += queued;
+        lock.unlock();
+        try {
+            task();
+        } catch (const std::exception&) {
+            // ошибка соединения не должна останавливать поток пула
+        }
+        lock.lock();
+        if (--active_[owner] == 0) {
+            active_.erase(owner);
+        }
+        // освободившееся место для задачи из очереди этот же поток займет на следующем круге
+        queuedActive_ -= queued;
+    }
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Общие на сессию потоки для соединений с пирами. Соединения блокирующие, каждое занимает поток целиком,
+ * поэтому число потоков -- это глобальный лимит соединений по всем торрентам.
+ * Соединения, которым пока не хватило потока, ждут в очереди своего торрента (`owner`). Освободившийся поток
+ * берет задачу из очередей по кругу, так что торрент с длинным списком пиров не забирает все потоки,
+ * пока другим торрентам есть кого подключать.
+ * Задачи из очередей могут занять не все потоки (см. ReserveForImmediate): иначе долгие исходящие соединения
+ * держали бы весь пул, и TryRun отказывал бы каждому входящему до конца скачивания
+ */
+class ConnectionPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit ConnectionPool(size_t maxConnections);
+    ~ConnectionPool();
+
+    /*
+     * Поставить соединение торрента `owner` в очередь
+     */
+    void Submit(size_t owner, Task task);
+
+    /*
+     * Запустить задачу сразу, если есть свободный поток (для входящих соединений, которые не могут ждать).
+     * Возвращает false, если лимит соединений исчерпан
+     */
+    bool TryRun(size_t owner, Task task);
+
+    /*
+     * Оставить `count` потоков только для задач TryRun: задачи из очередей занимают не больше остальных
+     */
+    void ReserveForImmediate(size_t count);
+
+    /*
+     * Выбросить ждущие в очереди соединения торрента `owner`. Уже запущенные не трогаются
+     */
+    void Cancel(size_t owner);
+
+    /*
+     * Сколько соединений торрента `owner` сейчас работает и сколько ждет потока
+     */
+    size_t ActiveCount(size_t owner) const;
+    size_t PendingCount(size_t owner) const;
+
+    /*
+     * Дождаться выполнения всех задач, в том числе ждущих в очередях, и остановить потоки
+     */
+    void Join();
+private:
+    void WorkerRoutine();
+
+    /*
+     * Следующая задача: сначала TryRun, затем очереди торрентов по кругу начиная с торрента после `cursor_`
+     */
+    std::pair<size_t, Task> TakeLocked();
+
+    /*
+     * Есть ли задача в очередях и может ли ее взять еще один поток
+     */
+    bool CanTakeQueuedLocked() const;
+
+    mutable std::mutex mutex_;
+    std::condition_variable hasWork_;
+    std::deque<std::pair<size_t, Task>> immediate_;  // задачи TryRun; guarded by mutex_
+    std::map<size_t, std::deque<Task>> queues_;  // только непустые очереди; guarded by mutex_
+    std::unordered_map<size_t, size_t> active_;  // guarded by mutex_
+    size_t cursor_;  // торрент, из очереди которого задача была взята последней
+    size_t idle_;  // потоков, ждущих задачу
+    size_t queuedActive_;  // потоков, выполняющих задачи из очередей
+    size_t queuedLimit_;  // сколько потоков могут выполнять задачи из очередей
+    bool stopped_;
+    std::vector<std::thread> workers_;
+};
@@ -0,0 +1,818 @@
+#include "dht.h"
+#include "event_fd.h"
+#include "bencode.h"
+#include "byte_tools.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace {
+// сколько запросов одного поиска может ждать ответа одновременно
+constexpr size_t ALPHA = 3;
+// ответы на запросы, отправленные разом, должны поместиться в буфер приема сокета
+constexpr size_t MAX_QUERIES_IN_FLIGHT = 64;
+constexpr int RECEIVE_BUFFER_SIZE = 1 << 20;
+constexpr std::chrono::seconds QUERY_TIMEOUT(2);
+constexpr std::chrono::minutes SECRET_LIFETIME(5);
+constexpr std::chrono::minutes PEER_LIFETIME(30);
+constexpr size_t MAX_PEERS_PER_TORRENT = 100;
+// пока узлов мало, таблица пополняется чаще
+constexpr std::chrono::minutes BOOTSTRAP_INTERVAL(1);
+constexpr std::chrono::minutes REFRESH_INTERVAL(15);
+constexpr size_t COMPACT_NODE_LENGTH = 26;
+constexpr size_t MAX_CACHED_NODES = 200;
+constexpr int POLL_TIMEOUT_MS = 100;
+
+NodeId ToNodeId(std::string_view bytes) {
+    NodeId id{};
+    std::memcpy(id.data(), bytes.data(), std::min(bytes.size(), id.size()));
+    return id;
+}
+
+std::string_view AsString(const NodeId& id) {
+    return {reinterpret_cast<const char*>(id.data()), id.size()};
+}
+
+// a ближе к target, чем b
+bool Closer(const NodeId& target, const NodeId& a, const NodeId& b) {
+    for (size_t i = 0; i < target.size(); ++i) {
+        uint8_t da = a[i] ^ target[i];
+        uint8_t db = b[i] ^ target[i];
+        if (da != db) {
+            return da < db;
+        }
+    }
+    return false;
+}
+
+const Bencode::Node* FindString(const Bencode::Node& dict, std::string_view key, size_t length = 0) {
+    const Bencode::Node* node = dict.Find(key);
+    if (node == nullptr || !node->IsString() || (length != 0 && node->string.size() != length)) {
+        return nullptr;
+    }
+    return node;
+}
+
+bool ResolveAddress(const std::string& hostPort, Peer& peer) {
+    size_t colon = hostPort.rfind(':');
+    if (colon == std::string::npos) {
+        return false;
+    }
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(hostPort.substr(0, colon).c_str(), hostPort.substr(colon + 1).c_str(), &hints, &result) != 0) {
+        return false;
+    }
+    peer = Peer::FromSockaddr(result->ai_addr);
+    freeaddrinfo(result);
+    return true;
+}
+}
+
+RoutingTable::RoutingTable(const NodeId& self) : self_(self) {}
+
+size_t RoutingTable::BucketIndex(const NodeId& id) const {
+    for (size_t i = 0; i < id.size(); ++i) {
+        uint8_t difference = id[i] ^ self_[i];
+        if (difference != 0) {
+            return i * 8 + __builtin_clz(difference) - 24;
+        }
+    }
+    return buckets_.size();
+}
+
+void RoutingTable::Insert(const NodeId& id, const Peer& address, std::chrono::steady_clock::time_point now) {
+    const size_t index = BucketIndex(id);
+    if (index >= buckets_.size()) {
+        return;
+    }
+    std::vector<Node>& bucket = buckets_[index];
+    for (Node& node : bucket) {
+        if (node.id == id) {
+            node.address = address;
+            node.lastSeen = now;
+            node.failures = 0;
+            return;
+        }
+    }
+    if (bucket.size() < K) {
+        bucket.push_back({id, address, now, 0});
+        return;
+    }
+    // вытесняем узел, дольше всех не отвечающий; отвечающие узлы не трогаем
+    auto worst = std::max_element(bucket.begin(), bucket.end(), [](const Node& a, const Node& b) {
+        return a.failures < b.failures;
+    });
+    if (worst->failures > 0) {
+        *worst = {id, address, now, 0};
+    }
+}
+
+void RoutingTable::MarkFailed(const NodeId& id) {
+    const size_t index = BucketIndex(id);
+    if (index >= buckets_.size()) {
+        return;
+    }
+    for (Node& node : buckets_[index]) {
+        if (node.id == id) {
+            ++node.failures;
+        }
+    }
+}
+
+std::vector<RoutingTable::Node> RoutingTable::Closest(const NodeId& target, size_t count) const {
+    std::vector<Node> result;
+    for (const auto& bucket : buckets_) {
+        for (const Node& node : bucket) {
+            if (node.failures < 2) {
+                result.push_back(node);
+            }
+        }
+    }
+    count = std::min(count, result.size());
+    std::partial_sort(result.begin(), result.begin() + count, result.end(), [&](const Node& a, const Node& b) {
+        return Closer(target, a.id, b.id);
+    });
+    result.resize(count);
+    return result;
+}
+
+size_t RoutingTable::Size() const {
+    size_t size = 0;
+    for (const auto& bucket : buckets_) {
+        size += bucket.size();
+    }
+    return size;
+}
+
+struct DhtNode::Query {
+    uint64_t lookupId;  // 0 -- запрос вне поиска (bootstrap-узлы, announce_peer)
+    Peer address;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+struct DhtNode::Request {
+    std::string infoHash;
+    int announcePort;
+    PeersCallback onPeers;
+    DoneCallback onDone;
+};
+
+struct DhtNode::Lookup {
+    struct Candidate {
+        NodeId id{};
+        bool knownId = false;  // адрес из bootstrap или кеша: id узнаем из ответа
+        Peer address;
+        enum class State { Fresh, Queried, Responded, Failed } state = State::Fresh;
+        std::string token;
+
+        Candidate(const NodeId& id, bool knownId, const Peer& address) : id(id), knownId(knownId), address(address) {}
+    };
+
+    uint64_t id;
+    NodeId target;
+    bool findNode;  // find_node для пополнения таблицы вместо get_peers
+    Request request;
+    std::vector<Candidate> candidates;  // узлы с неизвестным id первыми, остальные по расстоянию до target
+    std::unordered_set<Peer> addresses;
+    std::unordered_set<Peer> peers;
+    size_t inFlight = 0;
+    bool finished = false;
+
+    void Sort() {
+        std::stable_sort(candidates.begin(), candidates.end(), [this](const Candidate& a, const Candidate& b) {
+            if (a.knownId != b.knownId) {
+                return !a.knownId;
+            }
+            return a.knownId && Closer(target, a.id, b.id);
+        });
+    }
+
+    Candidate* Find(const Peer& address) {
+        for (Candidate& candidate : candidates) {
+            if (candidate.address == address) {
+                return &candidate;
+            }
+        }
+        return nullptr;
+    }
+};
+
+DhtNode::DhtNode(Options options) :
+    options_(std::move(options)), sock_(-1), wakeFd_(-1), port_(0), stopped_(false), random_(std::random_device()()),
+    queriesSent_(0) {
+    for (uint8_t& byte : id_) {
+        byte = static_cast<uint8_t>(random_());
+    }
+    LoadCache();
+    table_ = std::make_unique<RoutingTable>(id_);
+    secret_ = RandomString(16);
+    previousSecret_ = secret_;
+
+    sock_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock_ < 0) {
+        throw std::runtime_error(std::string("Failed to create DHT socket: ") + std::strerror(errno));
+    }
+    setsockopt(sock_, SOL_SOCKET, SO_RCVBUF, &RECEIVE_BUFFER_SIZE, sizeof(RECEIVE_BUFFER_SIZE));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options_.port);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sock_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+        int error = errno;
+        close(sock_);
+        throw std::runtime_error("Failed to bind DHT port " + std::to_string(options_.port) + ": " +
+                                 std::strerror(error));
+    }
+    socklen_t length = sizeof(address);
+    getsockname(sock_, reinterpret_cast<sockaddr*>(&address), &length);
+    port_ = ntohs(address.sin_port);
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd_ < 0) {
+        close(sock_);
+        throw std::runtime_error(std::string("Failed to create DHT eventfd: ") + std::strerror(errno));
+    }
+    secretChanged_ = std::chrono::steady_clock::now();
+    thread_ = std::thread(&DhtNode::Loop, this);
+}
+
+DhtNode::~DhtNode() {
+    Stop();
+    close(sock_);
+    close(wakeFd_);
+}
+
+void DhtNode::Stop() {
+    if (!thread_.joinable()) {
+        return;
+    }
+    stopped_ = true;
+    SignalEventFd(wakeFd_);
+    thread_.join();
+    SaveCache();
+}
+
+int DhtNode::Port() const {
+    return port_;
+}
+
+size_t DhtNode::NodesCount() const {
+    std::lock_guard lock(mutex_);
+    return nodesCount_;
+}
+
+size_t DhtNode::QueriesSent() const {
+    return queriesSent_;
+}
+
+void DhtNode::GetPeers(const std::string& infoHash, int announcePort, PeersCallback onPeers, DoneCallback onDone) {
+    {
+        std::lock_guard lock(mutex_);
+        requests_.push_back({infoHash, announcePort, std::move(onPeers), std::move(onDone)});
+    }
+    SignalEventFd(wakeFd_);
+}
+
+void DhtNode::AddNode(const Peer& address) {
+    {
+        std::lock_guard lock(mutex_);
+        addedNodes_.push_back(address);
+    }
+    SignalEventFd(wakeFd_);
+}
+
+void DhtNode::Loop() {
+    // имена bootstrap-узлов разрешаются один раз, до первого поиска
+    for (const std::string& hostPort : options_.bootstrap) {
+        Peer peer;
+        if (ResolveAddress(hostPort, peer)) {
+            cachedNodes_.push_back(peer);
+        }
+    }
+    Bootstrap(std::chrono::steady_clock::now());
+
+    std::string buffer(4096, '\0');
+    while (!stopped_) {
+        pollfd fds[2] = {{sock_, POLLIN, 0}, {wakeFd_, POLLIN, 0}};
+        poll(fds, 2, POLL_TIMEOUT_MS);
+        if (fds[1].revents & POLLIN) {
+            DrainEventFd(wakeFd_);
+        }
+        auto now = std::chrono::steady_clock::now();
+
+        std::vector<Request> requests;
+        std::vector<Peer> added;
+        {
+            std::lock_guard lock(mutex_);
+            requests.swap(requests_);
+            added.swap(addedNodes_);
+        }
+        for (const Peer& address : added) {
+            cachedNodes_.push_back(address);
+            SendQuery(address, "find_node", {}, 0, now);
+        }
+        for (Request& request : requests) {
+            StartLookup(std::move(request), false, now);
+        }
+
+        while (true) {
+            sockaddr_storage from{};
+            socklen_t fromLength = sizeof(from);
+            ssize_t received = recvfrom(sock_, buffer.data(), buffer.size(), 0, reinterpret_cast<sockaddr*>(&from),
+                                        &fromLength);
+            if (received < 0) {
+                break;
+            }
+            HandleMessage(std::string_view(buffer.data(), received), Peer::FromSockaddr(reinterpret_cast<sockaddr*>(&from)),
+                          now);
+        }
+
+        HandleTimeouts(now);
+        // поиски, которым не хватило места среди запросов в пути, продолжаются по мере освобождения мест
+        for (auto& [id, lookup] : lookups_) {
+            if (!lookup->finished && lookup->inFlight < ALPHA) {
+                StepLookup(*lookup, now);
+            }
+        }
+        if (now - secretChanged_ >= SECRET_LIFETIME) {
+            previousSecret_ = secret_;
+            secret_ = RandomString(16);
+            secretChanged_ = now;
+        }
+        if (now - lastBootstrap_ >= (table_->Size() < RoutingTable::K ? BOOTSTRAP_INTERVAL : REFRESH_INTERVAL)) {
+            Bootstrap(now);
+        }
+        for (auto it = lookups_.begin(); it != lookups_.end();) {
+            it = it->second->finished ? lookups_.erase(it) : std::next(it);
+        }
+        std::lock_guard lock(mutex_);
+        nodesCount_ = table_->Size();
+    }
+}
+
+void DhtNode::Bootstrap(std::chrono::steady_clock::time_point now) {
+    lastBootstrap_ = now;
+    // поиск собственного id заполняет ближние к нам корзины и сообщает о нас соседям
+    Request request;
+    request.infoHash = std::string(AsString(id_));
+    request.announcePort = 0;
+    StartLookup(std::move(request), true, now);
+}
+
+void DhtNode::StartLookup(Request request, bool findNode, std::chrono::steady_clock::time_point now) {
+    auto lookup = std::make_unique<Lookup>();
+    lookup->id = nextLookupId_++;
+    lookup->target = ToNodeId(request.infoHash);
+    lookup->findNode = findNode;
+
+    // пиры, объявленные у нас самих, отдаем сразу
+    if (auto it = storage_.find(request.infoHash); it != storage_.end() && request.onPeers) {
+        std::vector<Peer> peers;
+        for (const auto& [peer, announced] : it->second) {
+            if (lookup->peers.insert(peer).second) {
+                peers.push_back(peer);
+            }
+        }
+        if (!peers.empty()) {
+            request.onPeers(peers);
+        }
+    }
+    lookup->request = std::move(request);
+
+    for (const RoutingTable::Node& node : table_->Closest(lookup->target, RoutingTable::K)) {
+        if (lookup->addresses.insert(node.address).second) {
+            lookup->candidates.emplace_back(node.id, true, node.address);
+        }
+    }
+    if (lookup->candidates.size() < RoutingTable::K) {
+        for (const Peer& address : cachedNodes_) {
+            if (lookup->addresses.insert(address).second) {
+                lookup->candidates.emplace_back(NodeId{}, false, address);
+            }
+        }
+    }
+    lookup->Sort();
+    Lookup& started = *lookup;
+    lookups_.emplace(started.id, std::move(lookup));
+    StepLookup(started, now);
+}
+
+void DhtNode::StepLookup(Lookup& lookup, std::chrono::steady_clock::time_point now) {
+    using State = Lookup::Candidate::State;
+    size_t considered = 0;
+    bool throttled = false;
+    for (Lookup::Candidate& candidate : lookup.candidates) {
+        if (lookup.inFlight >= ALPHA) {
+            break;
+        }
+        if (candidate.state == State::Failed) {
+            continue;
+        }
+        // поиск сходится к K ближайшим ответившим узлам; узлы с неизвестным id спрашиваем все
+        if (candidate.knownId && ++considered > RoutingTable::K) {
+            break;
+        }
+        if (candidate.state != State::Fresh) {
+            continue;
+        }
+        if (queries_.size() >= MAX_QUERIES_IN_FLIGHT) {
+            throttled = true;
+            break;
+        }
+        Bencode::Encoder arguments;
+        arguments.BeginDict();
+        arguments.Key("id");
+        arguments.String(AsString(id_));
+        if (lookup.findNode) {
+            arguments.Key("target");
+            arguments.String(AsString(lookup.target));
+        } else {
+            arguments.Key("info_hash");
+            arguments.String(AsString(lookup.target));
+        }
+        arguments.End();
+        candidate.state = State::Queried;
+        ++lookup.inFlight;
+        SendQuery(candidate.address, lookup.findNode ? "find_node" : "get_peers", arguments.Release(), lookup.id, now);
+    }
+    if (lookup.inFlight == 0 && !throttled) {
+        FinishLookup(lookup);
+    }
+}
+
+void DhtNode::FinishLookup(Lookup& lookup) {
+    using State = Lookup::Candidate::State;
+    lookup.finished = true;
+    if (lookup.request.announcePort != 0) {
+        size_t announced = 0;
+        for (const Lookup::Candidate& candidate : lookup.candidates) {
+            if (announced == RoutingTable::K) {
+                break;
+            }
+            if (candidate.state != State::Responded || candidate.token.empty()) {
+                continue;
+            }
+            Bencode::Encoder arguments;
+            arguments.BeginDict();
+            arguments.Key("id");
+            arguments.String(AsString(id_));
+            arguments.Key("implied_port");
+            arguments.Integer(0);
+            arguments.Key("info_hash");
+            arguments.String(AsString(lookup.target));
+            arguments.Key("port");
+            arguments.Integer(lookup.request.announcePort);
+            arguments.Key("token");
+            arguments.String(candidate.token);
+            arguments.End();
+            SendQuery(candidate.address, "announce_peer", arguments.Release(), 0, std::chrono::steady_clock::now());
+            ++announced;
+        }
+    }
+    if (lookup.request.onDone) {
+        lookup.request.onDone();
+    }
+}
+
+void DhtNode::AddCandidates(Lookup& lookup, std::string_view compactNodes) {
+    for (size_t offset = 0; offset + COMPACT_NODE_LENGTH <= compactNodes.size(); offset += COMPACT_NODE_LENGTH) {
+        NodeId id = ToNodeId(compactNodes.substr(offset, 20));
+        Peer address = Peer::FromCompact(compactNodes.data() + offset + 20, AF_INET);
+        if (id == id_ || address.port == 0 || !lookup.addresses.insert(address).second) {
+            continue;
+        }
+        lookup.candidates.emplace_back(id, true, address);
+    }
+    lookup.Sort();
+}
+
+void DhtNode::SendQuery(const Peer& address, std::string_view method, const std::string& arguments, uint64_t lookupId,
+                        std::chrono::steady_clock::time_point now) {
+    do {
+        ++nextTransaction_;
+    } while (queries_.contains(nextTransaction_));
+    const uint16_t transaction = nextTransaction_;
+    queries_[transaction] = std::make_unique<Query>(Query{lookupId, address, now + QUERY_TIMEOUT});
+
+    Bencode::Encoder message;
+    message.BeginDict();
+    message.Key("a");
+    if (arguments.empty()) {
+        // find_node собственного id для узлов, добавленных без поиска
+        message.BeginDict();
+        message.Key("id");
+        message.String(AsString(id_));
+        message.Key("target");
+        message.String(AsString(id_));
+        message.End();
+    } else {
+        message.Raw(arguments);
+    }
+    message.Key("q");
+    message.String(method);
+    message.Key("t");
+    const char transactionBytes[2] = {static_cast<char>(transaction >> 8), static_cast<char>(transaction & 0xFF)};
+    message.String(std::string_view(transactionBytes, 2));
+    message.Key("y");
+    message.String("q");
+    message.End();
+    Send(address, message.Release());
+    ++queriesSent_;
+}
+
+void DhtNode::Send(const Peer& address, const std::string& message) {
+    sockaddr_storage storage;
+    socklen_t length = address.ToSockaddr(storage);
+    // сокет неблокирующий: если буфер отправки полон, пакет теряется так же, как в сети, и запрос повторит таймаут
+    sendto(sock_, message.data(), message.size(), 0, reinterpret_cast<sockaddr*>(&storage), length);
+}
+
+void DhtNode::HandleMessage(std::string_view data, const Peer& from, std::chrono::steady_clock::time_point now) {
+    Bencode::Node message;
+    try {
+        message = Bencode::Decode(data);
+    } catch (const std::invalid_argument&) {
+        return;
+    }
+    const Bencode::Node* type = FindString(message, "y", 1);
+    const Bencode::Node* transaction = FindString(message, "t");
+    if (type == nullptr || transaction == nullptr) {
+        return;
+    }
+    if (type->string == "q") {
+        const Bencode::Node* method = FindString(message, "q");
+        const Bencode::Node* arguments = message.Find("a");
+        if (method != nullptr && arguments != nullptr && arguments->IsDict()) {
+            HandleQuery(transaction->string, method->string, *arguments, from, now);
+        }
+        return;
+    }
+    if (transaction->string.size() != 2) {
+        return;
+    }
+    const auto id = static_cast<uint16_t>(BytesToInt(transaction->string));
+    auto it = queries_.find(id);
+    // ответ с чужого адреса -- не на наш запрос
+    if (it == queries_.end() || !(it->second->address == from)) {
+        return;
+    }
+    std::unique_ptr<Query> query = std::move(it->second);
+    queries_.erase(it);
+    const Bencode::Node* response = message.Find("r");
+    if (type->string == "r" && response != nullptr && response->IsDict()) {
+        HandleResponse(*query, *response, from, now);
+        return;
+    }
+    // ошибка: узел жив, но поиску не помог
+    if (auto lookup = lookups_.find(query->lookupId); lookup != lookups_.end() && !lookup->second->finished) {
+        if (Lookup::Candidate* candidate = lookup->second->Find(from)) {
+            candidate->state = Lookup::Candidate::State::Failed;
+        }
+        --lookup->second->inFlight;
+        StepLookup(*lookup->second, now);
+    }
+}
+
+void DhtNode::HandleQuery(std::string_view transaction, std::string_view method, const Bencode::Node& arguments,
+                          const Peer& from, std::chrono::steady_clock::time_point now) {
+    const Bencode::Node* id = FindString(arguments, "id", 20);
+    if (id == nullptr) {
+        return;
+    }
+    // узлы в режиме только чтения (BEP 43) не отвечают на запросы, в таблицу их не берем
+    const Bencode::Node* readOnly = arguments.Find("ro");
+    if (readOnly == nullptr || !readOnly->IsInteger() || readOnly->integer != 1) {
+        table_->Insert(ToNodeId(id->string), from, now);
+    }
+
+    Bencode::Encoder message;
+    message.BeginDict();
+    bool failed = false;
+    auto error = [&](int code, std::string_view text) {
+        failed = true;
+        message.Key("e");
+        message.BeginList();
+        message.Integer(code);
+        message.String(text);
+        message.End();
+    };
+    if (method == "ping") {
+        message.Key("r");
+        message.BeginDict();
+        message.Key("id");
+        message.String(AsString(id_));
+        message.End();
+    } else if (method == "find_node" || method == "get_peers") {
+        const Bencode::Node* target = FindString(arguments, method == "find_node" ? "target" : "info_hash", 20);
+        if (target == nullptr) {
+            error(203, "Protocol Error");
+        } else {
+            message.Key("r");
+            message.BeginDict();
+            message.Key("id");
+            message.String(AsString(id_));
+            message.Key("nodes");
+            message.String(CompactNodes(ToNodeId(target->string)));
+            if (method == "get_peers") {
+                message.Key("token");
+                message.String(MakeToken(from, secret_));
+                if (auto it = storage_.find(std::string(target->string)); it != storage_.end() && !it->second.empty()) {
+                    message.Key("values");
+                    message.BeginList();
+                    for (const auto& [peer, announced] : it->second) {
+                        message.String(peer.ToCompact());
+                    }
+                    message.End();
+                }
+            }
+            message.End();
+        }
+    } else if (method == "announce_peer") {
+        const Bencode::Node* infoHash = FindString(arguments, "info_hash", 20);
+        const Bencode::Node* token = FindString(arguments, "token");
+        const Bencode::Node* port = arguments.Find("port");
+        const Bencode::Node* impliedPort = arguments.Find("implied_port");
+        const bool implied = impliedPort != nullptr && impliedPort->IsInteger() && impliedPort->integer != 0;
+        if (infoHash == nullptr || token == nullptr ||
+            (!implied && (port == nullptr || !port->IsInteger() || port->integer <= 0 || port->integer > 65535))) {
+            error(203, "Protocol Error");
+        } else if (token->string != MakeToken(from, secret_) && token->string != MakeToken(from, previousSecret_)) {
+            error(203, "Bad token");
+        } else {
+            Peer peer = from;
+            if (!implied) {
+                peer.port = static_cast<uint16_t>(port->integer);
+            }
+            auto& peers = storage_[std::string(infoHash->string)];
+            std::erase_if(peers, [&](const auto& stored) { return stored.first == peer; });
+            if (peers.size() >= MAX_PEERS_PER_TORRENT) {
+                peers.erase(peers.begin());
+            }
+            peers.emplace_back(peer, now);
+            message.Key("r");
+            message.BeginDict();
+            message.Key("id");
+            message.String(AsString(id_));
+            message.End();
+        }
+    } else {
+        error(204, "Method Unknown");
+    }
+    message.Key("t");
+    message.String(transaction);
+    message.Key("y");
+    message.String(failed ? "e" : "r");
+    message.End();
+    Send(from, message.Release());
+}
+
+void DhtNode::HandleResponse(const Query& query, const Bencode::Node& response, const Peer& from,
+                             std::chrono::steady_clock::time_point now) {
+    const Bencode::Node* id = FindString(response, "id", 20);
+    if (id == nullptr) {
+        return;
+    }
+    const NodeId nodeId = ToNodeId(id->string);
+    table_->Insert(nodeId, from, now);
+
+    auto it = lookups_.find(query.lookupId);
+    if (it == lookups_.end() || it->second->finished) {
+        // ответ bootstrap-узла на find_node вне поиска: его соседей проверим при следующем поиске
+        if (const Bencode::Node* nodes = FindString(response, "nodes"); nodes != nullptr && query.lookupId == 0) {
+            for (size_t offset = 0; offset + COMPACT_NODE_LENGTH <= nodes->string.size(); offset += COMPACT_NODE_LENGTH) {
+                Peer address = Peer::FromCompact(nodes->string.data() + offset + 20, AF_INET);
+                if (std::find(cachedNodes_.begin(), cachedNodes_.end(), address) == cachedNodes_.end() &&
+                    cachedNodes_.size() < MAX_CACHED_NODES) {
+                    cachedNodes_.push_back(address);
+                }
+            }
+        }
+        return;
+    }
+    Lookup& lookup = *it->second;
+    --lookup.inFlight;
+    if (Lookup::Candidate* candidate = lookup.Find(from)) {
+        candidate->state = Lookup::Candidate::State::Responded;
+        candidate->id = nodeId;
+        candidate->knownId = true;
+        if (const Bencode::Node* token = FindString(response, "token")) {
+            candidate->token = token->string;
+        }
+    }
+    if (const Bencode::Node* values = response.Find("values"); values != nullptr && values->IsList()) {
+        std::vector<Peer> peers;
+        for (const Bencode::Node& value : values->list) {
+            if (!value.IsString() || value.string.size() != 6) {
+                continue;
+            }
+            Peer peer = Peer::FromCompact(value.string.data(), AF_INET);
+            if (peer.port != 0 && lookup.peers.insert(peer).second) {
+                peers.push_back(peer);
+            }
+        }
+        if (!peers.empty() && lookup.request.onPeers) {
+            lookup.request.onPeers(peers);
+        }
+    }
+    if (const Bencode::Node* nodes = FindString(response, "nodes")) {
+        AddCandidates(lookup, nodes->string);
+    } else {
+        lookup.Sort();
+    }
+    StepLookup(lookup, now);
+}
+
+void DhtNode::HandleTimeouts(std::chrono::steady_clock::time_point now) {
+    std::vector<std::unique_ptr<Query>> expired;
+    for (auto it = queries_.begin(); it != queries_.end();) {
+        if (now >= it->second->deadline) {
+            expired.push_back(std::move(it->second));
+            it = queries_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (const auto& query : expired) {
+        auto it = lookups_.find(query->lookupId);
+        if (it == lookups_.end() || it->second->finished) {
+            continue;
+        }
+        Lookup& lookup = *it->second;
+        if (Lookup::Candidate* candidate = lookup.Find(query->address)) {
+            candidate->state = Lookup::Candidate::State::Failed;
+            if (candidate->knownId) {
+                table_->MarkFailed(candidate->id);
+            }
+        }
+        --lookup.inFlight;
+        StepLookup(lookup, now);
+    }
+
+    for (auto it = storage_.begin(); it != storage_.end();) {
+        std::erase_if(it->second, [&](const auto& stored) { return now - stored.second >= PEER_LIFETIME; });
+        it = it->second.empty() ? storage_.erase(it) : std::next(it);
+    }
+}
+
+std::string DhtNode::MakeToken(const Peer& address, const std::string& secret) const {
+    return CalculateSHA1(secret + std::string(reinterpret_cast<const char*>(address.address.data()), 4)).substr(0, 8);
+}
+
+std::string DhtNode::CompactNodes(const NodeId& target) const {
+    std::string result;
+    for (const RoutingTable::Node& node : table_->Closest(target, RoutingTable::K)) {
+        result += AsString(node.id);
+        result += node.address.ToCompact();
+    }
+    return result;
+}
+
+void DhtNode::LoadCache() {
+    if (options_.cacheFile.empty() || !std::ifstream(options_.cacheFile)) {
+        return;
+    }
+    try {
+        const std::string data = Bencode::getFileData(options_.cacheFile);
+        const Bencode::Node root = Bencode::Decode(data);
+        if (const Bencode::Node* id = FindString(root, "id", 20)) {
+            id_ = ToNodeId(id->string);
+        }
+        if (const Bencode::Node* nodes = FindString(root, "nodes")) {
+            for (size_t offset = 0; offset + COMPACT_NODE_LENGTH <= nodes->string.size(); offset += COMPACT_NODE_LENGTH) {
+                cachedNodes_.push_back(Peer::FromCompact(nodes->string.data() + offset + 20, AF_INET));
+            }
+        }
+    } catch (const std::exception&) {
+        // испорченный кеш не мешает запуску: узлы найдутся через bootstrap
+    }
+}
+
+void DhtNode::SaveCache() const {
+    if (options_.cacheFile.empty()) {
+        return;
+    }
+    Bencode::Encoder encoder;
+    encoder.BeginDict();
+    encoder.Key("id");
+    encoder.String(AsString(id_));
+    encoder.Key("nodes");
+    std::string nodes;
+    for (const RoutingTable::Node& node : table_->Closest(id_, MAX_CACHED_NODES)) {
+        nodes += AsString(node.id);
+        nodes += node.address.ToCompact();
+    }
+    encoder.String(nodes);
+    encoder.End();
+    std::ofstream(options_.cacheFile, std::ios::binary | std::ios::trunc) << encoder.Data();
+}
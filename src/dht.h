@@ -0,0 +1,169 @@
+#pragma once
+
+#include "peer.h"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace Bencode {
+struct Node;
+}
+
+using NodeId = std::array<uint8_t, 20>;
+
+/*
+ * Таблица маршрутизации DHT: узел с id, отличающимся от нашего начиная с бита `i`, попадает в корзину `i`.
+ * В каждой корзине не больше K узлов; новый узел вытесняет только узел, который перестал отвечать.
+ * https://www.bittorrent.org/beps/bep_0005.html#routing-table
+ */
+class RoutingTable {
+public:
+    static constexpr size_t K = 8;
+
+    struct Node {
+        NodeId id;
+        Peer address;
+        std::chrono::steady_clock::time_point lastSeen;
+        size_t failures = 0;  // запросов подряд без ответа
+    };
+
+    explicit RoutingTable(const NodeId& self);
+
+    /*
+     * Узел ответил или прислал запрос: добавить или обновить
+     */
+    void Insert(const NodeId& id, const Peer& address, std::chrono::steady_clock::time_point now);
+
+    /*
+     * Узел не ответил на запрос
+     */
+    void MarkFailed(const NodeId& id);
+
+    /*
+     * До `count` известных узлов, ближайших к `target` по метрике XOR
+     */
+    std::vector<Node> Closest(const NodeId& target, size_t count) const;
+
+    size_t Size() const;
+private:
+    size_t BucketIndex(const NodeId& id) const;
+
+    const NodeId self_;
+    std::array<std::vector<Node>, 160> buckets_;
+};
+
+/*
+ * Узел Mainline DHT: поиск пиров торрента без трекера.
+ * https://www.bittorrent.org/beps/bep_0005.html
+ *
+ * Вся работа идет в одном потоке на одном неблокирующем UDP-сокете: поиски (get_peers) -- это конечные автоматы,
+ * которые продвигаются по мере ответов, так что одновременные поиски не стоят отдельных потоков.
+ * Узел отвечает на запросы других узлов (ping, find_node, get_peers, announce_peer) и хранит объявленных
+ * у него пиров. Токены для announce_peer -- SHA1 от секрета и адреса запросившего, секрет меняется раз в 5 минут.
+ * Известные узлы сохраняются в `cacheFile` при остановке и используются при следующем запуске вместе
+ * с `bootstrap`
+ */
+class DhtNode {
+public:
+    struct Options {
+        int port = 0;  // 0 -- любой свободный
+        std::vector<std::string> bootstrap;  // host:port
+        std::string cacheFile;  // пусто -- не сохранять узлы
+    };
+
+    using PeersCallback = std::function<void(const std::vector<Peer>&)>;
+    using DoneCallback = std::function<void()>;
+
+    /*
+     * Открывает сокет и запускает поток узла. При ошибке сокета выбрасывает std::runtime_error
+     */
+    explicit DhtNode(Options options);
+
+    /*
+     * Вызывает Stop
+     */
+    ~DhtNode();
+
+    /*
+     * Найти пиров торрента `infoHash`. Пиры передаются в `onPeers` по мере ответов узлов (без повторов),
+     * в конце поиска вызывается `onDone`. Если `announcePort` не 0, ближайшим к торренту узлам сообщается,
+     * что мы раздаем его на этом TCP-порту. Колбэки вызываются из потока узла
+     */
+    void GetPeers(const std::string& infoHash, int announcePort, PeersCallback onPeers, DoneCallback onDone = {});
+
+    /*
+     * Спросить узел по адресу о ближайших к нам узлах (например, другой локальный узел в тестах)
+     */
+    void AddNode(const Peer& address);
+
+    /*
+     * Остановить поток и сохранить известные узлы в cacheFile. Незавершенные поиски не вызывают onDone
+     */
+    void Stop();
+
+    int Port() const;
+    size_t NodesCount() const;
+    size_t QueriesSent() const;
+private:
+    struct Query;
+    struct Lookup;
+    struct Request;
+
+    void Loop();
+    void Bootstrap(std::chrono::steady_clock::time_point now);
+    void StartLookup(Request request, bool findNode, std::chrono::steady_clock::time_point now);
+    void StepLookup(Lookup& lookup, std::chrono::steady_clock::time_point now);
+    void FinishLookup(Lookup& lookup);
+    void AddCandidates(Lookup& lookup, std::string_view compactNodes);
+
+    void SendQuery(const Peer& address, std::string_view method, const std::string& arguments, uint64_t lookupId,
+                   std::chrono::steady_clock::time_point now);
+    void Send(const Peer& address, const std::string& message);
+    void HandleMessage(std::string_view data, const Peer& from, std::chrono::steady_clock::time_point now);
+    void HandleQuery(std::string_view transaction, std::string_view method, const Bencode::Node& arguments,
+                     const Peer& from, std::chrono::steady_clock::time_point now);
+    void HandleResponse(const Query& query, const Bencode::Node& response, const Peer& from,
+                        std::chrono::steady_clock::time_point now);
+    void HandleTimeouts(std::chrono::steady_clock::time_point now);
+
+    std::string MakeToken(const Peer& address, const std::string& secret) const;
+    std::string CompactNodes(const NodeId& target) const;
+    void LoadCache();
+    void SaveCache() const;
+
+    const Options options_;
+    NodeId id_;
+    int sock_;
+    int wakeFd_;  // eventfd: будит поток, когда поставлен новый поиск или узел останавливается
+    int port_;
+    std::atomic<bool> stopped_;
+    std::mt19937_64 random_;
+    std::unique_ptr<RoutingTable> table_;  // создается, когда известен id_; только в потоке узла
+    std::string secret_, previousSecret_;
+    std::chrono::steady_clock::time_point secretChanged_, lastBootstrap_;
+    uint16_t nextTransaction_ = 0;
+    std::unordered_map<uint16_t, std::unique_ptr<Query>> queries_;
+    uint64_t nextLookupId_ = 1;
+    std::map<uint64_t, std::unique_ptr<Lookup>> lookups_;
+    std::vector<Peer> cachedNodes_;  // адреса из cacheFile и bootstrap
+    std::unordered_map<std::string, std::vector<std::pair<Peer, std::chrono::steady_clock::time_point>>> storage_;
+
+    mutable std::mutex mutex_;
+    std::vector<Request> requests_;  // guarded by mutex_
+    std::vector<Peer> addedNodes_;  // guarded by mutex_
+    size_t nodesCount_ = 0;  // копия table_.Size() для других потоков, guarded by mutex_
+    std::atomic<size_t> queriesSent_;
+    std::thread thread_;
+};
@@ -0,0 +1,167 @@
+#include "disk_writer.h"
+#include "metrics.h"
+#include <sys/uio.h>
+#include <unistd.h>
+#include <climits>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+
+DiskWriter::DiskWriter(size_t queueCapacity, FsyncPolicy policy, size_t syncIntervalBytes) :
+    queueCapacity_(std::max<size_t>(queueCapacity, 1)), policy_(policy), syncIntervalBytes_(syncIntervalBytes) {
+    worker_ = std::thread([this]() {
+        WriterRoutine();
+    });
+}
+
+DiskWriter::~DiskWriter() {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopped_ = true;
+    }
+    notEmpty_.notify_all();
+    worker_.join();
+}
+
+void DiskWriter::Submit(DiskWriteJob job) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // backpressure: сетевой поток ждет, пока диск не догонит
+    notFull_.wait(lock, [this]() {
+        return pending_.size() < queueCapacity_;
+    });
+    pending_.push_back(std::move(job));
+    notEmpty_.notify_one();
+}
+
+void DiskWriter::Flush(int fd) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    drained_.wait(lock, [this]() {
+        return pending_.empty() && inFlight_ == 0;
+    });
+    if (policy_ == FsyncPolicy::None || unsyncedBytes_[fd] == 0) {
+        return;
+    }
+    unsyncedBytes_[fd] = 0;
+    lock.unlock();
+    if (fdatasync(fd) < 0) {
+        std::cerr << "Error in fdatasync: " << std::strerror(errno) << std::endl;
+    }
+}
+
+size_t DiskWriter::QueueSize() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return pending_.size() + inFlight_;
+}
+
+void DiskWriter::WriterRoutine() {
+    while (true) {
+        std::vector<DiskWriteJob> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            notEmpty_.wait(lock, [this]() {
+                return !pending_.empty() || stopped_;
+            });
+            if (pending_.empty()) {
+                break; // stopped_ и очередь разобрана
+            }
+            batch.swap(pending_);
+            inFlight_ = batch.size();
+        }
+        notFull_.notify_all();
+
+        WriteBatch(batch);
+
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            inFlight_ = 0;
+        }
+        drained_.notify_all();
+    }
+}
+
+void DiskWriter::WriteBatch(std::vector<DiskWriteJob>& batch) {
+    std::sort(batch.begin(), batch.end(), [](const DiskWriteJob& lhs, const DiskWriteJob& rhs) {
+        return lhs.fd != rhs.fd ? lhs.fd < rhs.fd : lhs.offset < rhs.offset;
+    });
+
+    auto begin = batch.begin();
+    while (begin != batch.end()) {
+        // набираем цепочку заданий, каждое из которых начинается там, где закончилось предыдущее
+        auto end = begin + 1;
+        size_t nextOffset = begin->offset + begin->length;
+        while (end != batch.end() && end->fd == begin->fd && end->offset == nextOffset) {
+            nextOffset += end->length;
+            ++end;
+        }
+        bool ok = WriteContiguous(begin, end);
+        for (auto it = begin; it != end; ++it) {
+            if (it->onComplete) {
+                it->onComplete(ok);
+            }
+        }
+        begin = end;
+    }
+}
+
+bool DiskWriter::WriteContiguous(std::vector<DiskWriteJob>::iterator begin, std::vector<DiskWriteJob>::iterator end) {
+    const int fd = begin->fd;
+    size_t offset = begin->offset;
+    size_t written = 0;
+    Metrics::ScopedTimer timer(Metrics::Histogram::DiskWrite);
+
+    std::vector<iovec> iov;
+    iov.reserve(std::min<size_t>(end - begin, IOV_MAX));
+    while (begin != end) {
+        iov.clear();
+        size_t chunkSize = 0;
+        for (auto it = begin; it != end && iov.size() < IOV_MAX; ++it) {
+            iov.push_back({const_cast<char*>(it->data), it->length});
+            chunkSize += it->length;
+        }
+        size_t jobsInChunk = iov.size();
+
+        // pwritev может записать меньше, чем просили: досылаем остаток, сдвигая iovec'и
+        size_t chunkWritten = 0;
+        size_t first = 0;
+        while (chunkWritten < chunkSize) {
+            ssize_t result = pwritev(fd, iov.data() + first, static_cast<int>(iov.size() - first), offset + chunkWritten);
+            if (result < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Error in pwritev: " << std::strerror(errno) << std::endl;
+                return false;
+            }
+            chunkWritten += result;
+            size_t advance = result;
+            while (first < iov.size() && advance >= iov[first].iov_len) {
+                advance -= iov[first].iov_len;
+                ++first;
+            }
+            if (first < iov.size()) {
+                iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + advance;
+                iov[first].iov_len -= advance;
+            }
+        }
+        offset += chunkSize;
+        written += chunkSize;
+        Metrics::Add(Metrics::Counter::DiskWrittenBytes, chunkSize);
+        begin += jobsInChunk;
+    }
+
+    bool needSync = false;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        size_t& unsynced = unsyncedBytes_[fd];
+        unsynced += written;
+        if (policy_ == FsyncPolicy::Periodic && unsynced >= syncIntervalBytes_) {
+            unsynced = 0;
+            needSync = true;
+        }
+    }
+    if (needSync && fdatasync(fd) < 0) {
+        std::cerr << "Error in fdatasync: " << std::strerror(errno) << std::endl;
+    }
+    return true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+
+/*
+ * Когда вызывать fdatasync для файлов, в которые пишет DiskWriter
+ * https://man7.org/linux/man-pages/man2/fdatasync.2.html
+ */
+enum class FsyncPolicy {
+    None,      // не синхронизировать, данные сбрасывает ядро в фоне
+    Periodic,  // fdatasync после каждых `syncIntervalBytes` записанных в файл байт
+    OnClose,   // один fdatasync при DiskWriter::Flush (перед закрытием файла)
+};
+
+/*
+ * Задание на запись: `length` байт по адресу `data` нужно записать в файл `fd` по смещению `offset`.
+ * Данные не копируются: их владелец должен держать буфер живым до вызова `onComplete`.
+ * `onComplete` вызывается из потока записи после окончания записи, аргумент -- успешно ли она прошла
+ */
+struct DiskWriteJob {
+    int fd;
+    size_t offset;
+    const char* data;
+    size_t length;
+    std::function<void(bool)> onComplete;
+};
+
+/*
+ * Отдельный поток записи на диск (write-behind).
+ * Сетевые потоки только кладут задания в ограниченную очередь; если очередь заполнена, Submit блокируется,
+ * пока поток записи ее не разгрузит. Поток записи забирает из очереди все накопившиеся задания, сортирует их
+ * по смещению в файле и склеивает соседние в один вызов pwritev.
+ * https://man7.org/linux/man-pages/man2/pwritev.2.html
+ */
+class DiskWriter {
+public:
+    /*
+     * queueCapacity -- сколько заданий может ждать записи, прежде чем Submit начнет блокироваться
+     */
+    explicit DiskWriter(size_t queueCapacity = 64, FsyncPolicy policy = FsyncPolicy::None,
+                        size_t syncIntervalBytes = 64 << 20);
+    ~DiskWriter();
+
+    DiskWriter(const DiskWriter&) = delete;
+    DiskWriter& operator=(const DiskWriter&) = delete;
+
+    /*
+     * Поставить задание в очередь. Блокируется, пока в очереди нет места
+     */
+    void Submit(DiskWriteJob job);
+
+    /*
+     * Дождаться записи всех заданий для файла `fd` и синхронизировать его в соответствии с политикой
+     */
+    void Flush(int fd);
+
+    /*
+     * Сколько заданий сейчас ждет записи или пишется
+     */
+    size_t QueueSize() const;
+
+private:
+    void WriterRoutine();
+
+    /*
+     * Записать отсортированную по (fd, offset) пачку заданий, склеивая соседние
+     */
+    void WriteBatch(std::vector<DiskWriteJob>& batch);
+
+    /*
+     * Записать подряд идущие задания [begin, end) одним или несколькими вызовами pwritev
+     */
+    bool WriteContiguous(std::vector<DiskWriteJob>::iterator begin, std::vector<DiskWriteJob>::iterator end);
+
+    const size_t queueCapacity_;
+    const FsyncPolicy policy_;
+    const size_t syncIntervalBytes_;
+
+    std::vector<DiskWriteJob> pending_; // Guarded by mutex_
+    size_t inFlight_ = 0; // сколько заданий забрано потоком записи и еще не записано. Guarded by mutex_
+    bool stopped_ = false; // Guarded by mutex_
+    std::unordered_map<int, size_t> unsyncedBytes_; // байты, записанные в файл после последнего fdatasync. Guarded by mutex_
+    mutable std::mutex mutex_;
+    std::condition_variable notEmpty_, notFull_, drained_;
+    std::thread worker_;
+};
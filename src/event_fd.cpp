@@ -0,0 +1,20 @@
+#include "event_fd.h"
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+
+void SignalEventFd(int fd) {
+    const uint64_t one = 1;
+    ssize_t written;
+    do {
+        written = write(fd, &one, sizeof(one));
+    } while (written < 0 && errno == EINTR);
+}
+
+void DrainEventFd(int fd) {
+    uint64_t value;
+    ssize_t received;
+    do {
+        received = read(fd, &value, sizeof(value));
+    } while (received < 0 && errno == EINTR);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+ * Пробуждение потока, ждущего в poll на eventfd (созданном с EFD_NONBLOCK): так Stop/Interrupt/новые запросы
+ * будят потоки DhtNode, PeerListener, TcpConnect и MetricsServer
+ */
+
+/*
+ * Прибавить 1 к счетчику eventfd. Если счетчик переполнен (EAGAIN), поток и так будет разбужен
+ */
+void SignalEventFd(int fd);
+
+/*
+ * Сбросить счетчик eventfd после пробуждения. Пустой счетчик (EAGAIN) -- не ошибка
+ */
+void DrainEventFd(int fd);
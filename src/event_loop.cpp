@@ -0,0 +1,70 @@
+#include "event_loop.h"
+#include <algorithm>
+#include <vector>
+
+EventLoop::EventLoop() : notified_(false), nextId_(0) {}
+
+void EventLoop::Notify() {
+    std::lock_guard lock(mutex_);
+    notified_ = true;
+    wakeUp_.notify_one();
+}
+
+size_t EventLoop::AddTimer(Clock::time_point when, Callback callback) {
+    std::lock_guard lock(mutex_);
+    const size_t id = nextId_++;
+    timers_.emplace(when, Timer{id, Clock::duration::zero(), std::move(callback)});
+    // новый таймер может оказаться раньше того, до которого спит RunOnce
+    wakeUp_.notify_one();
+    return id;
+}
+
+size_t EventLoop::AddPeriodicTimer(Clock::duration interval, Callback callback) {
+    std::lock_guard lock(mutex_);
+    const size_t id = nextId_++;
+    timers_.emplace(Clock::now() + interval, Timer{id, interval, std::move(callback)});
+    wakeUp_.notify_one();
+    return id;
+}
+
+void EventLoop::CancelTimer(size_t id) {
+    std::lock_guard lock(mutex_);
+    for (auto it = timers_.begin(); it != timers_.end(); ++it) {
+        if (it->second.id == id) {
+            timers_.erase(it);
+            return;
+        }
+    }
+}
+
+void EventLoop::RunOnce(Clock::time_point deadline) {
+    std::vector<Timer> expired;
+    {
+        std::unique_lock lock(mutex_);
+        while (!notified_) {
+            const Clock::time_point wakeAt = timers_.empty() ? deadline : std::min(deadline, timers_.begin()->first);
+            if (Clock::now() >= wakeAt) {
+                break;
+            }
+            if (wakeAt == Clock::time_point::max()) {
+                wakeUp_.wait(lock);
+            } else {
+                wakeUp_.wait_until(lock, wakeAt);
+            }
+        }
+        notified_ = false;
+        const auto now = Clock::now();
+        while (!timers_.empty() && timers_.begin()->first <= now) {
+            Timer timer = std::move(timers_.begin()->second);
+            timers_.erase(timers_.begin());
+            if (timer.interval != Clock::duration::zero()) {
+                // следующий срок считается от текущего момента: пропущенные из-за долгой работы вызовы не копятся
+                timers_.emplace(now + timer.interval, Timer{timer.id, timer.interval, timer.callback});
+            }
+            expired.push_back(std::move(timer));
+        }
+    }
+    for (Timer& timer : expired) {
+        timer.callback();
+    }
+}
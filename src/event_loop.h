@@ -0,0 +1,61 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <mutex>
+
+/*
+ * Ожидание событий и таймеры для потока, координирующего работу (Session::Run).
+ * Другие потоки будят его через Notify (часть записана на диск, трекеры ответили, соединение завершилось),
+ * а периодическая работа идет по таймерам. Поток просыпается ровно тогда, когда что-то произошло
+ * или подошел срок ближайшего таймера, вместо того чтобы проверять все раз в секунду
+ */
+class EventLoop {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    EventLoop();
+
+    /*
+     * Разбудить поток, ждущий в RunOnce. Можно вызывать из любого потока; Notify до RunOnce не теряется
+     */
+    void Notify();
+
+    /*
+     * Вызвать `callback` один раз в момент `when`. Возвращает номер таймера для CancelTimer
+     */
+    size_t AddTimer(Clock::time_point when, Callback callback);
+
+    /*
+     * Вызывать `callback` каждые `interval`, первый раз через `interval` после добавления
+     */
+    size_t AddPeriodicTimer(Clock::duration interval, Callback callback);
+
+    /*
+     * Снять таймер. Неизвестные и уже сработавшие номера игнорируются
+     */
+    void CancelTimer(size_t id);
+
+    /*
+     * Дождаться Notify, срока ближайшего таймера или `deadline` (что наступит раньше), затем выполнить
+     * сработавшие таймеры. Колбэки выполняются в вызывающем потоке без блокировок, из них можно добавлять
+     * и снимать таймеры
+     */
+    void RunOnce(Clock::time_point deadline = Clock::time_point::max());
+private:
+    struct Timer {
+        size_t id;
+        Clock::duration interval;  // 0 -- одноразовый
+        Callback callback;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable wakeUp_;
+    bool notified_;  // guarded by mutex_
+    size_t nextId_;  // guarded by mutex_
+    std::multimap<Clock::time_point, Timer> timers_;  // guarded by mutex_
+};
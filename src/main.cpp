@@ -1,240 +1,206 @@
-#include "torrent_tracker.h"
-#include "piece_storage.h"
-#include "peer_connect.h"
+#include "session.h"
+#include "torrent_creator.h"
 #include "byte_tools.h"
 #include <iostream>
-#include <cassert>
-#include <cmath>
 #include <filesystem>
 #include <algorithm>
-#include "StaticThreadPool.h"
+#include <csignal>
+#include <cstdlib>
 
 namespace fs = std::filesystem;
-std::mutex cerrMutex, coutMutex;
 
 
-// Готовим директорию для скачивания
-std::filesystem::path PrepareDownloadDirectory(const std::string& saveDirectory) {
-    std::filesystem::path outputDirectory = saveDirectory;
-    std::filesystem::create_directories(outputDirectory);
-    return outputDirectory;
+void PrintUsage(const char* programName) {
+    std::cerr << "Usage: " << programName << " -d <save_directory> [--storage write|mmap] [--allocate sparse|fallocate|direct]"
+              << " [--fsync none|periodic|close] [--huge-pages] [--memory-limit <MiB>] [--spill]"
+              << " [--port <port>] [--max-uploads <N>] [--upload-slots <N>] [--upload-cache <MiB>] [--seed-time <seconds>]"
+              << " [--max-connections <N>] [--no-dht] [--dht-bootstrap <host:port>]... [--dht-cache <file>]"
+              << " [--web-seed-connections <N>] [--metrics-port <port>] [--metrics-json <file>] <torrent_file_path>..."
+              << std::endl;
+    std::cerr << "       " << programName << " create ... (see '" << programName << " create')" << std::endl;
 }
 
-// Удалить временный файл
-void DeleteDownloadedFile(const std::filesystem::path& outputFilename) {
-    std::filesystem::remove(outputFilename);
+void PrintCreateUsage(const char* programName) {
+    std::cerr << "Usage: " << programName << " create [-o <torrent_file_path>] [--announce <url>]... [--web-seed <url>]..."
+              << " [--piece-kb <K>] [--comment <text>] [--threads <N>] <file or directory>" << std::endl;
 }
 
-
-// Запуск многопоточного скачивания
-bool RunDownloadMultithread(PieceStorage& pieces, const TorrentFile& torrentFile, const std::string& ourId, const TorrentTracker& tracker, const size_t countOfPiecesToDownload) {
-    using namespace std::chrono_literals;
-    std::vector<std::shared_ptr<PeerConnect>> peerConnections;
-
-    std::cerr << "WE NEED TO DOWNLOAD " << countOfPiecesToDownload << std::endl;
-    for (const Peer& peer : tracker.GetPeers()) {
-        peerConnections.emplace_back(std::make_shared<PeerConnect>(peer, torrentFile, ourId, pieces));
-    }
-
-    
-    size_t workersCount = std::min(static_cast<size_t>(std::thread::hardware_concurrency()), peerConnections.size());
-    StaticThreadPool peerThreads(workersCount);
-
-    for (auto& peerConnectPtr : peerConnections){
-        peerThreads.Submit(
-            [peerConnectPtr] () {
-                bool tryAgain = true;
-                int attempts = 0;
-                do {
-                    try {
-                        ++attempts;
-                        peerConnectPtr->Run();
-                    } catch (const std::runtime_error& e) {
-                        // std::lock_guard<std::mutex> cerrLock(cerrMutex);
-                        // std::cerr << "Runtime error: " << e.what() << std::endl;
-                    } catch (const std::exception& e) {
-                        // std::lock_guard<std::mutex> cerrLock(cerrMutex);
-                        // std::cerr << "Exception: " << e.what() << std::endl;
-                    } catch (...) {
-                        // std::lock_guard<std::mutex> cerrLock(cerrMutex);
-                        // std::cerr << "Unknown error" << std::endl;
-                    }
-                    tryAgain = peerConnectPtr->Failed() && attempts < 3;
-                } while (tryAgain);
-            }
-        );
-    }
-
-    {
-        std::lock_guard<std::mutex> coutLock(coutMutex);
-        std::cout << "Started " << workersCount << " threads for peers" << std::endl;
-    }
-    std::this_thread::sleep_for(10s);
-    while (pieces.PiecesSavedToDiscCount() < countOfPiecesToDownload) {
-        if (pieces.PiecesInProgressCount() == 0) {
-            {
-                std::lock_guard<std::mutex> coutLock(coutMutex);
-                std::cout
-                        << "Want to download more pieces but all peer connections are not working. Let's request new peers"
-                        << std::endl;
-            }
-
-            for (auto& peerConnectPtr : peerConnections) {
-                peerConnectPtr->Terminate();
-            }
-            peerThreads.Join();
-            return true;
+// Подкоманда create: собрать .torrent для файла или директории
+int RunCreate(int argc, char* argv[]) {
+    CreateOptions options;
+    std::string source;
+    std::string output;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg == "--announce" && i + 1 < argc) {
+            options.announces.emplace_back(argv[++i]);
+        } else if (arg == "--web-seed" && i + 1 < argc) {
+            options.webSeeds.emplace_back(argv[++i]);
+        } else if (arg == "--piece-kb" && i + 1 < argc) {
+            options.pieceLength = std::stoul(argv[++i]) << 10;
+        } else if (arg == "--comment" && i + 1 < argc) {
+            options.comment = argv[++i];
+        } else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = std::stoul(argv[++i]);
+        } else if (source.empty() && !arg.starts_with("-")) {
+            source = arg;
+        } else {
+            PrintCreateUsage(argv[0]);
+            return 1;
         }
-        std::this_thread::sleep_for(1s);
-    }
-
-    {
-        std::lock_guard<std::mutex> coutLock(coutMutex);
-        std::cout << "Terminating all peer connections" << std::endl;
     }
-    for (auto& peerConnectPtr : peerConnections) {
-        peerConnectPtr->Terminate();
+    if (source.empty()) {
+        PrintCreateUsage(argv[0]);
+        return 1;
     }
 
-    peerThreads.Join();
-
-    return false;
-}
-
-// Подготовка к скачиванию + запуск многопоточной загрузки
-void DownloadTorrentFile(const TorrentFile& torrentFile, PieceStorage& pieces, const std::string& ourId, const size_t countOfPiecesToDownload) {
-    
-    TorrentTracker tracker(torrentFile.announce_list);
-    bool requestMorePeers = false;
-    do {
-        int attempts = 0;
-        bool gotPeers = false;
-        do {
-            try {
-                tracker.UpdatePeers(torrentFile, ourId, 12345);
-                gotPeers = true;
-            } catch (...) {
-                attempts++;
-                if (attempts > 3) {
-                    throw std::runtime_error("Error in updating peers!");
-                }
-            }
-        } while (!gotPeers);
-
-        if (tracker.GetPeers().empty()) {
-            std::cerr << "No peers found. Cannot download a file" << std::endl;
-        }
-
-        std::cout << "Found " << tracker.GetPeers().size() << " peers" << std::endl;
-        for (const Peer& peer : tracker.GetPeers()) {
-            std::cout << "Found peer " << peer.ip << ":" << peer.port << std::endl;
-        }
-
-        requestMorePeers = RunDownloadMultithread(pieces, torrentFile, ourId, tracker, countOfPiecesToDownload);
-    } while (requestMorePeers);
-}
-
-
-
-// рекурсивно создаем директории по указанному пути
-void create_directories_for_file(const std::filesystem::path& file_path) {
-    // Получаем путь к директории, содержащей файл
-    std::filesystem::path dir_path = file_path.parent_path();
-    
-    // Создаем все необходимые директории
     try {
-        std::filesystem::create_directories(dir_path);
-        std::cout << "Directories created successfully." << std::endl;
-    } catch (const std::filesystem::filesystem_error& e) {
-        std::cerr << "Error creating directories: " << e.what() << std::endl;
-    }
-}
-
-// Распределяем байты из одного общего файла по файлам из TorrentFile
-void DistributePiecesBetweenFiles(const TorrentFile& tf, const std::string& fileName, const std::string& saveDirectory) {
-    std::ifstream inputFile(fileName, std::ios::in | std::ios::binary);
-    char ch;
-    std::cout << std::endl << std::endl;
-    for (const auto& it : tf.files) {
-        std::string road = saveDirectory + "/";
-        if (tf.name == "") {
-            road += it.path;
-        } else {
-            road += tf.name + "/" + it.path;
-        }
-        create_directories_for_file(road);
-
-        std::ofstream outputFile(road, std::ios::out | std::ios::binary);
-        if (!outputFile.is_open()) {
-            std::cerr << "Error in opening file: " << road << std::endl;
-            return;
-        }
-        for (size_t i = 0; i < it.length; ++i) {
-            inputFile.get(ch);
-            outputFile.put(ch);
+        auto start = std::chrono::steady_clock::now();
+        TorrentFile tf = CreateTorrentFile(source, options);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (output.empty()) {
+            output = tf.name + ".torrent";
         }
-        outputFile.close();
-    }
-    inputFile.close();
-}
-
-void RunAllStagesOfDownloadingTorrentFile(const std::string& saveDirectory, size_t percent, const std::string& torrentFilePath) {
-    std::cout << "\n\n\nСкачивание " << percent << "% файла " << torrentFilePath << " в директорию " << saveDirectory << std::endl;
-    TorrentFile torrentFile;
-    try {
-        torrentFile = LoadTorrentFile(torrentFilePath);
-        std::cout << "Loaded torrent file " << torrentFilePath << ". " << torrentFile.comment << std::endl;
-    } catch (const std::invalid_argument& e) {
+        SaveTorrentFile(tf, output);
+        std::cout << "Created " << output << ": " << tf.files.size() << " files, " << tf.pieceHashes.size()
+                  << " pieces of " << (tf.pieceLength >> 10) << " KiB, hashed " << (tf.length >> 20) << " MiB in "
+                  << seconds << " s (" << (tf.length / std::max(seconds, 1e-9) / (1 << 20)) << " MiB/s)" << std::endl;
+        std::cout << "Info hash " << HexEncode(tf.infoHash) << std::endl;
+    } catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
-        return;
-    }
-
-    const std::string PeerId = "TESTAPPDONTWORRY" + RandomString(4);
-
-    const std::filesystem::path outputDirectory = PrepareDownloadDirectory(saveDirectory);
-    
-    std::string fileName = (outputDirectory / RandomString(40)).string();
-
-    PieceStorage pieces(torrentFile, outputDirectory, fileName);
-    size_t countOfPiecesToDownload = std::ceil(((static_cast<long double>(percent) / 100) * torrentFile.pieceHashes.size()));
-    std::cerr << torrentFile.name << std::endl;
-    pieces.SetNewSize(countOfPiecesToDownload);
-
-    DownloadTorrentFile(torrentFile, pieces, PeerId, countOfPiecesToDownload);
-    if (percent == 100) {
-        std::cout << "Distributing files..." << std::endl; 
-        DistributePiecesBetweenFiles(torrentFile, fileName, saveDirectory);
+        return 1;
     }
-    DeleteDownloadedFile(fileName);
+    return 0;
 }
 
-
 int main(int argc, char* argv[]) {
-    if (argc != 4) {
-        std::cerr << "Usage: " << argv[0] << " -d <save_directory> <torrent_file_path>" << std::endl;
-        return 1;
+    if (argc > 1 && std::string(argv[1]) == "create") {
+        return RunCreate(argc, argv);
     }
 
     std::string saveDirectory;
-    std::string torrentFilePath;
+    std::vector<std::string> torrentFilePaths;
     int percent = 100;
-
-    if (std::string(argv[1]) == "-d") {
-        saveDirectory = argv[2];
-        torrentFilePath = argv[3];
-    } else {
-        std::cerr << "Invalid arguments. Usage: " << argv[0] << " -d <save_directory> <torrent_file_path>" << std::endl;
-        return 1;
+    SessionOptions options;
+    if (const char* home = std::getenv("HOME")) {
+        options.dhtCacheFile = std::string(home) + "/.torrent-client-dht";
+    }
+    bool defaultBootstrap = true;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-d" && i + 1 < argc) {
+            saveDirectory = argv[++i];
+        } else if (arg == "--storage" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "mmap") {
+                options.storage.mode = StorageMode::Mmap;
+            } else if (mode == "write") {
+                options.storage.mode = StorageMode::Write;
+            } else {
+                std::cerr << "Unknown storage mode: " << mode << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--allocate" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode == "sparse") {
+                options.storage.allocation = AllocationMode::Sparse;
+            } else if (mode == "fallocate") {
+                options.storage.allocation = AllocationMode::Fallocate;
+            } else if (mode == "direct") {
+                options.storage.allocation = AllocationMode::Direct;
+            } else {
+                std::cerr << "Unknown allocation mode: " << mode << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--huge-pages") {
+            options.storage.hugePages = true;
+        } else if (arg == "--memory-limit" && i + 1 < argc) {
+            options.memoryLimit = std::stoull(argv[++i]) << 20;
+        } else if (arg == "--spill") {
+            options.storage.spillPartialPieces = true;
+        } else if (arg == "--port" && i + 1 < argc) {
+            options.port = std::stoi(argv[++i]);
+        } else if (arg == "--max-uploads" && i + 1 < argc) {
+            options.maxUploadPeers = std::max(1UL, std::stoul(argv[++i]));
+        } else if (arg == "--upload-slots" && i + 1 < argc) {
+            options.uploadSlots = std::stoul(argv[++i]);
+        } else if (arg == "--upload-cache" && i + 1 < argc) {
+            options.storage.uploadCacheBytes = std::stoull(argv[++i]) << 20;
+        } else if (arg == "--seed-time" && i + 1 < argc) {
+            options.seedTimeSeconds = std::stoul(argv[++i]);
+        } else if (arg == "--fsync" && i + 1 < argc) {
+            std::string policy = argv[++i];
+            if (policy == "none") {
+                options.fsyncPolicy = FsyncPolicy::None;
+            } else if (policy == "periodic") {
+                options.fsyncPolicy = FsyncPolicy::Periodic;
+            } else if (policy == "close") {
+                options.fsyncPolicy = FsyncPolicy::OnClose;
+            } else {
+                std::cerr << "Unknown fsync policy: " << policy << std::endl;
+                PrintUsage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--max-connections" && i + 1 < argc) {
+            options.maxConnections = std::max(1UL, std::stoul(argv[++i]));
+        } else if (arg == "--no-dht") {
+            options.dht = false;
+        } else if (arg == "--dht-bootstrap" && i + 1 < argc) {
+            // первый --dht-bootstrap заменяет узлы по умолчанию
+            if (defaultBootstrap) {
+                options.dhtBootstrap.clear();
+                defaultBootstrap = false;
+            }
+            options.dhtBootstrap.emplace_back(argv[++i]);
+        } else if (arg == "--dht-cache" && i + 1 < argc) {
+            options.dhtCacheFile = argv[++i];
+        } else if (arg == "--web-seed-connections" && i + 1 < argc) {
+            options.webSeedConnections = std::stoul(argv[++i]);
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            options.metricsPort = std::stoi(argv[++i]);
+        } else if (arg == "--metrics-json" && i + 1 < argc) {
+            options.metricsJsonFile = argv[++i];
+        } else if (!arg.starts_with("-")) {
+            torrentFilePaths.push_back(arg);
+        } else {
+            std::cerr << "Invalid arguments." << std::endl;
+            PrintUsage(argv[0]);
+            return 1;
+        }
     }
 
-    if (saveDirectory.empty() || torrentFilePath.empty()) {
+    if (saveDirectory.empty() || torrentFilePaths.empty()) {
         std::cerr << "Invalid arguments. Please check and try again." << std::endl;
+        PrintUsage(argv[0]);
         return 1;
     }
 
+    // sendfile не умеет MSG_NOSIGNAL: разрыв соединения пиром не должен убивать процесс
+    std::signal(SIGPIPE, SIG_IGN);
+
     saveDirectory = fs::absolute(saveDirectory).string();
-    torrentFilePath = fs::absolute(torrentFilePath).string();
 
-    RunAllStagesOfDownloadingTorrentFile(saveDirectory, percent, torrentFilePath);
+    Session session(options);
+    size_t loaded = 0;
+    for (const std::string& path : torrentFilePaths) {
+        const std::string torrentFilePath = fs::absolute(path).string();
+        try {
+            TorrentFile torrentFile = LoadTorrentFile(torrentFilePath);
+            std::cout << "Loaded torrent file " << torrentFilePath << ". " << torrentFile.comment << std::endl;
+            session.AddTorrent(torrentFile, saveDirectory, percent);
+            ++loaded;
+        } catch (const std::exception& e) {
+            std::cerr << torrentFilePath << ": " << e.what() << std::endl;
+        }
+    }
+    if (loaded == 0) {
+        return 1;
+    }
+    session.Run();
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,61 @@
+#include "mapped_file.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+namespace {
+// msync и madvise требуют адрес, выровненный по границе страницы
+size_t PageSize() {
+    static const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return pageSize;
+}
+}
+
+MappedFile::MappedFile(int fd, size_t length) : data_(nullptr), length_(length) {
+    if (length_ == 0) {
+        throw std::runtime_error("Cannot map empty file");
+    }
+    void* addr = mmap(nullptr, length_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error(std::string("Error in mmap: ") + std::strerror(errno));
+    }
+    data_ = static_cast<char*>(addr);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        msync(data_, length_, MS_SYNC);
+        munmap(data_, length_);
+    }
+}
+
+char* MappedFile::Data() const {
+    return data_;
+}
+
+size_t MappedFile::Size() const {
+    return length_;
+}
+
+void MappedFile::Advise(size_t offset, size_t length, int advice) const {
+    size_t begin = offset - offset % PageSize();
+    size_t end = std::min(offset + length, length_);
+    if (begin >= end) {
+        return;
+    }
+    madvise(data_ + begin, end - begin, advice);
+}
+
+void MappedFile::Sync(size_t offset, size_t length, bool async) const {
+    size_t begin = offset - offset % PageSize();
+    size_t end = std::min(offset + length, length_);
+    if (begin >= end) {
+        return;
+    }
+    if (msync(data_ + begin, end - begin, async ? MS_ASYNC : MS_SYNC) < 0) {
+        throw std::runtime_error(std::string("Error in msync: ") + std::strerror(errno));
+    }
+}
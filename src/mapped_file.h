@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+/*
+ * Файл, отображенный в память целиком (mmap с MAP_SHARED).
+ * Запись в отображение попадает в page cache напрямую, без промежуточного буфера и системного вызова write.
+ * https://man7.org/linux/man-pages/man2/mmap.2.html
+ */
+class MappedFile {
+public:
+    /*
+     * Отобразить первые `length` байт файла `fd` на чтение и запись.
+     * Если отображение создать не удалось (например, файл не помещается в адресное пространство), выбрасывается
+     * исключение std::runtime_error
+     */
+    MappedFile(int fd, size_t length);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    char* Data() const;
+    size_t Size() const;
+
+    /*
+     * Подсказка ядру о характере доступа к диапазону (MADV_RANDOM, MADV_SEQUENTIAL, MADV_DONTNEED, ...).
+     * Ошибки madvise игнорируются, так как это только подсказка
+     * https://man7.org/linux/man-pages/man2/madvise.2.html
+     */
+    void Advise(size_t offset, size_t length, int advice) const;
+
+    /*
+     * Сбросить изменения диапазона в файл. При `async` == true только инициировать запись (MS_ASYNC)
+     * https://man7.org/linux/man-pages/man2/msync.2.html
+     */
+    void Sync(size_t offset, size_t length, bool async) const;
+
+private:
+    char* data_;
+    size_t length_;
+};
@@ -0,0 +1,29 @@
+#include "memory_budget.h"
+#include <cassert>
+
+MemoryBudget::MemoryBudget(size_t limitBytes) : limit_(limitBytes), used_(0) {}
+
+bool MemoryBudget::TryAcquire(size_t bytes) {
+    size_t used = used_.load();
+    do {
+        // одну часть выдаем всегда, иначе при лимите меньше длины части скачивание встанет навсегда
+        if (limit_ != 0 && used != 0 && used + bytes > limit_) {
+            return false;
+        }
+    } while (!used_.compare_exchange_weak(used, used + bytes));
+    return true;
+}
+
+void MemoryBudget::Release(size_t bytes) {
+    size_t before = used_.fetch_sub(bytes);
+    assert(before >= bytes);
+    (void)before;
+}
+
+size_t MemoryBudget::Used() const {
+    return used_.load();
+}
+
+size_t MemoryBudget::Limit() const {
+    return limit_;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/*
+ * Общий лимит памяти под данные частей, которые скачиваются или ждут записи на диск.
+ * Буфер части занимает место в бюджете с момента, когда часть взяли на скачивание, и до окончания ее записи,
+ * поэтому и отстающий диск, и большое число пиров упираются в один и тот же лимит.
+ */
+class MemoryBudget {
+public:
+    /*
+     * limitBytes -- лимит в байтах, 0 -- без ограничений
+     */
+    explicit MemoryBudget(size_t limitBytes = 0);
+
+    /*
+     * Занять `bytes` байт, если они укладываются в лимит. Возвращает false, если бюджет исчерпан
+     */
+    bool TryAcquire(size_t bytes);
+
+    /*
+     * Вернуть ранее занятые байты
+     */
+    void Release(size_t bytes);
+
+    size_t Used() const;
+    size_t Limit() const;
+
+private:
+    const size_t limit_;
+    std::atomic<size_t> used_;
+};
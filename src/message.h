@@ -19,6 +19,13 @@ enum class MessageId : uint8_t {
     Cancel,
     Port,
     KeepAlive,
+    // Fast extension, https://www.bittorrent.org/beps/bep_0006.html
+    SuggestPiece = 13,
+    HaveAll,
+    HaveNone,
+    RejectRequest,
+    AllowedFast,
+    Extended = 20,  // https://www.bittorrent.org/beps/bep_0010.html
 };
 
 struct Message {
@@ -41,7 +48,7 @@ struct Message {
      * Формируем строку с сообщением, которую можно будет послать пиру в соответствии с протоколом.
      * Получается строка вида "<1 + payload length><message id><payload>"
      * Секция с длиной сообщения занимает 4 байта и представляет собой целое число в формате big-endian
-     * id сообщения занимает 1 байт и может принимать значения от 0 до 9 включительно
+     * id сообщения занимает 1 байт: от 0 до 9 включительно, от 13 до 17 для Fast extension или 20 для сообщений расширений
      */
     std::string ToString() const;
 };
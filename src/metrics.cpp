@@ -0,0 +1,273 @@
+#include "metrics.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+
+namespace Metrics {
+
+namespace {
+
+constexpr size_t COUNTERS = static_cast<size_t>(Counter::Count);
+constexpr size_t HISTOGRAMS = static_cast<size_t>(Histogram::Count);
+
+struct CounterInfo {
+    const char* name;
+    const char* help;
+};
+
+constexpr CounterInfo COUNTER_INFO[COUNTERS] = {
+    {"torrent_client_downloaded_bytes_total", "Block data received from peers"},
+    {"torrent_client_uploaded_bytes_total", "Block data sent to peers"},
+    {"torrent_client_web_seed_downloaded_bytes_total", "Data received from web seeds"},
+    {"torrent_client_requests_sent_total", "Block requests sent to peers"},
+    {"torrent_client_requests_rejected_total", "Block requests rejected by peers"},
+    {"torrent_client_pieces_verified_total", "Pieces that passed the hash check"},
+    {"torrent_client_pieces_hash_failed_total", "Pieces that failed the hash check"},
+    {"torrent_client_disk_written_bytes_total", "Bytes written to disk by the disk writer"},
+};
+
+constexpr CounterInfo HISTOGRAM_INFO[HISTOGRAMS] = {
+    {"torrent_client_request_rtt_seconds", "Time from a block request to its data"},
+    {"torrent_client_choked_seconds", "Time a peer kept us choked"},
+    {"torrent_client_hash_seconds", "Hash check of one piece"},
+    {"torrent_client_disk_write_seconds", "Writing one chain of adjacent pieces, with fdatasync when due"},
+};
+
+// Ячейки одного потока. Пишет в них только владелец, поэтому хватает relaxed load + store
+struct alignas(64) Shard {
+    struct HistogramCells {
+        std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKETS + 1> buckets{};
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> sumNanoseconds{0};
+    };
+    std::array<std::atomic<uint64_t>, COUNTERS> counters{};
+    std::array<HistogramCells, HISTOGRAMS> histograms{};
+};
+
+void Increment(std::atomic<uint64_t>& cell, uint64_t value) {
+    cell.store(cell.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// Все когда-либо созданные наборы ячеек и свободные из них (их потоки завершились)
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Shard>> shards;  // guarded by mutex
+    std::vector<Shard*> free;  // guarded by mutex
+};
+
+// не разрушается при выходе: потоки могут завершаться позже статических объектов
+Registry& GetRegistry() {
+    static Registry* registry = new Registry;
+    return *registry;
+}
+
+// Набор ячеек потока: берется при первой записи и возвращается в реестр, когда поток завершается
+class ThreadShard {
+public:
+    ~ThreadShard() {
+        if (shard_ != nullptr) {
+            Registry& registry = GetRegistry();
+            std::lock_guard lock(registry.mutex);
+            registry.free.push_back(shard_);
+        }
+    }
+
+    Shard& Get() {
+        if (shard_ == nullptr) {
+            Registry& registry = GetRegistry();
+            std::lock_guard lock(registry.mutex);
+            if (!registry.free.empty()) {
+                shard_ = registry.free.back();
+                registry.free.pop_back();
+            } else {
+                shard_ = registry.shards.emplace_back(std::make_unique<Shard>()).get();
+            }
+        }
+        return *shard_;
+    }
+private:
+    Shard* shard_ = nullptr;
+};
+
+thread_local ThreadShard threadShard;
+
+// Номер корзины: наименьшее k, при котором значение не больше 2^k мкс
+size_t BucketIndex(std::chrono::steady_clock::duration duration) {
+    const auto microseconds = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    if (microseconds <= 1) {
+        return 0;
+    }
+    return std::min<size_t>(std::bit_width(static_cast<uint64_t>(microseconds - 1)), HISTOGRAM_BUCKETS);
+}
+
+double BucketBound(size_t bucket) {
+    return static_cast<double>(uint64_t(1) << bucket) / 1e6;
+}
+
+std::string EscapeLabel(const std::string& value) {
+    std::string result;
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            result += '\\';
+            result += c;
+        } else if (c == '\n') {
+            result += "\\n";
+        } else {
+            result += c;
+        }
+    }
+    return result;
+}
+
+std::string EscapeJson(const std::string& value) {
+    std::ostringstream result;
+    for (unsigned char c : value) {
+        if (c == '\\' || c == '"') {
+            result << '\\' << c;
+        } else if (c < 0x20) {
+            result << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+        } else {
+            result << c;
+        }
+    }
+    return result.str();
+}
+
+std::string PrometheusLabels(const std::vector<std::pair<std::string, std::string>>& labels) {
+    if (labels.empty()) {
+        return "";
+    }
+    std::string result = "{";
+    for (const auto& [name, value] : labels) {
+        if (result.size() > 1) {
+            result += ',';
+        }
+        result += name + "=\"" + EscapeLabel(value) + "\"";
+    }
+    return result + "}";
+}
+
+}
+
+void Add(Counter counter, uint64_t value) {
+    Increment(threadShard.Get().counters[static_cast<size_t>(counter)], value);
+}
+
+void Observe(Histogram histogram, std::chrono::steady_clock::duration duration) {
+    auto& cells = threadShard.Get().histograms[static_cast<size_t>(histogram)];
+    Increment(cells.buckets[BucketIndex(duration)], 1);
+    Increment(cells.count, 1);
+    Increment(cells.sumNanoseconds, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+ScopedTimer::ScopedTimer(Histogram histogram) : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+
+ScopedTimer::~ScopedTimer() {
+    Observe(histogram_, std::chrono::steady_clock::now() - start_);
+}
+
+Snapshot Collect() {
+    Snapshot snapshot;
+    Registry& registry = GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    for (const auto& shard : registry.shards) {
+        for (size_t i = 0; i < COUNTERS; ++i) {
+            snapshot.counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < HISTOGRAMS; ++i) {
+            const auto& cells = shard->histograms[i];
+            auto& histogram = snapshot.histograms[i];
+            for (size_t bucket = 0; bucket <= HISTOGRAM_BUCKETS; ++bucket) {
+                histogram.buckets[bucket] += cells.buckets[bucket].load(std::memory_order_relaxed);
+            }
+            histogram.count += cells.count.load(std::memory_order_relaxed);
+            histogram.sumNanoseconds += cells.sumNanoseconds.load(std::memory_order_relaxed);
+        }
+    }
+    return snapshot;
+}
+
+std::string FormatPrometheus(const Snapshot& snapshot, const std::vector<Gauge>& gauges) {
+    std::ostringstream out;
+    out << std::setprecision(10);
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        out << "# HELP " << COUNTER_INFO[i].name << " " << COUNTER_INFO[i].help << "\n"
+            << "# TYPE " << COUNTER_INFO[i].name << " counter\n"
+            << COUNTER_INFO[i].name << " " << snapshot.counters[i] << "\n";
+    }
+    for (size_t i = 0; i < HISTOGRAMS; ++i) {
+        const std::string name = HISTOGRAM_INFO[i].name;
+        const HistogramSnapshot& histogram = snapshot.histograms[i];
+        out << "# HELP " << name << " " << HISTOGRAM_INFO[i].help << "\n"
+            << "# TYPE " << name << " histogram\n";
+        // корзины Prometheus накопленные: le="x" -- все значения не больше x
+        uint64_t cumulative = 0;
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; ++bucket) {
+            cumulative += histogram.buckets[bucket];
+            out << name << "_bucket{le=\"" << BucketBound(bucket) << "\"} " << cumulative << "\n";
+        }
+        // count берем из корзин, а не из histogram.count: ячейки читаются не атомарно все вместе
+        cumulative += histogram.buckets[HISTOGRAM_BUCKETS];
+        out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+            << name << "_sum " << histogram.sumNanoseconds / 1e9 << "\n"
+            << name << "_count " << cumulative << "\n";
+    }
+    for (size_t i = 0; i < gauges.size(); ++i) {
+        const Gauge& gauge = gauges[i];
+        if (i == 0 || gauges[i - 1].name != gauge.name) {
+            out << "# HELP " << gauge.name << " " << gauge.help << "\n"
+                << "# TYPE " << gauge.name << (gauge.counter ? " counter\n" : " gauge\n");
+        }
+        out << gauge.name << PrometheusLabels(gauge.labels) << " " << gauge.value << "\n";
+    }
+    return out.str();
+}
+
+std::string FormatJson(const Snapshot& snapshot, const std::vector<Gauge>& gauges) {
+    std::ostringstream out;
+    out << std::setprecision(10);
+    out << "{\n  \"counters\": {\n";
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        out << "    \"" << COUNTER_INFO[i].name << "\": " << snapshot.counters[i] << (i + 1 < COUNTERS ? ",\n" : "\n");
+    }
+    out << "  },\n  \"histograms\": {\n";
+    for (size_t i = 0; i < HISTOGRAMS; ++i) {
+        const HistogramSnapshot& histogram = snapshot.histograms[i];
+        out << "    \"" << HISTOGRAM_INFO[i].name << "\": {\"count\": " << histogram.count
+            << ", \"sum\": " << histogram.sumNanoseconds / 1e9 << ", \"buckets\": [";
+        // только непустые корзины, le -- верхняя граница корзины в секундах, null -- +Inf
+        bool first = true;
+        for (size_t bucket = 0; bucket <= HISTOGRAM_BUCKETS; ++bucket) {
+            if (histogram.buckets[bucket] == 0) {
+                continue;
+            }
+            out << (first ? "" : ", ") << "{\"le\": ";
+            if (bucket < HISTOGRAM_BUCKETS) {
+                out << BucketBound(bucket);
+            } else {
+                out << "null";
+            }
+            out << ", \"count\": " << histogram.buckets[bucket] << "}";
+            first = false;
+        }
+        out << "]}" << (i + 1 < HISTOGRAMS ? ",\n" : "\n");
+    }
+    out << "  },\n  \"gauges\": [\n";
+    for (size_t i = 0; i < gauges.size(); ++i) {
+        const Gauge& gauge = gauges[i];
+        out << "    {\"name\": \"" << gauge.name << "\", \"labels\": {";
+        for (size_t j = 0; j < gauge.labels.size(); ++j) {
+            out << (j == 0 ? "" : ", ") << "\"" << gauge.labels[j].first << "\": \""
+                << EscapeJson(gauge.labels[j].second) << "\"";
+        }
+        out << "}, \"value\": " << gauge.value << "}" << (i + 1 < gauges.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+    return out.str();
+}
+
+}
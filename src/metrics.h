@@ -0,0 +1,103 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Метрики клиента: счетчики и гистограммы длительностей, которые пишутся из горячих путей без блокировок.
+ * У каждого потока свой набор ячеек: поток прибавляет только к своим (обычные load/store без lock-префикса
+ * и без борьбы за кэш-линии с другими потоками), а Collect складывает ячейки всех потоков. Ячейки завершившегося
+ * потока остаются в реестре и достаются следующему новому потоку, так что накопленные значения не теряются,
+ * а память не растет с числом созданных потоков
+ */
+namespace Metrics {
+
+enum class Counter : size_t {
+    DownloadedBytes,         // данные блоков, полученные от пиров
+    UploadedBytes,           // данные блоков, отданные пирам
+    WebSeedDownloadedBytes,  // данные, полученные от web seed
+    RequestsSent,            // запросов блоков, посланных пирам
+    RequestsRejected,        // запросов, отклоненных пирами (RejectRequest)
+    PiecesVerified,          // частей, хеш которых совпал
+    PiecesHashFailed,        // частей, хеш которых не совпал
+    DiskWrittenBytes,        // байт, записанных DiskWriter
+    Count,
+};
+
+enum class Histogram : size_t {
+    RequestRtt,  // от запроса блока до получения его данных
+    ChokedTime,  // сколько пир держал нас зачоканными (от подключения или choke до unchoke)
+    HashTime,    // проверка хеша одной части
+    DiskWrite,   // запись одной склеенной цепочки частей (pwritev и fdatasync, если пора)
+    Count,
+};
+
+/*
+ * Верхние границы корзин гистограмм: 1 мкс, 2 мкс, 4 мкс, ..., 2^24 мкс (~16.8 с), последняя корзина -- +Inf
+ */
+constexpr size_t HISTOGRAM_BUCKETS = 25;
+
+void Add(Counter counter, uint64_t value = 1);
+
+void Observe(Histogram histogram, std::chrono::steady_clock::duration duration);
+
+/*
+ * Замеряет время жизни объекта и записывает его в гистограмму
+ */
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram histogram);
+    ~ScopedTimer();
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+private:
+    const Histogram histogram_;
+    const std::chrono::steady_clock::time_point start_;
+};
+
+struct HistogramSnapshot {
+    std::array<uint64_t, HISTOGRAM_BUCKETS + 1> buckets{};  // не накопленные: buckets[i] -- попавшие именно в i-ю
+    uint64_t count = 0;
+    uint64_t sumNanoseconds = 0;
+};
+
+struct Snapshot {
+    std::array<uint64_t, static_cast<size_t>(Counter::Count)> counters{};
+    std::array<HistogramSnapshot, static_cast<size_t>(Histogram::Count)> histograms{};
+};
+
+/*
+ * Сложить ячейки всех потоков. Значения, которые потоки пишут в этот момент, могут попасть или не попасть в сумму
+ */
+Snapshot Collect();
+
+/*
+ * Значение, которое не копится, а снимается в момент запроса: глубина очереди, состояние частей, байты пира.
+ * Метрики с одинаковым `name` должны идти подряд
+ */
+struct Gauge {
+    std::string name;
+    std::string help;
+    std::vector<std::pair<std::string, std::string>> labels;
+    double value;
+    bool counter = false;  // монотонно растет (пока существует), а не меняется в обе стороны
+};
+
+/*
+ * Текстовый формат Prometheus (version 0.0.4)
+ * https://prometheus.io/docs/instrumenting/exposition_formats/
+ */
+std::string FormatPrometheus(const Snapshot& snapshot, const std::vector<Gauge>& gauges);
+
+/*
+ * То же в JSON: по одной метрике на строку
+ */
+std::string FormatJson(const Snapshot& snapshot, const std::vector<Gauge>& gauges);
+
+}
@@ -0,0 +1,138 @@
+#include "metrics_server.h"
+#include "event_fd.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+// клиент, не приславший запрос за это время, отключается, чтобы не держать единственный поток сервера
+constexpr int REQUEST_TIMEOUT_MS = 2000;
+constexpr size_t MAX_REQUEST_SIZE = 8192;
+
+void SendAll(int sock, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t sent = send(sock, data.data(), data.size(), MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return;
+        }
+        data.remove_prefix(sent);
+    }
+}
+
+/*
+ * Прочитать заголовки запроса (до пустой строки). Возвращает false, если клиент отключился или не успел
+ */
+bool ReceiveRequest(int sock, std::string& request) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(REQUEST_TIMEOUT_MS);
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos) {
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        pollfd readable = {sock, POLLIN, 0};
+        if (left.count() <= 0 || request.size() > MAX_REQUEST_SIZE || poll(&readable, 1, static_cast<int>(left.count())) <= 0) {
+            return false;
+        }
+        ssize_t received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        request.append(buffer, received);
+    }
+    return true;
+}
+
+std::string Response(const std::string& status, const std::string& contentType, const std::string& body) {
+    return "HTTP/1.1 " + status + "\r\nContent-Type: " + contentType + "\r\nContent-Length: " +
+           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+}
+}
+
+MetricsServer::MetricsServer(int port, std::function<std::vector<Metrics::Gauge>()> gauges) :
+    gauges_(std::move(gauges)), sock_(-1), wakeFd_(-1) {
+    sock_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_ < 0) {
+        throw std::runtime_error(std::string("Failed to create metrics socket: ") + std::strerror(errno));
+    }
+    int reuse = 1;
+    setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // метрики отдаются только локально
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(sock_, 16) < 0) {
+        std::string error = std::strerror(errno);
+        close(sock_);
+        throw std::runtime_error("Cannot serve metrics on port " + std::to_string(port) + ": " + error);
+    }
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd_ < 0) {
+        std::string error = std::strerror(errno);
+        close(sock_);
+        throw std::runtime_error("Failed to create metrics eventfd: " + error);
+    }
+    thread_ = std::thread([this]() {
+        ServeLoop();
+    });
+}
+
+MetricsServer::~MetricsServer() {
+    SignalEventFd(wakeFd_);
+    thread_.join();
+    close(sock_);
+    close(wakeFd_);
+}
+
+void MetricsServer::ServeLoop() {
+    while (true) {
+        pollfd fds[2] = {{sock_, POLLIN, 0}, {wakeFd_, POLLIN, 0}};
+        if (poll(fds, 2, -1) <= 0) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+        int sock = accept4(sock_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (sock < 0) {
+            continue;
+        }
+        HandleRequest(sock);
+        close(sock);
+    }
+}
+
+void MetricsServer::HandleRequest(int sock) {
+    std::string request;
+    if (!ReceiveRequest(sock, request)) {
+        return;
+    }
+    // строка запроса: "GET /metrics HTTP/1.1"
+    const std::string requestLine = request.substr(0, request.find("\r\n"));
+    const size_t pathBegin = requestLine.find(' ') + 1;
+    const size_t pathEnd = requestLine.find(' ', pathBegin);
+    const std::string method = requestLine.substr(0, pathBegin - 1);
+    const std::string path = pathEnd == std::string::npos ? "" : requestLine.substr(pathBegin, pathEnd - pathBegin);
+    if (method != "GET") {
+        SendAll(sock, Response("405 Method Not Allowed", "text/plain", "Only GET is supported\n"));
+    } else if (path == "/metrics") {
+        SendAll(sock, Response("200 OK", "text/plain; version=0.0.4",
+                               Metrics::FormatPrometheus(Metrics::Collect(), gauges_())));
+    } else if (path == "/metrics.json") {
+        SendAll(sock, Response("200 OK", "application/json", Metrics::FormatJson(Metrics::Collect(), gauges_())));
+    } else {
+        SendAll(sock, Response("404 Not Found", "text/plain", "Try /metrics or /metrics.json\n"));
+    }
+}
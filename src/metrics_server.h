@@ -0,0 +1,37 @@
+#pragma once
+
+#include "metrics.h"
+#include <functional>
+#include <thread>
+#include <vector>
+
+/*
+ * HTTP-сервер метрик на 127.0.0.1:`port`: GET /metrics отдает метрики в текстовом формате Prometheus,
+ * GET /metrics.json -- в JSON. Запросы обслуживаются по одному в отдельном потоке, соединение закрывается
+ * после ответа. К счетчикам и гистограммам Metrics добавляются значения, которые возвращает `gauges`
+ * (вызывается из потока сервера)
+ */
+class MetricsServer {
+public:
+    MetricsServer(int port, std::function<std::vector<Metrics::Gauge>()> gauges);
+
+    /*
+     * Останавливает прием запросов
+     */
+    ~MetricsServer();
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+private:
+    void ServeLoop();
+
+    /*
+     * Прочитать запрос из принятого сокета `sock` и ответить на него
+     */
+    void HandleRequest(int sock);
+
+    const std::function<std::vector<Metrics::Gauge>()> gauges_;
+    int sock_;  // слушающий сокет
+    int wakeFd_;  // eventfd: деструктор будит поток сервера, ждущий в poll
+    std::thread thread_;
+};
@@ -0,0 +1,79 @@
+#include "peer.h"
+#include <arpa/inet.h>
+#include <cstring>
+#include <netinet/in.h>
+
+Peer Peer::FromCompact(const char* data, int family) {
+    Peer peer;
+    peer.family = family;
+    const size_t addressLength = family == AF_INET6 ? 16 : 4;
+    std::memcpy(peer.address.data(), data, addressLength);
+    peer.port = static_cast<uint16_t>((static_cast<unsigned char>(data[addressLength]) << 8) |
+                                      static_cast<unsigned char>(data[addressLength + 1]));
+    return peer;
+}
+
+std::string Peer::ToCompact() const {
+    std::string result(reinterpret_cast<const char*>(address.data()), family == AF_INET6 ? 16 : 4);
+    result += static_cast<char>(port >> 8);
+    result += static_cast<char>(port & 0xFF);
+    return result;
+}
+
+bool Peer::FromString(std::string_view ip, uint16_t port, Peer& peer) {
+    const std::string text(ip);
+    peer = Peer();
+    peer.port = port;
+    if (inet_pton(AF_INET, text.c_str(), peer.address.data()) == 1) {
+        peer.family = AF_INET;
+        return true;
+    }
+    if (inet_pton(AF_INET6, text.c_str(), peer.address.data()) == 1) {
+        peer.family = AF_INET6;
+        return true;
+    }
+    return false;
+}
+
+Peer Peer::FromSockaddr(const sockaddr* address) {
+    Peer peer;
+    if (address->sa_family == AF_INET6) {
+        const auto* address6 = reinterpret_cast<const sockaddr_in6*>(address);
+        peer.port = ntohs(address6->sin6_port);
+        if (IN6_IS_ADDR_V4MAPPED(&address6->sin6_addr)) {
+            peer.family = AF_INET;
+            std::memcpy(peer.address.data(), address6->sin6_addr.s6_addr + 12, 4);
+        } else {
+            peer.family = AF_INET6;
+            std::memcpy(peer.address.data(), address6->sin6_addr.s6_addr, 16);
+        }
+        return peer;
+    }
+    const auto* address4 = reinterpret_cast<const sockaddr_in*>(address);
+    peer.family = AF_INET;
+    peer.port = ntohs(address4->sin_port);
+    std::memcpy(peer.address.data(), &address4->sin_addr, 4);
+    return peer;
+}
+
+socklen_t Peer::ToSockaddr(sockaddr_storage& storage) const {
+    std::memset(&storage, 0, sizeof(storage));
+    if (family == AF_INET6) {
+        auto* address6 = reinterpret_cast<sockaddr_in6*>(&storage);
+        address6->sin6_family = AF_INET6;
+        address6->sin6_port = htons(port);
+        std::memcpy(address6->sin6_addr.s6_addr, address.data(), 16);
+        return sizeof(sockaddr_in6);
+    }
+    auto* address4 = reinterpret_cast<sockaddr_in*>(&storage);
+    address4->sin_family = AF_INET;
+    address4->sin_port = htons(port);
+    std::memcpy(&address4->sin_addr, address.data(), 4);
+    return sizeof(sockaddr_in);
+}
+
+std::string Peer::Ip() const {
+    char buffer[INET6_ADDRSTRLEN] = {};
+    inet_ntop(family, address.data(), buffer, sizeof(buffer));
+    return buffer;
+}
@@ -1,8 +1,57 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <string_view>
+#include <sys/socket.h>
 
+/*
+ * Адрес пира. Хранится в двоичном виде, как его присылает трекер в компактном формате,
+ * поэтому разбор списка пиров не требует ни строк, ни inet_pton
+ */
 struct Peer {
-    std::string ip;
-    int port;
+    int family = AF_INET;  // AF_INET или AF_INET6
+    std::array<uint8_t, 16> address{};  // для IPv4 заняты первые 4 байта; порядок байт сетевой
+    uint16_t port = 0;
+
+    /*
+     * Компактная запись: 4 байта IPv4 или 16 байт IPv6, затем 2 байта порта, все в порядке байт сети
+     * https://www.bittorrent.org/beps/bep_0023.html, https://www.bittorrent.org/beps/bep_0007.html
+     */
+    static Peer FromCompact(const char* data, int family);
+
+    /*
+     * Компактная запись адреса: 6 байт для IPv4, 18 байт для IPv6
+     */
+    std::string ToCompact() const;
+
+    /*
+     * Текстовый адрес IPv4 или IPv6. Возвращает false, если `ip` не является адресом (например, это имя хоста)
+     */
+    static bool FromString(std::string_view ip, uint16_t port, Peer& peer);
+
+    /*
+     * Адрес из sockaddr_in или sockaddr_in6 (IPv4, отображенный в IPv6, приводится к IPv4)
+     */
+    static Peer FromSockaddr(const sockaddr* address);
+
+    /*
+     * Заполнить sockaddr для connect, возвращает длину структуры
+     */
+    socklen_t ToSockaddr(sockaddr_storage& storage) const;
+
+    std::string Ip() const;
+
+    bool operator==(const Peer& other) const = default;
+};
+
+template <>
+struct std::hash<Peer> {
+    size_t operator()(const Peer& peer) const noexcept {
+        size_t result = std::hash<std::string_view>()(
+            std::string_view(reinterpret_cast<const char*>(peer.address.data()), peer.address.size()));
+        return result ^ (static_cast<size_t>(peer.port) << 1) ^ static_cast<size_t>(peer.family);
+    }
 };
@@ -1,6 +1,8 @@
 #include "byte_tools.h"
 #include "peer_connect.h"
 #include "message.h"
+#include "bencode.h"
+#include "metrics.h"
 #include <iostream>
 #include <sstream>
 #include <utility>
@@ -9,6 +11,62 @@
 using namespace std::chrono_literals;
 #define BYTESIZE 8;
 
+namespace {
+// бит протокола расширений в reserved handshake: 0x10 в байте 5 (20-й бит с конца)
+constexpr size_t EXTENSION_BYTE = 5;
+constexpr char EXTENSION_BIT = 0x10;
+constexpr uint8_t EXTENDED_HANDSHAKE_ID = 0;
+// id, под которым мы принимаем ut_pex; пир узнает его из нашего extension handshake
+constexpr uint8_t UT_PEX_ID = 1;
+// BEP 11: не чаще раза в минуту и не больше 50 добавленных и 50 закрытых пиров в сообщении
+constexpr std::chrono::seconds PEX_INTERVAL(60);
+constexpr size_t MAX_PEX_PEERS = 50;
+// бит Fast extension: 0x04 в последнем байте reserved
+constexpr size_t FAST_BYTE = 7;
+constexpr char FAST_BIT = 0x04;
+// сколько частей разрешаем качать без unchoke (k из BEP 6) и сколько таких разрешений принимаем от пира
+constexpr size_t ALLOWED_FAST_COUNT = 10;
+constexpr size_t MAX_ALLOWED_FAST = 64;
+constexpr size_t MAX_SUGGESTED = 16;
+// пир без choke отклоняет запрос за запросом: соединение бесполезно
+constexpr size_t MAX_REJECTED_REQUESTS = 16;
+
+std::string ExtendedMessage(uint8_t extensionId, const std::string& payload) {
+    return Message::Init(MessageId::Extended, static_cast<char>(extensionId) + payload).ToString();
+}
+
+// пиры семейства `family` из компактной строки `compact`, не больше MAX_PEX_PEERS
+void ParsePexPeers(const Bencode::Node* compact, int family, std::vector<Peer>& peers) {
+    if (compact == nullptr || !compact->IsString()) {
+        return;
+    }
+    const size_t stride = family == AF_INET6 ? 18 : 6;
+    for (size_t offset = 0, count = 0; offset + stride <= compact->string.size() && count < MAX_PEX_PEERS;
+         offset += stride, ++count) {
+        peers.push_back(Peer::FromCompact(compact->string.data() + offset, family));
+    }
+}
+
+// ключи `key` (адреса) и `key.f` (флаги, если `withFlags`) для пиров семейства `family`
+void PutPexPeers(Bencode::Encoder& encoder, std::string_view key, const std::vector<Peer>& peers, int family,
+                 bool withFlags) {
+    std::string compact;
+    size_t count = 0;
+    for (const Peer& peer : peers) {
+        if (peer.family == family) {
+            compact += peer.ToCompact();
+            ++count;
+        }
+    }
+    encoder.Key(key);
+    encoder.String(compact);
+    if (withFlags) {
+        encoder.Key(std::string(key) + ".f");
+        encoder.String(std::string(count, 0));
+    }
+}
+}
+
 
 /*
 -------------------------------------------------------------
@@ -24,26 +82,32 @@ PeerPiecesAvailability::PeerPiecesAvailability(std::string bitfield) :
     bitfield_(std::move(bitfield)) {}
 
 bool PeerPiecesAvailability::IsPieceAvailable(size_t pieceIndex) const {
-    if (pieceIndex > Size()){
-        throw std::out_of_range("Index out of range!");
+    if (all_) {
+        return true;
+    }
+    if (pieceIndex >= Size()){
+        return false;
     }
     size_t byteIndex = pieceIndex / BYTESIZE;
     size_t bitIndex = pieceIndex % BYTESIZE;
-    char byte = bitfield_[byteIndex];
-    bool bit = (byte >> bitIndex) & 1;
-    return bit;
+    // старший бит первого байта соответствует части с индексом 0
+    return (static_cast<unsigned char>(bitfield_[byteIndex]) >> (7 - bitIndex)) & 1;
 }
 
 
 void PeerPiecesAvailability::SetPieceAvailability(size_t pieceIndex) {
-    if (pieceIndex > Size()){
-        throw std::out_of_range("Index out of range!");
-    }
     size_t byteIndex = pieceIndex / BYTESIZE;
     size_t bitIndex = pieceIndex % BYTESIZE;
-    char byte = bitfield_[byteIndex];
-    byte |= ((byte >> bitIndex) | 1);
-    bitfield_[byteIndex] = byte;
+    if (byteIndex >= bitfield_.size()) {
+        // пир мог не прислать bitfield и сообщать о частях только через Have
+        bitfield_.resize(byteIndex + 1, 0);
+    }
+    bitfield_[byteIndex] = static_cast<char>(bitfield_[byteIndex] | (0x80 >> bitIndex));
+}
+
+void PeerPiecesAvailability::SetAllPiecesAvailable() {
+    all_ = true;
+    bitfield_.clear();
 }
 
 size_t PeerPiecesAvailability::Size() const {
@@ -60,12 +124,29 @@ size_t PeerPiecesAvailability::Size() const {
 */
 
 
-PeerConnect::PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage) :
-    socket_(TcpConnect(peer.ip, peer.port, 1000ms, 1000ms)), selfPeerId_(std::move(selfPeerId)), tf_(tf),
+PeerConnect::PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                         PeerExchange* exchange) :
+    socket_(TcpConnect(peer, 1000ms, 1000ms)), selfPeerId_(std::move(selfPeerId)), tf_(tf),
     pieceStorage_(pieceStorage), terminated_(false), choked_(true), pendingBlock_(false), failed_(false),
-    pieceInProgress_(nullptr) {}
+    pieceInProgress_(nullptr), incoming_(false), amChoking_(true), choking_(true), peerInterested_(false), downloadedBytes_(0), uploadedBytes_(0),
+    announcedPieces_(0), exchange_(exchange) {}
+
+PeerConnect::PeerConnect(int sock, const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                         PeerExchange* exchange) :
+    tf_(tf), socket_(TcpConnect(sock, peer, 1000ms)), selfPeerId_(std::move(selfPeerId)), terminated_(false),
+    choked_(true), pieceInProgress_(nullptr), pieceStorage_(pieceStorage), pendingBlock_(false), failed_(false),
+    incoming_(true), amChoking_(true), choking_(true), peerInterested_(false), downloadedBytes_(0), uploadedBytes_(0),
+    announcedPieces_(0), exchange_(exchange) {}
 
 void PeerConnect::Run() {
+    if (incoming_) {
+        // переподключиться к входящему пиру мы не можем
+        if (EstablishConnection()) {
+            MainLoop();
+        }
+        Terminate();
+        return;
+    }
     while(!terminated_.load()){
         if (EstablishConnection()) {
             // std::cout << "Connection established to peer" << std::endl;
@@ -79,6 +160,8 @@ void PeerConnect::Run() {
 
 void PeerConnect::Terminate() {
     terminated_.store(true);
+    // соединение, ждущее данных от пира, выходит сразу, а не по таймауту чтения
+    socket_.Interrupt();
     // std::cerr << "Terminate" << std::endl;
 }
 
@@ -86,19 +169,68 @@ bool PeerConnect::Failed() const {
     return failed_;
 }
 
+bool PeerConnect::IsTerminated() const {
+    return terminated_.load();
+}
+
+void PeerConnect::SetChoking(bool choking) {
+    choking_.store(choking);
+}
+
+bool PeerConnect::IsPeerInterested() const {
+    return peerInterested_.load();
+}
+
+uint64_t PeerConnect::DownloadedBytes() const {
+    return downloadedBytes_.load();
+}
+
+uint64_t PeerConnect::UploadedBytes() const {
+    return uploadedBytes_.load();
+}
+
+const Peer& PeerConnect::GetPeer() const {
+    return socket_.GetPeer();
+}
+
+size_t PeerConnect::OutstandingRequests() const {
+    return pendingBlock_.load() ? 1 : 0;
+}
+
+bool PeerConnect::IsChoked() const {
+    return choked_.load();
+}
+
+void PeerConnect::SetChoked(bool choked) {
+    const auto now = std::chrono::steady_clock::now();
+    if (choked && !choked_) {
+        chokedSince_ = now;
+    } else if (!choked && choked_) {
+        Metrics::Observe(Metrics::Histogram::ChokedTime, now - chokedSince_);
+    }
+    choked_ = choked;
+}
 
-void PeerConnect::PerformHandshake() {
-    socket_.EstablishConnection();
 
+std::string PeerConnect::HandshakeMessage() const {
     std::string handshakeMessage;
     handshakeMessage.reserve(68);
 
     handshakeMessage += static_cast<char>(19); // 1 - pstrlen
     handshakeMessage += "BitTorrent protocol"; // 19 - pstr
-    handshakeMessage += std::string(8, 0); // 8 - reserved (0)
+    std::string reserved(8, 0); // 8 - reserved
+    reserved[EXTENSION_BYTE] = EXTENSION_BIT;
+    reserved[FAST_BYTE] = FAST_BIT;
+    handshakeMessage += reserved;
     handshakeMessage += tf_.infoHash; // 20 - info_hash
     handshakeMessage += selfPeerId_; // 20 - peer_id
+    return handshakeMessage;
+}
 
+void PeerConnect::PerformHandshake() {
+    socket_.EstablishConnection();
+
+    std::string handshakeMessage = HandshakeMessage();
     socket_.SendData(handshakeMessage);
 
     std::string ans = socket_.ReceiveData(handshakeMessage.size());
@@ -106,16 +238,302 @@ void PeerConnect::PerformHandshake() {
     if (static_cast<int>(ans[0]) != 19 || ans.substr(1, 19) != "BitTorrent protocol") {
         throw std::runtime_error("Failed handshake!");
     }
+    peerId_ = ans.substr(48, 20);
+    // адрес из PEX или DHT может оказаться нашим собственным
+    if (peerId_ == selfPeerId_) {
+        throw std::runtime_error("Connected to ourselves!");
+    }
+    peerSupportsExtensions_ = (ans[20 + EXTENSION_BYTE] & EXTENSION_BIT) != 0;
+    peerPexId_ = 0;
+    pexSent_.clear();
+    lastPex_ = {};
+    fastExtension_ = (ans[20 + FAST_BYTE] & FAST_BIT) != 0;
+    allowedFast_.clear();
+    allowedFastForPeer_.clear();
+    suggested_.clear();
+    rejectedRequests_ = 0;
+    chokedSince_ = std::chrono::steady_clock::now();
+}
+
+void PeerConnect::AcceptHandshake() {
+    std::string handshake = socket_.ReceiveData(68);
+    if (static_cast<int>(handshake[0]) != 19 || handshake.substr(1, 19) != "BitTorrent protocol") {
+        throw std::runtime_error("Failed handshake!");
+    }
+    if (handshake.substr(28, 20) != tf_.infoHash) {
+        throw std::runtime_error("Peer requested another torrent!");
+    }
+    peerId_ = handshake.substr(48, 20);
+    peerSupportsExtensions_ = (handshake[20 + EXTENSION_BYTE] & EXTENSION_BIT) != 0;
+    fastExtension_ = (handshake[20 + FAST_BYTE] & FAST_BIT) != 0;
+
+    socket_.SendData(HandshakeMessage());
+}
+
+void PeerConnect::SendExtendedHandshake() {
+    if (exchange_ == nullptr || !peerSupportsExtensions_) {
+        return;
+    }
+    Bencode::Encoder handshake;
+    handshake.BeginDict();
+    handshake.Key("m");
+    handshake.BeginDict();
+    handshake.Key("ut_pex");
+    handshake.Integer(UT_PEX_ID);
+    handshake.End();
+    if (exchange_->ListenPort() != 0) {
+        handshake.Key("p");
+        handshake.Integer(exchange_->ListenPort());
+    }
+    handshake.End();
+    socket_.SendData(ExtendedMessage(EXTENDED_HANDSHAKE_ID, handshake.Data()));
+}
+
+void PeerConnect::HandleExtended(std::string_view payload) {
+    if (exchange_ == nullptr || payload.empty()) {
+        return;
+    }
+    const uint8_t extensionId = payload[0];
+    Bencode::Node dict;
+    try {
+        dict = Bencode::Decode(payload.substr(1));
+    } catch (const std::invalid_argument&) {
+        // неразборчивое сообщение расширения не повод рвать соединение
+        return;
+    }
+    if (extensionId == EXTENDED_HANDSHAKE_ID) {
+        const Bencode::Node* messages = dict.Find("m");
+        const Bencode::Node* pex = messages != nullptr ? messages->Find("ut_pex") : nullptr;
+        peerPexId_ = pex != nullptr && pex->IsInteger() && pex->integer > 0 && pex->integer < 256 ? pex->integer : 0;
+        // входящий пир подключился с временного порта; в PEX о нем можно сообщать, только если он назвал свой порт
+        const Bencode::Node* port = dict.Find("p");
+        if (incoming_ && !listenAddress_ && port != nullptr && port->IsInteger() && port->integer > 0 &&
+            port->integer <= 0xFFFF) {
+            Peer peer = socket_.GetPeer();
+            peer.port = static_cast<uint16_t>(port->integer);
+            listenAddress_ = peer;
+            exchange_->Connected(peer);
+        }
+    } else if (extensionId == UT_PEX_ID) {
+        std::vector<Peer> peers;
+        ParsePexPeers(dict.Find("added"), AF_INET, peers);
+        ParsePexPeers(dict.Find("added6"), AF_INET6, peers);
+        exchange_->AddPeers(peers);
+    }
+}
+
+void PeerConnect::SendPex() {
+    const auto now = std::chrono::steady_clock::now();
+    if (peerPexId_ == 0 || now - lastPex_ < PEX_INTERVAL) {
+        return;
+    }
+    lastPex_ = now;
+    const Peer self = listenAddress_.value_or(socket_.GetPeer());
+    std::unordered_set<Peer> current;
+    for (const Peer& peer : exchange_->ConnectedPeers()) {
+        if (!(peer == self)) {
+            current.insert(peer);
+        }
+    }
+    std::vector<Peer> added, dropped;
+    for (const Peer& peer : current) {
+        if (added.size() < MAX_PEX_PEERS && !pexSent_.contains(peer)) {
+            added.push_back(peer);
+        }
+    }
+    for (const Peer& peer : pexSent_) {
+        if (dropped.size() < MAX_PEX_PEERS && !current.contains(peer)) {
+            dropped.push_back(peer);
+        }
+    }
+    if (added.empty() && dropped.empty()) {
+        return;
+    }
+    for (const Peer& peer : added) {
+        pexSent_.insert(peer);
+    }
+    for (const Peer& peer : dropped) {
+        pexSent_.erase(peer);
+    }
+    // ключи в порядке возрастания байт
+    Bencode::Encoder pex;
+    pex.BeginDict();
+    PutPexPeers(pex, "added", added, AF_INET, true);
+    PutPexPeers(pex, "added6", added, AF_INET6, true);
+    PutPexPeers(pex, "dropped", dropped, AF_INET, false);
+    PutPexPeers(pex, "dropped6", dropped, AF_INET6, false);
+    pex.End();
+    socket_.SendData(ExtendedMessage(peerPexId_, pex.Data()));
+}
+
+void PeerConnect::SendBitfield() {
+    std::vector<size_t> saved = pieceStorage_.GetPiecesSavedToDiscSince(0);
+    announcedPieces_ = saved.size();
+    if (fastExtension_ && (saved.empty() || saved.size() == tf_.pieceHashes.size())) {
+        // с Fast extension первым сообщением после handshake должно быть bitfield, HaveAll или HaveNone
+        socket_.SendData(Message::Init(saved.empty() ? MessageId::HaveNone : MessageId::HaveAll, "").ToString());
+    } else if (!saved.empty()) {
+        std::string bitfield((tf_.pieceHashes.size() + 7) / 8, 0);
+        for (size_t index : saved) {
+            bitfield[index / 8] = static_cast<char>(bitfield[index / 8] | (0x80 >> (index % 8)));
+        }
+        socket_.SendData(Message::Init(MessageId::BitField, bitfield).ToString());
+    }
+    if (!saved.empty()) {
+        SendAllowedFast();
+    }
+}
+
+void PeerConnect::SendAllowedFast() {
+    const Peer& peer = socket_.GetPeer();
+    const size_t piecesCount = tf_.pieceHashes.size();
+    if (!fastExtension_ || peer.family != AF_INET || piecesCount == 0) {
+        return;
+    }
+    // x = IPv4-адрес пира с обнуленным последним байтом, затем info_hash; индексы частей -- из цепочки SHA1 от x
+    std::string x(reinterpret_cast<const char*>(peer.address.data()), 3);
+    x += '\0';
+    x += tf_.infoHash;
+    const size_t count = std::min(ALLOWED_FAST_COUNT, piecesCount);
+    std::string messages;
+    while (allowedFastForPeer_.size() < count) {
+        x = CalculateSHA1(x);
+        for (size_t i = 0; i < 5 && allowedFastForPeer_.size() < count; ++i) {
+            const size_t index = BytesToInt(std::string_view(x).substr(i * 4, 4)) % piecesCount;
+            // о частях, которых у нас нет, не сообщаем: пир все равно не сможет их скачать
+            if (allowedFastForPeer_.insert(index).second && pieceStorage_.HasPiece(index)) {
+                messages += Message::Init(MessageId::AllowedFast, IntToBytes(static_cast<int>(index))).ToString();
+            }
+        }
+    }
+    if (!messages.empty()) {
+        socket_.SendData(messages);
+    }
+}
+
+void PeerConnect::SendHaves() {
+    std::vector<size_t> saved = pieceStorage_.GetPiecesSavedToDiscSince(announcedPieces_);
+    if (saved.empty()) {
+        return;
+    }
+    std::string haves;
+    for (size_t index : saved) {
+        haves += Message::Init(MessageId::Have, IntToBytes(static_cast<int>(index))).ToString();
+    }
+    socket_.SendData(haves);
+    announcedPieces_ += saved.size();
+}
+
+void PeerConnect::ApplyChoking() {
+    bool choking = choking_.load();
+    if (choking == amChoking_) {
+        return;
+    }
+    // после choke пир считает все свои запросы отброшенными, а мы и не держим очереди запросов
+    socket_.SendData(Message::Init(choking ? MessageId::Choke : MessageId::Unchoke, "").ToString());
+    amChoking_ = choking;
+}
+
+void PeerConnect::ServeRequest(const std::string& message) {
+    // больше 128 КиБ за один запрос не отдаем, обычный размер блока -- 16 КиБ
+    constexpr size_t MAX_REQUEST_LENGTH = 1 << 17;
+    if (message.size() < 13) {
+        return;
+    }
+    size_t pieceIndex = BytesToInt(message.substr(1, 4));
+    size_t begin = BytesToInt(message.substr(5, 4));
+    size_t length = BytesToInt(message.substr(9, 4));
+    const bool allowed = !amChoking_ || allowedFastForPeer_.contains(pieceIndex);
+    UploadBlock block;
+    if (!allowed || length > MAX_REQUEST_LENGTH || !pieceStorage_.GetUploadBlock(pieceIndex, begin, length, block)) {
+        RejectRequest(std::string_view(message).substr(1, 12));
+        return;
+    }
+    // заголовок сообщения piece: длина, id, индекс части и смещение блока
+    std::string header = IntToBytes(static_cast<int>(length + 9));
+    header += static_cast<char>(MessageId::Piece);
+    header += message.substr(1, 8);
+    socket_.SendData(header, true);
+    if (block.fd != -1) {
+        socket_.SendFile(block.fd, block.offset, length);
+    } else {
+        socket_.SendData(block.data);
+    }
+    uploadedBytes_ += length;
+    Metrics::Add(Metrics::Counter::UploadedBytes, length);
+}
+
+void PeerConnect::RejectRequest(std::string_view request) {
+    // без Fast extension пир сам считает запросы отброшенными, когда его чокают
+    if (fastExtension_) {
+        socket_.SendData(Message::Init(MessageId::RejectRequest, std::string(request)).ToString());
+    }
+}
+
+void PeerConnect::HandleReject(const std::string& message) {
+    if (message.size() < 13 || !pendingBlock_ || !pieceInProgress_ ||
+        BytesToInt(message.substr(1, 4)) != pieceInProgress_->GetIndex()) {
+        return;
+    }
+    Metrics::Add(Metrics::Counter::RequestsRejected);
+    pendingBlock_ = false;
+    // BEP 6 отклоняет один запрос: полученные блоки части остаются, заново запросим только этот
+    const size_t blockOffset = BytesToInt(message.substr(5, 4)) / (1 << 14);
+    if (blockOffset * (1 << 14) < pieceInProgress_->GetLength()) {
+        pieceInProgress_->MarkBlockMissing(blockOffset);
+    }
+    // зачокавший пир больше не отдаст эту часть, если не разрешил ее (AllowedFast): пусть ее докачают другие
+    if (choked_ && !allowedFast_.contains(pieceInProgress_->GetIndex())) {
+        ReturnPieceInProgress();
+    }
+    if (!choked_ && ++rejectedRequests_ >= MAX_REJECTED_REQUESTS) {
+        throw std::runtime_error("Peer rejects all requests");
+    }
+}
+
+void PeerConnect::ReturnPieceInProgress() {
+    if (!isPieceDownloadingNow_) {
+        return;
+    }
+    pieceStorage_.DecrementPieceInProgressCounter();
+    pieceStorage_.BackPieceToQueue(pieceInProgress_->GetIndex());
+    pieceInProgress_.reset();
+    isPieceDownloadingNow_ = false;
+}
+
+PiecePtr PeerConnect::PickPiece() {
+    std::erase_if(allowedFast_, [this](size_t index) {
+        return pieceStorage_.HasPiece(index);
+    });
+    std::vector<size_t> candidates;
+    candidates.swap(suggested_);
+    candidates.insert(candidates.end(), allowedFast_.begin(), allowedFast_.end());
+    for (size_t index : candidates) {
+        if (piecesAvailability_.IsPieceAvailable(index) && (!choked_ || allowedFast_.contains(index))) {
+            if (PiecePtr piece = pieceStorage_.GetPieceToDownload(index)) {
+                return piece;
+            }
+        }
+    }
+    return choked_ ? nullptr : pieceStorage_.GetNextPieceToDownload();
 }
 
 void PeerConnect::ReceiveBitfield() {
     Message receivedMessage = Message::Parse(socket_.ReceiveData());
+    // extension handshake пир может прислать раньше bitfield
+    while (receivedMessage.id == MessageId::Extended) {
+        HandleExtended(receivedMessage.payload);
+        receivedMessage = Message::Parse(socket_.ReceiveData());
+    }
     if (receivedMessage.id == MessageId::Unchoke){
-        choked_ = false;
+        SetChoked(false);
     }
     else if (receivedMessage.id == MessageId::BitField){
         piecesAvailability_ = PeerPiecesAvailability(receivedMessage.payload);
     }
+    else if (receivedMessage.id == MessageId::HaveAll) {
+        piecesAvailability_.SetAllPiecesAvailable();
+    }
 }
 
 void PeerConnect::SendInterested() {
@@ -125,9 +543,22 @@ void PeerConnect::SendInterested() {
 
 bool PeerConnect::EstablishConnection() {
     try {
+        if (incoming_) {
+            AcceptHandshake();
+            SendBitfield();
+            SendExtendedHandshake();
+            return true;
+        }
         PerformHandshake();
+        SendBitfield();
+        SendExtendedHandshake();
         ReceiveBitfield();
         SendInterested();
+        // мы подключились сами, значит пир принимает соединения на этом адресе и о нем можно сообщать другим
+        if (exchange_ != nullptr) {
+            listenAddress_ = socket_.GetPeer();
+            exchange_->Connected(*listenAddress_);
+        }
         return true;
     } catch (const std::exception& e) {
         // std::cerr << "Failed to establish connection with peer " << socket_.GetIp() << ":" <<
@@ -141,8 +572,15 @@ void PeerConnect::RequestPiece() {
     // Проверяем, есть ли уже часть в процессе загрузки
     if (!pieceInProgress_) {
         // Если нет, получаем следующую часть для скачивания
-        pieceInProgress_ = pieceStorage_.GetNextPieceToDownload();
+        pieceInProgress_ = PickPiece();
+        if (!pieceInProgress_) {
+            // бюджет памяти исчерпан (ждем, пока скачанные части запишутся на диск) или пир нас чокает
+            // и разрешенных частей у нас в очереди нет
+            return;
+        }
         isPieceDownloadingNow_ = true;
+    } else if (choked_ && !allowedFast_.contains(pieceInProgress_->GetIndex())) {
+        return;
     }
 
     // Получаем первый недостающий блок в части
@@ -167,6 +605,9 @@ void PeerConnect::RequestPiece() {
 
         // Отправляем запрос через сокет
         socket_.SendData(request);
+        requestSentAt_ = std::chrono::steady_clock::now();
+        requestedBlock_ = *block;
+        Metrics::Add(Metrics::Counter::RequestsSent);
 
         // Устанавливаем флаг, что запрос на блок отправлен
         pendingBlock_ = true;
@@ -177,8 +618,18 @@ void PeerConnect::MainLoop() {
     clearFlags();
     while (!terminated_.load()){
         std::string message;
+        bool blockReceivedInPlace = false;
+        bool idle = false;
         try{
-             message = socket_.ReceiveData();
+             message = ReceiveMessage(blockReceivedInPlace);
+        }
+        catch (const TimeoutError&) {
+            // Пир молчит, но мы ничего у него и не ждем (нас зачокали или закончился бюджет памяти на части):
+            // соединение не рвем, а пробуем запросить блок еще раз
+            if (pendingBlock_) {
+                break;
+            }
+            idle = true;
         }
         catch(...){
             // if (isPieceDownloadingNow_ && pieceInProgress_.get()->GetIndex() == pieceStorage_.TotalPiecesCount() - 1) {
@@ -188,72 +639,185 @@ void PeerConnect::MainLoop() {
             // }
             break;
         }
-        if (message.empty()){
+        if (!idle && message.empty()){
             failed_ = true;
             break;
         }
 
-        MessageId messageId = static_cast<MessageId>(message[0]);
-        switch (messageId){
-            case MessageId::Choke:{
-                choked_ = true;
-                failed_ = true;
-                }
-                break;
-            case MessageId::Unchoke:{
-                choked_ = false;
-                }
-                break;
-            case MessageId::Have:{
-                size_t pieceIndex = BytesToInt(message.substr(1, 4));
-                piecesAvailability_.SetPieceAvailability(pieceIndex);
-                }
-                break;
-            case MessageId::Piece:{
-                size_t offset = BytesToInt(message.substr(5, 4));
-                offset /= (1 << 14);
-
-                std::string data = message.substr(9);
-
-                if (!pieceInProgress_){ // Может ли нам вообще прийти MessageId::Piece до того, как мы сделаем запрос?
-                    pieceInProgress_ = pieceStorage_.GetNextPieceToDownload();
-                    isPieceDownloadingNow_ = true;
-                }
-                pieceInProgress_->SaveBlock(offset, data);
-                pendingBlock_ = false;
-
-                if (pieceInProgress_->AllBlocksRetrieved()) {
-                    pieceStorage_.PieceProcessed(pieceInProgress_);
-                    isPieceDownloadingNow_ = false;
-                    pieceInProgress_.reset();
-                }
-                }
-                break;
-            default:
-                break;
-        }
-        if (!choked_ && !pendingBlock_ 
-        && (!pieceStorage_.QueueIsEmpty() || isPieceDownloadingNow_)){
-            RequestPiece();
+        try {
+            MessageId messageId = idle ? MessageId::KeepAlive : static_cast<MessageId>(message[0]);
+            switch (messageId){
+                case MessageId::Choke:{
+                    SetChoked(true);
+                    failed_ = true;
+                    }
+                    break;
+                case MessageId::Unchoke:{
+                    SetChoked(false);
+                    }
+                    break;
+                case MessageId::Interested:{
+                    peerInterested_ = true;
+                    }
+                    break;
+                case MessageId::NotInterested:{
+                    peerInterested_ = false;
+                    }
+                    break;
+                case MessageId::Have:{
+                    size_t pieceIndex = BytesToInt(message.substr(1, 4));
+                    piecesAvailability_.SetPieceAvailability(pieceIndex);
+                    }
+                    break;
+                case MessageId::BitField:{
+                    piecesAvailability_ = PeerPiecesAvailability(message.substr(1));
+                    }
+                    break;
+                case MessageId::HaveAll:{
+                    piecesAvailability_.SetAllPiecesAvailable();
+                    }
+                    break;
+                case MessageId::HaveNone:{
+                    piecesAvailability_ = PeerPiecesAvailability();
+                    }
+                    break;
+                case MessageId::RejectRequest:{
+                    HandleReject(message);
+                    }
+                    break;
+                case MessageId::AllowedFast:{
+                    size_t pieceIndex = message.size() >= 5 ? BytesToInt(message.substr(1, 4)) : tf_.pieceHashes.size();
+                    if (fastExtension_ && pieceIndex < tf_.pieceHashes.size() && allowedFast_.size() < MAX_ALLOWED_FAST) {
+                        allowedFast_.insert(pieceIndex);
+                    }
+                    }
+                    break;
+                case MessageId::SuggestPiece:{
+                    size_t pieceIndex = message.size() >= 5 ? BytesToInt(message.substr(1, 4)) : tf_.pieceHashes.size();
+                    if (fastExtension_ && pieceIndex < tf_.pieceHashes.size() && suggested_.size() < MAX_SUGGESTED) {
+                        suggested_.push_back(pieceIndex);
+                    }
+                    }
+                    break;
+                case MessageId::Request:{
+                    ServeRequest(message);
+                    }
+                    break;
+                case MessageId::Extended:{
+                    HandleExtended(std::string_view(message).substr(1));
+                    }
+                    break;
+                case MessageId::Piece:{
+                    if (message.size() < 9) {
+                        break;
+                    }
+                    const size_t length = blockReceivedInPlace ? requestedBlock_.length : message.size() - 9;
+                    const size_t pieceIndex = BytesToInt(message.substr(1, 4));
+                    if (!IsRequestedBlock(pieceIndex, BytesToInt(message.substr(5, 4)), length)) {
+                        // блок не запрашивали (или пир ответил на запрос, который мы уже сочли отклоненным):
+                        // сохранять его некуда, а чужая часть в нашем буфере испортила бы скачиваемую
+                        break;
+                    }
+                    const size_t offset = requestedBlock_.offset / (1 << 14);
+                    if (blockReceivedInPlace) {
+                        pieceInProgress_->MarkBlockRetrieved(offset);
+                    } else {
+                        pieceInProgress_->SaveBlock(offset, std::string_view(message).substr(9));
+                    }
+                    if (pendingBlock_) {
+                        Metrics::Observe(Metrics::Histogram::RequestRtt, std::chrono::steady_clock::now() - requestSentAt_);
+                    }
+                    pendingBlock_ = false;
+                    rejectedRequests_ = 0;
+
+                    if (pieceInProgress_->AllBlocksRetrieved()) {
+                        pieceStorage_.PieceProcessed(pieceInProgress_);
+                        isPieceDownloadingNow_ = false;
+                        pieceInProgress_.reset();
+                    }
+                    }
+                    break;
+                default:
+                    // Cancel: запросы обслуживаются сразу по приходу, отменять нечего
+                    break;
+            }
+            ApplyChoking();
+            SendHaves();
+            SendPex();
+            // пока пир нас чокает, можно качать только части, которые он разрешил (AllowedFast)
+            if ((!choked_ || !allowedFast_.empty()) && !pendingBlock_
+            && (!pieceStorage_.QueueIsEmpty() || isPieceDownloadingNow_)){
+                RequestPiece();
+            }
+        } catch (const std::exception&) {
+            // соединение разорвалось, пока мы отправляли пиру сообщения
+            break;
         }
     }
+    if (listenAddress_) {
+        exchange_->Disconnected(*listenAddress_);
+        listenAddress_.reset();
+    }
     if (isPieceDownloadingNow_){
         std::unique_lock lock(mutex_);
-        std::cout << "ВЕРНУЛИ ЧАСТЬ НОМЕР " << pieceInProgress_->GetIndex();
-        pieceInProgress_->Reset();
-        pieceStorage_.DecrementPieceInProgressCounter();
-        pieceStorage_.BackPieceToQueue(pieceInProgress_->GetIndex());
-        isPieceDownloadingNow_ = false;
+        ReturnPieceInProgress();
     }
 
 }
 
 
+bool PeerConnect::IsRequestedBlock(size_t pieceIndex, size_t begin, size_t length) const {
+    return pendingBlock_ && pieceInProgress_ && pieceIndex == pieceInProgress_->GetIndex() &&
+           begin == requestedBlock_.offset && length == requestedBlock_.length;
+}
+
+std::string PeerConnect::ReceiveMessage(bool& blockReceivedInPlace) {
+    blockReceivedInPlace = false;
+
+    // TimeoutError пропускаем наружу, только пока из сокета не прочитано ни байта этого сообщения
+    size_t length = BytesToInt(socket_.ReceiveData(4));
+    if (length == 0) {
+        return "";
+    }
+    try {
+        return ReceiveMessageBody(length, blockReceivedInPlace);
+    } catch (const TimeoutError& e) {
+        throw std::runtime_error(e.what());
+    }
+}
+
+std::string PeerConnect::ReceiveMessageBody(size_t length, bool& blockReceivedInPlace) {
+    constexpr size_t PIECE_HEADER_SIZE = 9; // 1 байт id + 4 байта индекс части + 4 байта смещение блока
+    std::string message = socket_.ReceiveData(std::min(length, PIECE_HEADER_SIZE));
+    if (length > PIECE_HEADER_SIZE && static_cast<MessageId>(message[0]) == MessageId::Piece) {
+        // для Choker считаем все полученные данные блоков, даже если блок нам уже не нужен
+        downloadedBytes_ += length - PIECE_HEADER_SIZE;
+        Metrics::Add(Metrics::Counter::DownloadedBytes, length - PIECE_HEADER_SIZE);
+    }
+    if (length > PIECE_HEADER_SIZE && static_cast<MessageId>(message[0]) == MessageId::Piece &&
+        IsRequestedBlock(BytesToInt(message.substr(1, 4)), BytesToInt(message.substr(5, 4)),
+                         length - PIECE_HEADER_SIZE)) {
+        char* destination = pieceInProgress_->BlockBuffer(requestedBlock_.offset / (1 << 14), requestedBlock_.length);
+        if (destination != nullptr) {
+            socket_.ReceiveInto(destination, length - PIECE_HEADER_SIZE);
+            blockReceivedInPlace = true;
+            return message;
+        }
+    }
+    if (length > message.size()) {
+        message += socket_.ReceiveData(length - message.size());
+    }
+    return message;
+}
+
 void PeerConnect::clearFlags() {
     failed_ = false;
     pendingBlock_ = false;
     pieceInProgress_ = nullptr;
     choked_ = true;
+    chokedSince_ = std::chrono::steady_clock::now();
+    amChoking_ = true;
+    peerInterested_ = false;
     // terminated_(false), choked_(true), pendingBlock_(false), failed_(false),
     // pieceInProgress_(nullptr)
 }
\ No newline at end of file
@@ -4,7 +4,11 @@
 #include "peer.h"
 #include "torrent_file.h"
 #include "piece_storage.h"
+#include "peer_exchange.h"
 #include <arpa/inet.h>
+#include <chrono>
+#include <optional>
+#include <unordered_set>
 #include "message.h"
 
 /*
@@ -30,12 +34,18 @@ public:
      */
     void SetPieceAvailability(size_t pieceIndex);
 
+    /*
+     * У пира есть все части (сообщение HaveAll): bitfield не хранится
+     */
+    void SetAllPiecesAvailable();
+
     /*
      * Сколько бит хранится в bitfield'е
      */
     size_t Size() const;
 private:
     std::string bitfield_;
+    bool all_ = false;
 };
 
 /*
@@ -44,7 +54,19 @@ private:
  */
 class PeerConnect {
 public:
-    PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage);
+    /*
+     * Исходящее соединение. Если задан `exchange`, с пиром обмениваемся адресами других пиров (ut_pex)
+     */
+    PeerConnect(const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                PeerExchange* exchange = nullptr);
+
+    /*
+     * Входящее соединение: пир `peer` сам подключился к нам, `sock` -- принятый сокет.
+     * Такое соединение используется только для раздачи: после handshake мы сообщаем пиру, какие части у нас есть,
+     * и отвечаем на его запросы. При разрыве соединения повторно не подключаемся
+     */
+    PeerConnect(int sock, const Peer& peer, const TorrentFile& tf, std::string selfPeerId, PieceStorage& pieceStorage,
+                PeerExchange* exchange = nullptr);
 
     /*
      * Основная функция, в которой будет происходить цикл общения с пиром.
@@ -52,12 +74,53 @@ public:
      */
     void Run();
 
+    /*
+     * Завершить соединение. Можно вызывать из любого потока: Run, ждущий данных от пира или места в буфере сокета
+     * для раздачи, выходит сразу
+     */
     void Terminate();
 
     /*
      * Соединение не удалось установить или оно было разорвано в результате ошибки.
      */
     bool Failed() const;
+
+    /*
+     * Соединение завершено и больше не будет установлено заново
+     */
+    bool IsTerminated() const;
+
+    /*
+     * Открыть (`choking` == false) или закрыть пиру раздачу. Вызывается из Choker в другом потоке,
+     * сообщение choke/unchoke отправляется из цикла общения с пиром
+     */
+    void SetChoking(bool choking);
+
+    /*
+     * Пир сообщил, что хочет у нас скачивать
+     */
+    bool IsPeerInterested() const;
+
+    /*
+     * Сколько байт данных блоков мы получили от пира и отдали ему за все время
+     */
+    uint64_t DownloadedBytes() const;
+    uint64_t UploadedBytes() const;
+
+    /*
+     * Адрес пира
+     */
+    const Peer& GetPeer() const;
+
+    /*
+     * Сколько запросов блоков послано пиру и еще не получено ответа
+     */
+    size_t OutstandingRequests() const;
+
+    /*
+     * Пир сейчас нас чокает
+     */
+    bool IsChoked() const;
 private:
     const TorrentFile& tf_;
     TcpConnect socket_;  // tcp-соединение с пиром
@@ -65,14 +128,73 @@ private:
     std::string peerId_;  // id пира, с которым мы общаемся в текущем соединении
     PeerPiecesAvailability piecesAvailability_;
     std::atomic<bool> terminated_;  // флаг, необходимый для завершения цикла общения с пиром
-    bool choked_;  // https://wiki.theory.org/BitTorrentSpecification#Overview
+    std::atomic<bool> choked_;  // https://wiki.theory.org/BitTorrentSpecification#Overview
     PiecePtr pieceInProgress_;
     PieceStorage& pieceStorage_;
-    bool pendingBlock_;  // уже послали запрос на скачивание части файла и ждем ответ
+    std::atomic<bool> pendingBlock_;  // уже послали запрос на скачивание части файла и ждем ответ
     bool failed_;  // соединение не удалось установить или оно было разорвано в результате ошибки
     bool isPieceDownloadingNow_ = false;
     std::mutex mutex_;
-    
+    const bool incoming_;  // пир подключился к нам сам
+    bool amChoking_;  // мы не отвечаем на запросы пира (так считает пир)
+    std::atomic<bool> choking_;  // решение Choker; отличие от amChoking_ означает, что пиру надо послать choke/unchoke
+    std::atomic<bool> peerInterested_;  // пир хочет у нас скачивать
+    std::atomic<uint64_t> downloadedBytes_;
+    std::atomic<uint64_t> uploadedBytes_;
+    size_t announcedPieces_;  // о скольких сохраненных частях (в порядке сохранения) мы уже сообщили пиру
+    PeerExchange* const exchange_;  // nullptr -- адресами пиров не обмениваемся
+    bool peerSupportsExtensions_ = false;  // пир выставил в handshake бит протокола расширений (BEP 10)
+    uint8_t peerPexId_ = 0;  // id сообщения ut_pex у пира из его extension handshake, 0 -- пир не поддерживает PEX
+    std::optional<Peer> listenAddress_;  // адрес пира, под которым соединение отмечено в exchange_
+    std::unordered_set<Peer> pexSent_;  // о каких пирах мы сообщили пиру и не сообщили, что соединение с ними закрыто
+    std::chrono::steady_clock::time_point lastPex_;
+    bool fastExtension_ = false;  // мы и пир поддерживаем Fast extension (BEP 6)
+    std::unordered_set<size_t> allowedFast_;  // части, которые пир разрешил у него качать, пока он нас чокает
+    std::unordered_set<size_t> allowedFastForPeer_;  // части, которые мы отдаем пиру, даже когда его чокаем
+    std::vector<size_t> suggested_;  // части, которые пир предложил скачать у него в первую очередь
+    size_t rejectedRequests_ = 0;  // отклоненных пиром запросов подряд
+    std::chrono::steady_clock::time_point requestSentAt_;  // когда послан запрос pendingBlock_ (для метрик)
+    Block requestedBlock_{};  // какой блок pieceInProgress_ запрошен запросом pendingBlock_
+    std::chrono::steady_clock::time_point chokedSince_;  // с какого момента пир нас чокает (для метрик)
+
+    /*
+     * Ответить на запрос `request` (индекс части, смещение, длина) сообщением RejectRequest, если пир понимает его
+     */
+    void RejectRequest(std::string_view request);
+
+    /*
+     * Пир отклонил запрос блока: блок снова становится недостающим, а если пир нас зачокал и часть не разрешена
+     * (AllowedFast), часть сразу возвращается в очередь, чтобы ее взял другой пир
+     */
+    void HandleReject(const std::string& message);
+
+    /*
+     * Сообщить пиру, какие части он может качать у нас, пока мы его чокаем (AllowedFast).
+     * Набор частей вычисляется из IPv4-адреса пира и info_hash, как описано в BEP 6
+     */
+    void SendAllowedFast();
+
+    /*
+     * Следующая часть для скачивания у этого пира: сначала предложенные пиром (SuggestPiece), затем разрешенные
+     * без unchoke (AllowedFast), затем из общей очереди. Пока пир нас чокает, только разрешенные
+     */
+    PiecePtr PickPiece();
+
+    /*
+     * Пир начал или перестал нас чокать; сколько он нас чокал, идет в метрики
+     */
+    void SetChoked(bool choked);
+
+    /*
+     * Вернуть недокачанную часть в очередь хранилища
+     */
+    void ReturnPieceInProgress();
+
+    /*
+     * Сообщение handshake с нашим info_hash и peer_id. В reserved выставлен бит протокола расширений
+     */
+    std::string HandshakeMessage() const;
+
     /*
      * Функция производит handshake.
      * - Подключиться к пиру по протоколу TCP
@@ -82,11 +204,59 @@ private:
      */
     void PerformHandshake();
 
+    /*
+     * Для входящего соединения: дождаться handshake пира, проверить info_hash и ответить своим handshake
+     */
+    void AcceptHandshake();
+
+    /*
+     * Отправить extension handshake, если пир поддерживает расширения: мы понимаем ut_pex и принимаем
+     * соединения на таком-то порту
+     * https://www.bittorrent.org/beps/bep_0010.html
+     */
+    void SendExtendedHandshake();
+
+    /*
+     * Обработать сообщение расширения (`payload` -- без id сообщения): extension handshake или ut_pex.
+     * Пиры из ut_pex передаются в exchange_
+     */
+    void HandleExtended(std::string_view payload);
+
+    /*
+     * Раз в минуту сообщить пиру, с какими пирами у торрента появились и закрылись соединения (ut_pex)
+     * https://www.bittorrent.org/beps/bep_0011.html
+     */
+    void SendPex();
+
+    /*
+     * Сообщить пиру, какие части у нас уже есть (сообщение bitfield). Если частей нет, ничего не посылается.
+     * С Fast extension вместо этого может быть послано HaveAll или HaveNone, а затем AllowedFast
+     */
+    void SendBitfield();
+
+    /*
+     * Послать пиру сообщения have о частях, сохраненных с момента прошлого bitfield или have
+     */
+    void SendHaves();
+
+    /*
+     * Отправить пиру choke или unchoke, если решение Choker изменилось
+     */
+    void ApplyChoking();
+
+    /*
+     * Ответить на запрос блока (сообщение request). Запрос игнорируется, если мы чокаем пира или части у нас нет.
+     * Тело блока отправляется через sendfile прямо из файла или из кэша раздачи (см. PieceStorage::GetUploadBlock)
+     */
+    void ServeRequest(const std::string& message);
+
     /*
      * - Провести handshake
      * - Получить bitfield с информацией о наличии у пира различных частей файла
      * - Сообщить пиру, что мы готовы получать от него данные (отправить interested)
-     * Возвращает true, если все три этапа прошли без ошибок
+     * Сразу после handshake пиру отправляется наш bitfield. Для входящего соединения выполняются только
+     * AcceptHandshake и SendBitfield.
+     * Возвращает true, если все этапы прошли без ошибок
      */
     bool EstablishConnection();
 
@@ -118,6 +288,26 @@ private:
      */
     void MainLoop();
 
+    /*
+     * Сообщение Piece с индексом части `pieceIndex`, смещением `begin` и `length` байтами данных отвечает
+     * на наш ожидающий ответа запрос. Блоки, которые мы не запрашивали (или уже перестали ждать), отбрасываются
+     */
+    bool IsRequestedBlock(size_t pieceIndex, size_t begin, size_t length) const;
+
+    /*
+     * Прочитать из сокета очередное сообщение.
+     * Если это сообщение Piece с запрошенным блоком текущей части, данные блока читаются сразу в буфер части
+     * (см. Piece::BlockBuffer): в возвращаемой строке остается только заголовок
+     * (id, индекс и смещение), а `blockReceivedInPlace` выставляется в true.
+     * TimeoutError выбрасывается, только если пир не прислал ни байта нового сообщения
+     */
+    std::string ReceiveMessage(bool& blockReceivedInPlace);
+
+    /*
+     * Прочитать сообщение длиной `length` после того, как его длина уже прочитана
+     */
+    std::string ReceiveMessageBody(size_t length, bool& blockReceivedInPlace);
+
     void clearFlags();
 };
 
@@ -0,0 +1,37 @@
+#include "peer_exchange.h"
+
+PeerExchange::PeerExchange(uint16_t listenPort, PeersCallback onPeers) :
+    listenPort_(listenPort), onPeers_(std::move(onPeers)) {}
+
+void PeerExchange::Connected(const Peer& peer) {
+    std::lock_guard lock(mutex_);
+    ++connected_[peer];
+}
+
+void PeerExchange::Disconnected(const Peer& peer) {
+    std::lock_guard lock(mutex_);
+    auto it = connected_.find(peer);
+    if (it != connected_.end() && --it->second == 0) {
+        connected_.erase(it);
+    }
+}
+
+std::vector<Peer> PeerExchange::ConnectedPeers() const {
+    std::lock_guard lock(mutex_);
+    std::vector<Peer> peers;
+    peers.reserve(connected_.size());
+    for (const auto& [peer, count] : connected_) {
+        peers.push_back(peer);
+    }
+    return peers;
+}
+
+void PeerExchange::AddPeers(const std::vector<Peer>& peers) {
+    if (onPeers_ && !peers.empty()) {
+        onPeers_(peers);
+    }
+}
+
+uint16_t PeerExchange::ListenPort() const {
+    return listenPort_;
+}
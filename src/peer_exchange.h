@@ -0,0 +1,53 @@
+#pragma once
+
+#include "peer.h"
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Обмен пирами торрента с его пирами (ut_pex).
+ * https://www.bittorrent.org/beps/bep_0011.html
+ *
+ * Общий для всех соединений торрента: соединения отмечают здесь пиров, с которыми связь установлена, и раз в минуту
+ * рассылают своим пирам изменения этого списка. Пиры, присланные нам, передаются в `onPeers`, а оттуда в очередь
+ * соединений сессии (с пропуском тех, с кем соединение уже есть)
+ */
+class PeerExchange {
+public:
+    using PeersCallback = std::function<void(const std::vector<Peer>&)>;
+
+    /*
+     * `listenPort` -- порт для входящих соединений, который сообщается пирам в extension handshake (0 -- не принимаем)
+     */
+    PeerExchange(uint16_t listenPort, PeersCallback onPeers);
+
+    /*
+     * Соединение с пиром установлено. `peer` -- адрес, по которому пир принимает соединения
+     */
+    void Connected(const Peer& peer);
+
+    /*
+     * Соединение, отмеченное через Connected, закрыто
+     */
+    void Disconnected(const Peer& peer);
+
+    /*
+     * Пиры, с которыми сейчас есть соединение
+     */
+    std::vector<Peer> ConnectedPeers() const;
+
+    /*
+     * Пир прислал нам адреса других пиров. Вызывается из потоков соединений
+     */
+    void AddPeers(const std::vector<Peer>& peers);
+
+    uint16_t ListenPort() const;
+private:
+    const uint16_t listenPort_;
+    const PeersCallback onPeers_;
+    mutable std::mutex mutex_;
+    std::unordered_map<Peer, size_t> connected_;  // адрес -> число соединений с ним, guarded by mutex_
+};
@@ -0,0 +1,208 @@
+#include "peer_listener.h"
+#include "event_fd.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <limits>
+
+namespace {
+// торрент входящего соединения неизвестен, пока пир не прислал рукопожатие
+constexpr size_t UNKNOWN_OWNER = std::numeric_limits<size_t>::max();
+// длина рукопожатия до конца info_hash: pstrlen, pstr "BitTorrent protocol", reserved, info_hash
+constexpr size_t HANDSHAKE_PREFIX_LENGTH = 1 + 19 + 8 + 20;
+constexpr int HANDSHAKE_TIMEOUT_MS = 5000;
+
+/*
+ * Прочитать начало рукопожатия, не забирая его из сокета (MSG_PEEK): PeerConnect потом разберет его целиком
+ */
+bool PeekInfoHash(int sock, std::string& infoHash) {
+    char buffer[HANDSHAKE_PREFIX_LENGTH];
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDSHAKE_TIMEOUT_MS);
+    while (true) {
+        ssize_t received = recv(sock, buffer, sizeof(buffer), MSG_PEEK);
+        if (received == static_cast<ssize_t>(sizeof(buffer))) {
+            break;
+        }
+        if (received == 0 || (received < 0 && errno != EINTR)) {
+            return false;
+        }
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left.count() <= 0) {
+            return false;
+        }
+        // данные есть, но не все: ждем следующую порцию
+        if (received > 0) {
+            std::this_thread::sleep_for(std::min(left, std::chrono::milliseconds(10)));
+            continue;
+        }
+        pollfd readable = {sock, POLLIN, 0};
+        poll(&readable, 1, static_cast<int>(left.count()));
+    }
+    infoHash.assign(buffer + HANDSHAKE_PREFIX_LENGTH - 20, 20);
+    return true;
+}
+}
+
+PeerListener::PeerListener(int port, std::string selfPeerId, ConnectionPool& pool, size_t maxPeers) :
+    selfPeerId_(std::move(selfPeerId)), pool_(pool), maxPeers_(maxPeers), sock_(-1), wakeFd_(-1), stopped_(false), activePeers_(0) {
+    // один сокет IPv6 принимает и IPv4 (как v4-mapped адреса); без поддержки IPv6 слушаем только IPv4
+    int family = AF_INET6;
+    sock_ = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock_ < 0) {
+        family = AF_INET;
+        sock_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (sock_ < 0) {
+        throw std::runtime_error(std::string("Failed to create listening socket: ") + std::strerror(errno));
+    }
+    int reuse = 1;
+    setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_storage address{};
+    socklen_t addressLength;
+    if (family == AF_INET6) {
+        int v6only = 0;
+        setsockopt(sock_, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        auto* address6 = reinterpret_cast<sockaddr_in6*>(&address);
+        address6->sin6_family = AF_INET6;
+        address6->sin6_port = htons(port);
+        address6->sin6_addr = in6addr_any;
+        addressLength = sizeof(sockaddr_in6);
+    } else {
+        auto* address4 = reinterpret_cast<sockaddr_in*>(&address);
+        address4->sin_family = AF_INET;
+        address4->sin_port = htons(port);
+        address4->sin_addr.s_addr = htonl(INADDR_ANY);
+        addressLength = sizeof(sockaddr_in);
+    }
+    if (bind(sock_, reinterpret_cast<sockaddr*>(&address), addressLength) < 0 || listen(sock_, 64) < 0) {
+        std::string error = std::strerror(errno);
+        close(sock_);
+        throw std::runtime_error("Cannot listen on port " + std::to_string(port) + ": " + error);
+    }
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd_ < 0) {
+        std::string error = std::strerror(errno);
+        close(sock_);
+        throw std::runtime_error("Failed to create listener eventfd: " + error);
+    }
+    acceptThread_ = std::thread([this]() {
+        AcceptLoop();
+    });
+}
+
+PeerListener::~PeerListener() {
+    Stop();
+}
+
+void PeerListener::Stop() {
+    if (stopped_.exchange(true)) {
+        return;
+    }
+    SignalEventFd(wakeFd_);
+    acceptThread_.join();
+    close(sock_);
+    close(wakeFd_);
+    {
+        std::lock_guard lock(mutex_);
+        for (auto& connection : connections_) {
+            connection.peer->Terminate();
+        }
+    }
+}
+
+void PeerListener::AddTorrent(size_t owner, const TorrentFile& tf, PieceStorage& pieceStorage, Choker& choker,
+                              PeerExchange* exchange) {
+    std::lock_guard lock(mutex_);
+    torrents_.push_back({owner, &tf, &pieceStorage, &choker, exchange});
+}
+
+void PeerListener::RemoveTorrent(size_t owner) {
+    std::lock_guard lock(mutex_);
+    torrents_.erase(std::remove_if(torrents_.begin(), torrents_.end(), [owner](const Torrent& torrent) {
+        return torrent.owner == owner;
+    }), torrents_.end());
+    for (auto& connection : connections_) {
+        if (connection.owner == owner) {
+            connection.peer->Terminate();
+        }
+    }
+}
+
+size_t PeerListener::ActivePeersCount() const {
+    return activePeers_.load();
+}
+
+void PeerListener::AcceptLoop() {
+    while (!stopped_.load()) {
+        // Stop будит поток через wakeFd_, таймаут не нужен
+        pollfd fds[2] = {{sock_, POLLIN, 0}, {wakeFd_, POLLIN, 0}};
+        int result = poll(fds, 2, -1);
+        if (result <= 0 || !(fds[0].revents & POLLIN)) {
+            continue;
+        }
+        sockaddr_storage address{};
+        socklen_t addressLength = sizeof(address);
+        int sock = accept4(sock_, reinterpret_cast<sockaddr*>(&address), &addressLength, SOCK_CLOEXEC);
+        if (sock < 0) {
+            continue;
+        }
+        HandleConnection(sock, Peer::FromSockaddr(reinterpret_cast<sockaddr*>(&address)));
+    }
+}
+
+void PeerListener::HandleConnection(int sock, const Peer& peer) {
+    if (activePeers_.load() >= maxPeers_) {
+        close(sock);
+        return;
+    }
+    ++activePeers_;
+    bool started = pool_.TryRun(UNKNOWN_OWNER, [this, sock, peer]() {
+        ServeConnection(sock, peer);
+        --activePeers_;
+    });
+    if (!started) {
+        --activePeers_;
+        close(sock);
+    }
+}
+
+void PeerListener::ServeConnection(int sock, const Peer& peer) {
+    std::string infoHash;
+    if (!PeekInfoHash(sock, infoHash)) {
+        close(sock);
+        return;
+    }
+    std::shared_ptr<PeerConnect> connection;
+    Choker* choker = nullptr;
+    {
+        std::lock_guard lock(mutex_);
+        auto torrent = std::find_if(torrents_.begin(), torrents_.end(), [&infoHash](const Torrent& torrent) {
+            return torrent.tf->infoHash == infoHash;
+        });
+        if (torrent == torrents_.end() || stopped_.load()) {
+            close(sock);
+            return;
+        }
+        connection = std::make_shared<PeerConnect>(sock, peer, *torrent->tf, selfPeerId_, *torrent->pieceStorage,
+                                                   torrent->exchange);
+        choker = torrent->choker;
+        // завершившиеся соединения больше не нужны
+        connections_.erase(std::remove_if(connections_.begin(), connections_.end(), [](const Connection& connection) {
+            return connection.peer.use_count() == 1;
+        }), connections_.end());
+        connections_.push_back({torrent->owner, connection});
+    }
+    choker->AddPeer(connection);
+    try {
+        connection->Run();
+    } catch (const std::exception&) {
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "peer_connect.h"
+#include "choker.h"
+#include "connection_pool.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Прием входящих соединений от пиров, которые хотят скачивать у нас.
+ * Один TCP-порт на все торренты сессии: слушает его в отдельном потоке, по info_hash из рукопожатия пира
+ * находит торрент и запускает для соединения PeerConnect в режиме раздачи в общем пуле соединений.
+ * Если свободных потоков в пуле нет или входящих соединений уже `maxPeers`, соединение сразу закрывается.
+ * Кому из принятых пиров открыть раздачу, решает Choker торрента
+ */
+class PeerListener {
+public:
+    PeerListener(int port, std::string selfPeerId, ConnectionPool& pool, size_t maxPeers);
+
+    /*
+     * Останавливает прием и завершает все входящие соединения
+     */
+    ~PeerListener();
+
+    /*
+     * Принимать пиров торрента `tf`. `owner` -- номер торрента в пуле соединений.
+     * Через `exchange` (если задан) принятые пиры обмениваются с нами адресами других пиров
+     */
+    void AddTorrent(size_t owner, const TorrentFile& tf, PieceStorage& pieceStorage, Choker& choker,
+                    PeerExchange* exchange = nullptr);
+
+    /*
+     * Больше не принимать пиров торрента `owner` и завершить уже принятые соединения с ними
+     */
+    void RemoveTorrent(size_t owner);
+
+    /*
+     * Перестать принимать соединения и завершить уже принятые. Потоки соединений принадлежат пулу,
+     * их надо дождаться через ConnectionPool::Join
+     */
+    void Stop();
+
+    /*
+     * Сколько входящих соединений обслуживается сейчас
+     */
+    size_t ActivePeersCount() const;
+private:
+    struct Torrent {
+        size_t owner;
+        const TorrentFile* tf;
+        PieceStorage* pieceStorage;
+        Choker* choker;
+        PeerExchange* exchange;
+    };
+
+    struct Connection {
+        size_t owner;
+        std::shared_ptr<PeerConnect> peer;
+    };
+
+    void AcceptLoop();
+
+    /*
+     * Запустить обслуживание принятого сокета `sock` пира `peer` или закрыть его, если все места заняты
+     */
+    void HandleConnection(int sock, const Peer& peer);
+
+    /*
+     * Дождаться начала рукопожатия, найти торрент по info_hash и обслуживать пира до разрыва соединения
+     */
+    void ServeConnection(int sock, const Peer& peer);
+
+    const std::string selfPeerId_;
+    ConnectionPool& pool_;
+    const size_t maxPeers_;
+    int sock_;  // слушающий сокет
+    int wakeFd_;  // eventfd: Stop будит поток приема, ждущий в poll
+    std::atomic<bool> stopped_;
+    std::atomic<size_t> activePeers_;
+    mutable std::mutex mutex_;
+    std::vector<Torrent> torrents_;  // guarded by mutex_
+    std::vector<Connection> connections_;  // guarded by mutex_
+    std::thread acceptThread_;
+};
@@ -2,24 +2,27 @@
 #include "piece.h"
 #include <iostream>
 #include <algorithm>
+#include <cstring>
 
 namespace {
 constexpr size_t BLOCK_SIZE = 1 << 14;
 }
 
-Piece::Piece(size_t index, size_t length, std::string hash) :
-    index_(index), length_(length), hash_(std::move(hash)) {
+Piece::Piece(size_t index, size_t length, const PieceHash& hash) :
+    index_(index), length_(length), hash_(hash) {
     
     size_t numBlocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    blocks_.reserve(numBlocks);
     for (size_t i = 0; i < numBlocks; ++i) {
         uint32_t blockLength = std::min(BLOCK_SIZE, length - i * BLOCK_SIZE);
-        blocks_.emplace_back(Block{static_cast<uint32_t>(index), static_cast<uint32_t>(i * BLOCK_SIZE), blockLength, Block::Missing, ""});
+        blocks_.emplace_back(Block{static_cast<uint32_t>(index), static_cast<uint32_t>(i * BLOCK_SIZE), blockLength, Block::Missing});
     }
 }
 
 bool Piece::HashMatches() const {
-    std::unique_lock lock(mutex_);
-    return GetHash() == hash_;
+    PieceHash hash;
+    CalculateSHA1(GetData(), hash.data());
+    return hash == hash_;
 }
 
 Block* Piece::FirstMissingBlock(){
@@ -38,13 +41,16 @@ size_t Piece::GetIndex() const {
 }
 
 
-void Piece::SaveBlock(size_t blockOffset, std::string data) {
+void Piece::SaveBlock(size_t blockOffset, std::string_view data) {
     std::unique_lock lock(mutex_);
     if (blockOffset >= blocks_.size()) {
         throw std::out_of_range("Block offset out of range!");
     }
+    if (buffer_ == nullptr) {
+        throw std::runtime_error("Piece buffer is not attached!");
+    }
     Block& block = blocks_[blockOffset];
-    block.data = std::move(data);
+    std::memcpy(buffer_ + block.offset, data.data(), std::min<size_t>(data.size(), block.length));
     block.status = Block::Retrieved;
 }
 
@@ -58,14 +64,12 @@ bool Piece::AllBlocksRetrieved() const {
 }
 
 
-std::string Piece::GetData() const {
+std::string_view Piece::GetData() const {
     std::unique_lock lock(mutex_);
-    std::string data;
-    data.reserve(length_.load());
-    for (const auto& block : blocks_) {
-        data.append(block.data);
+    if (buffer_ == nullptr) {
+        return {};
     }
-    return data;
+    return std::string_view(buffer_, length_.load());
 }
 
 
@@ -74,7 +78,7 @@ std::string Piece::GetDataHash() const {
 }
 
 
-const std::string& Piece::GetHash() const {
+const PieceHash& Piece::GetHash() const {
     return hash_;
 }
 
@@ -83,6 +87,78 @@ void Piece::Reset(){
     std::unique_lock lock(mutex_);
     for (auto& block : blocks_) {
         block.status = Block::Missing;
-        block.data.clear();
     }
-}
\ No newline at end of file
+}
+
+void Piece::ResetPendingBlocks() {
+    std::unique_lock lock(mutex_);
+    for (auto& block : blocks_) {
+        if (block.status == Block::Pending) {
+            block.status = Block::Missing;
+        }
+    }
+}
+
+std::vector<std::pair<size_t, size_t>> Piece::RetrievedRanges() const {
+    std::unique_lock lock(mutex_);
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (const auto& block : blocks_) {
+        if (block.status != Block::Retrieved) {
+            continue;
+        }
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == block.offset) {
+            ranges.back().second += block.length;
+        } else {
+            ranges.emplace_back(block.offset, block.length);
+        }
+    }
+    return ranges;
+}
+
+void Piece::AttachBuffer(char* buffer) {
+    std::unique_lock lock(mutex_);
+    ownBuffer_.Release();
+    buffer_ = buffer;
+}
+
+void Piece::AttachBuffer(PieceBuffer buffer) {
+    std::unique_lock lock(mutex_);
+    ownBuffer_ = std::move(buffer);
+    buffer_ = ownBuffer_.Data();
+}
+
+void Piece::ReleaseBuffer() {
+    std::unique_lock lock(mutex_);
+    ownBuffer_.Release();
+    buffer_ = nullptr;
+}
+
+char* Piece::BlockBuffer(size_t blockOffset, size_t length) {
+    std::unique_lock lock(mutex_);
+    if (buffer_ == nullptr || blockOffset >= blocks_.size() || blocks_[blockOffset].length != length) {
+        return nullptr;
+    }
+    return buffer_ + blocks_[blockOffset].offset;
+}
+
+void Piece::MarkBlockRetrieved(size_t blockOffset) {
+    std::unique_lock lock(mutex_);
+    if (blockOffset >= blocks_.size()) {
+        throw std::out_of_range("Block offset out of range!");
+    }
+    blocks_[blockOffset].status = Block::Retrieved;
+}
+
+void Piece::MarkBlockMissing(size_t blockOffset) {
+    std::unique_lock lock(mutex_);
+    if (blockOffset >= blocks_.size()) {
+        throw std::out_of_range("Block offset out of range!");
+    }
+    if (blocks_[blockOffset].status == Block::Pending) {
+        blocks_[blockOffset].status = Block::Missing;
+    }
+}
+
+size_t Piece::GetLength() const {
+    return length_.load();
+}
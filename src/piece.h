@@ -6,6 +6,9 @@
 #include <memory>
 #include <mutex>
 #include <atomic>
+#include <string_view>
+#include "buffer_pool.h"
+#include "torrent_file.h"
 
 /*
  * Части файла скачиваются не за одно сообщение, а блоками размером 2^14 байт или меньше (последний блок обычно меньше)
@@ -22,11 +25,13 @@ struct Block {
     uint32_t offset;  // смещение начала блока относительно начала части файла в байтах
     uint32_t length;  // длина блока в байтах
     Status status;  // статус загрузки данного блока
-    std::string data;  // бинарные данные
 };
 
 /*
- * Часть скачиваемого файла
+ * Часть скачиваемого файла.
+ * Данные всех блоков лежат в одном непрерывном буфере части, каждый блок пишется сразу по своему смещению.
+ * Буфер привязывается, когда часть берут на скачивание (см. AttachBuffer), и отдается обратно после записи на диск.
+ * Объекты частей PieceStorage создает, только когда часть берут на скачивание, и удаляет после записи
  */
 class Piece {
 public:
@@ -35,7 +40,7 @@ public:
      * length -- длина части файла. Все части, кроме последней, имеют длину, равную `torrentFile.pieceLength`
      * hash -- хеш-сумма части файла, взятая из `torrentFile.pieceHashes`
      */
-    Piece(size_t index, size_t length, std::string hash);
+    Piece(size_t index, size_t length, const PieceHash& hash);
 
     /*
      * Совпадает ли хеш скачанных данных с ожидаемым
@@ -55,7 +60,7 @@ public:
     /*
      * Сохранить скачанные данные для какого-то блока
      */
-    void SaveBlock(size_t blockOffset, std::string data);
+    void SaveBlock(size_t blockOffset, std::string_view data);
 
     /*
      * Скачали ли уже все блоки
@@ -63,9 +68,9 @@ public:
     bool AllBlocksRetrieved() const;
 
     /*
-     * Получить скачанные данные для части файла
+     * Получить скачанные данные для части файла (без копирования, указывает в буфер части)
      */
-    std::string GetData() const;
+    std::string_view GetData() const;
 
     /*
      * Посчитать хеш по скачанным данным
@@ -75,18 +80,67 @@ public:
     /*
      * Получить хеш для части из .torrent файла
      */
-    const std::string& GetHash() const;
+    const PieceHash& GetHash() const;
 
     /*
-     * Удалить все скачанные данные и отметить все блоки как Missing
+     * Отметить все блоки как Missing (буфер остается привязанным)
      */
     void Reset();
 
+    /*
+     * Отметить запрошенные, но не полученные блоки как Missing. Полученные блоки остаются Retrieved
+     */
+    void ResetPendingBlocks();
+
+    /*
+     * Непрерывные диапазоны полученных блоков: пары (смещение в части, длина)
+     */
+    std::vector<std::pair<size_t, size_t>> RetrievedRanges() const;
+
+    /*
+     * Привязать часть к внешнему буферу длиной `GetLength()` байт (например, к ее месту в отображенном в память
+     * выходном файле). Данные блоков сохраняются сразу в этот буфер
+     */
+    void AttachBuffer(char* buffer);
+
+    /*
+     * Привязать часть к буферу из пула. Часть владеет им до ReleaseBuffer
+     */
+    void AttachBuffer(PieceBuffer buffer);
+
+    /*
+     * Отвязать буфер (буфер из пула возвращается в пул)
+     */
+    void ReleaseBuffer();
+
+    /*
+     * Указатель на место блока в буфере части или nullptr, если буфер не привязан или длина блока не равна `length`.
+     * Позволяет читать данные блока из сокета сразу в итоговое место
+     */
+    char* BlockBuffer(size_t blockOffset, size_t length);
+
+    /*
+     * Отметить блок как скачанный, когда его данные уже записаны по адресу из `BlockBuffer`
+     */
+    void MarkBlockRetrieved(size_t blockOffset);
+
+    /*
+     * Снова отметить запрошенный блок как Missing (пир отклонил запрос). Полученный блок не трогается
+     */
+    void MarkBlockMissing(size_t blockOffset);
+
+    /*
+     * Длина части файла в байтах
+     */
+    size_t GetLength() const;
+
 private:
     mutable std::mutex mutex_;
     const std::atomic<size_t> index_, length_;
-    const std::string hash_;
+    const PieceHash hash_;
     std::vector<Block> blocks_;
+    PieceBuffer ownBuffer_;  // буфер из пула, если часть владеет своими данными
+    char* buffer_ = nullptr;  // буфер с данными части: ownBuffer_ или место в отображенном файле
 };
 
 using PiecePtr = std::shared_ptr<Piece>;
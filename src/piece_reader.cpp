@@ -0,0 +1,109 @@
+#include "piece_reader.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+namespace {
+void ReadFully(int fd, char* buffer, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t result = pread(fd, buffer + done, length - done, offset + static_cast<off_t>(done));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            throw std::runtime_error(std::string("Error in pread: ") + std::strerror(errno));
+        }
+        if (result == 0) {
+            throw std::runtime_error("Unexpected end of file in pread");
+        }
+        done += result;
+    }
+}
+}
+
+
+TempFileReader::TempFileReader(const std::string& fileName) : fd_(open(fileName.c_str(), O_RDONLY | O_CLOEXEC)) {
+    if (fd_ == -1) {
+        throw std::runtime_error("Cannot open " + fileName + " for reading: " + std::strerror(errno));
+    }
+}
+
+TempFileReader::~TempFileReader() {
+    close(fd_);
+}
+
+void TempFileReader::Read(uint64_t offset, char* buffer, size_t length) const {
+    ReadFully(fd_, buffer, length, static_cast<off_t>(offset));
+}
+
+bool TempFileReader::Locate(uint64_t offset, size_t, int& fd, off_t& fileOffset) const {
+    fd = fd_;
+    fileOffset = static_cast<off_t>(offset);
+    return true;
+}
+
+
+MultiFileReader::MultiFileReader(const std::vector<std::pair<std::filesystem::path, size_t>>& files) {
+    uint64_t begin = 0;
+    for (const auto& [path, length] : files) {
+        if (length == 0) {
+            continue;
+        }
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            std::string error = std::strerror(errno);
+            for (const Span& span : spans_) {
+                close(span.fd);
+            }
+            throw std::runtime_error("Cannot open " + path.string() + " for reading: " + error);
+        }
+        spans_.push_back({begin, length, fd});
+        begin += length;
+    }
+}
+
+MultiFileReader::~MultiFileReader() {
+    for (const Span& span : spans_) {
+        close(span.fd);
+    }
+}
+
+std::vector<MultiFileReader::Span>::const_iterator MultiFileReader::FindSpan(uint64_t offset) const {
+    auto it = std::upper_bound(spans_.begin(), spans_.end(), offset, [](uint64_t value, const Span& span) {
+        return value < span.begin;
+    });
+    if (it == spans_.begin()) {
+        return spans_.end();
+    }
+    --it;
+    return offset < it->begin + it->length ? it : spans_.end();
+}
+
+void MultiFileReader::Read(uint64_t offset, char* buffer, size_t length) const {
+    auto it = FindSpan(offset);
+    while (length > 0) {
+        if (it == spans_.end()) {
+            throw std::runtime_error("Read past the end of torrent data");
+        }
+        size_t inFile = std::min<uint64_t>(length, it->begin + it->length - offset);
+        ReadFully(it->fd, buffer, inFile, static_cast<off_t>(offset - it->begin));
+        buffer += inFile;
+        offset += inFile;
+        length -= inFile;
+        ++it;
+    }
+}
+
+bool MultiFileReader::Locate(uint64_t offset, size_t length, int& fd, off_t& fileOffset) const {
+    auto it = FindSpan(offset);
+    if (it == spans_.end() || offset + length > it->begin + it->length) {
+        return false;
+    }
+    fd = it->fd;
+    fileOffset = static_cast<off_t>(offset - it->begin);
+    return true;
+}
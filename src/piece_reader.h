@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+/*
+ * Чтение данных торрента для раздачи. Данные адресуются смещением в общем потоке байт торрента
+ * (часть i начинается со смещения i * pieceLength), независимо от того, как они разложены по файлам
+ */
+class PieceReader {
+public:
+    virtual ~PieceReader() = default;
+
+    /*
+     * Прочитать `length` байт, начиная со смещения `offset`. При ошибке чтения выбрасывает std::runtime_error
+     */
+    virtual void Read(uint64_t offset, char* buffer, size_t length) const = 0;
+
+    /*
+     * Найти файл, из которого диапазон можно отдать через sendfile целиком.
+     * Возвращает false, если диапазон лежит в нескольких файлах
+     */
+    virtual bool Locate(uint64_t offset, size_t length, int& fd, off_t& fileOffset) const = 0;
+};
+
+/*
+ * Данные лежат одним временным файлом, как их пишет PieceStorage
+ */
+class TempFileReader : public PieceReader {
+public:
+    explicit TempFileReader(const std::string& fileName);
+    ~TempFileReader() override;
+
+    void Read(uint64_t offset, char* buffer, size_t length) const override;
+    bool Locate(uint64_t offset, size_t length, int& fd, off_t& fileOffset) const override;
+private:
+    int fd_;
+};
+
+/*
+ * Данные разложены по файлам торрента (TorrentFile::files) в том же порядке, в котором они идут в торренте
+ */
+class MultiFileReader : public PieceReader {
+public:
+    /*
+     * files -- пути к файлам и их длины в порядке следования в торренте. Все файлы открываются сразу
+     */
+    explicit MultiFileReader(const std::vector<std::pair<std::filesystem::path, size_t>>& files);
+    ~MultiFileReader() override;
+
+    void Read(uint64_t offset, char* buffer, size_t length) const override;
+    bool Locate(uint64_t offset, size_t length, int& fd, off_t& fileOffset) const override;
+private:
+    struct Span {
+        uint64_t begin;  // смещение начала файла в потоке данных торрента
+        size_t length;
+        int fd;
+    };
+    std::vector<Span> spans_;  // по возрастанию begin, файлы нулевой длины пропущены
+
+    /*
+     * Файл, в котором лежит байт со смещением `offset`
+     */
+    std::vector<Span>::const_iterator FindSpan(uint64_t offset) const;
+};
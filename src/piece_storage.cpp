@@ -1,6 +1,21 @@
 #include "piece_storage.h"
 #include "byte_tools.h"
+#include "metrics.h"
 #include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <cstring>
+#include <cerrno>
+
+namespace {
+// O_DIRECT требует, чтобы адрес буфера, смещение и длина записи были кратны размеру логического блока устройства
+constexpr size_t DIRECT_IO_ALIGNMENT = 4096;
+
+size_t AlignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+}
 
 
 /*
@@ -9,90 +24,275 @@
 -------------------------------------------------------------
 */
 
-PieceStorage::PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, const std::string& fileName) {
+PieceStorage::PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, const std::string& fileName,
+                           DiskWriter& writer, MemoryBudget& budget, const StorageOptions& options, StaticThreadPool* hasher) :
+    pool_(options.hugePages), pieceHashes_(tf.pieceHashes), mode_(options.mode), allocation_(options.allocation), dirtyBegin_(0), dirtyEnd_(0),
+    writer_(writer), budget_(budget), hasher_(hasher), pendingHashes_(0), spillPartialPieces_(options.spillPartialPieces) {
     size_t tailSize = 0;
     for (const auto& it : tf.files) {
         tailSize += it.length;
     }
-    assert(tf.length >= tailSize && tf.pieceLength >= tf.length - tailSize);
-    tailSize = tf.pieceLength - (tf.length - tailSize);
-
-    for (size_t i = 0; i < tf.pieceHashes.size(); ++i) {
-        size_t pieceLength;
-        if (i != tf.pieceHashes.size() - 1){
-            pieceLength = tf.pieceLength;
-        } else {
-            if (tf.length % tf.pieceLength == 0){
-                pieceLength = tf.pieceLength;
-            } else{
-                pieceLength = tf.length % tf.pieceLength;
-            }
-        }
-        if (i == tf.pieceHashes.size() - 1) {
-            pieceLength = tailSize;
-        }
+    // последняя часть содержит все, что осталось от суммарной длины файлов после полных частей, -- от 1 байта
+    // до pieceLength. Иначе хешей больше или меньше, чем частей (LoadTorrentFile такое не пропускает)
+    const size_t pieces = tf.pieceHashes.size();
+    if (tf.length != tailSize || (pieces == 0 && tailSize != 0) ||
+        (pieces != 0 && (tailSize <= (pieces - 1) * tf.pieceLength || tailSize > pieces * tf.pieceLength))) {
+        throw std::invalid_argument("Piece hashes of " + tf.name + " do not match its length");
+    }
+    if (!tf.pieceHashes.empty()) {
+        tailSize -= (tf.pieceHashes.size() - 1) * tf.pieceLength;
+    }
 
-        auto piece = std::make_shared<Piece>(i, pieceLength, tf.pieceHashes[i]);
-        remainPieces_.push_back(piece);
-    } 
-    totalSize_ = remainPieces_.size();
+    // объекты частей создаются только при взятии на скачивание, в очереди лежат лишь номера
+    totalSize_ = tf.pieceHashes.size();
+    nextFreshPiece_ = 0;
+    endFreshPiece_ = totalSize_;
+    savedPieces_.assign(totalSize_, false);
+    savedBytes_ = 0;
     piecesInProgressCount_ = 0;
     pieceLength_ = tf.pieceLength;
+    lastPieceLength_ = tailSize;
+    fileLength_ = tf.length;
     
     fileName_ = fileName;
     if (!std::filesystem::exists(outputDirectory)) {
         std::filesystem::create_directories(outputDirectory);
     }
 
-    // reserve tf.length bytes
-    std::ofstream file(fileName_, std::ios::binary | std::ios::out);
-    file.seekp(tf.length - 1);
-    file.put('\0');
-    file.close();
+    if (allocation_ == AllocationMode::Direct && (mode_ == StorageMode::Mmap || pieceLength_ % DIRECT_IO_ALIGNMENT != 0)) {
+        // отображение в память работает только через page cache, а смещения частей должны быть выровнены
+        std::cerr << "O_DIRECT is not applicable here, using fallocate without it" << std::endl;
+        allocation_ = AllocationMode::Fallocate;
+    }
 
     OpenFile();
+    PreallocateFile();
+    reader_ = std::make_shared<TempFileReader>(fileName_);
+    if (options.uploadCacheBytes > 0) {
+        cache_ = std::make_unique<ReadCache>(options.uploadCacheBytes);
+    }
+    if (mode_ == StorageMode::Mmap) {
+        MapFile();
+    }
 }
 
 PieceStorage::~PieceStorage() {
+    WaitForHashing();
+    if (fd_ != -1) {
+        writer_.Flush(fd_);
+    }
     CloseFile();
 }
 
 int PieceStorage::OpenFile() {
-    fd_ = open(fileName_.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    // на чтение файл нужен для отображения в память с PROT_WRITE и для чтения сохраненных частично скачанных частей
+    int flags = O_RDWR | O_CREAT;
+    if (allocation_ == AllocationMode::Direct) {
+        fd_ = open(fileName_.c_str(), flags | O_DIRECT, S_IRUSR | S_IWUSR);
+        if (fd_ != -1) {
+            return fd_;
+        }
+        // например, tmpfs не поддерживает O_DIRECT
+        std::cerr << "Cannot open output file with O_DIRECT: " << std::strerror(errno) << std::endl;
+        allocation_ = AllocationMode::Fallocate;
+    }
+    fd_ = open(fileName_.c_str(), flags, S_IRUSR | S_IWUSR);
     if (fd_ == -1) {
         throw std::runtime_error("Error opening file");
     }
     return fd_;
 }
 
+void PieceStorage::PreallocateFile() {
+    if (allocation_ != AllocationMode::Sparse) {
+        if (fallocate(fd_, 0, 0, static_cast<off_t>(fileLength_)) == 0) {
+            return;
+        }
+        std::cerr << "Cannot preallocate output file, it will be sparse: " << std::strerror(errno) << std::endl;
+    }
+    if (ftruncate(fd_, static_cast<off_t>(fileLength_)) < 0) {
+        throw std::runtime_error(std::string("Error in ftruncate: ") + std::strerror(errno));
+    }
+}
+
+void PieceStorage::MapFile() {
+    try {
+        mapped_ = std::make_unique<MappedFile>(fd_, fileLength_);
+    } catch (const std::runtime_error& e) {
+        // файл не помещается в адресное пространство или ФС не поддерживает mmap -- пишем по-старому
+        std::cerr << "Cannot map output file, falling back to write(): " << e.what() << std::endl;
+        mode_ = StorageMode::Write;
+        return;
+    }
+    // части приходят от разных пиров вперемешку, поэтому упреждающее чтение соседних страниц бесполезно
+    mapped_->Advise(0, fileLength_, MADV_RANDOM);
+}
+
+void PieceStorage::SyncMappedLocked(bool force) {
+    // Сбрасываем изменения пачками: msync на каждую часть дал бы столько же системных вызовов, сколько было write
+    constexpr size_t SYNC_BATCH_BYTES = 64 << 20;
+    if (!mapped_ || dirtyBegin_ >= dirtyEnd_) {
+        return;
+    }
+    if (!force && dirtyEnd_ - dirtyBegin_ < SYNC_BATCH_BYTES) {
+        return;
+    }
+    try {
+        mapped_->Sync(dirtyBegin_, dirtyEnd_ - dirtyBegin_, !force);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << std::endl;
+    }
+    dirtyBegin_ = dirtyEnd_ = 0;
+}
+
 void PieceStorage::CloseFile() {
+    if (mapped_) {
+        SyncMappedLocked(true);
+        mapped_.reset();
+    }
     if (fd_ != -1) {
+        if (allocation_ == AllocationMode::Direct) {
+            // последняя часть записывалась с выравниванием и могла растянуть файл
+            ftruncate(fd_, static_cast<off_t>(fileLength_));
+        }
         close(fd_);
         fd_ = -1;
     }
 }
 
 PiecePtr PieceStorage::GetNextPieceToDownload() {
-    std::unique_lock lock(mutex_);
-    if (remainPieces_.empty()){
-        throw std::runtime_error("Queue is empty!");
+    PiecePtr toDownload;
+    {
+        std::unique_lock lock(mutex_);
+        if (RemainCountLocked() == 0){
+            throw std::runtime_error("Queue is empty!");
+        }
+        // нетронутые части, которые уже взяли вне очереди, пропускаем
+        while (nextFreshPiece_ < endFreshPiece_ && takenFreshPieces_.erase(nextFreshPiece_) != 0) {
+            ++nextFreshPiece_;
+        }
+        // сначала части, которые еще не брали, затем возвращенные в очередь
+        const bool fresh = nextFreshPiece_ < endFreshPiece_;
+        const size_t index = fresh ? nextFreshPiece_ : returnedPieces_.front();
+        if (!budget_.TryAcquire(BufferCharge(PieceLength(index)))) {
+            return nullptr;
+        }
+        if (fresh) {
+            ++nextFreshPiece_;
+        } else {
+            returnedPieces_.pop_front();
+        }
+        toDownload = StartDownloadLocked(index);
+    }
+    return AttachPieceBuffer(std::move(toDownload));
+}
+
+PiecePtr PieceStorage::GetPieceToDownload(size_t pieceIndex) {
+    PiecePtr toDownload;
+    {
+        std::unique_lock lock(mutex_);
+        const bool fresh = pieceIndex >= nextFreshPiece_ && pieceIndex < endFreshPiece_ &&
+                           !takenFreshPieces_.contains(pieceIndex);
+        auto returned = fresh ? returnedPieces_.end() :
+                                std::find(returnedPieces_.begin(), returnedPieces_.end(), pieceIndex);
+        if (!fresh && returned == returnedPieces_.end()) {
+            return nullptr;
+        }
+        if (!budget_.TryAcquire(BufferCharge(PieceLength(pieceIndex)))) {
+            return nullptr;
+        }
+        if (fresh) {
+            takenFreshPieces_.insert(pieceIndex);
+        } else {
+            returnedPieces_.erase(returned);
+        }
+        toDownload = StartDownloadLocked(pieceIndex);
     }
-    PiecePtr toDownload = remainPieces_.front();
-    remainPieces_.pop_front();
-    downloadingPieces_[toDownload->GetIndex()] = toDownload;
+    return AttachPieceBuffer(std::move(toDownload));
+}
+
+PiecePtr PieceStorage::StartDownloadLocked(size_t pieceIndex) {
+    PiecePtr toDownload;
+    if (auto parked = parkedPieces_.find(pieceIndex); parked != parkedPieces_.end()) {
+        toDownload = std::move(parked->second);
+        parkedPieces_.erase(parked);
+    } else {
+        toDownload = std::make_shared<Piece>(pieceIndex, PieceLength(pieceIndex), pieceHashes_[pieceIndex]);
+    }
+    downloadingPieces_[pieceIndex] = toDownload;
     ++piecesInProgressCount_;
     return toDownload;
 }
 
+PiecePtr PieceStorage::AttachPieceBuffer(PiecePtr toDownload) {
+    // часть принадлежит только вызывающему потоку, буфер привязываем без блокировки
+    if (mapped_) {
+        toDownload->AttachBuffer(mapped_->Data() + toDownload->GetIndex() * pieceLength_);
+        return toDownload;
+    }
+    PieceBuffer buffer = pool_.Acquire(AlignUp(toDownload->GetLength(), DIRECT_IO_ALIGNMENT));
+    if (allocation_ == AllocationMode::Direct) {
+        // O_DIRECT пишет часть целыми блоками, хвост после данных последней части должен быть нулевым
+        size_t length = toDownload->GetLength();
+        std::memset(buffer.Data() + length, 0, AlignUp(length, DIRECT_IO_ALIGNMENT) - length);
+    }
+    toDownload->AttachBuffer(std::move(buffer));
+    if (!toDownload->RetrievedRanges().empty() && !LoadSpilledBlocks(toDownload)) {
+        toDownload->Reset();
+    }
+    return toDownload;
+}
+
 void PieceStorage::PieceProcessed(const PiecePtr& piece) {
-    --piecesInProgressCount_;
-    std::unique_lock lock(mutex_);
+    if (hasher_ == nullptr) {
+        VerifyPiece(piece);
+        return;
+    }
+    {
+        std::lock_guard lock(hashMutex_);
+        ++pendingHashes_;
+    }
+    hasher_->Submit([this, piece]() {
+        VerifyPiece(piece);
+        std::lock_guard lock(hashMutex_);
+        if (--pendingHashes_ == 0) {
+            hashingDone_.notify_all();
+        }
+    });
+}
+
+void PieceStorage::WaitForHashing() {
+    std::unique_lock lock(hashMutex_);
+    hashingDone_.wait(lock, [this]() {
+        return pendingHashes_ == 0;
+    });
+}
+
+void PieceStorage::VerifyPiece(const PiecePtr& piece) {
+    // хеш считаем без блокировки хранилища: данные части больше никто не меняет
+    bool matches;
+    {
+        Metrics::ScopedTimer timer(Metrics::Histogram::HashTime);
+        matches = piece->HashMatches();
+    }
+    Metrics::Add(matches ? Metrics::Counter::PiecesVerified : Metrics::Counter::PiecesHashFailed);
+    if (!matches) {
+        std::cerr << "Hash mismatch for piece " << piece->GetIndex() << std::endl;
+        piece->Reset();
+        BackPieceToQueue(piece->GetIndex());
+        --piecesInProgressCount_;
+        return;
+    }
     SavePieceToDisk(piece);
 }
 
 bool PieceStorage::QueueIsEmpty() const {
     std::unique_lock lock(mutex_);
-    return remainPieces_.empty();
+    return RemainCountLocked() == 0;
+}
+
+void PieceStorage::SetOnPieceSaved(std::function<void()> callback) {
+    onPieceSaved_ = std::move(callback);
 }
 
 size_t PieceStorage::PiecesSavedToDiscCount() const {
@@ -100,12 +300,22 @@ size_t PieceStorage::PiecesSavedToDiscCount() const {
     return indicesOfSavedPiecesToDisc_.size();
 }
 
+uint64_t PieceStorage::BytesSavedToDisc() const {
+    std::unique_lock lock(mutex_);
+    return savedBytes_;
+}
+
 size_t PieceStorage::TotalPiecesCount() const {
     std::unique_lock lock(mutex_);
     return totalSize_;
 }
 
 void PieceStorage::CloseOutputFile() {
+    WaitForHashing();
+    // ждем записи без блокировки: DiskWriter сообщает о записанных частях через OnPieceWritten, которому нужен mutex_
+    if (fd_ != -1) {
+        writer_.Flush(fd_);
+    }
     std::unique_lock lock(mutex_);
     CloseFile();
 }
@@ -115,6 +325,69 @@ const std::vector<size_t>& PieceStorage::GetPiecesSavedToDiscIndices() const {
     return indicesOfSavedPiecesToDisc_;
 }
 
+bool PieceStorage::HasPiece(size_t pieceIndex) const {
+    std::unique_lock lock(mutex_);
+    return pieceIndex < savedPieces_.size() && savedPieces_[pieceIndex];
+}
+
+std::vector<size_t> PieceStorage::GetPiecesSavedToDiscSince(size_t from) const {
+    std::unique_lock lock(mutex_);
+    if (from >= indicesOfSavedPiecesToDisc_.size()) {
+        return {};
+    }
+    return {indicesOfSavedPiecesToDisc_.begin() + static_cast<std::ptrdiff_t>(from), indicesOfSavedPiecesToDisc_.end()};
+}
+
+bool PieceStorage::GetUploadBlock(size_t pieceIndex, size_t begin, size_t length, UploadBlock& block) const {
+    size_t pieceLength;
+    {
+        std::unique_lock lock(mutex_);
+        if (pieceIndex >= savedPieces_.size() || !savedPieces_[pieceIndex]) {
+            return false;
+        }
+        pieceLength = pieceIndex + 1 == savedPieces_.size() ? lastPieceLength_ : pieceLength_;
+        if (length == 0 || begin > pieceLength || length > pieceLength - begin) {
+            return false;
+        }
+        block.reader = reader_;
+    }
+
+    // читаем без блокировки хранилища: сохраненные части больше не меняются
+    const uint64_t pieceOffset = static_cast<uint64_t>(pieceIndex) * pieceLength_;
+    const PieceReader& reader = *block.reader;
+    if (cache_) {
+        block.piece = cache_->Get(pieceIndex, length, [&reader, pieceOffset, pieceLength]() {
+            std::string data(pieceLength, '\0');
+            reader.Read(pieceOffset, data.data(), pieceLength);
+            return data;
+        });
+        block.data = std::string_view(*block.piece).substr(begin, length);
+        return true;
+    }
+    if (reader.Locate(pieceOffset + begin, length, block.fd, block.offset)) {
+        return true;
+    }
+    // блок на стыке двух файлов: sendfile отдает только из одного, поэтому читаем в память
+    auto data = std::make_shared<std::string>(length, '\0');
+    reader.Read(pieceOffset + begin, data->data(), length);
+    block.piece = data;
+    block.data = *data;
+    return true;
+}
+
+void PieceStorage::SetUploadReader(std::shared_ptr<PieceReader> reader) {
+    std::unique_lock lock(mutex_);
+    reader_ = std::move(reader);
+}
+
+bool PieceStorage::GetReadCacheStats(ReadCache::Stats& stats) const {
+    if (!cache_) {
+        return false;
+    }
+    stats = cache_->GetStats();
+    return true;
+}
+
 size_t PieceStorage::PiecesInProgressCount() const {
     std::unique_lock lock(mutex_);
     return piecesInProgressCount_.load();
@@ -122,34 +395,62 @@ size_t PieceStorage::PiecesInProgressCount() const {
 
 void PieceStorage::SavePieceToDisk(const PiecePtr& piece) {
     size_t pieceIndex = piece->GetIndex();
-    std::string data = piece->GetData();
     size_t offset = pieceIndex * pieceLength_;
-    
-    if (fd_ == -1) {
-        OpenFile();
-    }
 
-    // Запись данных в файл с помощью функции write в цикле
-    for (size_t i = 0; i < data.size(); i += SSIZE_MAX) {
-        // Установка позиции в файле с помощью функции lseek
-        off_t pos = lseek(fd_, offset + i, SEEK_SET);
-        if (pos == -1) {
-            std::cerr << "Ошибка установки позиции в файле" << std::endl;
-            CloseFile();
-            return;
+    if (mapped_) {
+        // данные уже лежат в отображении файла, остается только периодически сбрасывать их на диск
+        {
+            std::unique_lock lock(mutex_);
+            if (dirtyBegin_ >= dirtyEnd_) {
+                dirtyBegin_ = offset;
+                dirtyEnd_ = offset + piece->GetLength();
+            } else {
+                dirtyBegin_ = std::min(dirtyBegin_, offset);
+                dirtyEnd_ = std::max(dirtyEnd_, offset + piece->GetLength());
+            }
+            SyncMappedLocked(false);
         }
+        OnPieceWritten(piece, true);
+        return;
+    }
 
-        // Запись блока данных в файл с помощью функции write
-        ssize_t bytes_written = write(fd_, data.c_str() + i, std::min(static_cast<size_t>(SSIZE_MAX), data.size() - i));
-        if (bytes_written == -1) {
-            std::cerr << "Ошибка записи в файл" << std::endl;
-            CloseFile();
-            return;
-        }
+    // буфер части выровнен и дополнен нулями (см. GetNextPieceToDownload), поэтому для O_DIRECT его можно
+    // записать как есть, округлив длину до границы блока
+    size_t length = piece->GetLength();
+    if (allocation_ == AllocationMode::Direct) {
+        length = AlignUp(length, DIRECT_IO_ALIGNMENT);
+    }
+    writer_.Submit(DiskWriteJob{fd_, offset, piece->GetData().data(), length, [this, piece](bool ok) {
+        OnPieceWritten(piece, ok);
+    }});
+}
+
+void PieceStorage::OnPieceWritten(const PiecePtr& piece, bool ok) {
+    size_t pieceIndex = piece->GetIndex();
+    if (!ok) {
+        std::cerr << "Ошибка записи части " << pieceIndex << " в файл" << std::endl;
+        piece->Reset();
+        BackPieceToQueue(pieceIndex);
+        --piecesInProgressCount_;
+        return;
+    }
+    piece->ReleaseBuffer();
+    budget_.Release(BufferCharge(piece->GetLength()));
+    size_t downloading, remain;
+    {
+        std::unique_lock lock(mutex_);
+        downloadingPieces_.erase(pieceIndex);
+        indicesOfSavedPiecesToDisc_.push_back(pieceIndex);
+        savedPieces_[pieceIndex] = true;
+        savedBytes_ += PieceLength(pieceIndex);
+        downloading = downloadingPieces_.size();
+        remain = RemainCountLocked();
+    }
+    --piecesInProgressCount_;
+    std::cout << "Сохранена часть " << pieceIndex << " , скачивается " << downloading << " , осталось: " << remain << std::endl;
+    if (onPieceSaved_) {
+        onPieceSaved_();
     }
-    downloadingPieces_.erase(pieceIndex);
-    indicesOfSavedPiecesToDisc_.push_back(pieceIndex);
-    std::cout << "Сохранена часть " << pieceIndex << " , скачивается " << downloadingPieces_.size() << " , осталось: " << remainPieces_.size() << std::endl;
 }
 
 void PieceStorage::DecrementPieceInProgressCounter() {
@@ -157,18 +458,116 @@ void PieceStorage::DecrementPieceInProgressCounter() {
 }
 
 void PieceStorage::BackPieceToQueue(const size_t pieceIndex) {
+    PiecePtr piece;
+    {
+        std::unique_lock lock(mutex_);
+        auto it = downloadingPieces_.find(pieceIndex);
+        if (it == downloadingPieces_.end()) {
+            return;
+        }
+        piece = it->second;
+    }
+    piece->ResetPendingBlocks();
+    if (!spillPartialPieces_) {
+        piece->Reset();
+    } else if (!mapped_ && !piece->RetrievedRanges().empty()) {
+        // в режиме Mmap полученные блоки уже лежат в файле, а здесь их сначала надо туда записать
+        SpillPiece(piece);
+        return;
+    }
+    ReturnPieceToQueue(piece);
+}
+
+size_t PieceStorage::BufferCharge(size_t pieceLength) const {
+    return mapped_ ? 0 : AlignUp(pieceLength, DIRECT_IO_ALIGNMENT);
+}
+
+size_t PieceStorage::PieceLength(size_t pieceIndex) const {
+    return pieceIndex + 1 == totalSize_ ? lastPieceLength_ : pieceLength_;
+}
+
+size_t PieceStorage::RemainCountLocked() const {
+    return endFreshPiece_ - nextFreshPiece_ - takenFreshPieces_.size() + returnedPieces_.size();
+}
+
+void PieceStorage::ReturnPieceToQueue(const PiecePtr& piece) {
+    piece->ReleaseBuffer();
+    budget_.Release(BufferCharge(piece->GetLength()));
+    const bool hasRetrievedBlocks = !piece->RetrievedRanges().empty();
     std::unique_lock lock(mutex_);
-    if (downloadingPieces_.contains(pieceIndex)){
-        remainPieces_.push_back(downloadingPieces_[pieceIndex]);
-        downloadingPieces_.erase(pieceIndex);
+    downloadingPieces_.erase(piece->GetIndex());
+    returnedPieces_.push_back(piece->GetIndex());
+    if (hasRetrievedBlocks) {
+        // блоки сохранены в файле (spillPartialPieces), их состояние нужно, чтобы прочитать их обратно
+        parkedPieces_[piece->GetIndex()] = piece;
     }
 }
 
+void PieceStorage::SpillPiece(const PiecePtr& piece) {
+    const auto ranges = piece->RetrievedRanges();
+    const size_t pieceOffset = piece->GetIndex() * pieceLength_;
+    const char* data = piece->GetData().data();
+    auto remaining = std::make_shared<std::atomic<size_t>>(ranges.size());
+    auto failed = std::make_shared<std::atomic<bool>>(false);
+    for (auto [offset, length] : ranges) {
+        if (allocation_ == AllocationMode::Direct) {
+            // диапазон заканчивается либо на границе блока, либо в конце последней части, дополненной нулями
+            length = AlignUp(length, DIRECT_IO_ALIGNMENT);
+        }
+        writer_.Submit(DiskWriteJob{fd_, pieceOffset + offset, data + offset, length,
+                                    [this, piece, remaining, failed](bool ok) {
+            if (!ok) {
+                failed->store(true);
+            }
+            if (remaining->fetch_sub(1) == 1) {
+                if (failed->load()) {
+                    piece->Reset();
+                }
+                ReturnPieceToQueue(piece);
+            }
+        }});
+    }
+}
+
+bool PieceStorage::LoadSpilledBlocks(const PiecePtr& piece) {
+    constexpr size_t BLOCK_LENGTH = 1 << 14;
+    const size_t pieceOffset = piece->GetIndex() * pieceLength_;
+    for (auto [offset, length] : piece->RetrievedRanges()) {
+        char* destination = piece->BlockBuffer(offset / BLOCK_LENGTH, std::min(BLOCK_LENGTH, length));
+        if (destination == nullptr) {
+            return false;
+        }
+        if (allocation_ == AllocationMode::Direct) {
+            length = AlignUp(length, DIRECT_IO_ALIGNMENT);
+        }
+        size_t done = 0;
+        while (done < length) {
+            ssize_t result = pread(fd_, destination + done, length - done, static_cast<off_t>(pieceOffset + offset + done));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                std::cerr << "Cannot read spilled blocks of piece " << piece->GetIndex() << std::endl;
+                return false;
+            }
+            done += result;
+        }
+    }
+    return true;
+}
+
 
 void PieceStorage::SetNewSize(const size_t newSize) {
     std::unique_lock lock(mutex_); // just in case
-    size_t oldSize = remainPieces_.size();
-    for (size_t i = newSize; i < oldSize; i++){
-        remainPieces_.pop_back();
+    // лишние части убираются с конца очереди: сначала возвращенные, затем не тронутые
+    while (RemainCountLocked() > newSize && !returnedPieces_.empty()) {
+        parkedPieces_.erase(returnedPieces_.back());
+        returnedPieces_.pop_back();
+    }
+    if (RemainCountLocked() > newSize) {
+        endFreshPiece_ = nextFreshPiece_ + newSize;
+        std::erase_if(takenFreshPieces_, [this](size_t index) {
+            return index >= endFreshPiece_;
+        });
     }
 }
\ No newline at end of file
@@ -2,16 +2,62 @@
 
 #include "torrent_file.h"
 #include "piece.h"
+#include "mapped_file.h"
+#include "disk_writer.h"
+#include "buffer_pool.h"
+#include "memory_budget.h"
+#include "piece_reader.h"
+#include "read_cache.h"
+#include "StaticThreadPool.h"
 #include <queue>
 #include <string>
 #include <unordered_set>
 #include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <fstream>
 #include <filesystem>
 #include <atomic>
 #include <fcntl.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <memory>
+
+/*
+ * Способ сохранения скачанных частей во временный файл
+ */
+enum class StorageMode {
+    Write,  // данные части собираются в буфер и записываются потоком DiskWriter
+    Mmap,   // файл отображается в память (MAP_SHARED), блоки пишутся сразу в итоговое место в файле
+};
+
+/*
+ * Как выделяется место под временный файл
+ */
+enum class AllocationMode {
+    Sparse,     // файл только растягивается до нужной длины (ftruncate), блоки выделяются ФС по мере записи
+    Fallocate,  // все блоки файла выделяются заранее через fallocate, чтобы запись в случайном порядке не фрагментировала файл
+    Direct,     // как Fallocate, плюс запись через O_DIRECT из выровненных по 4 КиБ буферов в обход page cache
+};
+
+struct StorageOptions {
+    StorageMode mode = StorageMode::Write;
+    AllocationMode allocation = AllocationMode::Sparse;
+    bool hugePages = false; // брать буферы частей из huge pages
+    bool spillPartialPieces = false; // сохранять на диск полученные блоки части, которую вернули в очередь
+    size_t uploadCacheBytes = 0; // размер кэша частей для раздачи (ReadCache), 0 -- раздавать через sendfile без кэша
+};
+
+/*
+ * Откуда отдавать блок, запрошенный пиром: либо диапазон файла для sendfile, либо данные в памяти
+ */
+struct UploadBlock {
+    std::shared_ptr<PieceReader> reader; // держит файл открытым, пока блок отправляется
+    int fd = -1; // если fd != -1, блок отдается через sendfile из `fd` со смещения `offset`
+    off_t offset = 0;
+    ReadCache::PieceData piece; // иначе данные блока -- `data`, они лежат в `piece`
+    std::string_view data;
+};
 
 /*
  * Хранилище информации о частях скачиваемого файла.
@@ -22,18 +68,43 @@ namespace fs = std::filesystem;
 
 class PieceStorage {
 public:
-    PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, const std::string& outputTempFileName);
+    /*
+     * writer -- поток записи на диск, через который сохраняются скачанные части (в режиме StorageMode::Write)
+     * budget -- лимит памяти под буферы частей; в режиме StorageMode::Mmap данные лежат в page cache и в бюджет не входят
+     * hasher -- пул, в котором проверяются хеши скачанных частей; nullptr -- проверять в потоке, вызвавшем PieceProcessed
+     * Хеши частей берутся из `tf` без копирования, `tf` должен жить дольше хранилища.
+     * Если число хешей не соответствует длине торрента, выбрасывает std::invalid_argument
+     */
+    PieceStorage(const TorrentFile& tf, const std::filesystem::path& outputDirectory, const std::string& outputTempFileName,
+                 DiskWriter& writer, MemoryBudget& budget, const StorageOptions& options = {},
+                 StaticThreadPool* hasher = nullptr);
 
     ~PieceStorage();
 
     /*
-     * Отдает указатель на следующую часть файла, которую надо скачать
+     * Вызывать `callback` после записи на диск каждой части (из потока записи).
+     * Задается до начала скачивания
+     */
+    void SetOnPieceSaved(std::function<void()> callback);
+
+    /*
+     * Отдает указатель на следующую часть файла, которую надо скачать.
+     * Возвращает nullptr, если части в очереди есть, но бюджет памяти исчерпан: новую часть можно будет взять,
+     * когда уже скачанные запишутся на диск
      */
     PiecePtr GetNextPieceToDownload();
 
+    /*
+     * Взять на скачивание часть `pieceIndex` вне очереди (например, пир разрешил качать ее, не дожидаясь unchoke).
+     * Возвращает nullptr, если части нет в очереди (уже скачивается или скачана) или бюджет памяти исчерпан
+     */
+    PiecePtr GetPieceToDownload(size_t pieceIndex);
+
     /*
      * Эта функция вызывается из PeerConnect, когда скачивание одной части файла завершено.
-     * В рамках данного задания требуется очистить очередь частей для скачивания как только хотя бы одна часть будет успешно скачана.
+     * Если хеш данных не совпадает с ожидаемым, часть очищается и возвращается в очередь.
+     * Проверка хеша (если задан пул hasher) и запись на диск происходят асинхронно: часть считается скачивающейся,
+     * пока DiskWriter ее не запишет
      */
     void PieceProcessed(const PiecePtr& piece);
 
@@ -47,13 +118,18 @@ public:
      */
     size_t PiecesSavedToDiscCount() const;
 
+    /*
+     * Сколько байт в частях, сохраненных на диск (downloaded и left в announce)
+     */
+    uint64_t BytesSavedToDisc() const;
+
     /*
      * Сколько частей файла всего
      */
     size_t TotalPiecesCount() const;
 
     /*
-     * Закрыть поток вывода в файл
+     * Закрыть поток вывода в файл. Сначала дожидается проверки хешей и записи уже скачанных частей
      */
     void CloseOutputFile();
 
@@ -62,6 +138,35 @@ public:
      */
     const std::vector<size_t>& GetPiecesSavedToDiscIndices() const;
 
+    /*
+     * Есть ли у нас часть `pieceIndex`, то есть скачана, проверена и записана на диск
+     */
+    bool HasPiece(size_t pieceIndex) const;
+
+    /*
+     * Номера сохраненных на диск частей в порядке сохранения, начиная с `from`-й.
+     * Позволяет соединению с пиром сообщать (Have) только о частях, появившихся с прошлого раза
+     */
+    std::vector<size_t> GetPiecesSavedToDiscSince(size_t from) const;
+
+    /*
+     * Найти данные блока сохраненной части для отправки пиру. Без кэша блок отдается через sendfile прямо из файла,
+     * с кэшем (StorageOptions::uploadCacheBytes) часть читается в память целиком при первом запросе.
+     * Возвращает false, если части у нас нет или блок выходит за ее границы
+     */
+    bool GetUploadBlock(size_t pieceIndex, size_t begin, size_t length, UploadBlock& block) const;
+
+    /*
+     * Раздавать данные из другого места, например из итоговых файлов после того, как временный файл
+     * разложен по ним (MultiFileReader). Уже начатые отправки дочитывают из прежнего источника
+     */
+    void SetUploadReader(std::shared_ptr<PieceReader> reader);
+
+    /*
+     * Статистика кэша раздачи. Возвращает false, если кэш выключен
+     */
+    bool GetReadCacheStats(ReadCache::Stats& stats) const;
+
     /*
      * Сколько частей файла в данный момент скачивается
      */
@@ -74,7 +179,10 @@ public:
     void DecrementPieceInProgressCounter();
 
     /*
-     * Если при скачивании блоков части возникла ошибка, то мы должны вернуть часть в очередь
+     * Если при скачивании блоков части возникла ошибка, то мы должны вернуть часть в очередь.
+     * Буфер части при этом отдается обратно в пул. Если включен spillPartialPieces, уже полученные блоки
+     * сначала записываются на свое место во временном файле и будут прочитаны обратно, когда часть возьмут снова;
+     * иначе они отбрасываются
      */
     void BackPieceToQueue(const size_t pieceIndex);
 
@@ -84,23 +192,102 @@ public:
     void SetNewSize(const size_t newSize);
 
 private:
-    std::deque<PiecePtr> remainPieces_; // очередь частей файла
+    BufferPool pool_; // буферы для данных частей; объявлен первым, чтобы пережить все части
+    const std::vector<PieceHash>& pieceHashes_; // хеши частей; TorrentFile живет дольше хранилища
+    size_t nextFreshPiece_, endFreshPiece_; // части [nextFreshPiece_, endFreshPiece_) еще ни разу не брали на скачивание
+    std::deque<size_t> returnedPieces_; // номера частей, возвращенных в очередь; идут после нетронутых
+    std::unordered_set<size_t> takenFreshPieces_; // нетронутые части, взятые вне очереди; все из [nextFreshPiece_, endFreshPiece_)
+    std::unordered_map<size_t, PiecePtr> parkedPieces_; // возвращенные части с сохраненными на диск блоками
     std::unordered_map<size_t, PiecePtr> downloadingPieces_; // хеш-мапа с частями файла, которые скачиваются в данный момент. Ключ - индекс, значение - PiecePtr
     
     size_t totalSize_; // общее количество частей файла
     mutable std::mutex mutex_; // mutex для критических секций
     std::vector<size_t> indicesOfSavedPiecesToDisc_; // индексы сохранненных на диск частей файла
+    std::vector<bool> savedPieces_; // savedPieces_[i] -- часть i сохранена на диск
+    uint64_t savedBytes_; // суммарная длина сохраненных частей
     std::string fileName_; // название скачиваемого файла
     std::atomic<size_t> piecesInProgressCount_; // количество частей файла, скачивающихся в данный момент
     int fd_; // filedescriptor для временного файла
     size_t pieceLength_; // длина части (данные из .torrent, размер последней части может отличаться)
+    size_t lastPieceLength_; // размер последней части
+    size_t fileLength_; // размер временного файла
+    std::shared_ptr<PieceReader> reader_; // источник данных для раздачи, изначально временный файл (без O_DIRECT)
+    std::unique_ptr<ReadCache> cache_; // кэш частей для раздачи, если включен
+    StorageMode mode_; // способ записи частей на диск
+    AllocationMode allocation_; // способ выделения места под файл
+    std::unique_ptr<MappedFile> mapped_; // отображение временного файла в память (только для StorageMode::Mmap)
+    size_t dirtyBegin_, dirtyEnd_; // диапазон отображения, измененный с последнего msync
+    /*
+     * Сбросить накопленные изменения отображения на диск, если их набралось достаточно (или всегда при `force`)
+     */
+    void SyncMappedLocked(bool force);
+    DiskWriter& writer_; // поток записи на диск
+    MemoryBudget& budget_; // лимит памяти под буферы частей
+    StaticThreadPool* hasher_; // пул проверки хешей, может быть nullptr
+    std::function<void()> onPieceSaved_;
+    std::mutex hashMutex_;
+    std::condition_variable hashingDone_;
+    size_t pendingHashes_; // частей, отправленных в hasher_ и еще не проверенных; guarded by hashMutex_
+    /*
+     * Проверить хеш части и поставить ее в очередь на запись или вернуть в очередь скачивания
+     */
+    void VerifyPiece(const PiecePtr& piece);
+    /*
+     * Дождаться, пока hasher_ проверит все отправленные ему части
+     */
+    void WaitForHashing();
+    bool spillPartialPieces_; // см. StorageOptions::spillPartialPieces
+    /*
+     * Сколько байт бюджета занимает буфер части длины `pieceLength`
+     */
+    size_t BufferCharge(size_t pieceLength) const;
+    /*
+     * Длина части `pieceIndex` (последняя короче остальных)
+     */
+    size_t PieceLength(size_t pieceIndex) const;
+    /*
+     * Сколько частей в очереди на скачивание
+     */
+    size_t RemainCountLocked() const;
+
+    /*
+     * Часть `pieceIndex` уже убрана из очереди и оплачена из бюджета: отметить ее скачивающейся
+     */
+    PiecePtr StartDownloadLocked(size_t pieceIndex);
+
+    /*
+     * Привязать к взятой части буфер и прочитать ее блоки, сохраненные на диск раньше (spillPartialPieces)
+     */
+    PiecePtr AttachPieceBuffer(PiecePtr piece);
+    /*
+     * Отдать буфер части и вернуть ее в очередь (часть должна быть в downloadingPieces_)
+     */
+    void ReturnPieceToQueue(const PiecePtr& piece);
+    /*
+     * Записать полученные блоки части на диск, после записи вернуть часть в очередь
+     */
+    void SpillPiece(const PiecePtr& piece);
+    /*
+     * Прочитать в буфер части блоки, сохраненные SpillPiece. Возвращает false при ошибке чтения
+     */
+    bool LoadSpilledBlocks(const PiecePtr& piece);
     /*
      * Сохраняет данную скачанную часть файла на диск.
      * Сохранение всех частей происходит в один выходной файл. Позиция записываемых данных зависит от индекса части
      * и размера частей. Данные, содержащиеся в части файла, должны быть записаны сразу в правильную позицию.
+     * В режиме StorageMode::Write данные только ставятся в очередь DiskWriter, вызывающий поток не ждет записи
      */
     void SavePieceToDisk(const PiecePtr& piece);
+    /*
+     * Вызывается, когда данные части оказались на диске (или запись не удалась, тогда часть возвращается в очередь)
+     */
+    void OnPieceWritten(const PiecePtr& piece, bool ok);
     int OpenFile();
     void CloseFile();
+    void MapFile();
+    /*
+     * Выделить место под временный файл в соответствии с `allocation_`
+     */
+    void PreallocateFile();
 };
 
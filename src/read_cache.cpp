@@ -0,0 +1,53 @@
+#include "read_cache.h"
+
+double ReadCache::Stats::HitRate() const {
+    return hits + misses == 0 ? 0 : static_cast<double>(hits) / static_cast<double>(hits + misses);
+}
+
+double ReadCache::Stats::ReadAmplification() const {
+    return bytesServed == 0 ? 0 : static_cast<double>(bytesRead) / static_cast<double>(bytesServed);
+}
+
+ReadCache::ReadCache(size_t capacityBytes) : capacityBytes_(capacityBytes), bytes_(0) {}
+
+ReadCache::PieceData ReadCache::Get(size_t pieceIndex, size_t requestedBytes, const std::function<std::string()>& load) {
+    {
+        std::lock_guard lock(mutex_);
+        stats_.bytesServed += requestedBytes;
+        auto it = index_.find(pieceIndex);
+        if (it != index_.end()) {
+            ++stats_.hits;
+            entries_.splice(entries_.begin(), entries_, it->second);
+            return it->second->data;
+        }
+        ++stats_.misses;
+    }
+
+    // читаем без блокировки, чтобы промах не задерживал остальные запросы
+    PieceData data = std::make_shared<const std::string>(load());
+
+    std::lock_guard lock(mutex_);
+    stats_.bytesRead += data->size();
+    auto it = index_.find(pieceIndex);
+    if (it != index_.end()) {
+        // ту же часть успел прочитать другой поток
+        return it->second->data;
+    }
+    if (data->size() > capacityBytes_) {
+        return data;
+    }
+    entries_.push_front({pieceIndex, data});
+    index_[pieceIndex] = entries_.begin();
+    bytes_ += data->size();
+    while (bytes_ > capacityBytes_) {
+        bytes_ -= entries_.back().data->size();
+        index_.erase(entries_.back().pieceIndex);
+        entries_.pop_back();
+    }
+    return data;
+}
+
+ReadCache::Stats ReadCache::GetStats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
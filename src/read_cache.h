@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ * Кэш данных частей для раздачи.
+ * Пиры запрашивают блоки по 16 КиБ из разных частей вперемешку, и без кэша каждый запрос -- отдельное случайное
+ * чтение с диска. Здесь при первом запросе блока часть читается целиком одним чтением (readahead),
+ * а следующие блоки той же части отдаются из памяти. Вытеснение -- LRU в пределах `capacityBytes`
+ */
+class ReadCache {
+public:
+    using PieceData = std::shared_ptr<const std::string>;
+
+    struct Stats {
+        uint64_t hits = 0;  // запросы, обслуженные из кэша
+        uint64_t misses = 0;  // запросы, для которых часть пришлось читать с диска
+        uint64_t bytesServed = 0;  // сколько байт отдано по запросам
+        uint64_t bytesRead = 0;  // сколько байт прочитано с диска
+
+        double HitRate() const;
+
+        /*
+         * Во сколько раз прочитано больше, чем отдано (readahead частей, которые потом не запросили целиком)
+         */
+        double ReadAmplification() const;
+    };
+
+    explicit ReadCache(size_t capacityBytes);
+
+    /*
+     * Данные части `pieceIndex` для запроса блока длиной `requestedBytes`.
+     * При промахе часть читается функцией `load` (без блокировки кэша) и кладется в кэш
+     */
+    PieceData Get(size_t pieceIndex, size_t requestedBytes, const std::function<std::string()>& load);
+
+    Stats GetStats() const;
+private:
+    struct Entry {
+        size_t pieceIndex;
+        PieceData data;
+    };
+
+    const size_t capacityBytes_;
+    mutable std::mutex mutex_;
+    std::list<Entry> entries_;  // от недавно использованных к давно использованным
+    std::unordered_map<size_t, std::list<Entry>::iterator> index_;
+    size_t bytes_;  // сколько байт данных лежит в кэше
+    Stats stats_;
+};
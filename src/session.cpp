@@ -0,0 +1,669 @@
+#include "session.h"
+#include "torrent_tracker.h"
+#include "choker.h"
+#include "byte_tools.h"
+#include "web_seed.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+
+std::mutex coutMutex;
+
+// Готовим директорию для скачивания
+std::filesystem::path PrepareDownloadDirectory(const std::string& saveDirectory) {
+    std::filesystem::path outputDirectory = saveDirectory;
+    std::filesystem::create_directories(outputDirectory);
+    return outputDirectory;
+}
+
+// Удалить временный файл
+void DeleteDownloadedFile(const std::filesystem::path& outputFilename) {
+    std::filesystem::remove(outputFilename);
+}
+
+// рекурсивно создаем директории по указанному пути
+void create_directories_for_file(const std::filesystem::path& file_path) {
+    // Получаем путь к директории, содержащей файл
+    std::filesystem::path dir_path = file_path.parent_path();
+
+    // Создаем все необходимые директории
+    try {
+        std::filesystem::create_directories(dir_path);
+        std::cout << "Directories created successfully." << std::endl;
+    } catch (const std::filesystem::filesystem_error& e) {
+        std::cerr << "Error creating directories: " << e.what() << std::endl;
+    }
+}
+
+// Путь, по которому сохраняется файл `file` из TorrentFile
+std::string DownloadedFilePath(const TorrentFile& tf, const File& file, const std::string& saveDirectory) {
+    std::string road = saveDirectory + "/";
+    if (tf.name == "") {
+        road += file.path;
+    } else {
+        road += tf.name + "/" + file.path;
+    }
+    return road;
+}
+
+// Распределяем байты из одного общего файла по файлам из TorrentFile
+void DistributePiecesBetweenFiles(const TorrentFile& tf, const std::string& fileName, const std::string& saveDirectory) {
+    std::ifstream inputFile(fileName, std::ios::in | std::ios::binary);
+    char ch;
+    std::cout << std::endl << std::endl;
+    for (const auto& it : tf.files) {
+        std::string road = DownloadedFilePath(tf, it, saveDirectory);
+        create_directories_for_file(road);
+
+        std::ofstream outputFile(road, std::ios::out | std::ios::binary);
+        if (!outputFile.is_open()) {
+            std::cerr << "Error in opening file: " << road << std::endl;
+            return;
+        }
+        for (size_t i = 0; i < it.length; ++i) {
+            inputFile.get(ch);
+            outputFile.put(ch);
+        }
+        outputFile.close();
+    }
+    inputFile.close();
+}
+
+// пока соединения только устанавливаются, отсутствие скачиваемых частей еще не значит, что пиры не работают,
+// поэтому внеочередной announce не раньше, чем через столько после предыдущего
+constexpr std::chrono::seconds STARTUP_GRACE_PERIOD(10);
+constexpr size_t MAX_FAILED_ANNOUNCES = 3;
+// после опроса без пиров следующий не раньше чем через столько, удваивая с каждой неудачей подряд
+// (но не реже DEFAULT_ANNOUNCE_INTERVAL): трекеры, которые не отвечают или отказывают, не опрашиваются каждую секунду
+constexpr std::chrono::seconds FAILED_ANNOUNCE_BACKOFF(30);
+// Опрос считается законченным, как только кто-то прислал пиров или прошло столько времени: один молчащий
+// udp-трекер иначе на все время повторов BEP 15 (~105 с) откладывал бы учет опроса и внеочередные announce
+constexpr std::chrono::seconds ANNOUNCE_ROUND_TIMEOUT(20);
+// если трекер не прислал interval
+constexpr std::chrono::seconds DEFAULT_ANNOUNCE_INTERVAL(1800);
+// как часто тикает choker торрента; заодно Run проверяет, не пора ли запросить пиров заново
+constexpr std::chrono::seconds CHOKER_TICK_INTERVAL(1);
+// сколько при завершении ждать ответов трекеров на stopped, прежде чем прервать udp-запросы
+constexpr std::chrono::seconds STOPPED_ANNOUNCE_GRACE(3);
+
+// Сколько потоков пула соединений держать для входящих: четверть пула, но не больше --max-uploads
+size_t IncomingReserve(const SessionOptions& options) {
+    const size_t connections = std::max<size_t>(1, options.maxConnections);
+    if (connections < 2) {
+        return 0;
+    }
+    return std::min(options.maxUploadPeers, std::max<size_t>(1, connections / 4));
+}
+
+}
+
+struct Session::Torrent {
+    enum class State {
+        Announcing,    // первый announce (не раньше nextAnnounce)
+        Downloading,   // соединения с пирами работают, трекеры опрашиваются заново по их interval
+        Distributing,  // скачивание закончено, данные раскладываются по файлам в пуле hashers_ (до distributed)
+        Seeding,       // данные разложены, раздаем до seedUntil
+        Done,
+    };
+
+    Torrent(size_t id, const TorrentFile& tf, std::string saveDirectory, std::string tempFileName, size_t percent,
+            size_t uploadSlots, UdpTrackerClient* udpTrackers) :
+        id(id), tf(tf), saveDirectory(std::move(saveDirectory)), tempFileName(std::move(tempFileName)), percent(percent),
+        piecesToDownload(std::ceil(((static_cast<long double>(percent) / 100) * tf.pieceHashes.size()))),
+        tracker(tf.announce_list, udpTrackers), choker(uploadSlots) {}
+
+    const size_t id;  // номер торрента в пуле соединений и PeerListener
+    const TorrentFile tf;
+    const std::string saveDirectory;
+    const std::string tempFileName;
+    const size_t percent;
+    const size_t piecesToDownload;
+    TorrentTracker tracker;
+    std::unique_ptr<PieceStorage> storage;
+    Choker choker;  // объявлен после storage: держит соединения, которые ссылаются на storage
+    std::unique_ptr<PeerExchange> exchange;  // пиры, присланные соединениями торрента через ut_pex
+    std::mutex peersMutex;  // соединения добавляются из потоков запросов к трекерам
+    // живые исходящие соединения (в очереди пула или работающие); соединение убирает себя, завершившись.
+    // Пиры из повторного announce, с которыми соединение уже есть, пропускаются. guarded by peersMutex
+    std::unordered_map<Peer, std::shared_ptr<PeerConnect>> peers;
+    // соединения с web seed из url-list; завершившиеся заменяются новыми при следующем announce. guarded by peersMutex
+    std::vector<std::shared_ptr<WebSeed>> webSeeds;
+    // серверы из url-list, которые не понимают Range: к ним больше не подключаемся. guarded by peersMutex
+    std::unordered_set<std::string> rangelessWebSeeds;
+    bool acceptPeers = false;  // опоздавшие ответы трекеров после StopConnections отбрасываются, guarded by peersMutex
+    State state = State::Announcing;
+    size_t failedAnnounces = 0;
+    bool announcing = false;  // результат опроса трекеров еще не учтен
+    std::atomic<bool> dhtSearching = false;  // поиск в DHT текущего опроса еще идет
+    std::atomic<bool> distributed = false;  // раскладка по файлам в состоянии Distributing закончена
+    std::atomic<size_t> roundPeers = 0;  // сколько пиров прислали трекеры и DHT в текущем опросе
+    size_t peersAfterAnnounce = 0;  // сколько было живых соединений после последнего удачного опроса
+    size_t chokerTimer = 0;  // периодический таймер Tick в EventLoop сессии
+    std::chrono::steady_clock::time_point lastAnnounce, nextAnnounce, seedUntil;
+};
+
+Session::Session(const SessionOptions& options) :
+    options_(options), peerId_("TESTAPPDONTWORRY" + RandomString(4)), writer_(64, options.fsyncPolicy),
+    memoryBudget_(options.memoryLimit),
+    hashers_(options.hashThreads != 0 ? options.hashThreads : std::max(1U, std::thread::hardware_concurrency())),
+    connections_(std::max<size_t>(1, options.maxConnections)) {
+    try {
+        udpTrackers_ = std::make_unique<UdpTrackerClient>();
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << ". UDP trackers are disabled" << std::endl;
+    }
+    if (options_.dht) {
+        try {
+            dht_ = std::make_unique<DhtNode>(DhtNode::Options{options_.port, options_.dhtBootstrap,
+                                                              options_.dhtCacheFile});
+        } catch (const std::runtime_error& e) {
+            std::cerr << e.what() << ". DHT is disabled" << std::endl;
+        }
+    }
+    // входящие соединения принимаем с самого начала: уже скачанные части раздаются, пока качаются остальные
+    try {
+        listener_ = std::make_unique<PeerListener>(options_.port, peerId_, connections_, options_.maxUploadPeers);
+    } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << ". Seeding is disabled" << std::endl;
+    }
+    if (listener_) {
+        // исходящие соединения живут до конца скачивания: без запаса потоков входящим не досталось бы ни одного
+        connections_.ReserveForImmediate(IncomingReserve(options_));
+    }
+    if (options_.metricsPort != 0) {
+        try {
+            metrics_ = std::make_unique<MetricsServer>(options_.metricsPort, [this]() {
+                return CollectGauges();
+            });
+        } catch (const std::runtime_error& e) {
+            std::cerr << e.what() << ". Metrics endpoint is disabled" << std::endl;
+        }
+    }
+}
+
+Session::~Session() {
+    metrics_.reset();
+    if (dht_) {
+        dht_->Stop();
+    }
+    if (listener_) {
+        listener_->Stop();
+    }
+    // stopped, отправленный из Close, успевает дойти до udp-трекеров, но не задерживает выход надолго
+    const auto stoppedDeadline = std::chrono::steady_clock::now() + STOPPED_ANNOUNCE_GRACE;
+    for (auto& torrent : torrents_) {
+        while (torrent->tracker.IsSendingEvents() && std::chrono::steady_clock::now() < stoppedDeadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    if (udpTrackers_) {
+        udpTrackers_->Stop();
+    }
+    for (auto& torrent : torrents_) {
+        StopConnections(*torrent);
+        torrent->tracker.Wait();
+    }
+    connections_.Join();
+    hashers_.Join();
+    // все соединения завершились: в итоги попадают и их байты
+    if (!options_.metricsJsonFile.empty()) {
+        std::ofstream output(options_.metricsJsonFile);
+        output << Metrics::FormatJson(Metrics::Collect(), CollectGauges());
+        if (!output) {
+            std::cerr << "Cannot write metrics to " << options_.metricsJsonFile << std::endl;
+        }
+    }
+}
+
+void Session::AddTorrent(const TorrentFile& tf, const std::string& saveDirectory, size_t percent) {
+    std::cout << "\n\n\nСкачивание " << percent << "% торрента " << tf.name << " в директорию " << saveDirectory << std::endl;
+    const std::filesystem::path outputDirectory = PrepareDownloadDirectory(saveDirectory);
+    auto torrent = std::make_unique<Torrent>(torrents_.size(), tf, saveDirectory,
+                                             (outputDirectory / RandomString(40)).string(), percent, options_.uploadSlots,
+                                             udpTrackers_.get());
+    torrent->storage = std::make_unique<PieceStorage>(torrent->tf, outputDirectory, torrent->tempFileName, writer_,
+                                                      memoryBudget_, options_.storage, &hashers_);
+    torrent->storage->SetNewSize(torrent->piecesToDownload);
+    // окончание скачивания замечается сразу после записи последней части, а не при следующей проверке
+    torrent->storage->SetOnPieceSaved([this]() {
+        events_.Notify();
+    });
+    torrent->chokerTimer = events_.AddPeriodicTimer(CHOKER_TICK_INTERVAL, [torrentPtr = torrent.get()]() {
+        if (torrentPtr->state == Torrent::State::Downloading) {
+            torrentPtr->choker.Tick(false);
+        } else if (torrentPtr->state == Torrent::State::Seeding) {
+            torrentPtr->choker.Tick(true);
+        }
+    });
+    // пиры из PEX добавляются к соединениям так же, как пиры от трекеров и DHT
+    torrent->exchange = std::make_unique<PeerExchange>(listener_ ? options_.port : 0,
+                                                       [this, torrentPtr = torrent.get()](const std::vector<Peer>& peers) {
+        AddPeers(*torrentPtr, peers);
+    });
+    if (listener_) {
+        listener_->AddTorrent(torrent->id, torrent->tf, *torrent->storage, torrent->choker, torrent->exchange.get());
+    }
+    std::lock_guard lock(torrentsMutex_);
+    torrents_.push_back(std::move(torrent));
+}
+
+void Session::Run() {
+    while (true) {
+        bool working = false;
+        const auto now = std::chrono::steady_clock::now();
+        auto wakeUp = std::chrono::steady_clock::time_point::max();
+        for (auto& torrent : torrents_) {
+            if (torrent->state != Torrent::State::Done) {
+                Step(*torrent, now);
+            }
+            working |= torrent->state != Torrent::State::Done;
+            wakeUp = std::min(wakeUp, WakeUpTime(*torrent));
+        }
+        if (!working) {
+            break;
+        }
+        // Step уже видел этот срок и ничего по нему не сделал: повторная проверка сразу же превратила бы
+        // ожидание в активный цикл, поэтому ждем события или следующего такта
+        if (wakeUp <= now) {
+            wakeUp = now + CHOKER_TICK_INTERVAL;
+        }
+        // спим до события (часть записана, трекеры ответили, соединение завершилось), таймера или своего срока
+        events_.RunOnce(wakeUp);
+    }
+}
+
+std::chrono::steady_clock::time_point Session::WakeUpTime(const Torrent& torrent) {
+    using State = Torrent::State;
+    switch (torrent.state) {
+        case State::Announcing:
+            return torrent.nextAnnounce;
+        case State::Downloading:
+            if (torrent.tracker.IsUpdating() || torrent.dhtSearching) {
+                // конец опроса сообщат колбэки трекеров и DHT, но учесть опрос надо не позже таймаута
+                return torrent.announcing ? torrent.lastAnnounce + ANNOUNCE_ROUND_TIMEOUT
+                                          : std::chrono::steady_clock::time_point::max();
+            }
+            return torrent.nextAnnounce;
+        case State::Seeding:
+            return torrent.seedUntil;
+        case State::Distributing:  // конец раскладки сообщит Notify
+        case State::Done:
+            break;
+    }
+    return std::chrono::steady_clock::time_point::max();
+}
+
+void Session::Step(Torrent& torrent, std::chrono::steady_clock::time_point now) {
+    using State = Torrent::State;
+    switch (torrent.state) {
+        case State::Announcing:
+            if (now < torrent.nextAnnounce) {
+                break;
+            }
+            // соединения с пирами начинаются по ответу первого трекера, не дожидаясь остальных
+            Announce(torrent, now);
+            torrent.state = State::Downloading;
+            break;
+        case State::Downloading: {
+            if (torrent.storage->PiecesSavedToDiscCount() >= torrent.piecesToDownload) {
+                {
+                    std::lock_guard<std::mutex> coutLock(coutMutex);
+                    std::cout << "Terminating all peer connections of " << torrent.tf.name << std::endl;
+                }
+                StopConnections(torrent);
+                Complete(torrent);
+                break;
+            }
+            const bool roundRunning = torrent.tracker.IsUpdating() || torrent.dhtSearching;
+            if (torrent.announcing && roundRunning && torrent.roundPeers == 0 &&
+                now - torrent.lastAnnounce < ANNOUNCE_ROUND_TIMEOUT) {
+                break;
+            }
+            const size_t livePeers = LivePeersCount(torrent);
+            if (torrent.announcing) {
+                torrent.announcing = false;
+                if (torrent.roundPeers == 0) {
+                    if (++torrent.failedAnnounces > MAX_FAILED_ANNOUNCES && livePeers == 0) {
+                        std::cerr << "Error in updating peers for " << torrent.tf.name << "!" << std::endl;
+                        Close(torrent);
+                        break;
+                    }
+                    // повторный announce не раньше min interval, иначе трекер может отклонить запрос
+                    const auto backoff = std::min<std::chrono::seconds>(
+                        DEFAULT_ANNOUNCE_INTERVAL,
+                        FAILED_ANNOUNCE_BACKOFF * (1 << std::min<size_t>(torrent.failedAnnounces - 1, 6)));
+                    torrent.nextAnnounce = std::max(torrent.tracker.NextAnnounceAllowed(), now + backoff);
+                } else {
+                    torrent.failedAnnounces = 0;
+                    torrent.peersAfterAnnounce = livePeers;
+                    const auto interval = torrent.tracker.GetInterval();
+                    torrent.nextAnnounce = torrent.lastAnnounce +
+                                           (interval.count() > 0 ? interval : DEFAULT_ANNOUNCE_INTERVAL);
+                }
+            }
+            if (roundRunning) {
+                // новый опрос начнется, когда закончится текущий: StartUpdatePeers дожидался бы его, блокируя поток
+                break;
+            }
+            // Внеочередной announce, если соединений осталось меньше половины или ни одно не приносит частей.
+            // Работающие соединения при этом не трогаем: новые пиры добавляются к ним.
+            // После неудачного опроса ждем nextAnnounce, иначе внеочередные опросы обошли бы backoff
+            const bool starving = torrent.failedAnnounces == 0 &&
+                                  (livePeers == 0 || livePeers * 2 < torrent.peersAfterAnnounce ||
+                                   torrent.storage->PiecesInProgressCount() == 0);
+            if (now >= torrent.nextAnnounce ||
+                (starving && now - torrent.lastAnnounce >= STARTUP_GRACE_PERIOD &&
+                 now >= torrent.tracker.NextAnnounceAllowed())) {
+                {
+                    std::lock_guard<std::mutex> coutLock(coutMutex);
+                    std::cout << "Requesting more peers for " << torrent.tf.name << ", " << livePeers
+                              << " peer connections are alive" << std::endl;
+                }
+                Announce(torrent, now);
+            }
+            break;
+        }
+        case State::Distributing:
+            if (torrent.distributed) {
+                FinishCompletion(torrent);
+            }
+            break;
+        case State::Seeding:
+            if (now >= torrent.seedUntil) {
+                Close(torrent);
+            }
+            break;
+        case State::Done:
+            break;
+    }
+}
+
+void Session::Announce(Torrent& torrent, std::chrono::steady_clock::time_point now) {
+    torrent.announcing = true;
+    torrent.lastAnnounce = now;
+    torrent.roundPeers = 0;
+    {
+        std::lock_guard lock(torrent.peersMutex);
+        torrent.acceptPeers = true;
+    }
+    // вызывается из потоков запросов к трекерам по одному разу на каждый ответ с новыми пирами
+    torrent.tracker.StartUpdatePeers(torrent.tf, peerId_, options_.port, CurrentStats(torrent),
+                                     [this, &torrent](const std::vector<Peer>& peers) {
+        AddPeers(torrent, peers);
+    }, [this]() {
+        events_.Notify();
+    });
+    StartWebSeeds(torrent);
+    if (dht_) {
+        torrent.dhtSearching = true;
+        // ближайшим к торренту узлам сообщаем о себе, только если принимаем входящие соединения
+        dht_->GetPeers(torrent.tf.infoHash, listener_ ? options_.port : 0, [this, &torrent](const std::vector<Peer>& peers) {
+            AddPeers(torrent, peers);
+        }, [this, &torrent] {
+            torrent.dhtSearching = false;
+            events_.Notify();
+        });
+    }
+}
+
+AnnounceStats Session::CurrentStats(const Torrent& torrent, AnnounceStats::Event event) {
+    AnnounceStats stats;
+    stats.downloaded = torrent.storage->BytesSavedToDisc();
+    stats.left = torrent.tf.length - std::min<uint64_t>(stats.downloaded, torrent.tf.length);
+    Choker::PeerTraffic other;
+    for (const auto& [peer, traffic] : torrent.choker.Traffic(other)) {
+        stats.uploaded += traffic.uploaded;
+    }
+    stats.uploaded += other.uploaded;
+    stats.event = event;
+    return stats;
+}
+
+void Session::AddPeers(Torrent& torrent, const std::vector<Peer>& peers) {
+    torrent.roundPeers += peers.size();
+    std::lock_guard lock(torrent.peersMutex);
+    if (!torrent.acceptPeers) {
+        return;
+    }
+    size_t added = 0;
+    for (const Peer& peer : peers) {
+        if (torrent.peers.contains(peer)) {
+            continue;
+        }
+        ++added;
+        auto peerConnectPtr = std::make_shared<PeerConnect>(peer, torrent.tf, peerId_, *torrent.storage,
+                                                            torrent.exchange.get());
+        torrent.peers.emplace(peer, peerConnectPtr);
+        torrent.choker.AddPeer(peerConnectPtr);
+        connections_.Submit(torrent.id, [this, &torrent, peer, peerConnectPtr]() {
+            bool tryAgain = true;
+            int attempts = 0;
+            do {
+                try {
+                    ++attempts;
+                    peerConnectPtr->Run();
+                } catch (const std::exception&) {
+                }
+                // после Terminate переподключаться не нужно: торрент скачан или соединения остановлены
+                tryAgain = peerConnectPtr->Failed() && attempts < 3 && !peerConnectPtr->IsTerminated();
+            } while (tryAgain);
+            // Choker выбросит завершенное соединение, а следующий announce сможет подключиться к пиру заново
+            peerConnectPtr->Terminate();
+            {
+                std::lock_guard lock(torrent.peersMutex);
+                if (auto it = torrent.peers.find(peer); it != torrent.peers.end() && it->second == peerConnectPtr) {
+                    torrent.peers.erase(it);
+                }
+            }
+            // соединений стало меньше: возможно, пора запросить пиров заново
+            events_.Notify();
+        });
+    }
+    if (added == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> coutLock(coutMutex);
+    std::cout << "Found " << added << " new peers for " << torrent.tf.name << " (" << torrent.peers.size()
+              << " connections)" << std::endl;
+}
+
+void Session::StartWebSeeds(Torrent& torrent) {
+    std::lock_guard lock(torrent.peersMutex);
+    if (!torrent.acceptPeers) {
+        return;
+    }
+    std::erase_if(torrent.webSeeds, [&torrent](const std::shared_ptr<WebSeed>& seed) {
+        if (seed->RangesUnsupported()) {
+            torrent.rangelessWebSeeds.insert(seed->Url());
+        }
+        return seed->IsTerminated();
+    });
+    size_t started = 0;
+    for (const std::string& url : torrent.tf.url_list) {
+        if (torrent.rangelessWebSeeds.contains(url)) {
+            continue;
+        }
+        size_t running = std::count_if(torrent.webSeeds.begin(), torrent.webSeeds.end(),
+                                       [&url](const std::shared_ptr<WebSeed>& seed) {
+            return seed->Url() == url;
+        });
+        for (; running < options_.webSeedConnections; ++running, ++started) {
+            auto seed = std::make_shared<WebSeed>(url, torrent.tf, *torrent.storage);
+            torrent.webSeeds.push_back(seed);
+            connections_.Submit(torrent.id, [this, seed]() {
+                seed->Run();
+                events_.Notify();
+            });
+        }
+    }
+    if (started == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> coutLock(coutMutex);
+    std::cout << "Started " << started << " web seed connections for " << torrent.tf.name << std::endl;
+}
+
+size_t Session::LivePeersCount(Torrent& torrent) {
+    std::lock_guard lock(torrent.peersMutex);
+    // web seed, который еще качает, тоже приносит части: без пиров торрент из-за него не закрывается
+    return torrent.peers.size() + std::count_if(torrent.webSeeds.begin(), torrent.webSeeds.end(),
+                                                [](const std::shared_ptr<WebSeed>& seed) {
+        return !seed->IsTerminated();
+    });
+}
+
+void Session::StopConnections(Torrent& torrent) {
+    connections_.Cancel(torrent.id);
+    std::lock_guard lock(torrent.peersMutex);
+    torrent.acceptPeers = false;
+    for (auto& [peer, peerConnectPtr] : torrent.peers) {
+        peerConnectPtr->Terminate();
+    }
+    // соединения, выброшенные из очереди пула, сами себя уже не уберут
+    torrent.peers.clear();
+    for (auto& seed : torrent.webSeeds) {
+        seed->Terminate();
+    }
+    torrent.webSeeds.clear();
+}
+
+void Session::Complete(Torrent& torrent) {
+    if (torrent.percent == 100) {
+        // completed -- только когда скачан весь торрент
+        torrent.tracker.AnnounceEvent(torrent.tf, peerId_, options_.port,
+                                      CurrentStats(torrent, AnnounceStats::Event::Completed));
+        std::cout << "Distributing files of " << torrent.tf.name << "..." << std::endl;
+        // копирование всего торрента не держит управляющий поток: остальные торренты тем временем обслуживаются
+        torrent.state = Torrent::State::Distributing;
+        hashers_.Submit([this, &torrent]() {
+            DistributePiecesBetweenFiles(torrent.tf, torrent.tempFileName, torrent.saveDirectory);
+            torrent.distributed = true;
+            events_.Notify();
+        });
+        return;
+    }
+    FinishCompletion(torrent);
+}
+
+void Session::FinishCompletion(Torrent& torrent) {
+    if (torrent.percent == 100) {
+        if (listener_) {
+            // дальше раздаем из итоговых файлов
+            std::vector<std::pair<std::filesystem::path, size_t>> files;
+            for (const auto& file : torrent.tf.files) {
+                files.emplace_back(DownloadedFilePath(torrent.tf, file, torrent.saveDirectory), file.length);
+            }
+            try {
+                torrent.storage->SetUploadReader(std::make_shared<MultiFileReader>(files));
+            } catch (const std::runtime_error& e) {
+                std::cerr << e.what() << std::endl;
+            }
+        }
+    }
+    // раздача из временного файла продолжает работать: он остается открытым до конца работы PieceStorage
+    DeleteDownloadedFile(torrent.tempFileName);
+
+    if (listener_ && options_.seedTimeSeconds > 0) {
+        std::cout << "Seeding " << torrent.tf.name << " for " << options_.seedTimeSeconds << " seconds" << std::endl;
+        torrent.seedUntil = std::chrono::steady_clock::now() + std::chrono::seconds(options_.seedTimeSeconds);
+        // сразу пересчитываем слоты: теперь пиров надо ранжировать по скорости раздачи им
+        torrent.choker.Recalculate(true);
+        torrent.state = Torrent::State::Seeding;
+    } else {
+        Close(torrent);
+    }
+}
+
+void Session::Close(Torrent& torrent) {
+    events_.CancelTimer(torrent.chokerTimer);
+    StopConnections(torrent);
+    torrent.tracker.AnnounceEvent(torrent.tf, peerId_, options_.port,
+                                  CurrentStats(torrent, AnnounceStats::Event::Stopped));
+    if (listener_) {
+        listener_->RemoveTorrent(torrent.id);
+    }
+    DeleteDownloadedFile(torrent.tempFileName);
+    ReadCache::Stats cacheStats;
+    if (torrent.storage->GetReadCacheStats(cacheStats)) {
+        std::cout << "Upload cache of " << torrent.tf.name << ": hit rate " << cacheStats.HitRate() * 100
+                  << "%, read amplification " << cacheStats.ReadAmplification() << std::endl;
+    }
+    torrent.state = Torrent::State::Done;
+}
+
+std::vector<Metrics::Gauge> Session::CollectGauges() const {
+    std::vector<Metrics::Gauge> gauges;
+    {
+        std::lock_guard lock(torrentsMutex_);
+        for (const auto& torrent : torrents_) {
+            const std::vector<std::pair<std::string, std::string>> label = {{"torrent", torrent->tf.name}};
+            const size_t saved = torrent->storage->PiecesSavedToDiscCount();
+            const size_t inProgress = torrent->storage->PiecesInProgressCount();
+            const size_t queued = torrent->piecesToDownload - std::min(torrent->piecesToDownload, saved + inProgress);
+            const char* piecesHelp = "Pieces to download by state";
+            gauges.push_back({"torrent_client_pieces", piecesHelp, {label[0], {"state", "saved"}},
+                              static_cast<double>(saved)});
+            gauges.push_back({"torrent_client_pieces", piecesHelp, {label[0], {"state", "in_progress"}},
+                              static_cast<double>(inProgress)});
+            gauges.push_back({"torrent_client_pieces", piecesHelp, {label[0], {"state", "queued"}},
+                              static_cast<double>(queued)});
+
+            size_t connected = 0, chokingUs = 0, outstanding = 0;
+            for (const auto& peer : torrent->choker.Peers()) {
+                if (peer->IsTerminated()) {
+                    continue;
+                }
+                ++connected;
+                chokingUs += peer->IsChoked();
+                outstanding += peer->OutstandingRequests();
+            }
+            gauges.push_back({"torrent_client_peer_connections", "Established peer connections", label,
+                              static_cast<double>(connected)});
+            gauges.push_back({"torrent_client_peers_choking_us", "Connected peers that keep us choked", label,
+                              static_cast<double>(chokingUs)});
+            gauges.push_back({"torrent_client_outstanding_requests", "Block requests waiting for data", label,
+                              static_cast<double>(outstanding)});
+            gauges.push_back({"torrent_client_connection_queue", "Outgoing connections waiting for a pool worker",
+                              label, static_cast<double>(connections_.PendingCount(torrent->id))});
+
+            Choker::PeerTraffic other;
+            auto traffic = torrent->choker.Traffic(other);
+            std::vector<std::pair<std::string, Choker::PeerTraffic>> peers;
+            peers.reserve(traffic.size() + 1);
+            for (const auto& [peer, bytes] : traffic) {
+                peers.emplace_back(peer.family == AF_INET6 ? "[" + peer.Ip() + "]:" + std::to_string(peer.port)
+                                                           : peer.Ip() + ":" + std::to_string(peer.port), bytes);
+            }
+            // адреса, вытесненные из учета по отдельности (см. Choker::Traffic)
+            if (other.downloaded != 0 || other.uploaded != 0) {
+                peers.emplace_back("other", other);
+            }
+            for (const auto& [address, bytes] : peers) {
+                gauges.push_back({"torrent_client_peer_downloaded_bytes_total", "Block data received from the peer",
+                                  {label[0], {"peer", address}}, static_cast<double>(bytes.downloaded), true});
+                gauges.push_back({"torrent_client_peer_uploaded_bytes_total", "Block data sent to the peer",
+                                  {label[0], {"peer", address}}, static_cast<double>(bytes.uploaded), true});
+            }
+        }
+    }
+    gauges.push_back({"torrent_client_disk_queue", "Pieces waiting for the disk writer", {},
+                      static_cast<double>(writer_.QueueSize())});
+    gauges.push_back({"torrent_client_hash_queue", "Pieces waiting for a hash thread", {},
+                      static_cast<double>(hashers_.QueuedCount())});
+    gauges.push_back({"torrent_client_memory_used_bytes", "Memory taken by blocks of unsaved pieces", {},
+                      static_cast<double>(memoryBudget_.Used())});
+    // метрики с одним именем в выводе должны идти подряд, а собраны они по торрентам
+    std::stable_sort(gauges.begin(), gauges.end(), [](const Metrics::Gauge& lhs, const Metrics::Gauge& rhs) {
+        return lhs.name < rhs.name;
+    });
+    return gauges;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include "torrent_file.h"
+#include "piece_storage.h"
+#include "disk_writer.h"
+#include "memory_budget.h"
+#include "connection_pool.h"
+#include "peer_listener.h"
+#include "StaticThreadPool.h"
+#include "udp_tracker.h"
+#include "dht.h"
+#include "event_loop.h"
+#include "metrics_server.h"
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Параметры сессии, задаваемые из командной строки. Лимиты общие для всех торрентов сессии
+ */
+struct SessionOptions {
+    StorageOptions storage;
+    FsyncPolicy fsyncPolicy = FsyncPolicy::None;
+    size_t memoryLimit = 0; // лимит памяти под данные частей в байтах, 0 -- без ограничений
+    int port = 12345; // порт для входящих соединений, сообщается трекеру
+    size_t maxUploadPeers = 8; // сколько входящих соединений обслуживается одновременно
+    size_t uploadSlots = 4; // скольким самым быстрым пирам каждого торрента открыта раздача, не считая optimistic unchoke
+    size_t seedTimeSeconds = 0; // сколько еще раздавать торрент после окончания скачивания
+    size_t maxConnections = 32; // сколько всего соединений с пирами (входящих и исходящих) может быть открыто
+    size_t hashThreads = 0; // потоков проверки хешей частей, 0 -- по числу ядер
+    bool dht = true; // искать пиров еще и в DHT, на UDP-порту с номером `port`
+    std::vector<std::string> dhtBootstrap = {"router.bittorrent.com:6881", "dht.transmissionbt.com:6881",
+                                             "router.utorrent.com:6881"}; // host:port для первого входа в DHT
+    std::string dhtCacheFile; // где хранить известные узлы DHT между запусками, пусто -- не хранить
+    size_t webSeedConnections = 2; // сколько соединений открывать с каждым web seed из url-list, 0 -- не качать с них
+    int metricsPort = 0; // порт HTTP-сервера метрик на 127.0.0.1 (MetricsServer), 0 -- не запускать
+    std::string metricsJsonFile; // куда записать метрики в JSON при завершении, пусто -- не записывать
+};
+
+/*
+ * Скачивание и раздача нескольких торрентов в одном процессе.
+ * Все торренты работают через один пул соединений с общим лимитом и очередью по кругу между торрентами
+ * (ConnectionPool), один пул проверки хешей, один поток записи на диск, один бюджет памяти,
+ * один UDP-сокет для трекеров udp://, один узел DHT и один порт для входящих соединений. Координация (трекеры, choker, завершение) идет из потока, вызвавшего Run:
+ * он спит, пока другие потоки не сообщат о событии или не подойдет срок таймера (EventLoop)
+ */
+class Session {
+public:
+    explicit Session(const SessionOptions& options);
+
+    /*
+     * Завершает все соединения и дожидается их потоков
+     */
+    ~Session();
+
+    /*
+     * Добавить торрент: первые `percent` процентов частей скачиваются в `saveDirectory`.
+     * Скачивание начнется при следующем шаге Run
+     */
+    void AddTorrent(const TorrentFile& tf, const std::string& saveDirectory, size_t percent = 100);
+
+    /*
+     * Работать, пока все торренты не будут скачаны и не отраздают `seedTimeSeconds`
+     */
+    void Run();
+private:
+    struct Torrent;
+
+    /*
+     * Продвинуть торрент по его состояниям: announce, скачивание (с повторными announce), раскладка по файлам, раздача
+     */
+    void Step(Torrent& torrent, std::chrono::steady_clock::time_point now);
+
+    /*
+     * Когда торрент надо проверить, даже если ничего не произошло: срок announce или конца раздачи.
+     * Пока идет опрос трекеров и DHT, срока нет: о его окончании сообщают их колбэки через Notify
+     */
+    static std::chrono::steady_clock::time_point WakeUpTime(const Torrent& torrent);
+
+    /*
+     * Начать опрос трекеров и поиск в DHT: соединения с новыми пирами ставятся в очередь пула по мере ответов,
+     * уже открытые соединения остаются. Закончен ли опрос, видно по tracker.IsUpdating() и dhtSearching
+     */
+    void Announce(Torrent& torrent, std::chrono::steady_clock::time_point now);
+
+    /*
+     * Счетчики для announce: скачано -- сохраненные части, роздано -- по всем соединениям торрента
+     */
+    static AnnounceStats CurrentStats(const Torrent& torrent, AnnounceStats::Event event = AnnounceStats::Event::None);
+
+    /*
+     * Поставить в очередь пула соединения с пирами, с которыми соединения еще нет.
+     * Вызывается из потоков трекеров, потока DHT и потоков соединений (пиры из ut_pex)
+     */
+    void AddPeers(Torrent& torrent, const std::vector<Peer>& peers);
+
+    /*
+     * Довести число соединений с каждым web seed торрента до `webSeedConnections`.
+     * Соединения работают в пуле наравне с пирами и берут части из той же очереди
+     */
+    void StartWebSeeds(Torrent& torrent);
+
+    /*
+     * Сколько исходящих соединений торрента (с пирами и web seed) стоят в очереди пула или работают
+     */
+    static size_t LivePeersCount(Torrent& torrent);
+
+    /*
+     * Завершить исходящие соединения торрента и выбросить ждущие в очереди
+     */
+    void StopConnections(Torrent& torrent);
+
+    /*
+     * Скачивание закончено: сообщить трекерам completed и начать раскладывать данные по файлам в пуле hashers_,
+     * дальше раздавать из них (см. FinishCompletion)
+     */
+    void Complete(Torrent& torrent);
+
+    /*
+     * Данные разложены по файлам (или торрент скачан не целиком): раздавать до seedUntil или закрыть торрент
+     */
+    void FinishCompletion(Torrent& torrent);
+
+    /*
+     * Торрент больше не обслуживается, трекерам уходит stopped
+     */
+    void Close(Torrent& torrent);
+
+    /*
+     * Метрики, которые снимаются в момент запроса: состояние частей, соединения и байты по пирам каждого торрента,
+     * глубина очередей. Вызывается из потока MetricsServer и при завершении
+     */
+    std::vector<Metrics::Gauge> CollectGauges() const;
+
+    const SessionOptions options_;
+    const std::string peerId_;
+    EventLoop events_;  // объявлен раньше всего, что может звать Notify из своих потоков
+    DiskWriter writer_;
+    MemoryBudget memoryBudget_;
+    std::unique_ptr<UdpTrackerClient> udpTrackers_;  // общий для всех торрентов: connection_id кешируется по трекерам
+    std::unique_ptr<DhtNode> dht_;  // останавливается первым: его колбэки ссылаются на торренты
+    mutable std::mutex torrentsMutex_;  // AddTorrent против потока метрик
+    std::vector<std::unique_ptr<Torrent>> torrents_;  // добавляются под torrentsMutex_
+    StaticThreadPool hashers_;
+    ConnectionPool connections_;
+    std::unique_ptr<PeerListener> listener_;
+    std::unique_ptr<MetricsServer> metrics_;
+};
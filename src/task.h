@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Задача без аргументов и результата, как std::function<void()>, но только перемещаемая и без выделения памяти
+ * для небольших функторов: лямбда с захватом до INLINE_SIZE байт лежит прямо в объекте задачи, большие
+ * (и те, что могут бросить исключение при перемещении) -- в куче. Благодаря перемещаемости в задачу можно положить
+ * std::packaged_task и другие функторы, которые нельзя копировать
+ */
+class Task {
+public:
+    static constexpr size_t INLINE_SIZE = 48;
+
+    Task() noexcept = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) {
+        using Functor = std::decay_t<F>;
+        if constexpr (sizeof(Functor) <= INLINE_SIZE && alignof(Functor) <= alignof(std::max_align_t) &&
+                      std::is_nothrow_move_constructible_v<Functor>) {
+            new (storage_) Functor(std::forward<F>(f));
+            ops_ = &INLINE_OPS<Functor>;
+        } else {
+            new (storage_) Functor*(new Functor(std::forward<F>(f)));
+            ops_ = &HEAP_OPS<Functor>;
+        }
+    }
+
+    Task(Task&& other) noexcept : ops_(other.ops_) {
+        if (ops_ != nullptr) {
+            ops_->move(other.storage_, storage_);
+            other.ops_ = nullptr;
+        }
+    }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            ops_ = other.ops_;
+            if (ops_ != nullptr) {
+                ops_->move(other.storage_, storage_);
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        Reset();
+    }
+
+    void operator()() {
+        ops_->invoke(storage_);
+    }
+
+    explicit operator bool() const noexcept {
+        return ops_ != nullptr;
+    }
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* from, void* to) noexcept;  // перемещает функтор и разрушает его в `from`
+        void (*destroy)(void* storage) noexcept;
+    };
+
+    template <typename Functor>
+    static constexpr Ops INLINE_OPS = {
+        [](void* storage) {
+            (*std::launder(static_cast<Functor*>(storage)))();
+        },
+        [](void* from, void* to) noexcept {
+            Functor* source = std::launder(static_cast<Functor*>(from));
+            new (to) Functor(std::move(*source));
+            source->~Functor();
+        },
+        [](void* storage) noexcept {
+            std::launder(static_cast<Functor*>(storage))->~Functor();
+        },
+    };
+
+    template <typename Functor>
+    static constexpr Ops HEAP_OPS = {
+        [](void* storage) {
+            (**std::launder(static_cast<Functor**>(storage)))();
+        },
+        [](void* from, void* to) noexcept {
+            new (to) Functor*(*std::launder(static_cast<Functor**>(from)));
+        },
+        [](void* storage) noexcept {
+            delete *std::launder(static_cast<Functor**>(storage));
+        },
+    };
+
+    void Reset() noexcept {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+    alignas(std::max_align_t) unsigned char storage_[INLINE_SIZE];
+    const Ops* ops_ = nullptr;
+};
@@ -1,9 +1,11 @@
 #include "tcp_connect.h"
+#include "event_fd.h"
 #include "byte_tools.h"
 #include "bencode.h"
 
 
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <arpa/inet.h>
 #include <stdexcept>
 #include <cstring>
@@ -13,25 +15,57 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
 #include <limits>
 #include <utility>
 #include <cassert>
+#include <netinet/tcp.h>
 
+namespace {
 
+// пир, который столько не принимает данные (окно приема нулевое), считается отвалившимся
+constexpr int SEND_TIMEOUT_MS = 30000;
 
-TcpConnect::TcpConnect(std::string ip, int port, std::chrono::milliseconds connectTimeout,
-                       std::chrono::milliseconds readTimeout) : ip_(std::move(ip)), port_(port),
+/*
+ * Короткие сообщения (have, request) уходят сразу, не дожидаясь ACK на предыдущие: иначе алгоритм Нейгла
+ * задерживает request, отправленный вслед за have, до delayed ACK пира (до 40 мс на каждую часть).
+ * Склеивать сообщения там, где это нужно, можно через MSG_MORE в SendData
+ */
+void EnableNoDelay(int sock) {
+    int enable = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+}
+
+
+TcpConnect::TcpConnect(const Peer& peer, std::chrono::milliseconds connectTimeout,
+                       std::chrono::milliseconds readTimeout) : peer_(peer),
                                                                 connectTimeout_(connectTimeout),
-                                                                readTimeout_(readTimeout), sock_(-1) {}
+                                                                readTimeout_(readTimeout), sock_(-1),
+                                                                wakeFd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+
+TcpConnect::TcpConnect(int sock, const Peer& peer, std::chrono::milliseconds readTimeout) :
+    peer_(peer), connectTimeout_(0), readTimeout_(readTimeout), sock_(sock),
+    wakeFd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    // как и у исходящих: запись ждет места в буфере через poll, чтобы ее мог прервать Interrupt
+    fcntl(sock_, F_SETFL, fcntl(sock_, F_GETFL) | O_NONBLOCK);
+    EnableNoDelay(sock_);
+}
 
 TcpConnect::~TcpConnect() {
     CloseConnection();
+    if (wakeFd_ >= 0) {
+        close(wakeFd_);
+    }
 }
 
 
 void TcpConnect::EstablishConnection() {
+    // при переподключении закрываем предыдущий сокет
+    CloseConnection();
     // Создаем сокет
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int sock = socket(peer_.family, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (sock < 0) {
         throw std::runtime_error(std::string("Failed to create socket: ") + std::strerror(errno));
     }
@@ -40,28 +74,30 @@ void TcpConnect::EstablishConnection() {
         throw std::runtime_error(std::string("Failed to set socket to non-blocking mode: ") + std::strerror(errno));
     }
 
-    // Задаем адрес сервера
-    // assert(t1 == t2);
-    sockaddr_in _sockaddr = {AF_INET, htons(port_), BytesToInt(Bencode::getCompactIp(ip_, true))};
-    // sockaddr_in _sockaddr = {AF_INET, htons(port_), inet_addr(ip_.c_str())};
-    
+    // Задаем адрес сервера (IPv4 или IPv6)
+    sockaddr_storage _sockaddr;
+    socklen_t sockaddrLength = peer_.ToSockaddr(_sockaddr);
 
     // Подключаемся к серверу
-    assert(sizeof(sockaddr) == sizeof(sockaddr_in)); // for normal reinterpret_cast
-    int result = connect(sock,  reinterpret_cast<sockaddr*>(&_sockaddr), sizeof(sockaddr));
+    int result = connect(sock, reinterpret_cast<sockaddr*>(&_sockaddr), sockaddrLength);
     if (result < 0 && errno != EINPROGRESS) {
         throw std::runtime_error("Error in setting up a connection! Error:\t" + errno);
     }
 
-    pollfd _pollfd = {sock, POLLOUT, 0};
+    // poll пропускает отрицательный дескриптор, так что без eventfd ждем только сокет
+    pollfd _pollfd[2] = {{sock, POLLOUT, 0}, {wakeFd_, POLLIN, 0}};
     auto start = std::chrono::steady_clock::now();
-    while (!(_pollfd.revents & POLLOUT)) {
+    while (!(_pollfd[0].revents & POLLOUT)) {
         auto now = std::chrono::steady_clock::now();
         auto delta = std::chrono::duration_cast<std::chrono::milliseconds>(now - start);
         if (delta > connectTimeout_) {
             throw std::runtime_error("Connection timed out!");
         }
-        result = poll(&_pollfd, 1, connectTimeout_.count() - delta.count());
+        result = poll(_pollfd, 2, connectTimeout_.count() - delta.count());
+        if (result > 0 && (_pollfd[1].revents & POLLIN)) {
+            close(sock);
+            throw std::runtime_error("Connection interrupted");
+        }
         if (result < 0){
             throw std::runtime_error("Error in poll (in 'EstablishConnectin')! Error:\t" + errno);
         }
@@ -70,11 +106,8 @@ void TcpConnect::EstablishConnection() {
         }
     }
 
-    // Выключаем неблокирующий режим работы
-    if (fcntl(sock, F_SETFL, 0) < 0) {
-        throw std::runtime_error("Error in fcntl! Error:\t" + errno);
-    }
-
+    // Неблокирующий режим остается: и чтение, и запись ждут сокет в poll вместе с wakeFd_
+    EnableNoDelay(sock);
     sock_ = sock;
     return;
 }
@@ -85,9 +118,43 @@ void TcpConnect::EstablishConnection() {
  * Полезная информация:
  * - https://man7.org/linux/man-pages/man2/send.2.html
  */
-void TcpConnect::SendData(const std::string& data) const {
-    if (send(sock_, data.c_str(), data.size(), MSG_NOSIGNAL) < 0) {
-        throw std::runtime_error("Error in sending data!");
+void TcpConnect::SendData(std::string_view data, bool more) const {
+    const int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    size_t bytesSent = 0;
+    while (bytesSent < data.size()) {
+        ssize_t result = send(sock_, data.data() + bytesSent, data.size() - bytesSent, flags);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            WaitWritable();
+            continue;
+        }
+        if (result < 0) {
+            throw std::runtime_error(std::string("Error in sending data: ") + std::strerror(errno));
+        }
+        bytesSent += result;
+    }
+}
+
+void TcpConnect::SendFile(int fd, off_t offset, size_t length) const {
+    while (length > 0) {
+        // у sendfile нет флага MSG_NOSIGNAL, SIGPIPE при разрыве соединения игнорируется в main
+        ssize_t result = sendfile(sock_, fd, &offset, length);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            WaitWritable();
+            continue;
+        }
+        if (result < 0) {
+            throw std::runtime_error(std::string("Error in sendfile: ") + std::strerror(errno));
+        }
+        if (result == 0) {
+            throw std::runtime_error("Unexpected end of file in sendfile");
+        }
+        length -= result;
     }
 }
 
@@ -108,46 +175,60 @@ std::string TcpConnect::ReceiveData(size_t bufferSize) const {
     if (bufferSize == 0) {
         // Прочитать длину сообщения
         std::string lenBuffer(4, 0);
-        size_t bytesReceived = 0;
-        while (bytesReceived < 4) {
-            pollfd _pollfd = {sock_, POLLIN, 0};
-            int result = poll(&_pollfd, 1, readTimeout_.count());
-            if (result < 0){
-                throw std::runtime_error("Error in poll (in 'ReceiveData')! Error:\t" + errno);
-            }
-            else if (result == 0){
-                throw std::runtime_error("Poll (in 'ReceiveData') timed out!");
-            }
-            else if (_pollfd.revents & POLLIN) {
-                ssize_t bytesRead = recv(sock_, &lenBuffer[bytesReceived], 4 - bytesReceived, 0);
-                if (bytesRead <= 0){
-                    throw std::runtime_error("Error in recv (in 'ReceiveData')!");
-                }
-                bytesReceived += bytesRead;
-            }
-        }
+        ReceiveInto(lenBuffer.data(), lenBuffer.size());
         bufferSize = BytesToInt(lenBuffer);
     } 
     buffer.resize(bufferSize);
+    ReceiveInto(buffer.data(), bufferSize);
+    return buffer;
+}
+
+void TcpConnect::ReceiveInto(char* buffer, size_t bufferSize) const {
     size_t bytesReceived = 0;
     while (bytesReceived < bufferSize) {
-        pollfd _pollfd = {sock_, POLLIN, 0};
-        int result = poll(&_pollfd, 1, readTimeout_.count());
+        pollfd _pollfd[2] = {{sock_, POLLIN, 0}, {wakeFd_, POLLIN, 0}};
+        int result = poll(_pollfd, 2, readTimeout_.count());
+        if (result > 0 && (_pollfd[1].revents & POLLIN)) {
+            throw std::runtime_error("Connection interrupted");
+        }
         if (result < 0){
             throw std::runtime_error("Error in poll (in 'ReceiveData')! Error:\t" + errno);
         }
         else if (result == 0){
+            if (bytesReceived == 0) {
+                throw TimeoutError("Poll (in 'ReceiveData') timed out!");
+            }
             throw std::runtime_error("Poll (in 'ReceiveData') timed out!");
         }
-        else if (_pollfd.revents & POLLIN) {
-            ssize_t bytesRead = recv(sock_, &buffer[bytesReceived], bufferSize - bytesReceived, 0);
+        else if (_pollfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t bytesRead = recv(sock_, buffer + bytesReceived, bufferSize - bytesReceived, 0);
+            if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            }
             if (bytesRead <= 0){
                 throw std::runtime_error("Error in recv (in 'ReceiveData')!");
             }
             bytesReceived += bytesRead;
         }
     }
-    return buffer;
+}
+
+
+void TcpConnect::WaitWritable() const {
+    pollfd _pollfd[2] = {{sock_, POLLOUT, 0}, {wakeFd_, POLLIN, 0}};
+    int result;
+    do {
+        result = poll(_pollfd, 2, SEND_TIMEOUT_MS);
+    } while (result < 0 && errno == EINTR);
+    if (result > 0 && (_pollfd[1].revents & POLLIN)) {
+        throw std::runtime_error("Connection interrupted");
+    }
+    if (result < 0) {
+        throw std::runtime_error(std::string("Error in poll (in 'WaitWritable'): ") + std::strerror(errno));
+    }
+    if (result == 0) {
+        throw std::runtime_error("Peer does not receive data, send timed out");
+    }
 }
 
 
@@ -163,10 +244,20 @@ void TcpConnect::CloseConnection() {
     }
 }
 
-const std::string &TcpConnect::GetIp() const {
-    return ip_;
+void TcpConnect::Interrupt() const {
+    if (wakeFd_ >= 0) {
+        SignalEventFd(wakeFd_);
+    }
+}
+
+std::string TcpConnect::GetIp() const {
+    return peer_.Ip();
 }
 
 int TcpConnect::GetPort() const {
-    return port_;
-}
\ No newline at end of file
+    return peer_.port;
+}
+
+const Peer& TcpConnect::GetPeer() const {
+    return peer_;
+}
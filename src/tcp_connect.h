@@ -1,16 +1,36 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <chrono>
+#include <stdexcept>
+#include "peer.h"
+
+/*
+ * Истекло время ожидания данных из сокета, при этом в текущем вызове не было прочитано ни одного байта
+ */
+class TimeoutError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
 
 /*
  * Обертка над низкоуровневой структурой сокета.
  */
 class TcpConnect {
 public:
-    TcpConnect(std::string ip, int port, std::chrono::milliseconds connectTimeout, std::chrono::milliseconds readTimeout);
+    TcpConnect(const Peer& peer, std::chrono::milliseconds connectTimeout, std::chrono::milliseconds readTimeout);
+
+    /*
+     * Обернуть уже установленное соединение (например, принятое через accept) с пиром `peer`.
+     * Сокет переводится в неблокирующий режим, EstablishConnection для него не вызывается
+     */
+    TcpConnect(int sock, const Peer& peer, std::chrono::milliseconds readTimeout);
     ~TcpConnect();
 
+    TcpConnect(const TcpConnect&) = delete;
+    TcpConnect& operator=(const TcpConnect&) = delete;
+
     /*
      * Установить tcp соединение.
      * Если соединение занимает более `connectTimeout` времени, то прервать подключение и выбросить исключение.
@@ -27,11 +47,23 @@ public:
     void EstablishConnection();
 
     /*
-     * Послать данные в сокет
+     * Послать данные в сокет целиком. Пока в буфере сокета нет места, ждет его вместе с wakeFd_ (см. Interrupt),
+     * но не дольше 30 с без продвижения: пир, который перестал читать, не держит поток вечно.
+     * `more` -- за этими данными сразу последует продолжение (например, тело блока через SendFile):
+     * ядро придержит их, чтобы заголовок и данные ушли в одних и тех же TCP-сегментах
      * Полезная информация:
      * - https://man7.org/linux/man-pages/man2/send.2.html
      */
-    void SendData(const std::string& data) const;
+    void SendData(std::string_view data, bool more = false) const;
+
+    /*
+     * Послать в сокет `length` байт файла `fd`, начиная со смещения `offset`.
+     * Данные копируются ядром из page cache прямо в сокет, минуя память процесса. Места в буфере сокета ждет так же,
+     * как SendData
+     * Полезная информация:
+     * - https://man7.org/linux/man-pages/man2/sendfile.2.html
+     */
+    void SendFile(int fd, off_t offset, size_t length) const;
 
     /*
      * Прочитать данные из сокета.
@@ -46,16 +78,34 @@ public:
      */
     std::string ReceiveData(size_t bufferSize = 0) const;
 
+    /*
+     * Прочитать из сокета ровно `bufferSize` байт в заранее выделенный буфер `buffer`.
+     * Позволяет принимать данные сразу в итоговое место без промежуточной строки
+     */
+    void ReceiveInto(char* buffer, size_t bufferSize) const;
+
     /*
      * Закрыть сокет
      */
     void CloseConnection();
 
-    const std::string& GetIp() const;
+    /*
+     * Прервать ожидание в EstablishConnection, ReceiveData/ReceiveInto и SendData/SendFile из другого потока:
+     * текущее и все последующие ожидания сразу выбрасывают std::runtime_error, не дожидаясь таймаута
+     */
+    void Interrupt() const;
+
+    std::string GetIp() const;
     int GetPort() const;
+    const Peer& GetPeer() const;
 private:
-    const std::string ip_;
-    const int port_;
+    /*
+     * Дождаться места в буфере отправки сокета. Выбрасывает std::runtime_error после Interrupt или таймаута
+     */
+    void WaitWritable() const;
+
+    const Peer peer_;
     std::chrono::milliseconds connectTimeout_, readTimeout_;
     int sock_;
+    int wakeFd_;  // eventfd, который ждется вместе с сокетом; после Interrupt всегда читаем. -1, если создать не удалось
 };
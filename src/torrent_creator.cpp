@@ -0,0 +1,259 @@
+#include "torrent_creator.h"
+#include "bencode.h"
+#include "byte_tools.h"
+#include "piece_reader.h"
+#include "StaticThreadPool.h"
+#include <algorithm>
+#include <condition_variable>
+#include <ctime>
+#include <exception>
+#include <future>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr size_t MIN_PIECE_LENGTH = 1 << 14;  // не меньше блока, который запрашивают у пиров
+constexpr size_t MIN_AUTO_PIECE_LENGTH = 256 << 10;
+constexpr size_t MAX_AUTO_PIECE_LENGTH = 16 << 20;
+constexpr uint64_t TARGET_PIECE_COUNT = 1500;
+// одно чтение с диска -- несколько целых частей примерно такого объема
+constexpr size_t READ_CHUNK_BYTES = 16 << 20;
+
+// Степень двойки, при которой частей получается около TARGET_PIECE_COUNT
+size_t ChoosePieceLength(uint64_t totalLength) {
+    size_t length = MIN_AUTO_PIECE_LENGTH;
+    while (length < MAX_AUTO_PIECE_LENGTH && totalLength / length > TARGET_PIECE_COUNT) {
+        length *= 2;
+    }
+    return length;
+}
+
+/*
+ * Буферы под прочитанные данные. Их число ограничено, поэтому читающий поток не уходит
+ * дальше хеширующих больше чем на несколько блоков
+ */
+class BufferQueue {
+public:
+    explicit BufferQueue(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            free_.push_back(std::make_shared<std::string>());
+        }
+    }
+
+    std::shared_ptr<std::string> Take() {
+        std::unique_lock lock(mutex_);
+        notEmpty_.wait(lock, [this]() {
+            return !free_.empty();
+        });
+        auto buffer = std::move(free_.back());
+        free_.pop_back();
+        return buffer;
+    }
+
+    void Put(std::shared_ptr<std::string> buffer) {
+        std::lock_guard lock(mutex_);
+        free_.push_back(std::move(buffer));
+        notEmpty_.notify_one();
+    }
+private:
+    std::vector<std::shared_ptr<std::string>> free_;
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+};
+
+// Имя торрента -- последний компонент пути, в том числе для путей вида "dir/"
+std::string SourceName(const fs::path& source) {
+    fs::path normal = fs::absolute(source).lexically_normal();
+    if (normal.filename().empty()) {
+        normal = normal.parent_path();
+    }
+    return normal.filename().string();
+}
+
+void CollectFiles(const fs::path& source, TorrentFile& tf, std::vector<std::pair<fs::path, size_t>>& paths) {
+    if (fs::is_regular_file(source)) {
+        size_t length = fs::file_size(source);
+        tf.files.push_back(File(length, tf.name));
+        tf.singleFile = true;
+        paths.emplace_back(source, length);
+        return;
+    }
+    if (!fs::is_directory(source)) {
+        throw std::runtime_error("Cannot create a torrent from " + source.string() + ": not a file or directory");
+    }
+    for (const auto& entry : fs::recursive_directory_iterator(source)) {
+        if (entry.is_regular_file()) {
+            paths.emplace_back(entry.path(), entry.file_size());
+        }
+    }
+    // порядок файлов в торренте должен быть одинаковым при любом порядке обхода директории
+    std::sort(paths.begin(), paths.end(), [&source](const auto& lhs, const auto& rhs) {
+        return lhs.first.lexically_relative(source).generic_string() < rhs.first.lexically_relative(source).generic_string();
+    });
+    for (const auto& [path, length] : paths) {
+        tf.files.push_back(File(length, path.lexically_relative(source).generic_string()));
+    }
+}
+
+void HashPieces(const std::vector<std::pair<fs::path, size_t>>& paths, size_t threads, TorrentFile& tf) {
+    const MultiFileReader reader(paths);
+    const size_t pieceCount = (tf.length + tf.pieceLength - 1) / tf.pieceLength;
+    const size_t piecesPerChunk = std::max<size_t>(1, READ_CHUNK_BYTES / tf.pieceLength);
+    tf.pieceHashes.assign(pieceCount, PieceHash{});
+
+    BufferQueue buffers(threads * 2);
+    StaticThreadPool pool(threads);
+    // исключение из хеширования куска выбрасывается из future::get после того, как пул отработает
+    std::vector<std::future<void>> results;
+    try {
+        for (size_t first = 0; first < pieceCount; first += piecesPerChunk) {
+            const uint64_t offset = static_cast<uint64_t>(first) * tf.pieceLength;
+            const size_t length = std::min<uint64_t>(static_cast<uint64_t>(piecesPerChunk) * tf.pieceLength,
+                                                     tf.length - offset);
+            auto buffer = buffers.Take();
+            buffer->resize(length);
+            reader.Read(offset, buffer->data(), length);
+            results.push_back(pool.Async([&tf, &buffers, buffer, first]() mutable {
+                try {
+                    std::string_view data(*buffer);
+                    for (size_t index = first; !data.empty(); ++index) {
+                        const size_t pieceLength = std::min(tf.pieceLength, data.size());
+                        CalculateSHA1(data.substr(0, pieceLength), tf.pieceHashes[index].data());
+                        data.remove_prefix(pieceLength);
+                    }
+                } catch (...) {
+                    // буфер возвращается и при ошибке, иначе чтение следующих кусков встанет
+                    buffers.Put(std::move(buffer));
+                    throw;
+                }
+                buffers.Put(std::move(buffer));
+            }));
+        }
+    } catch (...) {
+        pool.Join();
+        throw;
+    }
+    pool.Join();
+    for (auto& result : results) {
+        result.get();
+    }
+}
+
+}
+
+TorrentFile CreateTorrentFile(const fs::path& source, const CreateOptions& options) {
+    TorrentFile tf;
+    tf.name = SourceName(source);
+    tf.comment = options.comment;
+    tf.created_by = options.createdBy;
+    tf.creation_date = static_cast<size_t>(std::time(nullptr));
+    tf.announce_list = options.announces;
+    tf.url_list = options.webSeeds;
+
+    std::vector<std::pair<fs::path, size_t>> paths;
+    CollectFiles(source, tf, paths);
+    for (const File& file : tf.files) {
+        tf.length += file.length;
+    }
+    if (tf.length == 0) {
+        throw std::runtime_error("Cannot create a torrent from " + source.string() + ": no data");
+    }
+
+    tf.pieceLength = options.pieceLength != 0 ? options.pieceLength : ChoosePieceLength(tf.length);
+    if (tf.pieceLength < MIN_PIECE_LENGTH || (tf.pieceLength & (tf.pieceLength - 1)) != 0) {
+        throw std::runtime_error("Piece length must be a power of two not less than 16 KiB");
+    }
+    const size_t threads = options.threads != 0 ? options.threads
+                                                : std::max(1U, std::thread::hardware_concurrency());
+    HashPieces(paths, threads, tf);
+    return tf;
+}
+
+std::string EncodeTorrentFile(TorrentFile& tf) {
+    using Bencode::Encoder;
+    // ключи словарей идут по возрастанию
+    Encoder encoder;
+    encoder.BeginDict();
+    if (!tf.announce_list.empty()) {
+        encoder.Key("announce");
+        encoder.String(tf.announce_list.front());
+        encoder.Key("announce-list");
+        encoder.BeginList();
+        for (const std::string& url : tf.announce_list) {
+            encoder.BeginList();
+            encoder.String(url);
+            encoder.End();
+        }
+        encoder.End();
+    }
+    if (!tf.comment.empty()) {
+        encoder.Key("comment");
+        encoder.String(tf.comment);
+    }
+    if (!tf.created_by.empty()) {
+        encoder.Key("created by");
+        encoder.String(tf.created_by);
+    }
+    if (tf.creation_date != 0) {
+        encoder.Key("creation date");
+        encoder.Integer(static_cast<int64_t>(tf.creation_date));
+    }
+
+    encoder.Key("info");
+    const size_t infoBegin = encoder.Data().size();
+    encoder.BeginDict();
+    // торрент из одного файла (а не директория с одним файлом) записывается без списка files
+    if (!tf.singleFile) {
+        encoder.Key("files");
+        encoder.BeginList();
+        for (const File& file : tf.files) {
+            encoder.BeginDict();
+            encoder.Key("length");
+            encoder.Integer(static_cast<int64_t>(file.length));
+            encoder.Key("path");
+            encoder.BeginList();
+            for (const auto& component : fs::path(file.path)) {
+                encoder.String(component.string());
+            }
+            encoder.End();
+            encoder.End();
+        }
+        encoder.End();
+    } else {
+        encoder.Key("length");
+        encoder.Integer(static_cast<int64_t>(tf.length));
+    }
+    encoder.Key("name");
+    encoder.String(tf.name);
+    encoder.Key("piece length");
+    encoder.Integer(static_cast<int64_t>(tf.pieceLength));
+    encoder.Key("pieces");
+    encoder.String(std::string_view(reinterpret_cast<const char*>(tf.pieceHashes.data()),
+                                    tf.pieceHashes.size() * sizeof(PieceHash)));
+    encoder.End();
+    tf.infoHash = CalculateSHA1(std::string_view(encoder.Data()).substr(infoBegin));
+
+    if (!tf.url_list.empty()) {
+        encoder.Key("url-list");
+        encoder.BeginList();
+        for (const std::string& url : tf.url_list) {
+            encoder.String(url);
+        }
+        encoder.End();
+    }
+    encoder.End();
+    return encoder.Release();
+}
+
+void SaveTorrentFile(TorrentFile& tf, const std::string& filename) {
+    const std::string data = EncodeTorrentFile(tf);
+    std::ofstream output(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!output.write(data.data(), static_cast<std::streamsize>(data.size()))) {
+        throw std::runtime_error("Cannot write " + filename);
+    }
+}
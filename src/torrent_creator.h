@@ -0,0 +1,35 @@
+#pragma once
+
+#include "torrent_file.h"
+#include <filesystem>
+#include <string>
+#include <vector>
+
+/*
+ * Параметры создания .torrent файла
+ */
+struct CreateOptions {
+    std::vector<std::string> announces;  // первый адрес пишется в announce, все вместе -- в announce-list
+    std::vector<std::string> webSeeds;   // адреса HTTP-серверов с теми же файлами, пишутся в url-list
+    std::string comment;
+    std::string createdBy = "torrent-client";
+    size_t pieceLength = 0;  // 0 -- подобрать по объему данных
+    size_t threads = 0;      // потоков для хеширования, 0 -- по числу ядер
+};
+
+/*
+ * Собрать TorrentFile для файла или директории `source`.
+ * Файлы директории обходятся рекурсивно и идут в TorrentFile::files в порядке возрастания относительного пути,
+ * в этом же порядке их данные образуют общий поток байт, который режется на части.
+ * Данные читает один поток большими последовательными блоками, SHA1 частей считают потоки пула параллельно.
+ * При ошибке выбрасывает std::runtime_error
+ */
+TorrentFile CreateTorrentFile(const std::filesystem::path& source, const CreateOptions& options);
+
+/*
+ * Записать TorrentFile в формате bencode. Заполняет tf.infoHash -- SHA1 записанного словаря info,
+ * тот же, что посчитает LoadTorrentFile для результата
+ */
+std::string EncodeTorrentFile(TorrentFile& tf);
+
+void SaveTorrentFile(TorrentFile& tf, const std::string& filename);
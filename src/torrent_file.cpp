@@ -1,182 +1,147 @@
 #include "torrent_file.h"
 #include "bencode.h"
-#include <vector>
-#include <openssl/sha.h>
-#include <fstream>
-#include <variant>
-#include <sstream>
-#include <unordered_map>
 #include "byte_tools.h"
+#include <cstring>
+#include <set>
+#include <stdexcept>
 using namespace Bencode;
 
+namespace {
+std::string GetString(const Node& dict, std::string_view key) {
+    const Node* node = dict.Find(key);
+    return node && node->IsString() ? std::string(node->string) : std::string();
+}
 
-TorrentFile parser(std::string& data){
-    std::stack<char> op;
-    TorrentFile tf;
-    flagForTorrentFile flag = NOTHING;
-    std::unordered_map<std::string, flagForTorrentFile> um = makeFlag();
-    size_t num = 0;
-    std::string infoString = "";
-    int cnt = 0;
-    int infoCounter = 0;
-    int8_t isFiles = 0;
-    std::string prevStr = "";
-    File file;
-    size_t ds = data.size();
-    std::string pathRoad = "";
-    for (size_t i = 0; i < data.size(); ++i){
-        char c = data[i];
-        size_t oldI = i;
+size_t GetInteger(const Node& dict, std::string_view key) {
+    const Node* node = dict.Find(key);
+    if (!node) {
+        return 0;
+    }
+    if (!node->IsInteger() || node->integer < 0) {
+        throw std::invalid_argument("Torrent file: '" + std::string(key) + "' must be a non-negative integer");
+    }
+    return static_cast<size_t>(node->integer);
+}
 
-        if (c == 'd') { // type == dict
-            if (flag == flagForTorrentFile::INFO){
-                infoCounter++;
-                flag = flagForTorrentFile::NOTHING;
-            } else if (flag != flagForTorrentFile::NOTHING || isFiles == 1){
-                cnt++;
-                if (infoCounter > 0){
-                    infoCounter++;
-                }
-            }
-            op.push(c);
-        } else if (c == 'i') { // type == integer
-            cnt++;
-            if (infoCounter > 0){
-                infoCounter++;
-            }
-            op.push('i');
-        } else if (c == 'l') { // type == list
-            if (flag != flagForTorrentFile::NOTHING || isFiles == 1){
-                cnt++;
-                if (infoCounter > 0){
-                    infoCounter++;
-                }
-            }
-            op.push('l');
-        } else if (c == 'e') { // end of type
-            if (file.path != "" && file.length != 0) {
-                tf.files.push_back(file);
-                file.clear();
-            }
-            else if (pathRoad != "") {
-                file.path = pathRoad;
-                pathRoad = "";
-                flag = flagForTorrentFile::NOTHING;
-            }
-            if (cnt > 0) {
-                cnt--;
-            }
-            if (cnt == 0){
-                flag = flagForTorrentFile::NOTHING;
-                if (isFiles == 1) {
-                    isFiles = -1;
-                }
-            }
-            if (infoCounter > 0){
-                infoCounter--;
-                if (infoCounter == 0) { // last symbol of info
-                    infoString += c;
-                }
+// Строковые значения с неизвестными ключами сохраняются в otherInfo
+void CollectOtherInfo(const Node& dict, const std::set<std::string_view>& known, TorrentFile& tf) {
+    for (const auto& [key, value] : dict.dict) {
+        if (value.IsString() && !known.contains(key)) {
+            tf.otherInfo.emplace_back(key, value.string);
+        }
+    }
+}
+
+void ParseFiles(const Node& files, TorrentFile& tf) {
+    if (!files.IsList()) {
+        throw std::invalid_argument("Torrent file: 'files' must be a list");
+    }
+    for (const Node& entry : files.list) {
+        if (!entry.IsDict()) {
+            throw std::invalid_argument("Torrent file: file entry must be a dictionary");
+        }
+        File file;
+        file.length = GetInteger(entry, "length");
+        file.md5sum = GetString(entry, "md5sum");
+        const Node* path = entry.Find("path");
+        if (!path || !path->IsList() || path->list.empty()) {
+            throw std::invalid_argument("Torrent file: file entry without path");
+        }
+        for (const Node& component : path->list) {
+            if (!component.IsString()) {
+                throw std::invalid_argument("Torrent file: path component must be a string");
             }
-            op.pop();
-        } else if (c >= '0' && c <= '9') { // type == string
-            if (op.top() == 'i') { // нужно получить число
-                num = getNumWithDecrementIdx(data, i);
-                if (flag == flagForTorrentFile::CREATION_DATE) {
-                    tf.creation_date = num;
-                } else if (flag == flagForTorrentFile::LENGTH) {
-                    if (isFiles != 0) {
-                        file.length = num;
-                    } else {
-                        tf.length = num;
-                    }
-                } else if (flag == flagForTorrentFile::PIECE_LENGTH) {
-                    tf.pieceLength = num;
-                }
-                flag = flagForTorrentFile::NOTHING;
-                num = 0;
+            if (!file.path.empty()) {
+                file.path += "/";
             }
-            else{
-                std::pair<std::string, std::string> s = getPairOfLenAndWord(data, i);
-                
-                // TODO: охарактеризировать строки
-                if (flag == flagForTorrentFile::NOTHING) {
-                    if (um.find(s.second) == um.end()){
-                        flag = flagForTorrentFile::OTHER;
-                        prevStr = s.second;
-                    } else{
-                        flag = um[s.second];
-                        if (flag == flagForTorrentFile::FILES) {    
-                            isFiles = 1;
-                            flag = flagForTorrentFile::NOTHING;
-                        }
-                    }
-                } else if (flag == flagForTorrentFile::ANNOUNCE || flag == flagForTorrentFile::ANNOUNCE_LIST) {
-                    tf.announce_list.push_back(s.second);
-                    if (flag == flagForTorrentFile::ANNOUNCE) {
-                        flag = flagForTorrentFile::NOTHING;
-                    }
-                } else if (flag == flagForTorrentFile::COMMENT) {
-                    tf.comment = s.second;
-                    flag = flagForTorrentFile::NOTHING;
-                } else if (flag == flagForTorrentFile::CREATED_BY) {
-                    tf.created_by = s.second;
-                    flag = flagForTorrentFile::NOTHING;
-                } else if (flag == flagForTorrentFile::OTHER) {
-                    tf.otherInfo.push_back(std::make_pair(prevStr, s.second));
-                    prevStr = "";
-                    flag = flagForTorrentFile::NOTHING;
-                } else if (flag == flagForTorrentFile::PATH) {
-                    if (pathRoad != "") {
-                        pathRoad += "/";
-                    }
-                    pathRoad += s.second;
-                } else if (flag == flagForTorrentFile::MD5SUM) {
-                    if (isFiles != 0) {
-                        file.md5sum = s.second;
-                    } else {
-                        tf.md5sum = s.second;
-                    }
-                    flag = flagForTorrentFile::NOTHING;
-                } else if (flag == flagForTorrentFile::NAME) {
-                    tf.name = s.second;
-                    flag = flagForTorrentFile::NOTHING;
-                } else if (flag == flagForTorrentFile::PIECES) {
-                    size_t pieces_size = stoll(s.first);
-                    for (size_t idx = 0; idx < pieces_size; idx += 20){
-                        tf.pieceHashes.push_back(s.second.substr(idx, 20));
-                    }
-                    flag = flagForTorrentFile::NOTHING;
-                } else if (flag == flagForTorrentFile::URL_LIST) {
-                    tf.url_list.push_back(s.second);
+            file.path += component.string;
+        }
+        tf.files.push_back(std::move(file));
+    }
+}
+}
+
+TorrentFile parseData(std::string_view data) {
+    const Node root = Decode(data);
+    if (!root.IsDict()) {
+        throw std::invalid_argument("Torrent file: root must be a dictionary");
+    }
+    const Node* info = root.Find("info");
+    if (!info || !info->IsDict()) {
+        throw std::invalid_argument("Torrent file: no info dictionary");
+    }
+
+    TorrentFile tf;
+    // info_hash -- SHA1 от словаря info ровно в том виде, в котором он записан в файле
+    tf.infoHash = CalculateSHA1(info->raw);
+
+    std::set<std::string> announces;
+    if (const Node* announce = root.Find("announce"); announce && announce->IsString()) {
+        announces.emplace(announce->string);
+    }
+    if (const Node* announceList = root.Find("announce-list"); announceList && announceList->IsList()) {
+        for (const Node& tier : announceList->list) {
+            for (const Node& url : tier.list) {
+                if (url.IsString()) {
+                    announces.emplace(url.string);
                 }
             }
-
         }
+    }
+    tf.announce_list.assign(announces.begin(), announces.end());
 
-        if (infoCounter > 0){
-            for (size_t j = oldI; j <= i; ++j){
-                infoString += data[j];
+    tf.comment = GetString(root, "comment");
+    tf.created_by = GetString(root, "created by");
+    tf.creation_date = GetInteger(root, "creation date");
+    if (const Node* urls = root.Find("url-list")) {
+        if (urls->IsString()) {
+            tf.url_list.emplace_back(urls->string);
+        }
+        for (const Node& url : urls->list) {
+            if (url.IsString()) {
+                tf.url_list.emplace_back(url.string);
             }
         }
     }
-    tf.infoHash = CalculateSHA1(infoString);
-    
-    if (tf.files.empty()) {
+    CollectOtherInfo(root, {"announce", "comment", "created by"}, tf);
+
+    tf.name = GetString(*info, "name");
+    tf.md5sum = GetString(*info, "md5sum");
+    tf.pieceLength = GetInteger(*info, "piece length");
+    const Node* pieces = info->Find("pieces");
+    if (!pieces || !pieces->IsString() || pieces->string.size() % 20 != 0) {
+        throw std::invalid_argument("Torrent file: 'pieces' must be a string of 20-byte hashes");
+    }
+    tf.pieceHashes.resize(pieces->string.size() / sizeof(PieceHash));
+    std::memcpy(tf.pieceHashes.data(), pieces->string.data(), pieces->string.size());
+    CollectOtherInfo(*info, {"name", "md5sum", "pieces"}, tf);
+
+    if (const Node* files = info->Find("files")) {
+        ParseFiles(*files, tf);
+        for (const File& file : tf.files) {
+            tf.length += file.length;
+        }
+    } else {
+        tf.length = GetInteger(*info, "length");
         tf.files.push_back(File(tf.length, tf.name, tf.md5sum));
+        tf.singleFile = true;
     }
-    if (tf.length == 0){
-        tf.length = tf.pieceHashes.size() * tf.pieceLength;
+    if (tf.pieceLength == 0 && (!tf.pieceHashes.empty() || tf.length != 0)) {
+        throw std::invalid_argument("Torrent file: 'piece length' must be positive");
     }
-    std::set<std::string> unique_strings(tf.announce_list.begin(), tf.announce_list.end());
-    tf.announce_list.clear();
-    for (const auto& it : unique_strings){
-        tf.announce_list.push_back(it);
+    // по хешу на каждую полную часть и на неполную последнюю
+    const size_t expectedPieces =
+        tf.pieceLength == 0 ? 0 : tf.length / tf.pieceLength + (tf.length % tf.pieceLength != 0);
+    if (tf.pieceHashes.size() != expectedPieces) {
+        throw std::invalid_argument("Torrent file: " + std::to_string(tf.pieceHashes.size()) + " piece hashes for " +
+                                    std::to_string(tf.length) + " bytes in pieces of " +
+                                    std::to_string(tf.pieceLength) + " bytes, expected " +
+                                    std::to_string(expectedPieces));
     }
     return tf;
 }
+
 TorrentFile LoadTorrentFile(const std::string& filename) {
     std::string data = getFileData(filename);
-    TorrentFile result = parser(data);
-    return result;
-}
\ No newline at end of file
+    return parseData(data);
+}
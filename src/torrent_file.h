@@ -1,7 +1,16 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <string>
 #include <vector>
+#include <string_view>
+
+/*
+ * SHA1 части в том виде, в котором он записан в .torrent файле (20 байт)
+ */
+using PieceHash = std::array<uint8_t, 20>;
+static_assert(sizeof(PieceHash) == 20, "piece hashes are copied from .torrent files as one block");
 
 struct File {
     File(size_t length, const std::string& path, const std::string& md5sum = "") :
@@ -28,16 +37,20 @@ struct TorrentFile {
     size_t creation_date = 0;
     std::string name;
     std::string md5sum;
-    std::vector<std::string> pieceHashes;
+    std::vector<PieceHash> pieceHashes;  // один непрерывный буфер по 20 байт на часть
     size_t pieceLength = 0;
     size_t length = 0;
     std::string infoHash;
     std::vector<std::pair<std::string, std::string>> otherInfo;
     std::vector<File> files;
+    bool singleFile = false;  // в info нет списка files: единственный файл называется `name`
     std::vector<std::string> url_list;
 };
 
 
 TorrentFile LoadTorrentFile(const std::string& filename);
 
-TorrentFile parseData(const std::string& data);
\ No newline at end of file
+/*
+ * Разобрать содержимое .torrent файла. При ошибке в данных выбрасывает std::invalid_argument
+ */
+TorrentFile parseData(std::string_view data);
\ No newline at end of file
@@ -1,51 +1,329 @@
 #include "torrent_tracker.h"
+#include "udp_tracker.h"
 #include "bencode.h"
 #include "byte_tools.h"
 #include <cpr/cpr.h>
+#include <curl/curl.h>
+#include <sstream>
 
-using namespace Bencode;
-
-TorrentTracker::TorrentTracker(const std::vector<std::string>& urls){
-    urls_ = urls;
-}
-
-void TorrentTracker::UpdatePeers(const TorrentFile& tf, std::string peerId, int port){
-    for (const std::string& announce : tf.announce_list) {
-        std::cout << "Connecting to tracker " << announce << std::endl;
-        cpr::Response res = cpr::Get(
-                cpr::Url{announce},
-                cpr::Parameters {
-                        {"info_hash", tf.infoHash},
-                        {"peer_id", peerId},
-                        {"port", std::to_string(port)},
-                        {"uploaded", std::to_string(0)},
-                        {"downloaded", std::to_string(0)},
-                        {"left", std::to_string(tf.length)},
-                        {"compact", std::to_string(1)}
-                },
-                cpr::Timeout{10000/*20000*/}
-        );
-        if (res.status_code != 200 || res.text.find("fail") != std::string::npos) {
-            // std::cerr << res.status_code << std::endl;
-            std::cout << "Error in connecting!" << std::endl;
+namespace {
+
+// компактная запись: адрес и 2 байта порта
+constexpr size_t COMPACT_PEER_LENGTH = 6;
+constexpr size_t COMPACT_PEER6_LENGTH = 18;
+
+constexpr std::chrono::milliseconds ANNOUNCE_TIMEOUT(10000);
+// до мертвого трекера не стоит ждать все ANNOUNCE_TIMEOUT: остальные трекеры опрашиваются параллельно
+constexpr std::chrono::milliseconds CONNECT_TIMEOUT(3000);
+// stopped уходит при завершении работы, ждать его ответа дольше незачем
+constexpr std::chrono::milliseconds STOPPED_TIMEOUT(3000);
+
+bool IsUdpUrl(const std::string& url) {
+    return url.starts_with("udp://");
+}
+
+std::unique_ptr<cpr::Session> MakeSession(const std::string& url, std::chrono::milliseconds timeout) {
+    auto session = std::make_unique<cpr::Session>();
+    session->SetUrl(cpr::Url{url});
+    session->SetTimeout(cpr::Timeout{timeout});
+    session->SetConnectTimeout(cpr::ConnectTimeout{std::min(CONNECT_TIMEOUT, timeout)});
+    // адрес трекера разрешается один раз на все время работы, а не раз в минуту (умолчание curl)
+    curl_easy_setopt(session->GetCurlHolder()->handle, CURLOPT_DNS_CACHE_TIMEOUT, -1L);
+    return session;
+}
+
+const char* EventName(AnnounceStats::Event event) {
+    switch (event) {
+        case AnnounceStats::Event::Started:
+            return "started";
+        case AnnounceStats::Event::Completed:
+            return "completed";
+        case AnnounceStats::Event::Stopped:
+            return "stopped";
+        case AnnounceStats::Event::None:
+            break;
+    }
+    return "";
+}
+
+void ParseCompactPeers(std::string_view data, int family, size_t stride, std::vector<Peer>& peers) {
+    // неполная запись в конце списка отбрасывается
+    const size_t count = data.size() / stride;
+    peers.reserve(peers.size() + count);
+    for (size_t i = 0; i < count; ++i) {
+        peers.push_back(Peer::FromCompact(data.data() + i * stride, family));
+    }
+}
+
+void ParseDictPeers(const Bencode::Node& list, std::vector<Peer>& peers) {
+    for (const Bencode::Node& entry : list.list) {
+        const Bencode::Node* ip = entry.Find("ip");
+        const Bencode::Node* port = entry.Find("port");
+        if (ip == nullptr || !ip->IsString() || port == nullptr || !port->IsInteger() ||
+            port->integer <= 0 || port->integer > 65535) {
             continue;
         }
-        std::cout << "Successfully connected to tracker!" << std::endl;
+        Peer peer;
+        if (Peer::FromString(ip->string, static_cast<uint16_t>(port->integer), peer)) {
+            peers.push_back(peer);
+        }
+    }
+}
+
+std::chrono::seconds GetSeconds(const Bencode::Node& root, std::string_view key) {
+    const Bencode::Node* node = root.Find(key);
+    if (node == nullptr || !node->IsInteger() || node->integer < 0) {
+        return std::chrono::seconds(0);
+    }
+    return std::chrono::seconds(node->integer);
+}
+
+}
+
+TrackerResponse ParseTrackerResponse(std::string_view data) {
+    const Bencode::Node root = Bencode::Decode(data);
+    if (!root.IsDict()) {
+        throw std::invalid_argument("Tracker response is not a dictionary");
+    }
+    TrackerResponse response;
+    if (const Bencode::Node* failure = root.Find("failure reason")) {
+        response.failureReason = failure->IsString() ? std::string(failure->string) : "unknown failure";
+        return response;
+    }
+    if (const Bencode::Node* warning = root.Find("warning message"); warning != nullptr && warning->IsString()) {
+        response.warningMessage = warning->string;
+    }
+    response.interval = GetSeconds(root, "interval");
+    response.minInterval = GetSeconds(root, "min interval");
+    if (const Bencode::Node* complete = root.Find("complete"); complete != nullptr && complete->IsInteger()) {
+        response.complete = complete->integer;
+    }
+    if (const Bencode::Node* incomplete = root.Find("incomplete"); incomplete != nullptr && incomplete->IsInteger()) {
+        response.incomplete = incomplete->integer;
+    }
+    if (const Bencode::Node* trackerId = root.Find("tracker id"); trackerId != nullptr && trackerId->IsString()) {
+        response.trackerId = trackerId->string;
+    }
+    if (const Bencode::Node* peers = root.Find("peers")) {
+        if (peers->IsString()) {
+            ParseCompactPeers(peers->string, AF_INET, COMPACT_PEER_LENGTH, response.peers);
+        } else if (peers->IsList()) {
+            ParseDictPeers(*peers, response.peers);
+        }
+    }
+    if (const Bencode::Node* peers6 = root.Find("peers6"); peers6 != nullptr && peers6->IsString()) {
+        ParseCompactPeers(peers6->string, AF_INET6, COMPACT_PEER6_LENGTH, response.peers);
+    }
+    return response;
+}
 
-        std::string data = (std::string)res.text;
-        size_t beg = data.find("peers") + 5;
-        size_t count = getNumWithIncrementIdx(data, beg);
-        const size_t countOfBytes = 6;
-        for (size_t idx = beg; idx <= beg + count; idx += countOfBytes){
-            peers_.push_back(parsePeer(data.substr(idx, countOfBytes)));
+TorrentTracker::TorrentTracker(const std::vector<std::string>& urls, UdpTrackerClient* udp) :
+    udp_(udp), pendingRequests_(0), pendingEvents_(0) {
+    for (const std::string& url : urls) {
+        if (IsUdpUrl(url)) {
+            if (udp_ != nullptr) {
+                urls_.push_back(url);
+                sessions_.push_back(nullptr);
+            }
+            continue;
         }
+        urls_.push_back(url);
+        sessions_.push_back(MakeSession(url, ANNOUNCE_TIMEOUT));
+    }
+    eventRequests_.resize(urls_.size());
+    started_.assign(urls_.size(), false);
+}
+
+TorrentTracker::~TorrentTracker() {
+    Wait();
+}
+
+void TorrentTracker::StartUpdatePeers(const TorrentFile& tf, std::string peerId, int port, AnnounceStats stats,
+                                      PeersCallback onPeers, std::function<void()> onDone) {
+    Wait();
+    {
+        std::lock_guard lock(mutex_);
+        seen_.clear();
+        peers_.clear();
+        interval_ = std::chrono::seconds(0);
+        minInterval_ = std::chrono::seconds(0);
+        lastAnnounce_ = std::chrono::steady_clock::now();
+    }
+    pendingRequests_ = urls_.size();
+    if (urls_.empty() && onDone) {
+        onDone();
+    }
+    for (size_t i = 0; i < urls_.size(); ++i) {
+        requests_.emplace_back([this, i, &tf, peerId, port, stats, onPeers, onDone]() {
+            Announce(i, tf, peerId, port, stats, onPeers);
+            if (--pendingRequests_ == 0 && onDone) {
+                onDone();
+            }
+        });
     }
+}
+
+void TorrentTracker::AnnounceEvent(const TorrentFile& tf, std::string peerId, int port, AnnounceStats stats) {
+    for (size_t i = 0; i < urls_.size(); ++i) {
+        {
+            std::lock_guard lock(mutex_);
+            if (!started_[i]) {
+                continue;
+            }
+        }
+        ++pendingEvents_;
+        eventRequests_[i] = std::thread([this, i, &tf, peerId, port, stats,
+                                         previous = std::move(eventRequests_[i])]() mutable {
+            if (previous.joinable()) {
+                previous.join();
+            }
+            // соединение трекера из sessions_ может быть занято идущим опросом
+            std::unique_ptr<cpr::Session> session;
+            if (sessions_[i] != nullptr) {
+                session = MakeSession(urls_[i], stats.event == AnnounceStats::Event::Stopped ? STOPPED_TIMEOUT
+                                                                                             : ANNOUNCE_TIMEOUT);
+            }
+            try {
+                TrackerResponse response = Request(i, session.get(), tf, peerId, port, stats);
+                if (!response.failureReason.empty()) {
+                    std::cout << "Tracker " + urls_[i] + " error: " + response.failureReason + "\n" << std::flush;
+                }
+            } catch (const std::exception& e) {
+                std::cout << "Error in sending " + std::string(EventName(stats.event)) + " to tracker " + urls_[i] +
+                             ": " + e.what() + "\n" << std::flush;
+            }
+            --pendingEvents_;
+        });
+    }
+}
+
+bool TorrentTracker::IsUpdating() const {
+    return pendingRequests_.load() > 0;
+}
+
+bool TorrentTracker::IsSendingEvents() const {
+    return pendingEvents_.load() > 0;
+}
+
+void TorrentTracker::Wait() {
+    for (auto& request : requests_) {
+        request.join();
+    }
+    requests_.clear();
+    for (auto& request : eventRequests_) {
+        if (request.joinable()) {
+            request.join();
+        }
+    }
+}
+
+void TorrentTracker::UpdatePeers(const TorrentFile& tf, std::string peerId, int port) {
+    StartUpdatePeers(tf, std::move(peerId), port, AnnounceStats{.left = tf.length});
+    Wait();
+    std::lock_guard lock(mutex_);
     if (peers_.empty()){
         throw std::runtime_error("No peers found!");
     }
-    return;
 }
 
-const std::vector<Peer> &TorrentTracker::GetPeers() const {
+TrackerResponse TorrentTracker::Request(size_t index, cpr::Session* session, const TorrentFile& tf,
+                                        const std::string& peerId, int port, const AnnounceStats& stats) {
+    if (session == nullptr) {
+        UdpTrackerClient::AnnounceRequest request;
+        request.infoHash = tf.infoHash;
+        request.peerId = peerId;
+        request.downloaded = stats.downloaded;
+        request.left = stats.left;
+        request.uploaded = stats.uploaded;
+        request.event = stats.event;
+        request.port = static_cast<uint16_t>(port);
+        return udp_->Announce(urls_[index], request);
+    }
+    cpr::Parameters parameters = {
+            {"info_hash", tf.infoHash},
+            {"peer_id", peerId},
+            {"port", std::to_string(port)},
+            {"uploaded", std::to_string(stats.uploaded)},
+            {"downloaded", std::to_string(stats.downloaded)},
+            {"left", std::to_string(stats.left)},
+            {"compact", std::to_string(1)}
+    };
+    if (stats.event != AnnounceStats::Event::None) {
+        parameters.Add({"event", EventName(stats.event)});
+    }
+    session->SetParameters(parameters);
+    cpr::Response res = session->Get();
+    if (res.status_code != 200) {
+        throw std::runtime_error("HTTP status " + std::to_string(res.status_code));
+    }
+    return ParseTrackerResponse(res.text);
+}
+
+void TorrentTracker::Announce(size_t index, const TorrentFile& tf, const std::string& peerId, int port,
+                              AnnounceStats stats, const PeersCallback& onPeers) {
+    std::ostringstream log;
+    TrackerResponse response;
+    {
+        std::lock_guard lock(mutex_);
+        if (!started_[index]) {
+            stats.event = AnnounceStats::Event::Started;
+        }
+    }
+    try {
+        response = Request(index, sessions_[index].get(), tf, peerId, port, stats);
+    } catch (const std::exception& e) {
+        log << "Error in connecting to tracker " << urls_[index] << ": " << e.what() << "\n";
+        std::cout << log.str() << std::flush;
+        return;
+    }
+    if (!response.failureReason.empty()) {
+        log << "Tracker " << urls_[index] << " error: " << response.failureReason << "\n";
+        std::cout << log.str() << std::flush;
+        return;
+    }
+    if (!response.warningMessage.empty()) {
+        log << "Tracker " << urls_[index] << " warning: " << response.warningMessage << "\n";
+    }
+    log << "Successfully connected to tracker " << urls_[index] << "! " << response.peers.size() << " peers, interval "
+        << response.interval.count() << "s\n";
+    std::cout << log.str() << std::flush;
+
+    std::lock_guard lock(mutex_);
+    started_[index] = true;
+    std::vector<Peer> newPeers;
+    for (const Peer& peer : response.peers) {
+        if (peer.port != 0 && seen_.insert(peer).second) {
+            newPeers.push_back(peer);
+        }
+    }
+    peers_.insert(peers_.end(), newPeers.begin(), newPeers.end());
+    if (response.interval.count() > 0 && (interval_.count() == 0 || response.interval < interval_)) {
+        interval_ = response.interval;
+    }
+    if (response.minInterval.count() > 0 && (minInterval_.count() == 0 || response.minInterval < minInterval_)) {
+        minInterval_ = response.minInterval;
+    }
+    if (onPeers && !newPeers.empty()) {
+        onPeers(newPeers);
+    }
+}
+
+std::vector<Peer> TorrentTracker::GetPeers() const {
+    std::lock_guard lock(mutex_);
     return peers_;
 }
+
+std::chrono::seconds TorrentTracker::GetInterval() const {
+    std::lock_guard lock(mutex_);
+    return interval_;
+}
+
+std::chrono::seconds TorrentTracker::GetMinInterval() const {
+    std::lock_guard lock(mutex_);
+    return minInterval_;
+}
+
+std::chrono::steady_clock::time_point TorrentTracker::NextAnnounceAllowed() const {
+    std::lock_guard lock(mutex_);
+    return lastAnnounce_ + minInterval_;
+}
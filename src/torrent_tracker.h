@@ -1,35 +1,173 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 #include "torrent_file.h"
 #include "peer.h"
 
+/*
+ * Разобранный ответ трекера на announce
+ * https://wiki.theory.org/BitTorrentSpecification#Tracker_Response
+ */
+struct TrackerResponse {
+    std::string failureReason;  // непусто, если трекер отклонил запрос; остальные поля тогда не заполняются
+    std::string warningMessage;
+    std::chrono::seconds interval{0};     // через сколько трекер ждет следующий announce
+    std::chrono::seconds minInterval{0};  // чаще этого обращаться нельзя; 0, если трекер не прислал
+    int64_t complete = 0;    // сидов
+    int64_t incomplete = 0;  // личеров
+    std::string trackerId;
+    std::vector<Peer> peers;  // из peers (компактный формат или список словарей) и peers6
+};
+
+/*
+ * Разобрать тело ответа трекера. Компактные списки пиров разбираются сразу в двоичные адреса,
+ * в списке словарей пропускаются пиры, заданные именем хоста.
+ * При ошибке в данных выбрасывает std::invalid_argument
+ */
+TrackerResponse ParseTrackerResponse(std::string_view data);
+
+/*
+ * Что сообщается трекеру в announce: сколько байт скачано и роздано за время работы, сколько осталось скачать
+ * и событие. https://wiki.theory.org/BitTorrentSpecification#Tracker_Request_Parameters
+ */
+struct AnnounceStats {
+    enum class Event {
+        None,
+        Started,    // первый announce трекеру
+        Completed,  // скачивание закончено
+        Stopped,    // торрент больше не скачивается и не раздается
+    };
+    uint64_t uploaded = 0;
+    uint64_t downloaded = 0;
+    uint64_t left = 0;
+    Event event = Event::None;
+};
+
+namespace cpr {
+class Session;
+}
+
+class UdpTrackerClient;
+
 class TorrentTracker {
 public:
     /*
-     * url - адрес трекера, берется из поля announce в .torrent-файле
+     * Вызывается для каждого ответившего трекера с пирами, которых в этом опросе еще не было
+     */
+    using PeersCallback = std::function<void(const std::vector<Peer>&)>;
+
+    /*
+     * urls - адреса трекеров из announce и announce-list .torrent-файла.
+     * Трекеры udp:// опрашиваются через общий для сессии `udp`; без него они пропускаются
      */
-    TorrentTracker(const std::vector<std::string>& urls);
+    TorrentTracker(const std::vector<std::string>& urls, UdpTrackerClient* udp = nullptr);
 
     /*
-     * Получить список пиров у трекера и сохранить его для дальнейшей работы.
+     * Дожидается незавершенных запросов к трекерам, в том числе AnnounceEvent
+     */
+    ~TorrentTracker();
+
+    /*
+     * Получить список пиров у трекеров и сохранить его для дальнейшей работы.
      * Запрос пиров происходит посредством HTTP GET запроса, данные передаются в формате bencode.
-     * Такой же формат использовался в .torrent файле.
-     * Подсказка: посмотрите, что было написано в main.cpp в домашнем задании torrent-file
+     * Такой же формат использовался в .torrent файле. Трекеры udp:// опрашиваются по BEP 15 (см. UdpTrackerClient).
+     * Все трекеры опрашиваются одновременно, каждый в своем потоке. Для каждого трекера держится свое
+     * HTTP-соединение (cpr::Session): повторные announce идут по тому же keep-alive соединению
+     * и без повторного разрешения имени.
+     * Метод не ждет ответов: пиры, полученные от нескольких трекеров, объединяются без повторов и по мере
+     * ответа каждого трекера передаются в `onPeers` (из потока запроса, вызовы не пересекаются).
+     * Если предыдущий опрос еще идет, сначала дожидается его. `onDone` вызывается из потока последнего
+     * завершившегося запроса, когда ответили (или не ответили за таймаут) все трекеры.
+     * Трекеру, который еще не принял ни одного announce, вместо события из `stats` уходит started.
      *
      * tf: структура с разобранными данными из .torrent файла из предыдущего домашнего задания.
      * peerId: id, под которым представляется наш клиент.
-     * port: порт, на котором наш клиент будет слушать входящие соединения (пока что мы не слушаем и на этот порт никто
-     *  не сможет подключиться).
+     * port: порт, на котором наш клиент слушает входящие соединения (см. PeerListener).
+     * stats: счетчики для announce, на момент начала опроса.
+     */
+    void StartUpdatePeers(const TorrentFile& tf, std::string peerId, int port, AnnounceStats stats,
+                          PeersCallback onPeers = {}, std::function<void()> onDone = {});
+
+    /*
+     * Сообщить событие `stats.event` (completed или stopped) трекерам, которые приняли started. Не ждет ни ответов,
+     * ни идущего опроса, пиры из ответов не берутся. Announce одному трекеру уходят по порядку вызовов:
+     * stopped не обгонит completed. HTTP-запрос со stopped ограничен несколькими секундами, udp-запрос
+     * прерывается остановкой UdpTrackerClient
+     */
+    void AnnounceEvent(const TorrentFile& tf, std::string peerId, int port, AnnounceStats stats);
+
+    /*
+     * Есть неотправленные или неотвеченные запросы AnnounceEvent
+     */
+    bool IsSendingEvents() const;
+
+    /*
+     * Идет ли опрос трекеров
+     */
+    bool IsUpdating() const;
+
+    /*
+     * Дождаться ответа (или таймаута) всех трекеров текущего опроса и запросов AnnounceEvent
+     */
+    void Wait();
+
+    /*
+     * То же, что StartUpdatePeers и Wait. Если ни один трекер не прислал пиров, выбрасывает std::runtime_error
      */
     void UpdatePeers(const TorrentFile& tf, std::string peerId, int port);
 
     /*
-     * Отдает полученный ранее список пиров
+     * Отдает полученный в текущем опросе список пиров
+     */
+    std::vector<Peer> GetPeers() const;
+
+    /*
+     * Интервалы из ответов трекеров текущего опроса (наименьшие среди ответивших)
      */
-    const std::vector<Peer>& GetPeers() const;
+    std::chrono::seconds GetInterval() const;
+    std::chrono::seconds GetMinInterval() const;
+
+    /*
+     * Момент, раньше которого повторный announce нарушил бы min interval трекера
+     */
+    std::chrono::steady_clock::time_point NextAnnounceAllowed() const;
 
 private:
+    /*
+     * Запрос опроса к трекеру `index`, выполняется в своем потоке
+     */
+    void Announce(size_t index, const TorrentFile& tf, const std::string& peerId, int port, AnnounceStats stats,
+                  const PeersCallback& onPeers);
+
+    /*
+     * Отправить announce трекеру `index` (HTTP-трекеру через `session`) и разобрать ответ.
+     * Если трекер не ответил, выбрасывает исключение
+     */
+    TrackerResponse Request(size_t index, cpr::Session* session, const TorrentFile& tf, const std::string& peerId,
+                            int port, const AnnounceStats& stats);
+
     std::vector<std::string> urls_;
-    std::vector<Peer> peers_;
+    UdpTrackerClient* udp_;
+    std::vector<std::unique_ptr<cpr::Session>> sessions_;  // по одному на HTTP-трекер, переживают опросы
+    std::vector<std::thread> requests_;
+    std::atomic<size_t> pendingRequests_;
+    // последний запрос AnnounceEvent к каждому трекеру, следующий сначала дожидается его
+    std::vector<std::thread> eventRequests_;
+    std::atomic<size_t> pendingEvents_;
+    mutable std::mutex mutex_;
+    std::vector<bool> started_;  // трекер принял announce со started; guarded by mutex_
+    std::unordered_set<Peer> seen_;  // guarded by mutex_
+    std::vector<Peer> peers_;  // guarded by mutex_
+    std::chrono::seconds interval_{0};  // guarded by mutex_
+    std::chrono::seconds minInterval_{0};  // guarded by mutex_
+    std::chrono::steady_clock::time_point lastAnnounce_;  // guarded by mutex_
 };
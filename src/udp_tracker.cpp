@@ -0,0 +1,404 @@
+#include "udp_tracker.h"
+#include "byte_tools.h"
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace {
+constexpr uint64_t PROTOCOL_ID = 0x41727101980;
+constexpr uint32_t ACTION_CONNECT = 0;
+constexpr uint32_t ACTION_ANNOUNCE = 1;
+constexpr uint32_t ACTION_ERROR = 3;
+constexpr size_t CONNECT_LENGTH = 16;
+constexpr size_t ANNOUNCE_LENGTH = 98;
+constexpr size_t ANNOUNCE_RESPONSE_HEADER = 20;
+// трекер принимает connection_id две минуты, клиенту разрешено пользоваться им минуту
+constexpr std::chrono::seconds CONNECTION_ID_LIFETIME(60);
+// как часто поток приема проверяет таймауты и флаг остановки
+constexpr int POLL_TIMEOUT_MS = 100;
+
+template <typename T>
+void PutInt(std::string& packet, size_t offset, T value) {
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        packet[offset + i] = static_cast<char>((value >> (8 * (sizeof(T) - 1 - i))) & 0xFF);
+    }
+}
+
+// коды событий в announce по BEP 15
+uint32_t EventCode(AnnounceStats::Event event) {
+    switch (event) {
+        case AnnounceStats::Event::Completed:
+            return 1;
+        case AnnounceStats::Event::Started:
+            return 2;
+        case AnnounceStats::Event::Stopped:
+            return 3;
+        case AnnounceStats::Event::None:
+            break;
+    }
+    return 0;
+}
+
+uint64_t GetInt(std::string_view data, size_t offset, size_t length) {
+    return BytesToInt(data.substr(offset, length));
+}
+
+// ответ принимается только с адреса трекера, которому ушел запрос
+bool SameAddress(const sockaddr_storage& lhs, const sockaddr_storage& rhs) {
+    if (lhs.ss_family != rhs.ss_family) {
+        return false;
+    }
+    if (lhs.ss_family == AF_INET) {
+        const auto& left = reinterpret_cast<const sockaddr_in&>(lhs);
+        const auto& right = reinterpret_cast<const sockaddr_in&>(rhs);
+        return left.sin_port == right.sin_port && left.sin_addr.s_addr == right.sin_addr.s_addr;
+    }
+    const auto& left = reinterpret_cast<const sockaddr_in6&>(lhs);
+    const auto& right = reinterpret_cast<const sockaddr_in6&>(rhs);
+    return left.sin6_port == right.sin6_port &&
+           std::memcmp(&left.sin6_addr, &right.sin6_addr, sizeof(left.sin6_addr)) == 0;
+}
+
+/*
+ * udp://host:port[/path], host может быть IPv6-адресом в квадратных скобках
+ */
+void ParseUdpUrl(const std::string& url, std::string& host, std::string& port) {
+    constexpr std::string_view SCHEME = "udp://";
+    if (url.compare(0, SCHEME.size(), SCHEME) != 0) {
+        throw std::invalid_argument("Not a UDP tracker URL: " + url);
+    }
+    std::string authority = url.substr(SCHEME.size(), url.find('/', SCHEME.size()) - SCHEME.size());
+    size_t colon = authority.rfind(':');
+    if (colon == std::string::npos || colon + 1 == authority.size() || authority.find(']', colon) != std::string::npos) {
+        throw std::invalid_argument("UDP tracker URL without port: " + url);
+    }
+    host = authority.substr(0, colon);
+    port = authority.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+}
+}
+
+UdpTrackerClient::UdpTrackerClient(std::chrono::milliseconds retransmitTimeout, size_t maxRetransmits) :
+    retransmitTimeout_(retransmitTimeout), maxRetransmits_(maxRetransmits), sock_(-1), dualStack_(true),
+    stopped_(false), random_(std::random_device()()) {
+    key_ = random_();
+    // один сокет IPv6 отправляет и на IPv4-адреса (как v4-mapped); без поддержки IPv6 работаем только с IPv4
+    sock_ = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock_ >= 0) {
+        int v6only = 0;
+        setsockopt(sock_, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    } else {
+        dualStack_ = false;
+        sock_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    }
+    if (sock_ < 0) {
+        throw std::runtime_error(std::string("Failed to create UDP tracker socket: ") + std::strerror(errno));
+    }
+    receiver_ = std::thread(&UdpTrackerClient::ReceiveLoop, this);
+}
+
+UdpTrackerClient::~UdpTrackerClient() {
+    Stop();
+    if (receiver_.joinable()) {
+        receiver_.join();
+    }
+    close(sock_);
+}
+
+void UdpTrackerClient::Stop() {
+    stopped_ = true;
+    std::lock_guard lock(mutex_);
+    finished_.notify_all();
+}
+
+size_t UdpTrackerClient::ConnectsSent() const {
+    std::lock_guard lock(mutex_);
+    return connectsSent_;
+}
+
+size_t UdpTrackerClient::AnnouncesSent() const {
+    std::lock_guard lock(mutex_);
+    return announcesSent_;
+}
+
+UdpTrackerClient::Tracker& UdpTrackerClient::GetTracker(const std::string& url) {
+    std::string host, port;
+    ParseUdpUrl(url, host, port);
+    const std::string name = host + ":" + port;
+    {
+        std::lock_guard lock(mutex_);
+        if (auto it = trackers_.find(name); it != trackers_.end()) {
+            return *it->second;
+        }
+    }
+
+    // имя разрешается один раз за время работы, без блокировки: остальные трекеры тем временем работают
+    addrinfo hints{};
+    hints.ai_family = dualStack_ ? AF_UNSPEC : AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* result = nullptr;
+    if (int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &result); error != 0) {
+        throw std::runtime_error("Failed to resolve UDP tracker " + name + ": " + gai_strerror(error));
+    }
+    auto tracker = std::make_unique<Tracker>();
+    tracker->name = name;
+    const addrinfo* chosen = result;
+    Peer address = Peer::FromSockaddr(chosen->ai_addr);
+    freeaddrinfo(result);
+    tracker->ipv6 = address.family == AF_INET6;
+    if (dualStack_ && !tracker->ipv6) {
+        auto* address6 = reinterpret_cast<sockaddr_in6*>(&tracker->address);
+        address6->sin6_family = AF_INET6;
+        address6->sin6_port = htons(address.port);
+        address6->sin6_addr.s6_addr[10] = 0xFF;
+        address6->sin6_addr.s6_addr[11] = 0xFF;
+        std::memcpy(address6->sin6_addr.s6_addr + 12, address.address.data(), 4);
+        tracker->addressLength = sizeof(sockaddr_in6);
+    } else {
+        tracker->addressLength = address.ToSockaddr(tracker->address);
+    }
+
+    std::lock_guard lock(mutex_);
+    // другой поток мог успеть добавить этот трекер, пока разрешалось имя
+    auto [it, inserted] = trackers_.emplace(name, std::move(tracker));
+    return *it->second;
+}
+
+TrackerResponse UdpTrackerClient::Announce(const std::string& url, const AnnounceRequest& request) {
+    if (stopped_) {
+        throw std::runtime_error("UDP tracker client is stopped");
+    }
+    Tracker& tracker = GetTracker(url);
+
+    Pending pending;
+    pending.tracker = &tracker;
+    // connection_id и transaction_id заполняются при отправке
+    pending.packet.assign(ANNOUNCE_LENGTH, '\0');
+    PutInt<uint32_t>(pending.packet, 8, ACTION_ANNOUNCE);
+    pending.packet.replace(16, 20, request.infoHash, 0, 20);
+    pending.packet.replace(36, 20, request.peerId, 0, 20);
+    PutInt<uint64_t>(pending.packet, 56, request.downloaded);
+    PutInt<uint64_t>(pending.packet, 64, request.left);
+    PutInt<uint64_t>(pending.packet, 72, request.uploaded);
+    PutInt<uint32_t>(pending.packet, 80, EventCode(request.event));
+    PutInt<uint32_t>(pending.packet, 84, 0);  // IP: адрес отправителя
+    PutInt<uint32_t>(pending.packet, 88, key_);
+    PutInt<int32_t>(pending.packet, 92, -1);  // num_want: по умолчанию трекера
+    PutInt<uint16_t>(pending.packet, 96, request.port);
+
+    std::unique_lock lock(mutex_);
+    if (std::chrono::steady_clock::now() < tracker.connectionExpires) {
+        SendAnnounces(tracker, {&pending});
+    } else {
+        tracker.waiting.push_back(&pending);
+        if (!tracker.connecting) {
+            SendConnect(tracker);
+        }
+    }
+    finished_.wait(lock, [&] { return pending.done || stopped_; });
+    if (!pending.done) {
+        if (auto it = announces_.find(pending.transaction); it != announces_.end() && it->second == &pending) {
+            announces_.erase(it);
+        }
+        std::erase(tracker.waiting, &pending);
+        throw std::runtime_error("UDP tracker client is stopped");
+    }
+    if (!pending.error.empty()) {
+        throw std::runtime_error(pending.error);
+    }
+    return std::move(pending.response);
+}
+
+uint32_t UdpTrackerClient::NewTransaction() {
+    uint32_t transaction;
+    do {
+        transaction = random_();
+    } while (announces_.contains(transaction));
+    return transaction;
+}
+
+void UdpTrackerClient::SendConnect(Tracker& tracker) {
+    tracker.connecting = true;
+    tracker.connectTransaction = NewTransaction();
+    tracker.connectDeadline = std::chrono::steady_clock::now() + retransmitTimeout_ * (1 << tracker.connectAttempt);
+    std::string packet(CONNECT_LENGTH, '\0');
+    PutInt<uint64_t>(packet, 0, PROTOCOL_ID);
+    PutInt<uint32_t>(packet, 8, ACTION_CONNECT);
+    PutInt<uint32_t>(packet, 12, tracker.connectTransaction);
+    // ошибку отправки не разбираем: запрос повторится по таймауту
+    sendto(sock_, packet.data(), packet.size(), 0, reinterpret_cast<const sockaddr*>(&tracker.address),
+           tracker.addressLength);
+    ++connectsSent_;
+}
+
+void UdpTrackerClient::SendAnnounces(Tracker& tracker, const std::vector<Pending*>& pending) {
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<iovec> vectors(pending.size());
+    std::vector<mmsghdr> messages(pending.size());
+    for (size_t i = 0; i < pending.size(); ++i) {
+        Pending& announce = *pending[i];
+        announce.transaction = NewTransaction();
+        announce.deadline = now + retransmitTimeout_ * (1 << announce.attempt);
+        PutInt<uint64_t>(announce.packet, 0, tracker.connectionId);
+        PutInt<uint32_t>(announce.packet, 12, announce.transaction);
+        announces_[announce.transaction] = &announce;
+
+        vectors[i] = {announce.packet.data(), announce.packet.size()};
+        messages[i] = {};
+        messages[i].msg_hdr.msg_name = &tracker.address;
+        messages[i].msg_hdr.msg_namelen = tracker.addressLength;
+        messages[i].msg_hdr.msg_iov = &vectors[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    // announce всех торрентов к трекеру уходят одним системным вызовом
+    for (size_t sent = 0; sent < messages.size();) {
+        int result = sendmmsg(sock_, messages.data() + sent, messages.size() - sent, 0);
+        if (result <= 0) {
+            break;
+        }
+        sent += result;
+    }
+    announcesSent_ += pending.size();
+}
+
+void UdpTrackerClient::Finish(Pending& pending, std::string error) {
+    pending.done = true;
+    pending.error = std::move(error);
+    finished_.notify_all();
+}
+
+void UdpTrackerClient::HandleDatagram(std::string_view data, const sockaddr_storage& from) {
+    if (data.size() < 8) {
+        return;
+    }
+    const auto action = static_cast<uint32_t>(GetInt(data, 0, 4));
+    const auto transaction = static_cast<uint32_t>(GetInt(data, 4, 4));
+
+    if (auto it = announces_.find(transaction); it != announces_.end()) {
+        Pending& pending = *it->second;
+        if (!SameAddress(from, pending.tracker->address)) {
+            return;
+        }
+        if (action == ACTION_ERROR) {
+            announces_.erase(it);
+            pending.response.failureReason = std::string(data.substr(8));
+            Finish(pending, "");
+        } else if (action == ACTION_ANNOUNCE && data.size() >= ANNOUNCE_RESPONSE_HEADER) {
+            announces_.erase(it);
+            pending.response.interval = std::chrono::seconds(GetInt(data, 8, 4));
+            pending.response.incomplete = static_cast<int64_t>(GetInt(data, 12, 4));
+            pending.response.complete = static_cast<int64_t>(GetInt(data, 16, 4));
+            // по IPv6 трекер присылает адреса IPv6, неполная запись в конце отбрасывается
+            const size_t stride = pending.tracker->ipv6 ? 18 : 6;
+            for (size_t offset = ANNOUNCE_RESPONSE_HEADER; offset + stride <= data.size(); offset += stride) {
+                pending.response.peers.push_back(
+                    Peer::FromCompact(data.data() + offset, pending.tracker->ipv6 ? AF_INET6 : AF_INET));
+            }
+            Finish(pending, "");
+        }
+        return;
+    }
+
+    for (auto& [name, tracker] : trackers_) {
+        if (!tracker->connecting || tracker->connectTransaction != transaction) {
+            continue;
+        }
+        // чужой или испорченный ответ ничего не меняет: connect повторится по таймауту, announce ждут дальше
+        const bool connected = action == ACTION_CONNECT && data.size() >= CONNECT_LENGTH;
+        if (!SameAddress(from, tracker->address) || (!connected && action != ACTION_ERROR)) {
+            return;
+        }
+        tracker->connecting = false;
+        tracker->connectAttempt = 0;
+        std::vector<Pending*> waiting;
+        waiting.swap(tracker->waiting);
+        if (connected) {
+            tracker->connectionId = GetInt(data, 8, 8);
+            tracker->connectionExpires = std::chrono::steady_clock::now() + CONNECTION_ID_LIFETIME;
+            SendAnnounces(*tracker, waiting);
+        } else {
+            for (Pending* pending : waiting) {
+                pending->response.failureReason = std::string(data.substr(8));
+                Finish(*pending, "");
+            }
+        }
+        return;
+    }
+}
+
+void UdpTrackerClient::HandleTimeouts(std::chrono::steady_clock::time_point now) {
+    for (auto& [name, tracker] : trackers_) {
+        if (!tracker->connecting || now < tracker->connectDeadline) {
+            continue;
+        }
+        if (tracker->connectAttempt >= maxRetransmits_) {
+            tracker->connecting = false;
+            tracker->connectAttempt = 0;
+            for (Pending* pending : tracker->waiting) {
+                Finish(*pending, "UDP tracker " + name + " does not respond");
+            }
+            tracker->waiting.clear();
+        } else {
+            ++tracker->connectAttempt;
+            SendConnect(*tracker);
+        }
+    }
+
+    std::unordered_map<Tracker*, std::vector<Pending*>> retransmit;
+    for (auto it = announces_.begin(); it != announces_.end();) {
+        Pending& pending = *it->second;
+        if (now < pending.deadline) {
+            ++it;
+            continue;
+        }
+        it = announces_.erase(it);
+        if (pending.attempt >= maxRetransmits_) {
+            Finish(pending, "UDP tracker " + pending.tracker->name + " does not respond");
+            continue;
+        }
+        ++pending.attempt;
+        Tracker& tracker = *pending.tracker;
+        if (now < tracker.connectionExpires) {
+            retransmit[&tracker].push_back(&pending);
+        } else {
+            // connection_id устарел, пока ждали ответа: сначала получаем новый
+            tracker.waiting.push_back(&pending);
+            if (!tracker.connecting) {
+                SendConnect(tracker);
+            }
+        }
+    }
+    for (auto& [tracker, pending] : retransmit) {
+        SendAnnounces(*tracker, pending);
+    }
+}
+
+void UdpTrackerClient::ReceiveLoop() {
+    // ответ с большим списком пиров не превышает размера UDP-датаграммы
+    std::string buffer(65536, '\0');
+    while (!stopped_) {
+        pollfd readable = {sock_, POLLIN, 0};
+        if (poll(&readable, 1, POLL_TIMEOUT_MS) > 0) {
+            while (true) {
+                sockaddr_storage from{};
+                socklen_t fromLength = sizeof(from);
+                ssize_t received = recvfrom(sock_, buffer.data(), buffer.size(), MSG_DONTWAIT,
+                                            reinterpret_cast<sockaddr*>(&from), &fromLength);
+                if (received < 0) {
+                    break;
+                }
+                std::lock_guard lock(mutex_);
+                HandleDatagram(std::string_view(buffer.data(), received), from);
+            }
+        }
+        std::lock_guard lock(mutex_);
+        HandleTimeouts(std::chrono::steady_clock::now());
+    }
+}
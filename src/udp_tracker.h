@@ -0,0 +1,130 @@
+#pragma once
+
+#include "torrent_tracker.h"
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Клиент UDP-трекеров (udp://host:port/announce), один на все торренты сессии.
+ * https://www.bittorrent.org/beps/bep_0015.html
+ *
+ * Перед announce у трекера нужно получить connection_id (запрос connect), он действует минуту и кешируется
+ * для каждого трекера: повторные announce и announce других торрентов к тому же трекеру обходятся одним пакетом
+ * туда и обратно. Пока connect в пути, announce всех торрентов к этому трекеру ждут его и уходят одной пачкой
+ * (sendmmsg), как только придет connection_id. Все запросы идут через один UDP-сокет, ответы разбирает
+ * отдельный поток. Запрос без ответа повторяется через retransmitTimeout * 2^n, после `maxRetransmits`
+ * повторов трекер считается недоступным
+ */
+class UdpTrackerClient {
+public:
+    struct AnnounceRequest {
+        std::string infoHash;
+        std::string peerId;
+        uint64_t downloaded = 0;
+        uint64_t left = 0;
+        uint64_t uploaded = 0;
+        AnnounceStats::Event event = AnnounceStats::Event::None;
+        uint16_t port = 0;
+    };
+
+    /*
+     * По умолчанию таймауты из BEP 15: 15 секунд, затем 30 и 60
+     */
+    explicit UdpTrackerClient(std::chrono::milliseconds retransmitTimeout = std::chrono::seconds(15),
+                              size_t maxRetransmits = 2);
+
+    /*
+     * Вызывает Stop и дожидается потока приема
+     */
+    ~UdpTrackerClient();
+
+    /*
+     * Отправить announce трекеру `url` и дождаться ответа. Пиры в ответе того же семейства адресов, что и трекер.
+     * Если трекер не ответил или клиент остановлен, выбрасывает std::runtime_error.
+     * Ошибка, присланная трекером, возвращается в failureReason
+     */
+    TrackerResponse Announce(const std::string& url, const AnnounceRequest& request);
+
+    /*
+     * Прервать все ждущие Announce, новые сразу завершаются ошибкой
+     */
+    void Stop();
+
+    /*
+     * Сколько отправлено запросов connect и announce (вместе с повторами)
+     */
+    size_t ConnectsSent() const;
+    size_t AnnouncesSent() const;
+private:
+    struct Tracker;
+
+    // один announce одного торрента; живет на стеке ждущего его потока
+    struct Pending {
+        Tracker* tracker;
+        std::string packet;
+        uint32_t transaction = 0;
+        size_t attempt = 0;
+        std::chrono::steady_clock::time_point deadline;
+        bool done = false;
+        TrackerResponse response;
+        std::string error;
+    };
+
+    struct Tracker {
+        std::string name;
+        sockaddr_storage address{};
+        socklen_t addressLength = 0;
+        bool ipv6 = false;
+        uint64_t connectionId = 0;
+        std::chrono::steady_clock::time_point connectionExpires;
+        bool connecting = false;
+        uint32_t connectTransaction = 0;
+        size_t connectAttempt = 0;
+        std::chrono::steady_clock::time_point connectDeadline;
+        std::vector<Pending*> waiting;  // ждут connection_id
+    };
+
+    /*
+     * Найти трекер по адресу из URL, при первом обращении разрешить имя
+     */
+    Tracker& GetTracker(const std::string& url);
+
+    // все следующие методы вызываются под mutex_
+    void SendConnect(Tracker& tracker);
+    void SendAnnounces(Tracker& tracker, const std::vector<Pending*>& pending);
+    void Finish(Pending& pending, std::string error);
+    /*
+     * Разобрать ответ, пришедший с адреса `from`. Ответы не с адреса трекера, которому ушел запрос, и испорченные
+     * ответы отбрасываются: запрос остается ждать и повторяется по таймауту
+     */
+    void HandleDatagram(std::string_view data, const sockaddr_storage& from);
+    void HandleTimeouts(std::chrono::steady_clock::time_point now);
+    uint32_t NewTransaction();
+
+    void ReceiveLoop();
+
+    const std::chrono::milliseconds retransmitTimeout_;
+    const size_t maxRetransmits_;
+    int sock_;
+    bool dualStack_;
+    std::atomic<bool> stopped_;
+    uint32_t key_;  // поле key в announce: по нему трекер узнает клиента, если у того сменится адрес
+    std::mt19937 random_;  // guarded by mutex_
+    mutable std::mutex mutex_;
+    std::condition_variable finished_;
+    std::unordered_map<std::string, std::unique_ptr<Tracker>> trackers_;  // по host:port, guarded by mutex_
+    std::unordered_map<uint32_t, Pending*> announces_;  // отправленные announce по transaction_id, guarded by mutex_
+    size_t connectsSent_ = 0;  // guarded by mutex_
+    size_t announcesSent_ = 0;  // guarded by mutex_
+    std::thread receiver_;
+};
@@ -0,0 +1,235 @@
+#include "web_seed.h"
+#include "metrics.h"
+#include <cpr/cpr.h>
+#include <curl/curl.h>
+#include <algorithm>
+#include <cctype>
+#include <iostream>
+#include <thread>
+
+namespace {
+
+constexpr size_t BLOCK_SIZE = 1 << 14;
+constexpr std::chrono::milliseconds CONNECT_TIMEOUT(3000);
+constexpr std::chrono::milliseconds REQUEST_TIMEOUT(30000);
+// запрос, по которому меньше LOW_SPEED_LIMIT байт/с приходит дольше LOW_SPEED_TIME секунд, прерывается
+constexpr long LOW_SPEED_LIMIT = 1024;
+constexpr long LOW_SPEED_TIME = 10;
+// сколько ошибок подряд терпим; перед повтором ждем RETRY_DELAY, 2 * RETRY_DELAY, ...
+constexpr size_t MAX_FAILURES = 3;
+constexpr std::chrono::milliseconds RETRY_DELAY(1000);
+// бюджет памяти исчерпан: ждем, пока скачанные части запишутся на диск
+constexpr std::chrono::milliseconds BUDGET_WAIT(50);
+// проверяем флаг остановки не реже, чем раз в 200 мс
+constexpr int POLL_TIMEOUT_MS = 200;
+
+// процентное кодирование пути (RFC 3986): unreserved символы и разделители '/' остаются как есть
+std::string EscapePath(std::string_view path) {
+    static constexpr char HEX[] = "0123456789ABCDEF";
+    std::string result;
+    result.reserve(path.size());
+    for (unsigned char c : path) {
+        if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+            result += static_cast<char>(c);
+        } else {
+            result += '%';
+            result += HEX[c >> 4];
+            result += HEX[c & 0x0F];
+        }
+    }
+    return result;
+}
+
+}
+
+WebSeed::WebSeed(std::string url, const TorrentFile& tf, PieceStorage& pieceStorage) :
+    url_(std::move(url)), tf_(tf), pieceStorage_(pieceStorage), session_(std::make_unique<cpr::Session>()),
+    terminated_(false), failed_(false), rangesUnsupported_(false), responseLimit_(0), downloadedBytes_(0),
+    requestsSent_(0) {
+    size_t offset = 0;
+    for (const File& file : tf_.files) {
+        fileOffsets_.push_back(offset);
+        offset += file.length;
+    }
+    session_->SetTimeout(cpr::Timeout{REQUEST_TIMEOUT});
+    session_->SetConnectTimeout(cpr::ConnectTimeout{CONNECT_TIMEOUT});
+    CURL* handle = session_->GetCurlHolder()->handle;
+    // адрес сервера разрешается один раз, соединение переиспользуется всеми запросами этого объекта
+    curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, -1L);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, LOW_SPEED_LIMIT);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, LOW_SPEED_TIME);
+    // curl вызывает его во время передачи и не реже раза в секунду при простое: Terminate прерывает идущий запрос.
+    // Ответ длиннее запрошенного диапазона -- сервер шлет файл целиком, такой запрос тоже прерывается
+    session_->SetProgressCallback(cpr::ProgressCallback{
+        [this](cpr::cpr_pf_arg_t downloadTotal, cpr::cpr_pf_arg_t downloadNow, cpr::cpr_pf_arg_t, cpr::cpr_pf_arg_t,
+               intptr_t) {
+            if (static_cast<uint64_t>(std::max(downloadTotal, downloadNow)) > responseLimit_) {
+                rangesUnsupported_ = true;
+                return false;
+            }
+            return !terminated_.load();
+        }});
+}
+
+WebSeed::~WebSeed() = default;
+
+void WebSeed::Run() {
+    size_t failures = 0;
+    while (!terminated_.load()) {
+        PiecePtr piece;
+        try {
+            if (pieceStorage_.QueueIsEmpty()) {
+                break;
+            }
+            piece = pieceStorage_.GetNextPieceToDownload();
+        } catch (const std::runtime_error&) {
+            // последнюю часть очереди между проверкой и взятием забрало другое соединение
+            break;
+        }
+        if (!piece) {
+            Sleep(BUDGET_WAIT);
+            continue;
+        }
+        try {
+            DownloadPiece(*piece);
+            failures = 0;
+            pieceStorage_.PieceProcessed(piece);
+        } catch (const std::exception& e) {
+            pieceStorage_.DecrementPieceInProgressCounter();
+            pieceStorage_.BackPieceToQueue(piece->GetIndex());
+            if (terminated_.load()) {
+                break;  // запрос прерван Terminate, это не отказ сервера
+            }
+            if (rangesUnsupported_.load()) {
+                std::cerr << "Web seed " << url_ << " ignores Range requests, not using it" << std::endl;
+                failed_ = true;
+                break;
+            }
+            if (++failures >= MAX_FAILURES) {
+                std::cerr << "Web seed " << url_ << " failed: " << e.what() << std::endl;
+                failed_ = true;
+                break;
+            }
+            Sleep(RETRY_DELAY * failures);
+        }
+    }
+    terminated_ = true;
+}
+
+void WebSeed::Terminate() {
+    terminated_ = true;
+}
+
+bool WebSeed::IsTerminated() const {
+    return terminated_.load();
+}
+
+bool WebSeed::Failed() const {
+    return failed_.load();
+}
+
+bool WebSeed::RangesUnsupported() const {
+    return rangesUnsupported_.load();
+}
+
+const std::string& WebSeed::Url() const {
+    return url_;
+}
+
+uint64_t WebSeed::DownloadedBytes() const {
+    return downloadedBytes_.load();
+}
+
+size_t WebSeed::RequestsSent() const {
+    return requestsSent_.load();
+}
+
+void WebSeed::DownloadPiece(Piece& piece) {
+    // блоки, прочитанные обратно из временного файла (spillPartialPieces), уже есть и не запрашиваются
+    std::vector<Block*> blocks;
+    while (Block* block = piece.FirstMissingBlock()) {
+        blocks.push_back(block);
+    }
+    const size_t pieceBegin = piece.GetIndex() * tf_.pieceLength;
+    std::string data;
+    for (size_t i = 0; i < blocks.size();) {
+        // подряд идущие недостающие блоки запрашиваются одним диапазоном
+        size_t j = i + 1;
+        while (j < blocks.size() && blocks[j]->offset == blocks[j - 1]->offset + blocks[j - 1]->length) {
+            ++j;
+        }
+        const size_t rangeBegin = blocks[i]->offset;
+        const size_t rangeLength = blocks[j - 1]->offset + blocks[j - 1]->length - rangeBegin;
+        data.clear();
+        Fetch(pieceBegin + rangeBegin, rangeLength, data);
+        for (; i < j; ++i) {
+            piece.SaveBlock(blocks[i]->offset / BLOCK_SIZE,
+                            std::string_view(data).substr(blocks[i]->offset - rangeBegin, blocks[i]->length));
+        }
+        downloadedBytes_ += rangeLength;
+        Metrics::Add(Metrics::Counter::WebSeedDownloadedBytes, rangeLength);
+    }
+}
+
+void WebSeed::Fetch(size_t begin, size_t length, std::string& data) {
+    const size_t end = begin + length;
+    // последний файл, начинающийся не позже begin (пустые файлы с тем же смещением пропускаются)
+    size_t file = std::upper_bound(fileOffsets_.begin(), fileOffsets_.end(), begin) - fileOffsets_.begin() - 1;
+    for (; begin < end; ++file) {
+        if (file >= tf_.files.size()) {
+            throw std::runtime_error("Piece is out of the torrent data");
+        }
+        const size_t fileBegin = fileOffsets_[file];
+        const size_t fileEnd = fileBegin + tf_.files[file].length;
+        if (fileEnd <= begin) {
+            continue;
+        }
+        const size_t from = begin - fileBegin;
+        const size_t to = std::min(end, fileEnd) - fileBegin;
+        // файл не длиннее части можно принять и целиком, если сервер не понимает Range
+        const bool wholeFileAllowed = tf_.files[file].length <= tf_.pieceLength;
+        responseLimit_ = wholeFileAllowed ? std::max<uint64_t>(to - from, tf_.files[file].length) : to - from;
+        session_->SetUrl(cpr::Url{FileUrl(file)});
+        session_->SetHeader(cpr::Header{{"Range", "bytes=" + std::to_string(from) + "-" + std::to_string(to - 1)}});
+        ++requestsSent_;
+        cpr::Response response = session_->Get();
+        if (rangesUnsupported_.load()) {
+            throw std::runtime_error("Server ignores Range requests: " + FileUrl(file));
+        }
+        if (response.error) {
+            throw std::runtime_error(response.error.message);
+        }
+        std::string_view body = response.text;
+        if (response.status_code == 200 && wholeFileAllowed && body.size() >= to) {
+            body = body.substr(from, to - from);
+        } else if (response.status_code == 200) {
+            rangesUnsupported_ = true;
+            throw std::runtime_error("Server ignores Range requests: " + FileUrl(file));
+        } else if (response.status_code != 206 || body.size() != to - from) {
+            throw std::runtime_error("HTTP status " + std::to_string(response.status_code) + " for " + FileUrl(file));
+        }
+        data.append(body);
+        begin = fileBegin + to;
+    }
+}
+
+std::string WebSeed::FileUrl(size_t fileIndex) const {
+    // у торрента из одного файла url указывает на сам файл, у многофайлового -- на директорию над `name`
+    if (tf_.singleFile) {
+        return url_.ends_with('/') ? url_ + EscapePath(tf_.name) : url_;
+    }
+    std::string url = url_;
+    if (!url.ends_with('/')) {
+        url += '/';
+    }
+    return url + EscapePath(tf_.name) + "/" + EscapePath(tf_.files[fileIndex].path);
+}
+
+void WebSeed::Sleep(std::chrono::milliseconds delay) const {
+    const auto deadline = std::chrono::steady_clock::now() + delay;
+    while (!terminated_.load() && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::min<std::chrono::milliseconds>(
+            std::chrono::milliseconds(POLL_TIMEOUT_MS),
+            std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now())));
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "torrent_file.h"
+#include "piece_storage.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cpr {
+class Session;
+}
+
+/*
+ * Скачивание частей с HTTP-сервера, на котором лежат файлы торрента (web seed, url-list из .torrent).
+ * https://www.bittorrent.org/beps/bep_0019.html
+ *
+ * Один объект -- одно keep-alive соединение с сервером: части берутся из той же очереди PieceStorage, что и для пиров,
+ * недостающие блоки части запрашиваются HTTP-запросами с заголовком Range (по одному на каждый файл, через который
+ * проходит часть) и проверяются тем же PieceProcessed. Несколько соединений с одним сервером -- несколько объектов
+ */
+class WebSeed {
+public:
+    WebSeed(std::string url, const TorrentFile& tf, PieceStorage& pieceStorage);
+    ~WebSeed();
+
+    /*
+     * Качать части, пока очередь не опустеет, не будет вызван Terminate или сервер не откажет несколько раз подряд
+     */
+    void Run();
+
+    /*
+     * Остановить Run: идущий HTTP-запрос прерывается (в пределах секунды), блоки части возвращаются в очередь
+     */
+    void Terminate();
+
+    /*
+     * Run завершился или завершится при следующей проверке
+     */
+    bool IsTerminated() const;
+
+    /*
+     * Сервер отказал несколько раз подряд или не понимает Range, соединение брошено
+     */
+    bool Failed() const;
+
+    /*
+     * Сервер ответил на запрос с Range файлом целиком (200 OK). Такой ответ на файл длиннее части прерывается
+     * сразу, как только видна его длина: иначе каждая часть стоила бы скачивания всего файла. Больше к этому
+     * серверу подключаться не стоит
+     */
+    bool RangesUnsupported() const;
+
+    const std::string& Url() const;
+    uint64_t DownloadedBytes() const;
+    size_t RequestsSent() const;
+private:
+    /*
+     * Скачать все недостающие блоки части. При ошибке выбрасывает std::runtime_error, блоки остаются Pending
+     */
+    void DownloadPiece(Piece& piece);
+
+    /*
+     * Получить байты [begin, begin + length) общего потока данных торрента, по запросу на каждый затронутый файл
+     */
+    void Fetch(size_t begin, size_t length, std::string& data);
+
+    /*
+     * Адрес файла `fileIndex` на сервере: для торрента из одного файла -- сам url (или url + имя, если url
+     * заканчивается на '/'), иначе url/имя торрента/путь файла
+     */
+    std::string FileUrl(size_t fileIndex) const;
+
+    /*
+     * Подождать `delay`, проверяя флаг Terminate
+     */
+    void Sleep(std::chrono::milliseconds delay) const;
+
+    const std::string url_;
+    const TorrentFile& tf_;
+    PieceStorage& pieceStorage_;
+    std::vector<size_t> fileOffsets_;  // смещение начала каждого файла в общем потоке данных
+    std::unique_ptr<cpr::Session> session_;
+    std::atomic<bool> terminated_;
+    std::atomic<bool> failed_;
+    std::atomic<bool> rangesUnsupported_;
+    uint64_t responseLimit_;  // сколько байт ответа ждем на текущий запрос; больше -- сервер не понимает Range
+    std::atomic<uint64_t> downloadedBytes_;
+    std::atomic<size_t> requestsSent_;
+};